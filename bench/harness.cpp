@@ -0,0 +1,289 @@
+// Microwave benchmark harness: builds each program with microwave and the system C compiler,
+// runs it several times and reports median wall time and peak RSS
+#include "driver.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct Options {
+    std::string microwave = "./microwave";
+    std::vector<std::string> mwFlags;
+    std::vector<std::string> cFlags = {"-O2"};
+    int runs = 5;
+    std::string saveFile, compareFile;
+    std::vector<std::string> programs;
+};
+
+struct Result {
+    std::string name;
+    double medianMs = 0, minMs = 0;
+    long maxRssKb = 0;
+    std::string output;     // hash of stdout, so changed behaviour is not mistaken for a speedup
+    std::string error;
+};
+
+// One finished child process
+struct Measurement {
+    int status = -1;        // exit code, or -1 if it could not start or was killed
+    double ms = 0;
+    long rssKb = 0;
+};
+
+static std::vector<std::string> words(const std::string& text) {
+    std::istringstream in(text);
+    std::vector<std::string> out;
+    std::string word;
+    while (in >> word) out.push_back(word);
+    return out;
+}
+
+// Runs argv with stdout sent to outPath (stderr is kept) and measures it with wait4
+static Measurement measure(const std::vector<std::string>& argv, const std::string& outPath) {
+    std::vector<char*> args;
+    for (const auto& arg : argv) args.push_back(const_cast<char*>(arg.c_str()));
+    args.push_back(nullptr);
+
+    Measurement m;
+    fflush(stdout);
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0) return m;
+    if (pid == 0) {
+        int fd = open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) _exit(127);
+        close(fd);
+        execvp(args[0], args.data());
+        _exit(127);
+    }
+    int status;
+    rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) return m;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    m.ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    m.rssKb = usage.ru_maxrss;
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 127) m.status = WEXITSTATUS(status);
+    return m;
+}
+
+static std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+static std::string baseName(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.rfind('.');
+    return dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+static Result benchmark(const std::string& source, const Options& options, const std::string& workDir) {
+    Result result;
+    result.name = baseName(source);
+    std::string cPath = workDir + "/" + result.name + ".c";
+    std::string binPath = workDir + "/" + result.name;
+    std::string outPath = workDir + "/" + result.name + ".out";
+
+    std::vector<std::string> argv = {options.microwave};
+    argv.insert(argv.end(), options.mwFlags.begin(), options.mwFlags.end());
+    argv.insert(argv.end(), {source, cPath});
+    if (measure(argv, "/dev/null").status != 0) {
+        result.error = "microwave failed";
+        return result;
+    }
+    argv = cCompiler();
+    argv.insert(argv.end(), options.cFlags.begin(), options.cFlags.end());
+    // -pthread for the task runtime of programs that spawn; harmless for the rest
+    argv.insert(argv.end(), {"-o", binPath, cPath, "-lm", "-pthread"});
+    if (measure(argv, "/dev/null").status != 0) {
+        result.error = "C compiler failed";
+        return result;
+    }
+
+    // The untimed warm-up run also records the output; timed runs write to /dev/null
+    if (measure({binPath}, outPath).status < 0) {
+        result.error = "crashed";
+        return result;
+    }
+    char hash[17];
+    snprintf(hash, sizeof hash, "%016llx", static_cast<unsigned long long>(hashBytes(readFile(outPath))));
+    result.output = hash;
+
+    std::vector<double> times;
+    for (int i = 0; i < options.runs; ++i) {
+        Measurement m = measure({binPath}, "/dev/null");
+        if (m.status < 0) {
+            result.error = "crashed";
+            return result;
+        }
+        times.push_back(m.ms);
+        result.maxRssKb = std::max(result.maxRssKb, m.rssKb);
+    }
+    std::sort(times.begin(), times.end());
+    size_t mid = times.size() / 2;
+    result.medianMs = times.size() % 2 ? times[mid] : (times[mid - 1] + times[mid]) / 2;
+    result.minMs = times.front();
+    return result;
+}
+
+// First line of "$CC --version", so saved results say which C compiler produced them
+static std::string cCompilerVersion(const std::string& workDir) {
+    std::vector<std::string> argv = cCompiler();
+    argv.push_back("--version");
+    std::string path = workDir + "/cc-version";
+    measure(argv, path);
+    std::string text = readFile(path);
+    return text.substr(0, text.find('\n'));
+}
+
+static std::string join(const std::vector<std::string>& parts) {
+    std::string out;
+    for (const auto& part : parts) out += (out.empty() ? "" : " ") + part;
+    return out;
+}
+
+// Saved results are tab-separated: program, median ms, min ms, max RSS KiB, output hash
+static void saveResults(const std::string& path, const std::vector<Result>& results, const Options& options,
+                        const std::string& ccVersion) {
+    std::ofstream file(path);
+    if (!file) throw std::runtime_error("Cannot write file: " + path);
+    file << "# microwave bench v1\n";
+    file << "# cc: " << ccVersion << "\n";
+    file << "# cflags: " << join(options.cFlags) << "\n";
+    file << "# mwflags: " << join(options.mwFlags) << "\n";
+    file << "# runs: " << options.runs << "\n";
+    for (const auto& r : results) {
+        if (!r.error.empty()) continue;
+        file << r.name << '\t' << r.medianMs << '\t' << r.minMs << '\t' << r.maxRssKb << '\t' << r.output << '\n';
+    }
+}
+
+static std::map<std::string, Result> loadResults(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("Cannot open file: " + path);
+    std::map<std::string, Result> results;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream fields(line);
+        Result r;
+        if (fields >> r.name >> r.medianMs >> r.minMs >> r.maxRssKb >> r.output) results[r.name] = r;
+    }
+    return results;
+}
+
+static std::vector<std::string> defaultPrograms() {
+    std::vector<std::string> programs;
+    if (DIR* dir = opendir("bench")) {
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > 3 && name.compare(name.size() - 3, 3, ".mw") == 0) programs.push_back("bench/" + name);
+        }
+        closedir(dir);
+    }
+    std::sort(programs.begin(), programs.end());
+    return programs;
+}
+
+static void printUsage() {
+    std::cerr << "Usage: bench/harness [options] [program.mw ...]   (default: bench/*.mw)" << std::endl;
+    std::cerr << "  --microwave <path>   compiler under test (default ./microwave)" << std::endl;
+    std::cerr << "  --mwflags \"<opts>\"   extra microwave options, e.g. \"--no-fold\"" << std::endl;
+    std::cerr << "  --cflags \"<flags>\"   C compiler flags (default -O2); the compiler is $CC or cc" << std::endl;
+    std::cerr << "  --runs <n>           timed runs per program after one warm-up (default 5)" << std::endl;
+    std::cerr << "  --save <file>        write the results for a later --compare" << std::endl;
+    std::cerr << "  --compare <file>     show each median against saved results" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--microwave" && hasValue) {
+            options.microwave = argv[++i];
+        } else if (arg == "--mwflags" && hasValue) {
+            options.mwFlags = words(argv[++i]);
+        } else if (arg == "--cflags" && hasValue) {
+            options.cFlags = words(argv[++i]);
+        } else if (arg == "--runs" && hasValue) {
+            options.runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--save" && hasValue) {
+            options.saveFile = argv[++i];
+        } else if (arg == "--compare" && hasValue) {
+            options.compareFile = argv[++i];
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            printUsage();
+            return 1;
+        } else {
+            options.programs.push_back(arg);
+        }
+    }
+    if (options.programs.empty()) options.programs = defaultPrograms();
+    if (options.programs.empty()) {
+        printUsage();
+        return 1;
+    }
+
+    char workTemplate[] = "/tmp/mw-bench-XXXXXX";
+    if (!mkdtemp(workTemplate)) {
+        std::cerr << "Error: cannot create a work directory: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    std::string workDir = workTemplate;
+
+    int failures = 0;
+    try {
+        std::map<std::string, Result> baseline;
+        if (!options.compareFile.empty()) baseline = loadResults(options.compareFile);
+        std::string ccVersion = cCompilerVersion(workDir);
+        std::cout << "cc: " << ccVersion << "; cflags: " << join(options.cFlags)
+                  << "; mwflags: " << join(options.mwFlags) << "; runs: " << options.runs << std::endl;
+        printf("%-12s %11s %11s %12s  %-16s%s\n", "program", "median ms", "min ms", "max RSS KiB", "output",
+               baseline.empty() ? "" : "  vs saved");
+
+        std::vector<Result> results;
+        for (const auto& program : options.programs) {
+            Result r = benchmark(program, options, workDir);
+            results.push_back(r);
+            if (!r.error.empty()) {
+                printf("%-12s %s\n", r.name.c_str(), r.error.c_str());
+                ++failures;
+                continue;
+            }
+            printf("%-12s %11.2f %11.2f %12ld  %-16s", r.name.c_str(), r.medianMs, r.minMs, r.maxRssKb, r.output.c_str());
+            auto old = baseline.find(r.name);
+            if (old != baseline.end()) {
+                printf("  %+6.1f%%", 100.0 * (r.medianMs - old->second.medianMs) / old->second.medianMs);
+                if (old->second.output != r.output) printf("  (output changed)");
+            }
+            printf("\n");
+        }
+        if (!options.saveFile.empty()) saveResults(options.saveFile, results, options, ccVersion);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        ++failures;
+    }
+
+    runProcess({"rm", "-rf", workDir});
+    return failures ? 1 : 0;
+}
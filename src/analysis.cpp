@@ -0,0 +1,201 @@
+#include "analysis.h"
+#include <unordered_map>
+#include <unordered_set>
+
+static const std::unordered_set<std::string> globalNames = {
+    "heat", "door_closed", "door_open", "temp_str"
+};
+
+static const std::unordered_set<std::string> pureBuiltins = {
+    "len", "slice", "copy", "sum", "has", "get", "keys", "values"
+};
+
+static const std::unordered_set<std::string> mutatingBuiltins = {
+    "push", "append", "fill"
+};
+
+static const std::unordered_set<std::string> mapMutatingBuiltins = {
+    "remove", "reserve", "rehash"
+};
+
+static const std::unordered_set<std::string> elementBuiltins = {
+    "len", "sum", "copy", "has", "get", "keys", "values"
+};
+
+static const VarExpr* asVar(const Expr* e) { return dynamic_cast<const VarExpr*>(e); }
+
+// A value no other variable can already hold: an empty declaration, a literal or a copy()
+static bool isFresh(const Expr* init) {
+    if (!init || dynamic_cast<const ArrayLiteralExpr*>(init)) return true;
+    auto call = dynamic_cast<const CallExpr*>(init);
+    auto callee = call ? asVar(call->function.get()) : nullptr;
+    return callee && callee->name == "copy";
+}
+
+// Arrays and maps the function creates itself and never hands to another name: a literal, an
+// empty declaration or a copy(), afterwards only indexed, mutated in place, read element-wise,
+// passed where no array comes back, or returned. Writing to them changes nothing the caller sees.
+static std::unordered_set<std::string> ownedLocals(const Function& fn,
+                                                   const std::unordered_map<std::string, const Function*>& functions) {
+    std::unordered_set<std::string> owned, shared;
+    for (const auto& param : fn.params) shared.insert(param.name);
+    std::unordered_map<std::string, int> uses, contained;
+    auto contain = [&](const Expr* e) {
+        if (auto var = asVar(e)) ++contained[var->name];
+    };
+    for (const auto& stmt : fn.body) {
+        walkStmt(*stmt, [&](const Stmt& st) {
+            if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&st)) {
+                bool collection = varDecl->type.size() > 2 && varDecl->type.compare(varDecl->type.size() - 2, 2, "[]") == 0;
+                collection = collection || varDecl->type.compare(0, 4, "map<") == 0;
+                (collection && isFresh(varDecl->initializer.get()) ? owned : shared).insert(varDecl->name);
+            } else if (auto ret = dynamic_cast<const ReturnStmt*>(&st)) {
+                contain(ret->expr.get());
+            }
+        }, [&](const Expr& e) {
+            if (auto var = asVar(&e)) {
+                ++uses[var->name];
+            } else if (auto array = dynamic_cast<const ArrayExpr*>(&e)) {
+                contain(array->base.get());
+            } else if (auto bin = dynamic_cast<const BinaryExpr*>(&e)) {
+                bool assigns = bin->op.back() == '=' && bin->op != "==" && bin->op != "!=" &&
+                               bin->op != "<=" && bin->op != ">=";
+                auto target = asVar(bin->left.get());
+                if (!assigns) {
+                    contain(bin->left.get());   // element-wise operands are only read
+                    contain(bin->right.get());
+                } else if (target) {
+                    if (bin->op == "=" && isFresh(bin->right.get())) contain(target);
+                    else shared.insert(target->name);
+                }
+            } else if (auto unary = dynamic_cast<const UnaryExpr*>(&e)) {
+                if (unary->op != "++" && unary->op != "--") contain(unary->operand.get());
+            } else if (auto call = dynamic_cast<const CallExpr*>(&e)) {
+                auto callee = asVar(call->function.get());
+                if (!callee || call->args.empty()) return;
+                auto target = functions.find(callee->name);
+                if (target != functions.end()) {
+                    const std::string& type = target->second->returnType;
+                    if (type.size() > 2 && type.compare(type.size() - 2, 2, "[]") == 0) return;
+                    for (const auto& arg : call->args) contain(arg.get());
+                } else if (elementBuiltins.count(callee->name) || mutatingBuiltins.count(callee->name) ||
+                           mapMutatingBuiltins.count(callee->name)) {
+                    contain(call->args[0].get());
+                    if (callee->name == "append" && call->args.size() > 1) contain(call->args[1].get());
+                }
+            }
+        });
+    }
+    for (auto it = owned.begin(); it != owned.end();) {
+        if (shared.count(*it) || uses[*it] != contained[*it]) it = owned.erase(it);
+        else ++it;
+    }
+    return owned;
+}
+
+class PurityChecker {
+    std::unordered_map<std::string, const Function*> functions;
+    std::unordered_map<const Function*, std::string> verdicts;
+    std::unordered_set<const Function*> inProgress;
+    
+    std::string check(const Function& fn) {
+        auto done = verdicts.find(&fn);
+        if (done != verdicts.end()) return done->second;
+        if (inProgress.count(&fn)) return ""; // recursion: assume pure until shown otherwise
+        inProgress.insert(&fn);
+        
+        // Names declared inside the function shadow the globals
+        std::unordered_set<std::string> locals;
+        for (const auto& param : fn.params) locals.insert(param.name);
+        for (const auto& stmt : fn.body) {
+            walkStmt(*stmt, [&](const Stmt& s) {
+                if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&s)) locals.insert(varDecl->name);
+            }, [&](const Expr& e) {
+                if (auto lambda = dynamic_cast<const LambdaExpr*>(&e)) {
+                    locals.insert(lambda->params.begin(), lambda->params.end());
+                }
+            });
+        }
+        
+        std::unordered_set<std::string> owned = ownedLocals(fn, functions);
+        auto ownedTarget = [&](const Expr* target) {
+            auto array = dynamic_cast<const ArrayExpr*>(target);
+            auto var = asVar(array ? array->base.get() : target);
+            return var && owned.count(var->name);
+        };
+        
+        std::string reason;
+        auto fail = [&](const std::string& why) {
+            if (reason.empty()) reason = why;
+        };
+        for (const auto& stmt : fn.body) {
+            walkStmt(*stmt, [&](const Stmt& s) {
+                if (dynamic_cast<const BeepStmt*>(&s)) fail("prints with beep");
+                if (dynamic_cast<const HeatStmt*>(&s)) fail("sets heat");
+                if (auto defrost = dynamic_cast<const DefrostStmt*>(&s)) {
+                    if (!locals.count(defrost->varName) && globalNames.count(defrost->varName)) {
+                        fail("defrosts global '" + defrost->varName + "'");
+                    }
+                }
+            }, [&](const Expr& e) {
+                if (auto var = dynamic_cast<const VarExpr*>(&e)) {
+                    if (globalNames.count(var->name) && !locals.count(var->name)) {
+                        fail("uses global '" + var->name + "'");
+                    }
+                } else if (auto bin = dynamic_cast<const BinaryExpr*>(&e)) {
+                    bool assigns = bin->op.back() == '=' && bin->op != "==" && bin->op != "!=" &&
+                                   bin->op != "<=" && bin->op != ">=";
+                    if (assigns && dynamic_cast<const ArrayExpr*>(bin->left.get()) && !ownedTarget(bin->left.get())) {
+                        fail("writes to an array or map element");
+                    }
+                    if (bin->op == "+" && dynamic_cast<const StringExpr*>(bin->left.get()) &&
+                        dynamic_cast<const VarExpr*>(bin->right.get())) {
+                        fail("builds a string in the shared temp_str buffer");
+                    }
+                } else if (auto unary = dynamic_cast<const UnaryExpr*>(&e)) {
+                    if ((unary->op == "++" || unary->op == "--") && dynamic_cast<const ArrayExpr*>(unary->operand.get()) &&
+                        !ownedTarget(unary->operand.get())) {
+                        fail("writes to an array or map element");
+                    }
+                } else if (auto call = dynamic_cast<const CallExpr*>(&e)) {
+                    auto callee = dynamic_cast<const VarExpr*>(call->function.get());
+                    if (!callee) {
+                        fail("calls a lambda");
+                        return;
+                    }
+                    auto target = functions.find(callee->name);
+                    if (target != functions.end()) {
+                        std::string why = check(*target->second);
+                        if (!why.empty()) fail("calls impure '" + callee->name + "' (" + why + ")");
+                    } else if (mutatingBuiltins.count(callee->name) || mapMutatingBuiltins.count(callee->name)) {
+                        if (call->args.empty() || !ownedTarget(call->args[0].get())) {
+                            fail(std::string(mutatingBuiltins.count(callee->name) ? "mutates an array with " : "mutates a map with ") +
+                                 callee->name + "()");
+                        }
+                    } else if (callee->name == "beep" || callee->name == "printf") {
+                        fail("prints with " + callee->name + "()");
+                    } else if (!pureBuiltins.count(callee->name)) {
+                        fail("calls unknown '" + callee->name + "'");
+                    }
+                }
+            });
+        }
+        
+        inProgress.erase(&fn);
+        // Verdicts that leaned on an unfinished caller are only provisional
+        if (inProgress.empty() || !reason.empty()) verdicts[&fn] = reason;
+        return reason;
+    }
+    
+public:
+    PurityChecker(const Program& program) {
+        for (const auto& func : program.functions) functions[func->name] = func.get();
+    }
+    
+    std::string reasonFor(const Function& fn) { return check(fn); }
+};
+
+std::string impurityReason(const Function& fn, const Program& program) {
+    PurityChecker checker(program);
+    return checker.reasonFor(fn);
+}
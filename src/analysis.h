@@ -0,0 +1,7 @@
+#pragma once
+#include "parser.h"
+#include <string>
+
+// Why fn is not pure (touches global state, prints, mutates arrays it did not create or
+// calls something impure), or an empty string when it is pure
+std::string impurityReason(const Function& fn, const Program& program);
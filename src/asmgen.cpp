@@ -0,0 +1,1510 @@
+#include "asmgen.h"
+#include "runtime.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+// Where a value lives while an expression is evaluated: Int and Bool in %eax (Bool only
+// changes how beep prints it), Ptr in %rax, Float (single precision) and Double in %xmm0.
+// Array values are 24-byte {data, len, cap} structs in the frame, with their address in %rax.
+enum class Kind { Void, Int, Bool, Ptr, Float, Double, IntArray, BoolArray, PtrArray, FloatArray };
+
+bool isInteger(Kind k) { return k == Kind::Int || k == Kind::Bool; }
+bool isFloating(Kind k) { return k == Kind::Float || k == Kind::Double; }
+bool isArray(Kind k) { return k >= Kind::IntArray; }
+
+Kind elementOf(Kind array) {
+    if (array == Kind::BoolArray) return Kind::Bool;
+    if (array == Kind::PtrArray) return Kind::Ptr;
+    if (array == Kind::FloatArray) return Kind::Float;
+    return Kind::Int;
+}
+
+Kind arrayOf(Kind element) {
+    if (element == Kind::Bool) return Kind::BoolArray;
+    if (element == Kind::Ptr) return Kind::PtrArray;
+    if (element == Kind::Float) return Kind::FloatArray;
+    return Kind::IntArray;
+}
+
+int elementSize(Kind array) { return array == Kind::PtrArray ? 8 : 4; }
+
+[[noreturn]] void unsupported(const ASTNode& node, const std::string& what) {
+    throw std::runtime_error("line " + std::to_string(node.line) + ": the assembly backend does not support " +
+                             what + "; use the C backend");
+}
+
+Kind kindOf(const std::string& type, const ASTNode& where) {
+    if (type.size() > 2 && type.compare(type.size() - 2, 2, "[]") == 0) {
+        Kind element = kindOf(type.substr(0, type.size() - 2), where);
+        if (element == Kind::Void || isArray(element)) unsupported(where, type + " values");
+        return arrayOf(element);
+    }
+    if (type == "int" || type == "auto") return Kind::Int;
+    if (type == "bool") return Kind::Bool;
+    if (type == "float") return Kind::Float;
+    if (type == "string") return Kind::Ptr;
+    if (type == "void") return Kind::Void;
+    if (type.compare(0, 4, "map<") == 0) unsupported(where, "maps");
+    unsupported(where, type + " values");
+}
+
+// C's usual arithmetic conversions; bool takes part as int. Arrays never take part.
+Kind promote(Kind a, Kind b) {
+    if (isArray(a) || isArray(b)) return Kind::Void;
+    if (a == Kind::Ptr || b == Kind::Ptr) return Kind::Ptr;
+    if (a == Kind::Double || b == Kind::Double) return Kind::Double;
+    if (a == Kind::Float || b == Kind::Float) return Kind::Float;
+    return Kind::Int;
+}
+
+// Literals as C reads them: 2 is int, 2.5 double and a folded 2.5f float
+Kind numberKind(const std::string& text) {
+    if (text.back() == 'f') return Kind::Float;
+    return text.find_first_of(".e") != std::string::npos ? Kind::Double : Kind::Int;
+}
+
+int32_t intValue(const std::string& text) {
+    return static_cast<int32_t>(static_cast<uint32_t>(std::strtoll(text.c_str(), nullptr, 10)));
+}
+
+// Element kind of an array literal judged from its elements alone, as the C backend does
+Kind literalKind(const ArrayLiteralExpr& lit) {
+    for (const auto& e : lit.elements) {
+        if (auto num = dynamic_cast<const NumberExpr*>(e.get())) {
+            if (num->value.find('.') != std::string::npos) return Kind::Float;
+        } else if (dynamic_cast<const StringExpr*>(e.get())) {
+            return Kind::Ptr;
+        } else if (dynamic_cast<const BoolExpr*>(e.get())) {
+            return Kind::Bool;
+        }
+    }
+    return Kind::Int;
+}
+
+bool isComparison(const std::string& op) {
+    return op == "==" || op == "!=" || op == "<" || op == ">" || op == "<=" || op == ">=";
+}
+
+bool isAssignment(const std::string& op) {
+    return op.back() == '=' && !isComparison(op);
+}
+
+bool isLeaf(const Expr& e) {
+    return dynamic_cast<const NumberExpr*>(&e) || dynamic_cast<const StringExpr*>(&e) ||
+           dynamic_cast<const BoolExpr*>(&e) || dynamic_cast<const VarExpr*>(&e);
+}
+
+// GNU as reads C escapes except these four
+std::string asString(const std::string& text) {
+    std::string out = "\"";
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '\\' && i + 1 < text.size()) {
+            char next = text[++i];
+            if (next == 'a') out += "\\007";
+            else if (next == 'v') out += "\\013";
+            else if (next == '?' || next == '\'') out += next;
+            else out += std::string("\\") + next;
+        } else {
+            out += text[i];
+        }
+    }
+    return out + "\"";
+}
+
+const char* const savedRegs64[] = {"%rbx", "%r12", "%r13", "%r14", "%r15"};
+const char* const savedRegs32[] = {"%ebx", "%r12d", "%r13d", "%r14d", "%r15d"};
+const int numSavedRegs = 5;
+const char* const intArgs64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
+const char* const intArgs32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
+const int numIntArgs = 6, numFloatArgs = 8;
+const char* const globalNames[] = {"heat", "door_closed", "door_open"};
+const char* const arrayBuiltins[] = {"len", "push", "append", "slice", "copy", "fill"};
+
+// Uses inside loops count this much more per level when picking locals for registers
+const long long loopWeight = 8, maxWeight = 4096;
+
+// A parameter, declared variable or timer counter; scopes are resolved before code is emitted
+struct Local {
+    Kind kind;
+    long long weight = 0;
+    int reg = -1;       // index into savedRegs, or -1 for a stack slot at offset(%rbp)
+    int offset = 0;
+};
+
+class AsmGenerator {
+    CodegenOptions options;
+    std::string out;
+    std::string rodata;
+    std::string relro;                                  // tables of string addresses
+    std::string body;                                   // function being generated
+    std::unordered_map<std::string, const Function*> functions;
+    std::unordered_map<std::string, std::string> strings;   // literal -> label
+    std::unordered_map<std::string, std::string> numbers;   // data directive -> label
+    std::unordered_map<std::string, int> files;             // .loc file numbers
+    int labelCounter = 0, tableCounter = 0;
+
+    // Per function
+    const Function* current = nullptr;
+    Kind returnKind = Kind::Void;
+    std::vector<Local> locals;
+    std::vector<int> paramSlots;
+    int returnSlot = -1;                                // destination of an array result
+    std::unordered_map<const Expr*, int> varSlots;      // VarExpr -> local, or -1 for a global
+    std::unordered_map<const Stmt*, int> declSlots;     // VarDeclStmt and TimerStmt -> local
+    std::unordered_map<const Stmt*, int> defrostSlots;  // DefrostStmt -> local, or -2 if not one
+    std::vector<std::unordered_map<std::string, int>> scopes;
+    long long weight = 1;
+    int tempBase = 0, tempDepth = 0, maxTemps = 0;
+    std::string returnLabel;
+    std::vector<std::pair<std::string, std::string>> loops;    // continue, break labels
+
+    void emit(const std::string& line) { body += "\t" + line + "\n"; }
+    void label(const std::string& name) { body += name + ":\n"; }
+    std::string newLabel() { return ".L" + std::to_string(labelCounter++); }
+
+    std::string stringLabel(const std::string& text) {
+        auto found = strings.find(text);
+        if (found != strings.end()) return found->second;
+        std::string name = ".Lstr" + std::to_string(strings.size());
+        rodata += name + ":\n\t.string " + asString(text) + "\n";
+        return strings[text] = name;
+    }
+
+    std::string dataLabel(const std::string& directive) {
+        auto found = numbers.find(directive);
+        if (found != numbers.end()) return found->second;
+        std::string name = ".Lnum" + std::to_string(numbers.size());
+        rodata += "\t.p2align 3\n" + name + ":\n\t" + directive + "\n";
+        return numbers[directive] = name;
+    }
+
+    // A float or double constant in .rodata, as a RIP-relative operand
+    std::string constant(Kind kind, double value) {
+        char directive[40];
+        if (kind == Kind::Float) {
+            float f = static_cast<float>(value);
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof bits);
+            snprintf(directive, sizeof directive, ".long 0x%08x", bits);
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof bits);
+            snprintf(directive, sizeof directive, ".quad 0x%016llx", static_cast<unsigned long long>(bits));
+        }
+        return dataLabel(directive) + "(%rip)";
+    }
+
+    // ---- Scope resolution and register allocation ----
+
+    int declareLocal(const std::string& name, Kind kind) {
+        locals.push_back(Local{kind});
+        int slot = static_cast<int>(locals.size()) - 1;
+        scopes.back()[name] = slot;
+        return slot;
+    }
+
+    int lookup(const std::string& name) const {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(name);
+            if (found != it->end()) return found->second;
+        }
+        return -2;
+    }
+
+    void resolveBlock(const std::vector<std::unique_ptr<Stmt>>& stmts) {
+        scopes.emplace_back();
+        for (const auto& s : stmts) resolveStmt(*s);
+        scopes.pop_back();
+    }
+
+    void resolveLoop(const std::vector<std::unique_ptr<Stmt>>& stmts) {
+        long long saved = weight;
+        weight = std::min(weight * loopWeight, maxWeight);
+        resolveBlock(stmts);
+        weight = saved;
+    }
+
+    void resolveStmt(const Stmt& stmt) {
+        if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&stmt)) {
+            if (varDecl->initializer) resolveExpr(*varDecl->initializer);
+            declSlots[&stmt] = declareLocal(varDecl->name, kindOf(varDecl->type, stmt));
+            locals[declSlots[&stmt]].weight += weight;
+        } else if (auto heat = dynamic_cast<const HeatStmt*>(&stmt)) {
+            resolveExpr(*heat->expr);
+        } else if (auto beep = dynamic_cast<const BeepStmt*>(&stmt)) {
+            resolveExpr(*beep->expr);
+        } else if (auto defrost = dynamic_cast<const DefrostStmt*>(&stmt)) {
+            int slot = lookup(defrost->varName);
+            if (slot >= 0) locals[slot].weight += weight;
+            defrostSlots[&stmt] = slot;
+        } else if (auto ret = dynamic_cast<const ReturnStmt*>(&stmt)) {
+            if (ret->expr) resolveExpr(*ret->expr);
+        } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(&stmt)) {
+            long long saved = weight;
+            weight = std::min(weight * loopWeight, maxWeight);
+            resolveExpr(*whileStmt->cond);
+            weight = saved;
+            resolveLoop(whileStmt->body);
+        } else if (auto forStmt = dynamic_cast<const ForStmt*>(&stmt)) {
+            scopes.emplace_back();
+            if (forStmt->init) resolveStmt(*forStmt->init);
+            long long saved = weight;
+            weight = std::min(weight * loopWeight, maxWeight);
+            if (forStmt->cond) resolveExpr(*forStmt->cond);
+            if (forStmt->update) resolveExpr(*forStmt->update);
+            weight = saved;
+            resolveLoop(forStmt->body);
+            scopes.pop_back();
+        } else if (auto timer = dynamic_cast<const TimerStmt*>(&stmt)) {
+            long long saved = weight;
+            weight = std::min(weight * loopWeight, maxWeight);
+            resolveExpr(*timer->count);
+            scopes.emplace_back();
+            declSlots[&stmt] = declareLocal("__i", Kind::Int);
+            locals[declSlots[&stmt]].weight += 2 * weight;
+            weight = saved;
+            resolveLoop(timer->body);
+            scopes.pop_back();
+        } else if (auto ifStmt = dynamic_cast<const IfStmt*>(&stmt)) {
+            resolveExpr(*ifStmt->cond);
+            resolveBlock(ifStmt->thenBody);
+            resolveBlock(ifStmt->elseBody);
+        } else if (auto expr = dynamic_cast<const ExprStmt*>(&stmt)) {
+            resolveExpr(*expr->expr);
+        }
+    }
+
+    void resolveExpr(const Expr& expr) {
+        if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+            int slot = lookup(var->name);
+            if (slot >= 0) {
+                locals[slot].weight += weight;
+            } else if (std::find(std::begin(globalNames), std::end(globalNames), var->name) != std::end(globalNames)) {
+                slot = -1;
+            } else if (functions.count(var->name)) {
+                unsupported(expr, "functions as values");
+            } else {
+                throw std::runtime_error("line " + std::to_string(expr.line) + ": unknown variable '" + var->name + "'");
+            }
+            varSlots[&expr] = slot;
+        } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            resolveExpr(*bin->left);
+            resolveExpr(*bin->right);
+            if (!isComparison(bin->op) && !isAssignment(bin->op) &&
+                (isArray(typeOf(*bin->left)) || isArray(typeOf(*bin->right)))) {
+                unsupported(expr, "element-wise array expressions");
+            }
+        } else if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            resolveExpr(*unary->operand);
+            if (unary->op == "-" && isArray(typeOf(*unary->operand))) unsupported(expr, "element-wise array expressions");
+        } else if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+            auto callee = dynamic_cast<const VarExpr*>(call->function.get());
+            if (!callee) unsupported(expr, "calls through expressions");
+            if (lookup(callee->name) >= 0) unsupported(expr, "calls through variables");
+            for (const auto& arg : call->args) resolveExpr(*arg);
+            if (callee->name == "sum" && !functions.count("sum") && !call->args.empty() && isArray(typeOf(*call->args[0]))) {
+                unsupported(expr, "sum()");
+            }
+        } else if (auto array = dynamic_cast<const ArrayExpr*>(&expr)) {
+            resolveExpr(*array->base);
+            resolveExpr(*array->index);
+        } else if (auto lit = dynamic_cast<const ArrayLiteralExpr*>(&expr)) {
+            for (const auto& e : lit->elements) resolveExpr(*e);
+        } else if (dynamic_cast<const LambdaExpr*>(&expr)) {
+            unsupported(expr, "lambdas");
+        } else if (auto spawn = dynamic_cast<const SpawnExpr*>(&expr)) {
+            resolveExpr(*spawn->call);
+        }
+    }
+
+    // The most used int, bool and string locals get callee-saved registers, so calls keep them.
+    // Returns how many were used; temporaries start below the last stack slot.
+    int allocateRegisters() {
+        std::vector<int> order;
+        for (size_t i = 0; i < locals.size(); ++i) {
+            if (!isFloating(locals[i].kind) && !isArray(locals[i].kind)) order.push_back(static_cast<int>(i));
+        }
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return locals[a].weight > locals[b].weight; });
+        int used = 0;
+        for (int slot : order) {
+            if (used == numSavedRegs) break;
+            locals[slot].reg = used++;
+        }
+        int offset = 8 * used;
+        for (auto& local : locals) {
+            if (local.reg >= 0) continue;
+            offset += isArray(local.kind) ? 24 : 8;
+            local.offset = -offset;
+        }
+        tempBase = offset;
+        return used;
+    }
+
+    // ---- Operands ----
+
+    std::string home(int slot) const {
+        const Local& local = locals[slot];
+        if (local.reg >= 0) return local.kind == Kind::Ptr ? savedRegs64[local.reg] : savedRegs32[local.reg];
+        return std::to_string(local.offset) + "(%rbp)";
+    }
+
+    std::string varOperand(const VarExpr& var) const {
+        int slot = varSlots.at(&var);
+        return slot < 0 ? var.name + "(%rip)" : home(slot);
+    }
+
+    Kind varKind(const VarExpr& var) const {
+        int slot = varSlots.at(&var);
+        return slot < 0 ? Kind::Int : locals[slot].kind;
+    }
+
+    bool inRegister(const VarExpr& var) const {
+        int slot = varSlots.at(&var);
+        return slot >= 0 && locals[slot].reg >= 0;
+    }
+
+    // Integer literals and int variables as a direct instruction operand
+    bool intLeaf(const Expr& e, std::string& operand) const {
+        if (auto num = dynamic_cast<const NumberExpr*>(&e)) {
+            if (numberKind(num->value) != Kind::Int) return false;
+            operand = "$" + std::to_string(intValue(num->value));
+            return true;
+        }
+        if (auto boolean = dynamic_cast<const BoolExpr*>(&e)) {
+            operand = boolean->value ? "$1" : "$0";
+            return true;
+        }
+        auto var = dynamic_cast<const VarExpr*>(&e);
+        if (!var || !isInteger(varKind(*var))) return false;
+        operand = varOperand(*var);
+        return true;
+    }
+
+    // x86 instructions take at most one memory operand
+    static bool isMemory(const std::string& operand) { return operand.find('(') != std::string::npos; }
+
+    // n contiguous 8-byte temporaries; returns the frame offset of the lowest
+    int pushTemps(int n) {
+        tempDepth += n;
+        maxTemps = std::max(maxTemps, tempDepth);
+        return -(tempBase + 8 * tempDepth);
+    }
+
+    std::string pushTemp() { return std::to_string(pushTemps(1)) + "(%rbp)"; }
+
+    void popTemp(int n = 1) { tempDepth -= n; }
+
+    static std::string frameSlot(int offset) { return std::to_string(offset) + "(%rbp)"; }
+
+    // Copies the 24-byte array struct at srcOffset(src) to dstOffset(dst) through %r11
+    void copyArray(const std::string& src, int srcOffset, const std::string& dst, int dstOffset) {
+        for (int field = 0; field < 24; field += 8) {
+            emit("movq " + std::to_string(srcOffset + field) + "(" + src + "), %r11");
+            emit("movq %r11, " + std::to_string(dstOffset + field) + "(" + dst + ")");
+        }
+    }
+
+    // An array copied from a variable shares its storage without owning it (cap 0), so growing
+    // either one moves it to storage of its own
+    void copyArrayFrom(const Expr& source, int dstOffset) {
+        copyArray("%rax", 0, "%rbp", dstOffset);
+        if (dynamic_cast<const VarExpr*>(&source)) emit("movq $0, " + frameSlot(dstOffset + 16));
+    }
+
+    void clearArray(int offset) {
+        for (int field = 0; field < 24; field += 8) emit("movq $0, " + frameSlot(offset + field));
+    }
+
+    static std::string move(Kind kind) {
+        if (kind == Kind::Ptr || isArray(kind)) return "movq";
+        if (kind == Kind::Float) return "movss";
+        if (kind == Kind::Double) return "movsd";
+        return "movl";
+    }
+
+    static std::string resultReg(Kind kind) {
+        if (kind == Kind::Ptr || isArray(kind)) return "%rax";
+        if (isFloating(kind)) return "%xmm0";
+        return "%eax";
+    }
+
+    // ---- Types ----
+
+    Kind typeOf(const Expr& expr) const {
+        if (auto num = dynamic_cast<const NumberExpr*>(&expr)) return numberKind(num->value);
+        if (dynamic_cast<const StringExpr*>(&expr)) return Kind::Ptr;
+        if (dynamic_cast<const BoolExpr*>(&expr)) return Kind::Bool;
+        if (auto var = dynamic_cast<const VarExpr*>(&expr)) return varKind(*var);
+        if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            if (isComparison(bin->op) || bin->op == "&&" || bin->op == "||") return Kind::Bool;
+            if (isAssignment(bin->op)) return typeOf(*bin->left);
+            return promote(typeOf(*bin->left), typeOf(*bin->right));
+        }
+        if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            if (unary->op == "!") return Kind::Bool;
+            Kind k = typeOf(*unary->operand);
+            return k == Kind::Bool ? Kind::Int : k;
+        }
+        if (auto spawn = dynamic_cast<const SpawnExpr*>(&expr)) return typeOf(*spawn->call);
+        if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+            std::string builtin;
+            if (isArrayBuiltin(*call, builtin)) {
+                if (builtin == "len") return Kind::Int;
+                if (builtin == "slice" || builtin == "copy") return typeOf(*call->args[0]);
+                return Kind::Void;
+            }
+            auto callee = static_cast<const VarExpr*>(call->function.get());
+            auto fn = functions.find(callee->name);
+            return fn != functions.end() ? kindOf(fn->second->returnType, *fn->second) : Kind::Int;
+        }
+        if (auto array = dynamic_cast<const ArrayExpr*>(&expr)) {
+            Kind base = typeOf(*array->base);
+            return isArray(base) ? elementOf(base) : Kind::Int;
+        }
+        if (auto lit = dynamic_cast<const ArrayLiteralExpr*>(&expr)) return arrayOf(literalKind(*lit));
+        return Kind::Int;
+    }
+
+    // Array builtins apply when no program function shadows the name and the first argument is an array
+    bool isArrayBuiltin(const CallExpr& call, std::string& name) const {
+        auto callee = static_cast<const VarExpr*>(call.function.get());
+        if (std::find(std::begin(arrayBuiltins), std::end(arrayBuiltins), callee->name) == std::end(arrayBuiltins) ||
+            functions.count(callee->name) || call.args.empty() || !isArray(typeOf(*call.args[0]))) {
+            return false;
+        }
+        name = callee->name;
+        return true;
+    }
+
+    // Converts the value in the result register from one kind to another, as C assignment does
+    void convert(Kind from, Kind to, const ASTNode& where) {
+        if (from == to || to == Kind::Void || (isInteger(from) && isInteger(to))) return;
+        if (from == Kind::Void) throw std::runtime_error("line " + std::to_string(where.line) + ": void value used");
+        if (isArray(from) || isArray(to)) unsupported(where, "converting between arrays of different types or other values");
+        if (from == Kind::Ptr || to == Kind::Ptr) unsupported(where, "conversions between strings and numbers");
+        if (isInteger(from)) {
+            emit("pxor %xmm0, %xmm0");
+            emit(to == Kind::Float ? "cvtsi2ssl %eax, %xmm0" : "cvtsi2sdl %eax, %xmm0");
+        } else if (isInteger(to)) {
+            emit(from == Kind::Float ? "cvttss2si %xmm0, %eax" : "cvttsd2si %xmm0, %eax");
+        } else {
+            emit(from == Kind::Float ? "cvtss2sd %xmm0, %xmm0" : "cvtsd2ss %xmm0, %xmm0");
+        }
+    }
+
+    // Array literals take their element type from where they are used, as in the C backend
+    void genAs(const Expr& expr, Kind kind) {
+        auto lit = dynamic_cast<const ArrayLiteralExpr*>(&expr);
+        if (lit && isArray(kind)) genArrayLiteral(*lit, kind);
+        else convert(gen(expr), kind, expr);
+    }
+
+    // Loads a leaf (literal or variable) converted to kind into xmm, leaving %xmm0 alone
+    void loadFloatLeaf(const Expr& e, Kind kind, const std::string& xmm) {
+        std::string suffix = kind == Kind::Float ? "ss" : "sd";
+        if (auto num = dynamic_cast<const NumberExpr*>(&e)) {
+            double value = numberKind(num->value) == Kind::Int ? intValue(num->value) :
+                           numberKind(num->value) == Kind::Float ? std::strtof(num->value.c_str(), nullptr) :
+                           std::strtod(num->value.c_str(), nullptr);
+            emit("mov" + suffix + " " + constant(kind, value) + ", " + xmm);
+        } else if (auto boolean = dynamic_cast<const BoolExpr*>(&e)) {
+            emit("mov" + suffix + " " + constant(kind, boolean->value ? 1 : 0) + ", " + xmm);
+        } else {
+            auto& var = static_cast<const VarExpr&>(e);
+            Kind from = varKind(var);
+            if (from == Kind::Ptr) unsupported(e, "conversions between strings and numbers");
+            if (isInteger(from)) {
+                emit("pxor " + xmm + ", " + xmm);
+                emit("cvtsi2" + suffix + "l " + varOperand(var) + ", " + xmm);
+            } else if (kind == Kind::Float) {
+                emit("movss " + varOperand(var) + ", " + xmm);
+            } else {
+                emit("cvtss2sd " + varOperand(var) + ", " + xmm);
+            }
+        }
+    }
+
+    // Left operand in %xmm0 and right in %xmm1, both converted to kind
+    void floatOperands(const Expr& left, const Expr& right, Kind kind) {
+        if (isLeaf(right) && !dynamic_cast<const StringExpr*>(&right)) {
+            genAs(left, kind);
+            loadFloatLeaf(right, kind, "%xmm1");
+            return;
+        }
+        genAs(right, kind);
+        std::string temp = pushTemp();
+        emit(move(kind) + " %xmm0, " + temp);
+        genAs(left, kind);
+        emit(move(kind) + " " + temp + ", %xmm1");
+        popTemp();
+    }
+
+    // ---- Arrays ----
+
+    // Sets element to the operand addressing a[i] (through %r10 and %r11, which only leaf
+    // evaluation may run past) and returns the element kind
+    Kind elementAddress(const ArrayExpr& array, std::string& element) {
+        Kind kind = typeOf(*array.base);
+        if (kind == Kind::Ptr) unsupported(array, "writing to strings");
+        if (!isArray(kind)) unsupported(array, "indexing this value");
+        std::string size = std::to_string(elementSize(kind));
+        auto num = dynamic_cast<const NumberExpr*>(array.index.get());
+        bool constant = num && numberKind(num->value) == Kind::Int;
+        auto var = dynamic_cast<const VarExpr*>(array.base.get());
+        if (var) {
+            std::string index;
+            if (!constant && !intLeaf(*array.index, index)) {
+                genAs(*array.index, Kind::Int);
+                index = "%eax";
+            }
+            if (!constant) emit((index[0] == '$' ? "movq " : "movslq ") + index + ", %r11");
+            emit("movq " + varOperand(*var) + ", %r10");
+        } else {
+            std::string temp;
+            if (!constant) {
+                genAs(*array.index, Kind::Int);
+                temp = pushTemp();
+                emit("movl %eax, " + temp);
+            }
+            gen(*array.base);
+            if (!constant) {
+                emit("movslq " + temp + ", %r11");
+                popTemp();
+            }
+            emit("movq (%rax), %r10");
+        }
+        element = constant ? std::to_string(static_cast<long long>(intValue(num->value)) * elementSize(kind)) + "(%r10)"
+                           : "(%r10,%r11," + size + ")";
+        return elementOf(kind);
+    }
+
+    // Literal elements only: the initial contents can come from a table in .rodata
+    static bool isConstantLiteral(const ArrayLiteralExpr& lit, Kind element) {
+        for (const auto& e : lit.elements) {
+            if (element == Kind::Ptr) {
+                if (!dynamic_cast<const StringExpr*>(e.get())) return false;
+                continue;
+            }
+            auto unary = dynamic_cast<const UnaryExpr*>(e.get());
+            const Expr* value = unary && (unary->op == "-" || unary->op == "+") ? unary->operand.get() : e.get();
+            if (!dynamic_cast<const NumberExpr*>(value) && (unary || !dynamic_cast<const BoolExpr*>(value))) return false;
+        }
+        return true;
+    }
+
+    // Data directive for one constant element
+    std::string tableEntry(const Expr& e, Kind element) {
+        if (auto str = dynamic_cast<const StringExpr*>(&e)) return ".quad " + stringLabel(str->value);
+        if (auto boolean = dynamic_cast<const BoolExpr*>(&e)) return boolean->value ? ".long 1" : ".long 0";
+        auto unary = dynamic_cast<const UnaryExpr*>(&e);
+        bool negate = unary && unary->op == "-";
+        const std::string& text = static_cast<const NumberExpr&>(unary ? *unary->operand : e).value;
+        Kind kind = numberKind(text);
+        char directive[32];
+        if (element == Kind::Float) {
+            float value = kind == Kind::Float ? std::strtof(text.c_str(), nullptr) :
+                          static_cast<float>(kind == Kind::Int ? intValue(text) : std::strtod(text.c_str(), nullptr));
+            if (negate) value = -value;
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof bits);
+            snprintf(directive, sizeof directive, ".long 0x%08x", bits);
+        } else {
+            int64_t value = kind == Kind::Int ? intValue(text) : static_cast<int64_t>(std::strtod(text.c_str(), nullptr));
+            if (negate) value = -value;
+            snprintf(directive, sizeof directive, ".long %d", static_cast<int32_t>(static_cast<uint32_t>(value)));
+        }
+        return directive;
+    }
+
+    // Builds a new heap array from the literal, from a .rodata table when every element is a
+    // literal and from a buffer of evaluated elements otherwise. The struct goes to the frame
+    // slot at dst (a fresh temporary when 0); its address is left in %rax.
+    Kind genArrayLiteral(const ArrayLiteralExpr& lit, Kind kind, int dst = 0) {
+        if (!dst) dst = pushTemps(3);
+        Kind element = elementOf(kind);
+        int size = elementSize(kind);
+        size_t n = lit.elements.size();
+        if (n == 0) {
+            clearArray(dst);
+            emit("leaq " + frameSlot(dst) + ", %rax");
+            return kind;
+        }
+        int words = 0;
+        if (isConstantLiteral(lit, element)) {
+            std::string table = ".Ltab" + std::to_string(tableCounter++);
+            std::string entries;
+            for (const auto& e : lit.elements) entries += "\t" + tableEntry(*e, element) + "\n";
+            (element == Kind::Ptr ? relro : rodata) += "\t.p2align 3\n" + table + ":\n" + entries;
+            emit("leaq " + table + "(%rip), %rsi");
+        } else {
+            words = static_cast<int>((n * size + 7) / 8);
+            int buffer = pushTemps(words);
+            for (size_t i = 0; i < n; ++i) {
+                genAs(*lit.elements[i], element);
+                emit(move(element) + " " + resultReg(element) + ", " + frameSlot(buffer + static_cast<int>(i) * size));
+            }
+            emit("leaq " + frameSlot(buffer) + ", %rsi");
+        }
+        emit("leaq " + frameSlot(dst) + ", %rdi");
+        emit("movl $" + std::to_string(n) + ", %edx");
+        emit("movl $" + std::to_string(size) + ", %ecx");
+        emit("call mw_rt_array_from");
+        if (words) popTemp(words);
+        emit("leaq " + frameSlot(dst) + ", %rax");
+        return kind;
+    }
+
+    // len, push, append, slice, copy and fill on the runtime's size-generic arrays
+    Kind genArrayBuiltin(const CallExpr& call, const std::string& name) {
+        size_t arity = name == "slice" ? 3 : (name == "len" || name == "copy") ? 1 : 2;
+        if (call.args.size() != arity) {
+            throw std::runtime_error("line " + std::to_string(call.line) + ": builtin '" + name + "' expects " +
+                                     std::to_string(arity) + " arguments");
+        }
+        const Expr& array = *call.args[0];
+        Kind kind = typeOf(array);
+        std::string size = "$" + std::to_string(elementSize(kind));
+        auto var = dynamic_cast<const VarExpr*>(&array);
+        if (name == "len") {
+            if (var) {
+                emit("movl " + frameSlot(locals[varSlots.at(var)].offset + 8) + ", %eax");
+            } else {
+                gen(array);
+                emit("movl 8(%rax), %eax");
+            }
+            return Kind::Int;
+        }
+        if (name == "push" || name == "fill") {
+            Kind element = elementOf(kind);
+            genAs(*call.args[1], element);
+            std::string value = pushTemp();
+            emit(move(element) + " " + resultReg(element) + ", " + value);
+            if (name == "push") {
+                if (!var) unsupported(call, "push to a temporary array");
+                emit("leaq " + varOperand(*var) + ", %rdi");
+            } else {
+                gen(array);
+                emit("movq %rax, %rdi");
+            }
+            emit("leaq " + value + ", %rsi");
+            emit("movl " + size + ", %edx");
+            emit("call mw_rt_array_" + name);
+            popTemp();
+            return Kind::Void;
+        }
+        if (name == "append") {
+            if (!var) unsupported(call, "append to a temporary array");
+            genAs(*call.args[1], kind);
+            emit("movq %rax, %rsi");
+            emit("leaq " + varOperand(*var) + ", %rdi");
+            emit("movl " + size + ", %edx");
+            emit("call mw_rt_array_append");
+            return Kind::Void;
+        }
+        int dst = pushTemps(3);
+        if (name == "slice") {
+            genAs(*call.args[1], Kind::Int);
+            std::string lo = pushTemp();
+            emit("movl %eax, " + lo);
+            genAs(*call.args[2], Kind::Int);
+            std::string hi = pushTemp();
+            emit("movl %eax, " + hi);
+            gen(array);
+            emit("movq %rax, %rsi");
+            emit("movslq " + lo + ", %rdx");
+            emit("movslq " + hi + ", %rcx");
+            emit("movl " + size + ", %r8d");
+            popTemp(2);
+        } else {
+            gen(array);
+            emit("movq %rax, %rsi");
+            emit("movl " + size + ", %edx");
+        }
+        emit("leaq " + frameSlot(dst) + ", %rdi");
+        emit("call mw_rt_array_" + name);
+        emit("leaq " + frameSlot(dst) + ", %rax");
+        return kind;
+    }
+
+    // ---- Expressions ----
+
+    // Evaluates expr into the result register of its kind
+    Kind gen(const Expr& expr) {
+        if (auto num = dynamic_cast<const NumberExpr*>(&expr)) {
+            Kind kind = numberKind(num->value);
+            if (kind == Kind::Int) {
+                int32_t value = intValue(num->value);
+                emit(value == 0 ? "xorl %eax, %eax" : "movl $" + std::to_string(value) + ", %eax");
+            } else {
+                loadFloatLeaf(expr, kind, "%xmm0");
+            }
+            return kind;
+        } else if (auto str = dynamic_cast<const StringExpr*>(&expr)) {
+            emit("leaq " + stringLabel(str->value) + "(%rip), %rax");
+            return Kind::Ptr;
+        } else if (auto boolean = dynamic_cast<const BoolExpr*>(&expr)) {
+            emit(boolean->value ? "movl $1, %eax" : "xorl %eax, %eax");
+            return Kind::Bool;
+        } else if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+            Kind kind = varKind(*var);
+            emit((isArray(kind) ? "leaq " : move(kind) + " ") + varOperand(*var) + ", " + resultReg(kind));
+            return kind;
+        } else if (auto array = dynamic_cast<const ArrayExpr*>(&expr)) {
+            if (typeOf(*array->base) == Kind::Ptr) {
+                // s[i] reads a char, which C widens to int
+                genAs(*array->index, Kind::Int);
+                std::string temp = pushTemp();
+                emit("movl %eax, " + temp);
+                gen(*array->base);
+                emit("movslq " + temp + ", %r11");
+                emit("movsbl (%rax,%r11), %eax");
+                popTemp();
+                return Kind::Int;
+            }
+            std::string element;
+            Kind kind = elementAddress(*array, element);
+            emit(move(kind) + " " + element + ", " + resultReg(kind));
+            return kind;
+        } else if (auto lit = dynamic_cast<const ArrayLiteralExpr*>(&expr)) {
+            return genArrayLiteral(*lit, arrayOf(literalKind(*lit)));
+        } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            if (isAssignment(bin->op)) return genAssign(*bin, true);
+            if (isComparison(bin->op) || bin->op == "&&" || bin->op == "||") {
+                std::string falseLabel = newLabel(), end = newLabel();
+                if (!isComparison(bin->op) || !genCompareValue(*bin)) {
+                    genCond(expr, falseLabel, false);
+                    emit("movl $1, %eax");
+                    emit("jmp " + end);
+                    label(falseLabel);
+                    emit("xorl %eax, %eax");
+                    label(end);
+                }
+                return Kind::Bool;
+            }
+            return genArith(bin->op, *bin->left, *bin->right, expr);
+        } else if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            return genUnary(*unary, true);
+        } else if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+            return genCall(*call);
+        } else if (auto spawn = dynamic_cast<const SpawnExpr*>(&expr)) {
+            // No task runtime here: spawned calls run in place and sync is a no-op
+            return genCall(*spawn->call);
+        }
+        unsupported(expr, "this expression");
+    }
+
+    Kind genArith(const std::string& op, const Expr& left, const Expr& right, const ASTNode& where) {
+        if (op == "+") {
+            // "literal" + int variable: the C backend's sprintf into the shared temp_str
+            auto str = dynamic_cast<const StringExpr*>(&left);
+            auto var = dynamic_cast<const VarExpr*>(&right);
+            if (str && var && isInteger(varKind(*var))) {
+                emit("movl " + varOperand(*var) + ", %esi");
+                emit("leaq " + stringLabel(str->value) + "(%rip), %rdi");
+                emit("call mw_rt_concat_int");
+                return Kind::Ptr;
+            }
+        }
+        Kind kind = promote(typeOf(left), typeOf(right));
+        if (kind == Kind::Ptr) unsupported(where, "'" + op + "' on strings other than \"literal\" + int variable");
+        if (kind == Kind::Void) unsupported(where, "'" + op + "' on arrays");
+        if (isFloating(kind)) {
+            floatOperands(left, right, kind);
+            applyFloat(op, kind, where);
+            return kind;
+        }
+
+        std::string operand;
+        bool temp = !intLeaf(right, operand);
+        if (temp) {
+            genAs(right, Kind::Int);
+            operand = pushTemp();
+            emit("movl %eax, " + operand);
+        }
+        genAs(left, Kind::Int);
+        applyInt(op, operand, where);
+        if (temp) popTemp();
+        return Kind::Int;
+    }
+
+    // %eax = %eax op operand
+    void applyInt(const std::string& op, std::string operand, const ASTNode& where) {
+        if (op == "+") emit("addl " + operand + ", %eax");
+        else if (op == "-") emit("subl " + operand + ", %eax");
+        else if (op == "*") emit("imull " + operand + ", %eax");
+        else if (op == "&") emit("andl " + operand + ", %eax");
+        else if (op == "|") emit("orl " + operand + ", %eax");
+        else if (op == "^") emit("xorl " + operand + ", %eax");
+        else if (op == "<<" || op == ">>") {
+            std::string instr = op == "<<" ? "sall " : "sarl ";
+            if (operand[0] == '$') {
+                emit(instr + operand + ", %eax");
+            } else {
+                emit("movl " + operand + ", %ecx");
+                emit(instr + "%cl, %eax");
+            }
+        } else if (op == "/" || op == "%") {
+            if (operand[0] == '$') {
+                emit("movl " + operand + ", %ecx");
+                operand = "%ecx";
+            }
+            emit("cltd");
+            emit("idivl " + operand);
+            if (op == "%") emit("movl %edx, %eax");
+        } else {
+            unsupported(where, "operator '" + op + "'");
+        }
+    }
+
+    // %xmm0 = %xmm0 op %xmm1
+    void applyFloat(const std::string& op, Kind kind, const ASTNode& where) {
+        std::string suffix = kind == Kind::Float ? "ss" : "sd";
+        std::string instr = op == "+" ? "add" : op == "-" ? "sub" : op == "*" ? "mul" : op == "/" ? "div" : "";
+        if (instr.empty()) unsupported(where, "'" + op + "' on floats");
+        emit(instr + suffix + " %xmm1, %xmm0");
+    }
+
+    // Sets the flags for a comparison and returns the condition code that means true.
+    // Floating == and != also need the parity flag (set when either side is NaN).
+    std::string genCompare(const BinaryExpr& bin, bool& parity) {
+        parity = false;
+        const std::string& op = bin.op;
+        Kind kind = promote(typeOf(*bin.left), typeOf(*bin.right));
+        if (kind == Kind::Void) unsupported(bin, "comparing arrays");
+        if (isFloating(kind)) {
+            floatOperands(*bin.left, *bin.right, kind);
+            std::string ucomi = kind == Kind::Float ? "ucomiss " : "ucomisd ";
+            // Only "above" conditions are false for unordered operands, so < and <= swap sides
+            if (op == "<" || op == "<=") {
+                emit(ucomi + "%xmm0, %xmm1");
+                return op == "<" ? "a" : "ae";
+            }
+            emit(ucomi + "%xmm1, %xmm0");
+            if (op == ">" || op == ">=") return op == ">" ? "a" : "ae";
+            parity = true;
+            return op == "==" ? "e" : "ne";
+        }
+        if (kind == Kind::Ptr) {
+            if (typeOf(*bin.left) != Kind::Ptr || typeOf(*bin.right) != Kind::Ptr) {
+                unsupported(bin, "comparing strings with numbers");
+            }
+            genAs(*bin.right, Kind::Ptr);
+            std::string temp = pushTemp();
+            emit("movq %rax, " + temp);
+            genAs(*bin.left, Kind::Ptr);
+            emit("cmpq " + temp + ", %rax");
+            popTemp();
+        } else {
+            std::string operand, leftOperand;
+            auto leftVar = dynamic_cast<const VarExpr*>(bin.left.get());
+            if (intLeaf(*bin.right, operand) && leftVar && inRegister(*leftVar) && isInteger(varKind(*leftVar))) {
+                emit("cmpl " + operand + ", " + varOperand(*leftVar));
+            } else {
+                bool temp = !intLeaf(*bin.right, operand);
+                if (temp) {
+                    genAs(*bin.right, Kind::Int);
+                    operand = pushTemp();
+                    emit("movl %eax, " + operand);
+                }
+                genAs(*bin.left, Kind::Int);
+                emit("cmpl " + operand + ", %eax");
+                if (temp) popTemp();
+            }
+            if (op == "<") return "l";
+            if (op == "<=") return "le";
+            if (op == ">") return "g";
+            if (op == ">=") return "ge";
+        }
+        return op == "==" ? "e" : "ne";
+    }
+
+    static std::string invert(const std::string& cc) {
+        static const std::unordered_map<std::string, std::string> inverse = {
+            {"e", "ne"}, {"ne", "e"}, {"l", "ge"}, {"ge", "l"}, {"le", "g"}, {"g", "le"},
+            {"a", "be"}, {"be", "a"}, {"ae", "b"}, {"b", "ae"}
+        };
+        return inverse.at(cc);
+    }
+
+    // Comparison result as 0 or 1 in %eax; false if the caller should branch instead
+    bool genCompareValue(const BinaryExpr& bin) {
+        bool parity;
+        std::string cc = genCompare(bin, parity);
+        emit("set" + cc + " %al");
+        if (parity) {
+            emit(cc == "e" ? "setnp %cl" : "setp %cl");
+            emit(cc == "e" ? "andb %cl, %al" : "orb %cl, %al");
+        }
+        emit("movzbl %al, %eax");
+        return true;
+    }
+
+    // After ucomis against zero or another float: jump when the operands are (not) equal
+    void jumpFloatEqual(bool equal, const std::string& target) {
+        if (equal) {
+            std::string skip = newLabel();
+            emit("jp " + skip);
+            emit("je " + target);
+            label(skip);
+        } else {
+            emit("jne " + target);
+            emit("jp " + target);
+        }
+    }
+
+    // Jumps to target when expr is truthy (jumpIf) or falsy (!jumpIf); falls through otherwise
+    void genCond(const Expr& expr, const std::string& target, bool jumpIf) {
+        if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            if (bin->op == "&&" || bin->op == "||") {
+                bool isAnd = bin->op == "&&";
+                if (isAnd != jumpIf) {
+                    genCond(*bin->left, target, jumpIf);
+                    genCond(*bin->right, target, jumpIf);
+                } else {
+                    std::string skip = newLabel();
+                    genCond(*bin->left, skip, !jumpIf);
+                    genCond(*bin->right, target, jumpIf);
+                    label(skip);
+                }
+                return;
+            }
+            if (isComparison(bin->op)) {
+                bool parity;
+                std::string cc = genCompare(*bin, parity);
+                if (parity) jumpFloatEqual((cc == "e") == jumpIf, target);
+                else emit("j" + (jumpIf ? cc : invert(cc)) + " " + target);
+                return;
+            }
+        }
+        if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            if (unary->op == "!") {
+                genCond(*unary->operand, target, !jumpIf);
+                return;
+            }
+        }
+        auto var = dynamic_cast<const VarExpr*>(&expr);
+        if (var && isInteger(varKind(*var))) {
+            emit("cmpl $0, " + varOperand(*var));
+            emit((jumpIf ? "jne " : "je ") + target);
+            return;
+        }
+        Kind kind = gen(expr);
+        if (isArray(kind)) unsupported(expr, "arrays as conditions");
+        if (isFloating(kind)) {
+            emit("pxor %xmm1, %xmm1");
+            emit(kind == Kind::Float ? "ucomiss %xmm1, %xmm0" : "ucomisd %xmm1, %xmm0");
+            jumpFloatEqual(!jumpIf, target);
+            return;
+        }
+        if (kind == Kind::Void) convert(kind, Kind::Int, expr);
+        emit(kind == Kind::Ptr ? "testq %rax, %rax" : "testl %eax, %eax");
+        emit((jumpIf ? "jne " : "je ") + target);
+    }
+
+    void store(const VarExpr& var, Kind kind) {
+        emit(move(kind) + " " + resultReg(kind) + ", " + varOperand(var));
+    }
+
+    // Plain and compound assignment to a variable; the stored value stays in the result
+    // register when needValue
+    Kind genAssign(const BinaryExpr& bin, bool needValue) {
+        if (auto element = dynamic_cast<const ArrayExpr*>(bin.left.get())) return genElementAssign(bin, *element);
+        auto target = dynamic_cast<const VarExpr*>(bin.left.get());
+        if (!target) unsupported(bin, "assignment to this target");
+        Kind kind = varKind(*target);
+        if (isArray(kind)) {
+            // Arrays assign by value: the struct is copied and the storage shared, as in C
+            if (bin.op != "=") unsupported(bin, "'" + bin.op + "' on arrays");
+            genAs(*bin.right, kind);
+            copyArrayFrom(*bin.right, locals[varSlots.at(target)].offset);
+            if (needValue) emit("leaq " + varOperand(*target) + ", %rax");
+            return kind;
+        }
+        if (bin.op == "=") {
+            genAs(*bin.right, kind);
+            store(*target, kind);
+            return kind;
+        }
+        std::string op = bin.op.substr(0, bin.op.size() - 1);
+        std::string operand;
+        bool direct = isInteger(kind) && intLeaf(*bin.right, operand) &&
+                      (inRegister(*target) || !isMemory(operand));
+        static const std::unordered_map<std::string, std::string> directOps = {
+            {"+", "addl "}, {"-", "subl "}, {"&", "andl "}, {"|", "orl "}, {"^", "xorl "}
+        };
+        auto instr = directOps.find(op);
+        if (direct && instr != directOps.end()) {
+            // x += 1 and friends update the variable where it lives
+            emit(instr->second + operand + ", " + varOperand(*target));
+            if (needValue) emit("movl " + varOperand(*target) + ", %eax");
+            return kind;
+        }
+        convert(genArith(op, *target, *bin.right, bin), kind, bin);
+        store(*target, kind);
+        return kind;
+    }
+
+    // a[i] = v and a[i] op= v; the stored value stays in the result register
+    Kind genElementAssign(const BinaryExpr& bin, const ArrayExpr& target) {
+        Kind element = typeOf(target);
+        std::string where;
+        if (bin.op == "=" && isLeaf(*bin.right)) {
+            elementAddress(target, where);
+            genAs(*bin.right, element);
+            emit(move(element) + " " + resultReg(element) + ", " + where);
+            return element;
+        }
+        // The right side may call, so it is evaluated before the element is addressed
+        std::string op = bin.op.substr(0, bin.op.size() - 1);
+        Kind kind = op.empty() ? element : promote(element, typeOf(*bin.right));
+        if (kind == Kind::Ptr && !op.empty()) unsupported(bin, "'" + bin.op + "' on strings");
+        if (kind == Kind::Void) unsupported(bin, "'" + bin.op + "' on arrays");
+        genAs(*bin.right, kind);
+        std::string temp = pushTemp();
+        emit(move(kind) + " " + resultReg(kind) + ", " + temp);
+        elementAddress(target, where);
+        if (op.empty()) {
+            emit(move(kind) + " " + temp + ", " + resultReg(kind));
+        } else if (isFloating(kind)) {
+            if (element == Kind::Float && kind == Kind::Double) {
+                emit("cvtss2sd " + where + ", %xmm0");
+            } else {
+                emit(move(element) + " " + where + ", " + resultReg(element));
+                convert(element, kind, bin);
+            }
+            emit(move(kind) + " " + temp + ", %xmm1");
+            applyFloat(op, kind, bin);
+        } else {
+            emit("movl " + where + ", %eax");
+            applyInt(op, temp, bin);
+        }
+        convert(kind, element, bin);
+        emit(move(element) + " " + resultReg(element) + ", " + where);
+        popTemp();
+        return element;
+    }
+
+    Kind genUnary(const UnaryExpr& unary, bool needValue) {
+        const std::string& op = unary.op;
+        if (op == "++" || op == "--") {
+            auto var = dynamic_cast<const VarExpr*>(unary.operand.get());
+            auto element = dynamic_cast<const ArrayExpr*>(unary.operand.get());
+            if (!var && !element) unsupported(unary, "'" + op + "' on this target");
+            std::string where;
+            Kind kind = var ? varKind(*var) : elementAddress(*element, where);
+            if (var) where = varOperand(*var);
+            if (isInteger(kind)) {
+                if (needValue && !unary.isPrefix) emit("movl " + where + ", %eax");
+                emit((op == "++" ? "incl " : "decl ") + where);
+                if (needValue && unary.isPrefix) emit("movl " + where + ", %eax");
+                return Kind::Int;
+            }
+            if (kind != Kind::Float) unsupported(unary, "'" + op + "' on this value");
+            emit("movss " + where + ", %xmm0");
+            emit("movaps %xmm0, %xmm1");
+            emit((op == "++" ? "addss " : "subss ") + constant(Kind::Float, 1) + ", %xmm1");
+            emit("movss %xmm1, " + where);
+            if (unary.isPrefix) emit("movaps %xmm1, %xmm0");
+            return Kind::Float;
+        }
+        if (op == "!") {
+            std::string falseLabel = newLabel(), end = newLabel();
+            genCond(*unary.operand, falseLabel, true);
+            emit("movl $1, %eax");
+            emit("jmp " + end);
+            label(falseLabel);
+            emit("xorl %eax, %eax");
+            label(end);
+            return Kind::Bool;
+        }
+        Kind kind = gen(*unary.operand);
+        if (kind == Kind::Bool) kind = Kind::Int;
+        if (kind == Kind::Ptr || kind == Kind::Void || isArray(kind)) unsupported(unary, "'" + op + "' on this value");
+        if (op == "+") return kind;
+        if (op == "~") {
+            if (!isInteger(kind)) unsupported(unary, "'~' on floats");
+            emit("notl %eax");
+        } else if (kind == Kind::Int) {
+            emit("negl %eax");
+        } else if (kind == Kind::Float) {
+            emit("movd %xmm0, %eax");
+            emit("xorl $0x80000000, %eax");
+            emit("movd %eax, %xmm0");
+        } else {
+            emit("movq %xmm0, %rax");
+            emit("btcq $63, %rax");
+            emit("movq %rax, %xmm0");
+        }
+        return kind;
+    }
+
+    // Calls to program functions pass arguments as their parameter types; any other name is a
+    // C function (printf, ...) called the way C calls a variadic one
+    Kind genCall(const CallExpr& call) {
+        std::string builtin;
+        if (isArrayBuiltin(call, builtin)) return genArrayBuiltin(call, builtin);
+        auto callee = static_cast<const VarExpr*>(call.function.get());
+        auto found = functions.find(callee->name);
+        const Function* fn = found != functions.end() ? found->second : nullptr;
+        if (fn && fn->params.size() != call.args.size()) {
+            throw std::runtime_error("line " + std::to_string(call.line) + ": '" + fn->name + "' expects " +
+                                     std::to_string(fn->params.size()) + " arguments, got " +
+                                     std::to_string(call.args.size()));
+        }
+
+        // An array result is written through a hidden first argument; arrays are passed by address
+        // and copied by the callee
+        Kind result = fn ? kindOf(fn->returnType, *fn) : Kind::Int;
+        int dst = isArray(result) ? pushTemps(3) : 0;
+        std::vector<Kind> kinds;
+        std::vector<std::string> regs;
+        int ints = dst ? 1 : 0, floats = 0;
+        for (size_t i = 0; i < call.args.size(); ++i) {
+            Kind kind = fn ? kindOf(fn->params[i].type, *fn) : typeOf(*call.args[i]);
+            if (!fn && kind == Kind::Float) kind = Kind::Double;
+            if (!fn && isArray(kind)) unsupported(call, "passing arrays to C functions");
+            if (kind == Kind::Void) throw std::runtime_error("line " + std::to_string(call.line) + ": void value used");
+            kinds.push_back(kind);
+            if (isFloating(kind)) {
+                if (floats == numFloatArgs) unsupported(call, "calls with more than 8 floating-point arguments");
+                regs.push_back("%xmm" + std::to_string(floats++));
+            } else {
+                if (ints == numIntArgs) unsupported(call, "calls with more than 6 integer or string arguments");
+                regs.push_back(kind == Kind::Ptr || isArray(kind) ? intArgs64[ints] : intArgs32[ints]);
+                ++ints;
+            }
+        }
+
+        // Arguments that need code (and may call) go to temporaries first; leaves load last
+        std::vector<std::string> temps(call.args.size());
+        for (size_t i = 0; i < call.args.size(); ++i) {
+            if (isLeaf(*call.args[i])) continue;
+            genAs(*call.args[i], kinds[i]);
+            temps[i] = pushTemp();
+            emit(move(kinds[i]) + " " + resultReg(kinds[i]) + ", " + temps[i]);
+        }
+        for (size_t i = 0; i < call.args.size(); ++i) {
+            const Expr& arg = *call.args[i];
+            std::string operand;
+            if (!temps[i].empty()) {
+                emit(move(kinds[i]) + " " + temps[i] + ", " + regs[i]);
+            } else if (isArray(kinds[i])) {
+                auto var = dynamic_cast<const VarExpr*>(&arg);
+                if (!var || varKind(*var) != kinds[i]) convert(typeOf(arg), kinds[i], arg);
+                emit("leaq " + varOperand(*var) + ", " + regs[i]);
+            } else if (isFloating(kinds[i])) {
+                loadFloatLeaf(arg, kinds[i], regs[i]);
+            } else if (kinds[i] == Kind::Ptr) {
+                if (auto str = dynamic_cast<const StringExpr*>(&arg)) {
+                    emit("leaq " + stringLabel(str->value) + "(%rip), " + regs[i]);
+                } else if (typeOf(arg) == Kind::Ptr) {
+                    emit("movq " + varOperand(static_cast<const VarExpr&>(arg)) + ", " + regs[i]);
+                } else {
+                    unsupported(arg, "conversions between strings and numbers");
+                }
+            } else if (intLeaf(arg, operand)) {
+                emit("movl " + operand + ", " + regs[i]);
+            } else {
+                // A float or string leaf passed as int: convert through the result register
+                genAs(arg, kinds[i]);
+                emit("movl %eax, " + regs[i]);
+            }
+        }
+        for (size_t i = 0; i < temps.size(); ++i) {
+            if (!temps[i].empty()) popTemp();
+        }
+        if (dst) emit("leaq " + frameSlot(dst) + ", %rdi");
+        if (!fn) emit("movl $" + std::to_string(floats) + ", %eax");
+        emit("call " + (callee->name == "beep" ? std::string("printf") : callee->name));
+        return result;
+    }
+
+    // ---- Statements ----
+
+    void sourceLine(const ASTNode& node) {
+        if (!options.lineDirectives || node.line <= 0) return;
+        std::string file = current->sourceName.empty() ? options.sourceName : current->sourceName;
+        auto found = files.find(file);
+        int id = found != files.end() ? found->second : (files[file] = static_cast<int>(files.size()) + 1);
+        emit(".loc " + std::to_string(id) + " " + std::to_string(node.line) + " " + std::to_string(node.column));
+    }
+
+    void genBlock(const std::vector<std::unique_ptr<Stmt>>& stmts) {
+        for (const auto& s : stmts) genStmt(*s);
+    }
+
+    void genLoopBody(const std::vector<std::unique_ptr<Stmt>>& stmts, const std::string& next,
+                     const std::string& done) {
+        loops.emplace_back(next, done);
+        genBlock(stmts);
+        loops.pop_back();
+    }
+
+    // Temporaries holding array results live until the end of their statement
+    void genStmt(const Stmt& stmt) {
+        int depth = tempDepth;
+        genStmtBody(stmt);
+        tempDepth = depth;
+    }
+
+    void genStmtBody(const Stmt& stmt) {
+        sourceLine(stmt);
+        if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&stmt)) {
+            int slot = declSlots.at(&stmt);
+            Kind kind = locals[slot].kind;
+            auto lit = dynamic_cast<const ArrayLiteralExpr*>(varDecl->initializer.get());
+            if (lit && isArray(kind)) {
+                genArrayLiteral(*lit, kind, locals[slot].offset);
+            } else if (isArray(kind)) {
+                if (!varDecl->initializer) {
+                    clearArray(locals[slot].offset);
+                } else {
+                    genAs(*varDecl->initializer, kind);
+                    copyArrayFrom(*varDecl->initializer, locals[slot].offset);
+                }
+            } else if (varDecl->initializer) {
+                genAs(*varDecl->initializer, kind);
+                emit(move(kind) + " " + resultReg(kind) + ", " + home(slot));
+            } else if (isFloating(kind) || locals[slot].reg < 0) {
+                emit((kind == Kind::Ptr ? "movq $0, " : "movl $0, ") + home(slot));
+            } else {
+                emit("xorl " + std::string(savedRegs32[locals[slot].reg]) + ", " + savedRegs32[locals[slot].reg]);
+            }
+        } else if (auto heat = dynamic_cast<const HeatStmt*>(&stmt)) {
+            genAs(*heat->expr, Kind::Int);
+            emit("movl %eax, heat(%rip)");
+        } else if (auto beep = dynamic_cast<const BeepStmt*>(&stmt)) {
+            Kind kind = gen(*beep->expr);
+            if (kind == Kind::Int) {
+                emit("movslq %eax, %rdi");
+                emit("call mw_rt_beep_int");
+            } else if (kind == Kind::Bool) {
+                emit("movl %eax, %edi");
+                emit("call mw_rt_beep_bool");
+            } else if (kind == Kind::Ptr) {
+                emit("movq %rax, %rdi");
+                emit("call mw_rt_beep_str");
+            } else if (isFloating(kind)) {
+                if (kind == Kind::Float) emit("cvtss2sd %xmm0, %xmm0");
+                emit("call mw_rt_beep_float");
+            } else if (isArray(kind)) {
+                unsupported(stmt, "beeping arrays");
+            } else {
+                convert(kind, Kind::Int, stmt);
+            }
+        } else if (auto defrost = dynamic_cast<const DefrostStmt*>(&stmt)) {
+            int slot = defrostSlots.at(&stmt);
+            bool global = std::find(std::begin(globalNames), std::end(globalNames), defrost->varName) != std::end(globalNames);
+            if (slot < 0 && !global) {
+                throw std::runtime_error("line " + std::to_string(stmt.line) + ": unknown variable '" + defrost->varName + "'");
+            }
+            std::string where = slot < 0 ? defrost->varName + "(%rip)" : home(slot);
+            Kind kind = slot < 0 ? Kind::Int : locals[slot].kind;
+            if (isArray(kind)) unsupported(stmt, "defrosting arrays");
+            emit((kind == Kind::Ptr ? "movq $0, " : "movl $0, ") + where);
+        } else if (auto ret = dynamic_cast<const ReturnStmt*>(&stmt)) {
+            if (ret->expr && isArray(returnKind)) {
+                genAs(*ret->expr, returnKind);
+                emit("movq " + home(returnSlot) + ", %rdx");
+                copyArray("%rax", 0, "%rdx", 0);
+                emit("movq %rdx, %rax");
+            } else if (ret->expr) {
+                genAs(*ret->expr, returnKind);
+            } else if (current->name == "main") emit("xorl %eax, %eax");
+            emit("jmp " + returnLabel);
+        } else if (dynamic_cast<const BreakStmt*>(&stmt)) {
+            if (loops.empty()) throw std::runtime_error("line " + std::to_string(stmt.line) + ": break outside a loop");
+            emit("jmp " + loops.back().second);
+        } else if (dynamic_cast<const ContinueStmt*>(&stmt)) {
+            if (loops.empty()) throw std::runtime_error("line " + std::to_string(stmt.line) + ": continue outside a loop");
+            emit("jmp " + loops.back().first);
+        } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(&stmt)) {
+            // Test at the bottom: one branch per iteration
+            std::string top = newLabel(), test = newLabel(), done = newLabel();
+            emit("jmp " + test);
+            label(top);
+            genLoopBody(whileStmt->body, test, done);
+            label(test);
+            genCond(*whileStmt->cond, top, true);
+            label(done);
+        } else if (auto forStmt = dynamic_cast<const ForStmt*>(&stmt)) {
+            std::string top = newLabel(), next = newLabel(), test = newLabel(), done = newLabel();
+            if (forStmt->init) genStmt(*forStmt->init);
+            emit("jmp " + test);
+            label(top);
+            genLoopBody(forStmt->body, next, done);
+            label(next);
+            if (forStmt->update) genEffect(*forStmt->update);
+            label(test);
+            if (forStmt->cond) genCond(*forStmt->cond, top, true);
+            else emit("jmp " + top);
+            label(done);
+        } else if (auto timer = dynamic_cast<const TimerStmt*>(&stmt)) {
+            // for (int __i = 0; __i < count; ++__i), count read before every iteration as in C
+            int slot = declSlots.at(&stmt);
+            std::string counter = home(slot);
+            std::string top = newLabel(), next = newLabel(), test = newLabel(), done = newLabel();
+            emit("movl $0, " + counter);
+            emit("jmp " + test);
+            label(top);
+            genLoopBody(timer->body, next, done);
+            label(next);
+            emit("incl " + counter);
+            label(test);
+            std::string operand;
+            if (intLeaf(*timer->count, operand) && (locals[slot].reg >= 0 || !isMemory(operand))) {
+                emit("cmpl " + operand + ", " + counter);
+            } else {
+                genAs(*timer->count, Kind::Int);
+                emit("cmpl %eax, " + counter);
+            }
+            emit("jl " + top);
+            label(done);
+        } else if (auto ifStmt = dynamic_cast<const IfStmt*>(&stmt)) {
+            std::string elseLabel = newLabel();
+            genCond(*ifStmt->cond, elseLabel, false);
+            genBlock(ifStmt->thenBody);
+            if (ifStmt->elseBody.empty()) {
+                label(elseLabel);
+            } else {
+                std::string end = newLabel();
+                emit("jmp " + end);
+                label(elseLabel);
+                genBlock(ifStmt->elseBody);
+                label(end);
+            }
+        } else if (auto expr = dynamic_cast<const ExprStmt*>(&stmt)) {
+            genEffect(*expr->expr);
+        }
+    }
+
+    // An expression evaluated only for its side effects
+    void genEffect(const Expr& expr) {
+        auto bin = dynamic_cast<const BinaryExpr*>(&expr);
+        auto unary = dynamic_cast<const UnaryExpr*>(&expr);
+        if (bin && isAssignment(bin->op)) genAssign(*bin, false);
+        else if (unary && (unary->op == "++" || unary->op == "--")) genUnary(*unary, false);
+        else gen(expr);
+    }
+
+    // ---- Functions ----
+
+    void genFunction(const Function& func) {
+        current = &func;
+        if (func.memoized) unsupported(func, "popcorn functions");
+        returnKind = func.name == "main" ? Kind::Int : kindOf(func.returnType, func);
+        locals.clear();
+        paramSlots.clear();
+        varSlots.clear();
+        declSlots.clear();
+        defrostSlots.clear();
+        scopes.assign(1, {});
+        weight = 1;
+        returnSlot = isArray(returnKind) ? declareLocal("", Kind::Ptr) : -1;
+        for (const auto& param : func.params) {
+            paramSlots.push_back(declareLocal(param.name, kindOf(param.type, func)));
+            locals[paramSlots.back()].weight += 1;
+        }
+        for (const auto& stmt : func.body) resolveStmt(*stmt);
+        scopes.clear();
+
+        int saved = allocateRegisters();
+        tempDepth = maxTemps = 0;
+        returnLabel = newLabel();
+        body.clear();
+
+        // Parameters arrive in registers and move to their homes
+        int ints = 0, floats = 0;
+        if (returnSlot >= 0) emit("movq %rdi, " + home(returnSlot));
+        ints += returnSlot >= 0;
+        for (int slot : paramSlots) {
+            Kind kind = locals[slot].kind;
+            if (isArray(kind)) {
+                if (ints == numIntArgs) unsupported(func, "functions with more than 6 int, bool, string or array parameters");
+                copyArray(intArgs64[ints++], 0, "%rbp", locals[slot].offset);
+            } else if (isFloating(kind)) {
+                if (floats == numFloatArgs) unsupported(func, "functions with more than 8 float parameters");
+                emit("movss %xmm" + std::to_string(floats++) + ", " + home(slot));
+            } else {
+                if (ints == numIntArgs) unsupported(func, "functions with more than 6 int, bool, string or array parameters");
+                emit(move(kind) + " " + (kind == Kind::Ptr ? intArgs64[ints] : intArgs32[ints]) + ", " + home(slot));
+                ++ints;
+            }
+        }
+        if (func.name == "main") {
+            emit(options.lineFlush ? "movl $1, %edi" : "xorl %edi, %edi");
+            emit("call mw_rt_init");
+        }
+        genBlock(func.body);
+        if (func.name == "main") emit("xorl %eax, %eax");
+
+        int frame = (tempBase + 8 * maxTemps + 15) / 16 * 16;
+        out += "\t.p2align 4\n";
+        if (func.name == "main") out += "\t.globl main\n";
+        out += "\t.type " + func.name + ", @function\n" + func.name + ":\n";
+        std::string saveBody;
+        std::swap(body, saveBody);
+        sourceLine(func);
+        emit(".cfi_startproc");
+        emit("pushq %rbp");
+        emit(".cfi_def_cfa_offset 16");
+        emit(".cfi_offset %rbp, -16");
+        emit("movq %rsp, %rbp");
+        emit(".cfi_def_cfa_register %rbp");
+        if (frame > 0) emit("subq $" + std::to_string(frame) + ", %rsp");
+        for (int r = 0; r < saved; ++r) emit(std::string("movq ") + savedRegs64[r] + ", " + std::to_string(-8 * (r + 1)) + "(%rbp)");
+        out += body + saveBody;
+        body.clear();
+        label(returnLabel);
+        for (int r = 0; r < saved; ++r) emit("movq " + std::to_string(-8 * (r + 1)) + "(%rbp), " + savedRegs64[r]);
+        emit("leave");
+        emit(".cfi_def_cfa %rsp, 8");
+        emit("ret");
+        emit(".cfi_endproc");
+        out += body;
+        out += "\t.size " + func.name + ", .-" + func.name + "\n\n";
+        body.clear();
+    }
+
+public:
+    explicit AsmGenerator(const CodegenOptions& opts) : options(opts) {}
+
+    std::string generate(const Program& program) {
+        for (const auto& func : program.functions) functions[func->name] = func.get();
+        for (const auto& func : program.functions) genFunction(*func);
+
+        std::string header = "# Generated by microwave";
+        if (!options.sourceName.empty()) header += " from " + options.sourceName;
+        header += "\n";
+        if (!options.sourceName.empty()) header += "\t.file " + asString(options.sourceName) + "\n";
+        std::vector<std::pair<int, std::string>> fileList;
+        for (const auto& file : files) fileList.emplace_back(file.second, file.first);
+        std::sort(fileList.begin(), fileList.end());
+        for (const auto& file : fileList) header += "\t.file " + std::to_string(file.first) + " " + asString(file.second) + "\n";
+        header += "\t.text\n";
+
+        std::string data = "\t.data\n\t.p2align 2\n";
+        data += "heat:\n\t.long 0\ndoor_closed:\n\t.long 1\ndoor_open:\n\t.long 0\n";
+        std::string section = rodata.empty() ? "" : "\t.section .rodata\n" + rodata;
+        if (!relro.empty()) section += "\t.section .data.rel.ro,\"aw\"\n" + relro;
+        return header + out + section + data + "\t.section .note.GNU-stack,\"\",@progbits\n";
+    }
+};
+
+} // namespace
+
+std::string generateAsm(const Program& program, const CodegenOptions& options) {
+    AsmGenerator gen(options);
+    return gen.generate(program);
+}
+
+std::string asmRuntimeSource() {
+    return std::string("#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n\n") + beepRuntimeC + asmRuntimeC;
+}
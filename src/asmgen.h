@@ -0,0 +1,14 @@
+#pragma once
+#include "codegen.h"
+#include <string>
+
+// x86-64 assembly (GNU as syntax, SysV calling convention) generated straight from the AST.
+// Covers int, bool, float and string values, arrays and their builtins, every statement, calls
+// between functions and printf-style calls into C. Lambdas, popcorn functions, maps and
+// element-wise array expressions throw std::runtime_error naming the line; those programs need the
+// C backend.
+// Uses lineFlush and lineDirectives (.loc debug lines) from options.
+std::string generateAsm(const Program& program, const CodegenOptions& options = CodegenOptions());
+
+// C source of the runtime behind beep, string building and arrays, which generated assembly links against
+std::string asmRuntimeSource();
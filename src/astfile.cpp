@@ -0,0 +1,502 @@
+#include "astfile.h"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const unsigned astFileVersion = 3;
+
+static const char astMagic[4] = {'M', 'W', 'A', '\x1a'};
+static const size_t headerSize = 16;
+
+enum NodeTag : uint8_t {
+    TagNull,
+    // Expressions
+    TagNumber, TagString, TagBool, TagVar, TagBinary, TagUnary, TagCall, TagIndex, TagArrayLiteral, TagLambda,
+    TagSpawn,
+    // Statements
+    TagVarDecl, TagHeat, TagBeep, TagDefrost, TagReturn, TagBreak, TagContinue, TagWhile, TagFor, TagTimer,
+    TagIf, TagExprStmt, TagSync,
+    TagFunction
+};
+
+class ASTWriter {
+    std::string strings;
+    uint32_t stringCount = 0;
+    std::unordered_map<std::string, uint32_t> stringIds;
+    std::string nodes;
+
+    static void putU32(std::string& out, uint32_t v) {
+        for (int i = 0; i < 4; ++i) out += static_cast<char>((v >> (8 * i)) & 0xff);
+    }
+
+    static void putVarint(std::string& out, uint32_t v) {
+        while (v >= 0x80) {
+            out += static_cast<char>((v & 0x7f) | 0x80);
+            v >>= 7;
+        }
+        out += static_cast<char>(v);
+    }
+
+    void u32(uint32_t v) { putVarint(nodes, v); }
+
+    void str(const std::string& s) {
+        auto found = stringIds.find(s);
+        if (found == stringIds.end()) {
+            putVarint(strings, static_cast<uint32_t>(s.size()));
+            strings += s;
+            found = stringIds.emplace(s, stringCount++).first;
+        }
+        u32(found->second);
+    }
+
+    void begin(NodeTag tag, const ASTNode& node) {
+        nodes += static_cast<char>(tag);
+        u32(static_cast<uint32_t>(node.line));
+        u32(static_cast<uint32_t>(node.column));
+    }
+
+    void strList(const std::vector<std::string>& list) {
+        u32(static_cast<uint32_t>(list.size()));
+        for (const auto& s : list) str(s);
+    }
+
+    void exprList(const std::vector<std::unique_ptr<Expr>>& list) {
+        u32(static_cast<uint32_t>(list.size()));
+        for (const auto& e : list) expr(e.get());
+    }
+
+    void body(const std::vector<std::unique_ptr<Stmt>>& list) {
+        u32(static_cast<uint32_t>(list.size()));
+        for (const auto& s : list) stmt(s.get());
+    }
+
+    void expr(const Expr* e) {
+        if (!e) {
+            nodes += static_cast<char>(TagNull);
+        } else if (auto num = dynamic_cast<const NumberExpr*>(e)) {
+            begin(TagNumber, *e);
+            str(num->value);
+        } else if (auto s = dynamic_cast<const StringExpr*>(e)) {
+            begin(TagString, *e);
+            str(s->value);
+        } else if (auto b = dynamic_cast<const BoolExpr*>(e)) {
+            begin(TagBool, *e);
+            u32(b->value);
+        } else if (auto var = dynamic_cast<const VarExpr*>(e)) {
+            begin(TagVar, *e);
+            str(var->name);
+        } else if (auto bin = dynamic_cast<const BinaryExpr*>(e)) {
+            begin(TagBinary, *e);
+            str(bin->op);
+            expr(bin->left.get());
+            expr(bin->right.get());
+        } else if (auto unary = dynamic_cast<const UnaryExpr*>(e)) {
+            begin(TagUnary, *e);
+            str(unary->op);
+            u32(unary->isPrefix);
+            expr(unary->operand.get());
+        } else if (auto call = dynamic_cast<const CallExpr*>(e)) {
+            begin(TagCall, *e);
+            expr(call->function.get());
+            exprList(call->args);
+        } else if (auto array = dynamic_cast<const ArrayExpr*>(e)) {
+            begin(TagIndex, *e);
+            expr(array->base.get());
+            expr(array->index.get());
+        } else if (auto lit = dynamic_cast<const ArrayLiteralExpr*>(e)) {
+            begin(TagArrayLiteral, *e);
+            exprList(lit->elements);
+        } else if (auto lambda = dynamic_cast<const LambdaExpr*>(e)) {
+            begin(TagLambda, *e);
+            strList(lambda->params);
+            strList(lambda->paramTypes);
+            str(lambda->returnType);
+            body(lambda->body);
+        } else if (auto spawn = dynamic_cast<const SpawnExpr*>(e)) {
+            begin(TagSpawn, *e);
+            expr(spawn->call.get());
+        } else {
+            throw std::runtime_error("Cannot serialize unknown expression node");
+        }
+    }
+
+    void stmt(const Stmt* s) {
+        if (!s) {
+            nodes += static_cast<char>(TagNull);
+        } else if (auto varDecl = dynamic_cast<const VarDeclStmt*>(s)) {
+            begin(TagVarDecl, *s);
+            str(varDecl->type);
+            str(varDecl->name);
+            expr(varDecl->initializer.get());
+        } else if (auto heat = dynamic_cast<const HeatStmt*>(s)) {
+            begin(TagHeat, *s);
+            expr(heat->expr.get());
+        } else if (auto beep = dynamic_cast<const BeepStmt*>(s)) {
+            begin(TagBeep, *s);
+            expr(beep->expr.get());
+        } else if (auto defrost = dynamic_cast<const DefrostStmt*>(s)) {
+            begin(TagDefrost, *s);
+            str(defrost->varName);
+        } else if (auto ret = dynamic_cast<const ReturnStmt*>(s)) {
+            begin(TagReturn, *s);
+            expr(ret->expr.get());
+        } else if (dynamic_cast<const BreakStmt*>(s)) {
+            begin(TagBreak, *s);
+        } else if (dynamic_cast<const ContinueStmt*>(s)) {
+            begin(TagContinue, *s);
+        } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(s)) {
+            begin(TagWhile, *s);
+            expr(whileStmt->cond.get());
+            body(whileStmt->body);
+        } else if (auto forStmt = dynamic_cast<const ForStmt*>(s)) {
+            begin(TagFor, *s);
+            stmt(forStmt->init.get());
+            expr(forStmt->cond.get());
+            expr(forStmt->update.get());
+            body(forStmt->body);
+        } else if (auto timer = dynamic_cast<const TimerStmt*>(s)) {
+            begin(TagTimer, *s);
+            expr(timer->count.get());
+            body(timer->body);
+        } else if (auto ifStmt = dynamic_cast<const IfStmt*>(s)) {
+            begin(TagIf, *s);
+            expr(ifStmt->cond.get());
+            body(ifStmt->thenBody);
+            body(ifStmt->elseBody);
+        } else if (auto exprStmt = dynamic_cast<const ExprStmt*>(s)) {
+            begin(TagExprStmt, *s);
+            expr(exprStmt->expr.get());
+        } else if (dynamic_cast<const SyncStmt*>(s)) {
+            begin(TagSync, *s);
+        } else {
+            throw std::runtime_error("Cannot serialize unknown statement node");
+        }
+    }
+
+public:
+    std::string write(const Program& program) {
+        u32(static_cast<uint32_t>(program.functions.size()));
+        for (const auto& func : program.functions) {
+            begin(TagFunction, *func);
+            str(func->returnType);
+            str(func->name);
+            u32(static_cast<uint32_t>(func->params.size()));
+            for (const auto& param : func->params) {
+                str(param.type);
+                str(param.name);
+            }
+            u32(func->memoized);
+            u32(static_cast<uint32_t>(func->memoCapacity));
+            body(func->body);
+        }
+
+        std::string out(astMagic, sizeof astMagic);
+        putU32(out, astFileVersion);
+        putU32(out, stringCount);
+        putU32(out, static_cast<uint32_t>(headerSize + strings.size()));
+        out += strings;
+        out += nodes;
+        return out;
+    }
+};
+
+class ASTReader {
+    const unsigned char* p;
+    const unsigned char* end;
+    int lineOffset;
+    std::vector<std::pair<const char*, uint32_t>> strings;
+
+    [[noreturn]] static void corrupt() { throw std::runtime_error("Corrupt AST file"); }
+
+    uint32_t fixed32() {
+        if (end - p < 4) corrupt();
+        uint32_t v = p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+        p += 4;
+        return v;
+    }
+
+    uint32_t u32() {
+        uint32_t v = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            if (p == end) corrupt();
+            uint8_t byte = *p++;
+            v |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return v;
+        }
+        corrupt();
+    }
+
+    uint8_t tag() {
+        if (p == end) corrupt();
+        return *p++;
+    }
+
+    std::string str() {
+        uint32_t id = u32();
+        if (id >= strings.size()) corrupt();
+        return std::string(strings[id].first, strings[id].second);
+    }
+
+    // Counts are bounded by the bytes left, so a corrupt count cannot trigger a huge allocation
+    uint32_t count() {
+        uint32_t n = u32();
+        if (n > static_cast<size_t>(end - p)) corrupt();
+        return n;
+    }
+
+    std::vector<std::string> strList() {
+        std::vector<std::string> list(count());
+        for (auto& s : list) s = str();
+        return list;
+    }
+
+    std::vector<std::unique_ptr<Expr>> exprList() {
+        std::vector<std::unique_ptr<Expr>> list(count());
+        for (auto& e : list) e = required(expr());
+        return list;
+    }
+
+    std::vector<std::unique_ptr<Stmt>> body() {
+        std::vector<std::unique_ptr<Stmt>> list(count());
+        for (auto& s : list) {
+            s = stmt();
+            if (!s) corrupt();
+        }
+        return list;
+    }
+
+    static std::unique_ptr<Expr> required(std::unique_ptr<Expr> e) {
+        if (!e) corrupt();
+        return e;
+    }
+
+    std::unique_ptr<Expr> expr() {
+        uint8_t t = tag();
+        if (t == TagNull) return nullptr;
+        int line = static_cast<int>(u32()) + lineOffset;
+        int column = static_cast<int>(u32());
+        std::unique_ptr<Expr> e;
+        switch (t) {
+            case TagNumber: e = std::make_unique<NumberExpr>(str()); break;
+            case TagString: e = std::make_unique<StringExpr>(str()); break;
+            case TagBool: e = std::make_unique<BoolExpr>(u32() != 0); break;
+            case TagVar: e = std::make_unique<VarExpr>(str()); break;
+            case TagBinary: {
+                std::string op = str();
+                auto left = required(expr());
+                e = std::make_unique<BinaryExpr>(op, std::move(left), required(expr()));
+                break;
+            }
+            case TagUnary: {
+                std::string op = str();
+                bool prefix = u32() != 0;
+                e = std::make_unique<UnaryExpr>(op, required(expr()), prefix);
+                break;
+            }
+            case TagCall: {
+                auto call = std::make_unique<CallExpr>(required(expr()));
+                call->args = exprList();
+                e = std::move(call);
+                break;
+            }
+            case TagIndex: {
+                auto base = required(expr());
+                e = std::make_unique<ArrayExpr>(std::move(base), required(expr()));
+                break;
+            }
+            case TagArrayLiteral: {
+                auto lit = std::make_unique<ArrayLiteralExpr>();
+                lit->elements = exprList();
+                e = std::move(lit);
+                break;
+            }
+            case TagLambda: {
+                auto lambda = std::make_unique<LambdaExpr>();
+                lambda->params = strList();
+                lambda->paramTypes = strList();
+                lambda->returnType = str();
+                lambda->body = body();
+                if (lambda->params.size() != lambda->paramTypes.size()) corrupt();
+                e = std::move(lambda);
+                break;
+            }
+            case TagSpawn: {
+                auto call = required(expr());
+                if (!dynamic_cast<CallExpr*>(call.get())) corrupt();
+                e = std::make_unique<SpawnExpr>(std::unique_ptr<CallExpr>(static_cast<CallExpr*>(call.release())));
+                break;
+            }
+            default: corrupt();
+        }
+        e->line = line;
+        e->column = column;
+        return e;
+    }
+
+    std::unique_ptr<Stmt> stmt() {
+        uint8_t t = tag();
+        if (t == TagNull) return nullptr;
+        int line = static_cast<int>(u32()) + lineOffset;
+        int column = static_cast<int>(u32());
+        std::unique_ptr<Stmt> s;
+        switch (t) {
+            case TagVarDecl: {
+                std::string type = str();
+                std::string name = str();
+                s = std::make_unique<VarDeclStmt>(type, name, expr());
+                break;
+            }
+            case TagHeat: s = std::make_unique<HeatStmt>(required(expr())); break;
+            case TagBeep: s = std::make_unique<BeepStmt>(required(expr())); break;
+            case TagDefrost: s = std::make_unique<DefrostStmt>(str()); break;
+            case TagReturn: s = std::make_unique<ReturnStmt>(expr()); break;
+            case TagBreak: s = std::make_unique<BreakStmt>(); break;
+            case TagContinue: s = std::make_unique<ContinueStmt>(); break;
+            case TagWhile: {
+                auto whileStmt = std::make_unique<WhileStmt>(required(expr()));
+                whileStmt->body = body();
+                s = std::move(whileStmt);
+                break;
+            }
+            case TagFor: {
+                auto forStmt = std::make_unique<ForStmt>();
+                forStmt->init = stmt();
+                forStmt->cond = expr();
+                forStmt->update = expr();
+                forStmt->body = body();
+                s = std::move(forStmt);
+                break;
+            }
+            case TagTimer: {
+                auto timer = std::make_unique<TimerStmt>(required(expr()));
+                timer->body = body();
+                s = std::move(timer);
+                break;
+            }
+            case TagIf: {
+                auto ifStmt = std::make_unique<IfStmt>(required(expr()));
+                ifStmt->thenBody = body();
+                ifStmt->elseBody = body();
+                s = std::move(ifStmt);
+                break;
+            }
+            case TagExprStmt: s = std::make_unique<ExprStmt>(required(expr())); break;
+            case TagSync: s = std::make_unique<SyncStmt>(); break;
+            default: corrupt();
+        }
+        s->line = line;
+        s->column = column;
+        return s;
+    }
+
+public:
+    ASTReader(const char* data, size_t size, int lineOffset)
+        : p(reinterpret_cast<const unsigned char*>(data)), end(p + size), lineOffset(lineOffset) {}
+
+    std::unique_ptr<Program> read() {
+        const unsigned char* start = p;
+        if (static_cast<size_t>(end - p) < headerSize || memcmp(p, astMagic, sizeof astMagic) != 0) {
+            throw std::runtime_error("Not a microwave AST file");
+        }
+        p += sizeof astMagic;
+        uint32_t version = fixed32();
+        if (version != astFileVersion) {
+            throw std::runtime_error("AST file version " + std::to_string(version) + " is not supported (expected " +
+                                     std::to_string(astFileVersion) + "); regenerate it with --emit-ast");
+        }
+        uint32_t stringCount = fixed32();
+        uint32_t nodeOffset = fixed32();
+        if (nodeOffset > static_cast<size_t>(end - start) || stringCount > nodeOffset) corrupt();
+
+        // Strings are referenced where they sit; they are only copied into the nodes that use them
+        const unsigned char* nodes = start + nodeOffset;
+        const unsigned char* stringsEnd = end;
+        end = nodes;
+        strings.reserve(stringCount);
+        for (uint32_t i = 0; i < stringCount; ++i) {
+            uint32_t length = u32();
+            if (length > static_cast<size_t>(end - p)) corrupt();
+            strings.emplace_back(reinterpret_cast<const char*>(p), length);
+            p += length;
+        }
+        p = nodes;
+        end = stringsEnd;
+
+        auto program = std::make_unique<Program>();
+        uint32_t functions = count();
+        for (uint32_t i = 0; i < functions; ++i) {
+            if (tag() != TagFunction) corrupt();
+            int line = static_cast<int>(u32()) + lineOffset;
+            int column = static_cast<int>(u32());
+            std::string returnType = str();
+            auto func = std::make_unique<Function>(returnType, str());
+            func->line = line;
+            func->column = column;
+            uint32_t params = count();
+            for (uint32_t j = 0; j < params; ++j) {
+                std::string type = str();
+                func->params.emplace_back(type, str());
+            }
+            func->memoized = u32() != 0;
+            func->memoCapacity = static_cast<int>(u32());
+            func->body = body();
+            program->functions.push_back(std::move(func));
+        }
+        if (p != end) corrupt();
+        return program;
+    }
+};
+
+std::string serializeAST(const Program& program) {
+    return ASTWriter().write(program);
+}
+
+std::unique_ptr<Program> deserializeAST(const char* data, size_t size, int lineOffset) {
+    return ASTReader(data, size, lineOffset).read();
+}
+
+bool isASTData(const char* data, size_t size) {
+    return size >= sizeof astMagic && memcmp(data, astMagic, sizeof astMagic) == 0;
+}
+
+bool isASTFile(const std::string& filename) {
+    char head[sizeof astMagic];
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    ssize_t n = read(fd, head, sizeof head);
+    close(fd);
+    return n == static_cast<ssize_t>(sizeof head) && isASTData(head, sizeof head);
+}
+
+std::unique_ptr<Program> loadAST(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Not a microwave AST file: " + filename);
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error("Cannot map file: " + filename);
+    }
+    try {
+        auto program = deserializeAST(static_cast<const char*>(map), size);
+        munmap(map, size);
+        return program;
+    } catch (const std::runtime_error& e) {
+        munmap(map, size);
+        throw std::runtime_error(std::string(e.what()) + ": " + filename);
+    }
+}
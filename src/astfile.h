@@ -0,0 +1,30 @@
+#pragma once
+#include "parser.h"
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Binary serialization of a parsed Program (.mwa files)
+//
+// Layout:
+//   header   "MWA\x1a", then little-endian u32 version, string count and node stream offset
+//   strings  per string: length, bytes (every name, type and literal is stored once)
+//   nodes    pre-order; each node is a tag byte, its line and column, then its fields,
+//            with strings as table indices and child lists as count + nodes
+// Every other integer is an unsigned LEB128 varint.
+// Bump astFileVersion whenever an AST node gains, loses or reorders a field.
+
+extern const unsigned astFileVersion;
+
+std::string serializeAST(const Program& program);
+
+// Decodes straight from the given bytes; throws std::runtime_error on a bad or stale file.
+// lineOffset is added to every node's line, for a program parsed from an excerpt of a file.
+std::unique_ptr<Program> deserializeAST(const char* data, size_t size, int lineOffset = 0);
+
+// True if data (or the file) starts with the .mwa magic
+bool isASTData(const char* data, size_t size);
+bool isASTFile(const std::string& filename);
+
+// mmaps the file and decodes it in place
+std::unique_ptr<Program> loadAST(const std::string& filename);
@@ -0,0 +1,1014 @@
+#include "bytecode.h"
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+const char* opName(Op op) {
+    static const char* const names[] = {
+#define MW_OP_NAME(name) #name,
+        MW_OPCODES(MW_OP_NAME)
+#undef MW_OP_NAME
+    };
+    return names[static_cast<size_t>(op)];
+}
+
+static bool isArrayType(const std::string& type) {
+    return type.size() > 2 && type.compare(type.size() - 2, 2, "[]") == 0;
+}
+
+static std::string elementType(const std::string& arrayType) {
+    std::string elem = arrayType.substr(0, arrayType.size() - 2);
+    return elem == "auto" ? "int" : elem;
+}
+
+static bool isMapType(const std::string& type) {
+    return type.compare(0, 4, "map<") == 0;
+}
+
+static std::string mapKeyType(const std::string& mapType) {
+    return mapType.substr(4, mapType.find(',') - 4);
+}
+
+static std::string mapValueType(const std::string& mapType) {
+    size_t comma = mapType.find(',');
+    return mapType.substr(comma + 1, mapType.size() - comma - 2);
+}
+
+// String literals keep their C escapes in the AST; the VM needs the real characters
+static std::string unescape(const std::string& raw) {
+    std::string out;
+    for (size_t i = 0; i < raw.size(); ++i) {
+        if (raw[i] != '\\' || i + 1 == raw.size()) {
+            out += raw[i];
+            continue;
+        }
+        char c = raw[++i];
+        switch (c) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'a': out += '\a'; break;
+            case '0': out += '\0'; break;
+            default: out += c; break;
+        }
+    }
+    return out;
+}
+
+static const std::unordered_map<std::string, int> globals = {
+    {"heat", GlobalHeat}, {"door_closed", GlobalDoorClosed}, {"door_open", GlobalDoorOpen}
+};
+
+static const std::unordered_set<std::string> arrayBuiltins = {
+    "len", "push", "append", "slice", "copy", "fill", "sum"
+};
+
+static const std::unordered_set<std::string> mapBuiltins = {
+    "len", "has", "get", "remove", "reserve", "rehash", "keys", "values"
+};
+
+// Operators that apply element by element when an operand is an array
+static const std::unordered_set<std::string> elementwiseOps = {"+", "-", "*", "/", "%"};
+
+// Lanes of a float sum(), added in the order the generated C adds them
+static const int sumLanes = 16;
+
+struct Local {
+    int reg;
+    std::string type;
+};
+
+class BytecodeCompiler {
+    Module& module;
+    std::unordered_map<std::string, const Function*> functionDecls;
+    std::unordered_map<std::string, int> functionIndex;
+    std::unordered_map<const LambdaExpr*, int> lambdaIndex;
+    std::vector<const LambdaExpr*> pendingLambdas;
+    std::unordered_map<int32_t, int> intConstants;
+    std::unordered_map<std::string, int> stringConstants;
+
+    // Per-function state
+    int fnIndex = 0;
+    std::string returnType;
+    std::vector<std::unordered_map<std::string, Local>> scopes;
+    int nextReg = 0;
+    int line = 0;
+    struct Loop {
+        std::vector<size_t> breaks, continues;
+    };
+    std::vector<Loop> loops;
+
+    FunctionCode& cur() { return module.functions[fnIndex]; }
+
+    [[noreturn]] void error(const std::string& message) {
+        throw std::runtime_error("line " + std::to_string(line) + ": " + message);
+    }
+
+    size_t emit(Op op, int a = 0, int b = 0, int c = 0) {
+        FunctionCode& f = cur();
+        f.code.push_back({static_cast<uint16_t>(op), static_cast<uint16_t>(a),
+                          static_cast<uint16_t>(b), static_cast<uint16_t>(c)});
+        f.lines.push_back(line);
+        return f.code.size() - 1;
+    }
+
+    size_t here() { return cur().code.size(); }
+
+    void patch(size_t at, size_t target) {
+        cur().code[at].b = static_cast<uint16_t>(target & 0xffff);
+        cur().code[at].c = static_cast<uint16_t>(target >> 16);
+    }
+
+    void emitJump(Op op, int reg, size_t target) { patch(emit(op, reg), target); }
+
+    int allocReg() {
+        int reg = nextReg++;
+        if (nextReg > 0xffff) error("function '" + cur().name + "' needs too many registers");
+        cur().numRegs = std::max(cur().numRegs, nextReg);
+        return reg;
+    }
+
+    int target(int dst) { return dst >= 0 ? dst : allocReg(); }
+
+    int addConstant(const Value& value) {
+        if (module.constants.size() >= 0xffff) error("too many constants");
+        module.constants.push_back(value);
+        return static_cast<int>(module.constants.size() - 1);
+    }
+
+    int intConstant(int32_t value) {
+        auto found = intConstants.find(value);
+        if (found != intConstants.end()) return found->second;
+        return intConstants[value] = addConstant(Value::makeInt(value));
+    }
+
+    int stringConstant(const std::string& raw) {
+        auto found = stringConstants.find(raw);
+        if (found != stringConstants.end()) return found->second;
+        module.strings.push_back(unescape(raw));
+        return stringConstants[raw] = addConstant(Value::makeString(&module.strings.back()));
+    }
+
+    void pushScope() { scopes.emplace_back(); }
+    void popScope() { scopes.pop_back(); }
+
+    const Local* lookupLocal(const std::string& name) const {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(name);
+            if (found != it->end()) return &found->second;
+        }
+        return nullptr;
+    }
+
+    // Static type in Microwave names, or "" when only the runtime knows
+    std::string staticType(const Expr& expr) {
+        if (auto num = dynamic_cast<const NumberExpr*>(&expr)) {
+            return num->value.find('.') != std::string::npos ? "float" : "int";
+        } else if (dynamic_cast<const StringExpr*>(&expr)) {
+            return "string";
+        } else if (dynamic_cast<const BoolExpr*>(&expr)) {
+            return "bool";
+        } else if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+            if (auto local = lookupLocal(var->name)) return local->type;
+            if (globals.count(var->name)) return "int";
+            return "";
+        } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            const std::string& op = bin->op;
+            if (op == "==" || op == "!=" || op == "<" || op == ">" || op == "<=" || op == ">=" ||
+                op == "&&" || op == "||") {
+                return "bool";
+            }
+            if (op.back() == '=') return staticType(*bin->left);
+            std::string l = staticType(*bin->left), r = staticType(*bin->right);
+            if (elementwiseOps.count(op) && (isArrayType(l) || isArrayType(r))) {
+                bool floating = (isArrayType(l) ? elementType(l) : l) == "float" ||
+                                (isArrayType(r) ? elementType(r) : r) == "float";
+                return floating ? "float[]" : "int[]";   // element-wise
+            }
+            if (op == "+" && (l == "string" || r == "string")) return "string";
+            if (l == "float" || r == "float") return "float";
+            if (l.empty() || r.empty()) return "";
+            return "int";
+        } else if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            if (unary->op == "!") return "bool";
+            std::string t = staticType(*unary->operand);
+            return t == "bool" ? "int" : t;
+        } else if (auto spawn = dynamic_cast<const SpawnExpr*>(&expr)) {
+            return staticType(*spawn->call);
+        } else if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+            auto callee = dynamic_cast<const VarExpr*>(call->function.get());
+            if (!callee) return "";
+            auto fn = functionDecls.find(callee->name);
+            if (fn != functionDecls.end()) return fn->second->returnType;
+            if (callee->name == "len" || callee->name == "beep" || callee->name == "printf") return "int";
+            if ((callee->name == "slice" || callee->name == "copy") && !call->args.empty()) {
+                return staticType(*call->args[0]);
+            }
+            if (callee->name == "sum" && !call->args.empty()) {
+                std::string t = staticType(*call->args[0]);
+                return isArrayType(t) ? elementType(t) : "";
+            }
+            std::string t = call->args.empty() ? "" : staticType(*call->args[0]);
+            if (isMapType(t)) {
+                if (callee->name == "has" || callee->name == "remove") return "bool";
+                if (callee->name == "get") return mapValueType(t);
+                if (callee->name == "keys") return mapKeyType(t) + "[]";
+                if (callee->name == "values") return mapValueType(t) + "[]";
+            }
+            return "";
+        } else if (auto array = dynamic_cast<const ArrayExpr*>(&expr)) {
+            std::string t = staticType(*array->base);
+            if (isArrayType(t)) return elementType(t);
+            if (isMapType(t)) return mapValueType(t);
+            return t == "string" ? "int" : "";
+        }
+        return "";
+    }
+
+    // Coerce a freshly computed value in reg to a declared Microwave type, as C assignment would
+    void convert(int reg, std::string to, const std::string& from) {
+        if (to == "auto") to = "int";
+        if (to == "float") emit(Op::ToFloat, reg);
+        else if (to == "int" && from != "int") emit(Op::ToInt, reg);
+        else if (to == "bool" && from != "bool") emit(Op::ToBool, reg);
+    }
+
+    bool needsConversion(std::string to, const std::string& from) {
+        if (to == "auto") to = "int";
+        return to == "float" || (to == "int" && from != "int") || (to == "bool" && from != "bool");
+    }
+
+    // Register holding expr converted to type; never converts a variable in place
+    int valueAs(const Expr& expr, const std::string& type) {
+        std::string from = staticType(expr);
+        if (type.empty() || !needsConversion(type, from)) return operand(expr);
+        int reg = compileExpr(expr, -1);
+        if (isLocalRegister(reg)) {
+            int copy = allocReg();
+            emit(Op::Move, copy, reg);
+            reg = copy;
+        }
+        convert(reg, type, from);
+        return reg;
+    }
+
+    bool isLocalRegister(int reg) const {
+        for (const auto& scope : scopes) {
+            for (const auto& entry : scope) {
+                if (entry.second.reg == reg) return true;
+            }
+        }
+        return false;
+    }
+
+    // Register holding the value: a variable's own register, or a new temporary
+    int operand(const Expr& expr) {
+        if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+            if (auto local = lookupLocal(var->name)) return local->reg;
+        }
+        return compileExpr(expr, -1);
+    }
+
+    static Op binaryOp(const std::string& op) {
+        static const std::unordered_map<std::string, Op> ops = {
+            {"+", Op::Add}, {"-", Op::Sub}, {"*", Op::Mul}, {"/", Op::Div}, {"%", Op::Mod},
+            {"&", Op::BitAnd}, {"|", Op::BitOr}, {"^", Op::BitXor}, {"<<", Op::Shl}, {">>", Op::Shr},
+            {"==", Op::Eq}, {"!=", Op::Ne}, {"<", Op::Lt}, {"<=", Op::Le}, {">", Op::Gt}, {">=", Op::Ge}
+        };
+        auto found = ops.find(op);
+        if (found == ops.end()) throw std::runtime_error("Unsupported operator '" + op + "'");
+        return found->second;
+    }
+
+    // Compile expr into dst (or a new temporary when dst < 0) and return the register used
+    int compileExpr(const Expr& expr, int dst) {
+        if (auto num = dynamic_cast<const NumberExpr*>(&expr)) {
+            int out = target(dst);
+            if (num->value.find('.') != std::string::npos) {
+                emit(Op::LoadK, out, addConstant(Value::makeFloat(std::stod(num->value))));
+            } else {
+                emit(Op::LoadK, out, intConstant(static_cast<int32_t>(std::stoll(num->value))));
+            }
+            return out;
+        } else if (auto str = dynamic_cast<const StringExpr*>(&expr)) {
+            int out = target(dst);
+            emit(Op::LoadK, out, stringConstant(str->value));
+            return out;
+        } else if (auto boolean = dynamic_cast<const BoolExpr*>(&expr)) {
+            int out = target(dst);
+            emit(Op::LoadK, out, addConstant(Value::makeBool(boolean->value)));
+            return out;
+        } else if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+            return compileVar(*var, dst);
+        } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            return compileBinary(*bin, dst);
+        } else if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            return compileUnary(*unary, dst, false);
+        } else if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+            return compileCall(*call, dst);
+        } else if (auto spawn = dynamic_cast<const SpawnExpr*>(&expr)) {
+            // One thread: a spawned call simply runs here, so sync has nothing to wait for
+            return compileCall(*spawn->call, dst);
+        } else if (auto array = dynamic_cast<const ArrayExpr*>(&expr)) {
+            int base = operand(*array->base);
+            int index = elementIndex(*array);
+            int out = target(dst);
+            emit(Op::Index, out, base, index);
+            return out;
+        } else if (auto arrayLit = dynamic_cast<const ArrayLiteralExpr*>(&expr)) {
+            return compileArrayLiteral(*arrayLit, dst, "");
+        } else if (auto lambda = dynamic_cast<const LambdaExpr*>(&expr)) {
+            int out = target(dst);
+            emit(Op::LoadK, out, addConstant(Value::makeFunction(lambdaFunction(*lambda))));
+            return out;
+        }
+        error("unsupported expression");
+    }
+
+    int compileVar(const VarExpr& var, int dst) {
+        if (auto local = lookupLocal(var.name)) {
+            if (dst < 0 || dst == local->reg) return local->reg;
+            emit(Op::Move, dst, local->reg);
+            return dst;
+        }
+        auto global = globals.find(var.name);
+        if (global != globals.end()) {
+            int out = target(dst);
+            emit(Op::GetGlobal, out, global->second);
+            return out;
+        }
+        auto fn = functionIndex.find(var.name);
+        if (fn != functionIndex.end()) {
+            int out = target(dst);
+            emit(Op::LoadK, out, addConstant(Value::makeFunction(fn->second)));
+            return out;
+        }
+        error("unknown variable '" + var.name + "'");
+    }
+
+    int compileArrayLiteral(const ArrayLiteralExpr& lit, int dst, const std::string& elemType) {
+        int base = nextReg;
+        for (size_t i = 0; i < lit.elements.size(); ++i) allocReg();
+        for (size_t i = 0; i < lit.elements.size(); ++i) {
+            int reg = base + static_cast<int>(i);
+            compileExpr(*lit.elements[i], reg);
+            if (!elemType.empty()) convert(reg, elemType, staticType(*lit.elements[i]));
+        }
+        int out = target(dst);
+        emit(Op::NewArray, out, base, static_cast<int>(lit.elements.size()));
+        return out;
+    }
+
+    int compileBinary(const BinaryExpr& bin, int dst) {
+        const std::string& op = bin.op;
+        if (op == "&&" || op == "||") {
+            // Short-circuit into a fresh register so the right side still sees the old dst
+            int out = allocReg();
+            compileExpr(*bin.left, out);
+            emit(Op::ToBool, out);
+            size_t skip = emit(op == "&&" ? Op::JumpIfFalse : Op::JumpIfTrue, out);
+            compileExpr(*bin.right, out);
+            emit(Op::ToBool, out);
+            patch(skip, here());
+            if (dst >= 0 && dst != out) {
+                emit(Op::Move, dst, out);
+                return dst;
+            }
+            return out;
+        }
+        bool assigns = op.back() == '=' && op != "==" && op != "!=" && op != "<=" && op != ">=";
+        if (assigns) return compileAssignment(bin, dst);
+        if (elementwiseOps.count(op) && isArrayType(staticType(bin))) return compileFused(bin, dst, false);
+
+        int l = operand(*bin.left);
+        int r = operand(*bin.right);
+        int out = target(dst);
+        emit(binaryOp(op), out, l, r);
+        return out;
+    }
+
+    // Type of `x op= rhs` before it is stored back into x
+    std::string compoundType(const std::string& type, const Expr& rhs) {
+        std::string r = staticType(rhs);
+        if (type == "float" || r == "float") return "float";
+        return (type == "int" || type == "bool") && (r == "int" || r == "bool") ? "int" : "";
+    }
+
+    int compileAssignment(const BinaryExpr& bin, int dst) {
+        std::string op = bin.op.substr(0, bin.op.size() - 1); // "" for plain '='
+
+        if (auto var = dynamic_cast<const VarExpr*>(bin.left.get())) {
+            if (auto local = lookupLocal(var->name)) {
+                int reg = local->reg;
+                std::string type = local->type;
+                auto lit = dynamic_cast<const ArrayLiteralExpr*>(bin.right.get());
+                if (op.empty() && lit && isArrayType(type)) {
+                    compileArrayLiteral(*lit, reg, elementType(type));
+                } else if (op.empty()) {
+                    compileExpr(*bin.right, reg);
+                    if (type != "function") convert(reg, type, staticType(*bin.right));
+                } else {
+                    int r = operand(*bin.right);
+                    emit(binaryOp(op), reg, reg, r);
+                    convert(reg, type, compoundType(type, *bin.right));
+                }
+                if (dst >= 0 && dst != reg) emit(Op::Move, dst, reg);
+                return dst >= 0 ? dst : reg;
+            }
+            auto global = globals.find(var->name);
+            if (global == globals.end()) error("unknown variable '" + var->name + "'");
+            int value;
+            if (op.empty()) {
+                value = valueAs(*bin.right, "int");
+            } else {
+                value = allocReg();
+                emit(Op::GetGlobal, value, global->second);
+                emit(binaryOp(op), value, value, operand(*bin.right));
+                convert(value, "int", compoundType("int", *bin.right));
+            }
+            emit(Op::SetGlobal, value, global->second);
+            if (dst >= 0 && dst != value) emit(Op::Move, dst, value);
+            return dst >= 0 ? dst : value;
+        }
+
+        if (auto array = dynamic_cast<const ArrayExpr*>(bin.left.get())) {
+            std::string baseType = staticType(*array->base);
+            std::string elemType = isArrayType(baseType) ? elementType(baseType) :
+                                   isMapType(baseType) ? mapValueType(baseType) : "";
+            int base = operand(*array->base);
+            int index = elementIndex(*array);
+            int value;
+            if (op.empty()) {
+                value = valueAs(*bin.right, elemType);
+            } else {
+                value = allocReg();
+                loadElement(value, base, index, baseType);
+                emit(binaryOp(op), value, value, operand(*bin.right));
+                if (!elemType.empty()) convert(value, elemType, compoundType(elemType, *bin.right));
+            }
+            emit(Op::SetIndex, base, index, value);
+            if (dst >= 0 && dst != value) emit(Op::Move, dst, value);
+            return dst >= 0 ? dst : value;
+        }
+        error("cannot assign to this expression");
+    }
+
+    int compileUnary(const UnaryExpr& unary, int dst, bool discard) {
+        const std::string& op = unary.op;
+        if (op == "++" || op == "--") {
+            Op step = op == "++" ? Op::Inc : Op::Dec;
+            bool wantOld = !unary.isPrefix && !discard;
+            if (auto var = dynamic_cast<const VarExpr*>(unary.operand.get())) {
+                if (auto local = lookupLocal(var->name)) {
+                    int out = local->reg;
+                    if (wantOld) {
+                        out = target(dst);
+                        emit(Op::Move, out, local->reg);
+                    }
+                    emit(step, local->reg);
+                    if (!wantOld && dst >= 0 && dst != out) {
+                        emit(Op::Move, dst, out);
+                        out = dst;
+                    }
+                    return out;
+                }
+                auto global = globals.find(var->name);
+                if (global == globals.end()) error("unknown variable '" + var->name + "'");
+                int value = allocReg();
+                emit(Op::GetGlobal, value, global->second);
+                int out = target(dst);
+                if (wantOld) emit(Op::Move, out, value);
+                emit(step, value);
+                emit(Op::SetGlobal, value, global->second);
+                if (!wantOld) emit(Op::Move, out, value);
+                return out;
+            }
+            if (auto array = dynamic_cast<const ArrayExpr*>(unary.operand.get())) {
+                int base = operand(*array->base);
+                int index = elementIndex(*array);
+                int value = allocReg();
+                loadElement(value, base, index, staticType(*array->base));
+                int out = target(dst);
+                if (wantOld) emit(Op::Move, out, value);
+                emit(step, value);
+                emit(Op::SetIndex, base, index, value);
+                if (!wantOld) emit(Op::Move, out, value);
+                return out;
+            }
+            error("operand of " + op + " must be a variable or array element");
+        }
+
+        if (op == "-" && isArrayType(staticType(*unary.operand))) return compileFused(unary, dst, false);
+        int value = operand(*unary.operand);
+        if (op == "+") {
+            if (dst >= 0 && dst != value) {
+                emit(Op::Move, dst, value);
+                return dst;
+            }
+            return value;
+        }
+        int out = target(dst);
+        emit(op == "-" ? Op::Neg : op == "!" ? Op::Not : Op::BitNot, out, value);
+        return out;
+    }
+
+    // Register holding an element's index, converted to the key type of a map
+    int elementIndex(const ArrayExpr& array) {
+        std::string baseType = staticType(*array.base);
+        return valueAs(*array.index, isMapType(baseType) ? mapKeyType(baseType) : "");
+    }
+
+    // The element a compound assignment or ++/-- updates; a missing map key starts at zero
+    void loadElement(int out, int base, int index, const std::string& baseType) {
+        if (!isMapType(baseType)) {
+            emit(Op::Index, out, base, index);
+            return;
+        }
+        int args = allocReg();
+        allocReg();
+        emit(Op::Move, args, index);
+        std::string valueType = mapValueType(baseType);
+        if (valueType == "string") {
+            emit(Op::LoadK, args + 1, stringConstant(""));
+        } else {
+            emit(Op::LoadK, args + 1, intConstant(0));
+            convert(args + 1, valueType, "int");
+        }
+        emit(Op::Get, out, base, args);
+    }
+
+    // Consecutive argument registers starting at a fresh base, as Call expects
+    int compileArgs(const CallExpr& call, const Function* callee) {
+        int base = nextReg;
+        size_t count = std::max<size_t>(call.args.size(), 1);
+        for (size_t i = 0; i < count; ++i) allocReg();
+        for (size_t i = 0; i < call.args.size(); ++i) {
+            int reg = base + static_cast<int>(i);
+            compileExpr(*call.args[i], reg);
+            if (callee && i < callee->params.size()) {
+                const std::string& type = callee->params[i].type;
+                if (isArrayType(type) || type == "string") continue;
+                convert(reg, type, staticType(*call.args[i]));
+            }
+        }
+        return base;
+    }
+
+    int compileCall(const CallExpr& call, int dst) {
+        int argc = static_cast<int>(call.args.size());
+        auto callee = dynamic_cast<const VarExpr*>(call.function.get());
+
+        if (auto lambda = dynamic_cast<const LambdaExpr*>(call.function.get())) {
+            int fn = lambdaFunction(*lambda);
+            int base = compileArgs(call, nullptr);
+            emit(Op::Call, base, fn, argc);
+            return moveResult(base, dst);
+        }
+        if (callee && lookupLocal(callee->name)) {
+            int fnReg = lookupLocal(callee->name)->reg;
+            int base = compileArgs(call, nullptr);
+            emit(Op::CallValue, base, fnReg, argc);
+            return moveResult(base, dst);
+        }
+        if (!callee) error("call target must be a function name or lambda");
+
+        auto fn = functionDecls.find(callee->name);
+        if (fn != functionDecls.end()) {
+            int base = compileArgs(call, fn->second);
+            emit(Op::Call, base, functionIndex[callee->name], argc);
+            return moveResult(base, dst);
+        }
+        if (callee->name == "beep" || callee->name == "printf") {
+            int base = compileArgs(call, nullptr);
+            int out = target(dst);
+            emit(Op::Printf, out, base, argc);
+            return out;
+        }
+        if (mapBuiltins.count(callee->name) && !call.args.empty() && isMapType(staticType(*call.args[0]))) {
+            return compileMapBuiltin(call, callee->name, dst);
+        }
+        if (arrayBuiltins.count(callee->name)) return compileArrayBuiltin(call, callee->name, dst);
+        error("unknown function '" + callee->name + "'");
+    }
+
+    int moveResult(int base, int dst) {
+        if (dst >= 0 && dst != base) {
+            emit(Op::Move, dst, base);
+            return dst;
+        }
+        return base;
+    }
+
+    bool isFused(const Expr& expr) {
+        auto bin = dynamic_cast<const BinaryExpr*>(&expr);
+        auto unary = dynamic_cast<const UnaryExpr*>(&expr);
+        if (bin) return elementwiseOps.count(bin->op) && isArrayType(staticType(expr));
+        return unary && unary->op == "-" && isArrayType(staticType(*unary->operand));
+    }
+
+    // The arrays and numbers an element-wise expression combines, in evaluation order
+    void fusedLeaves(const Expr& expr, std::vector<const Expr*>& leaves) {
+        if (!isFused(expr)) {
+            leaves.push_back(&expr);
+        } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            fusedLeaves(*bin->left, leaves);
+            fusedLeaves(*bin->right, leaves);
+        } else {
+            fusedLeaves(*static_cast<const UnaryExpr&>(expr).operand, leaves);
+        }
+    }
+
+    // One element into a new register; float steps are rounded as a float[] stores them
+    int compileElement(const Expr& expr, const std::unordered_map<const Expr*, int>& leaves, int index) {
+        auto leaf = leaves.find(&expr);
+        if (leaf != leaves.end()) {
+            if (!isArrayType(staticType(expr))) return leaf->second;
+            int out = allocReg();
+            emit(Op::Index, out, leaf->second, index);
+            return out;
+        }
+        int out;
+        if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            int l = compileElement(*bin->left, leaves, index);
+            int r = compileElement(*bin->right, leaves, index);
+            out = allocReg();
+            emit(binaryOp(bin->op), out, l, r);
+        } else {
+            int value = compileElement(*static_cast<const UnaryExpr&>(expr).operand, leaves, index);
+            out = allocReg();
+            emit(Op::Neg, out, value);
+        }
+        if (staticType(expr) == "float[]") emit(Op::ToFloat, out);
+        return out;
+    }
+
+    // An element-wise expression, or sum() of one, runs as one loop with no intermediate arrays,
+    // as in the generated C: operands are evaluated once and their lengths checked before it
+    int compileFused(const Expr& root, int dst, bool reduce) {
+        std::vector<const Expr*> order;
+        fusedLeaves(root, order);
+        std::unordered_map<const Expr*, int> leaves;
+        int length = -1;
+        for (const Expr* leaf : order) {
+            std::string type = staticType(*leaf);
+            std::string elem = isArrayType(type) ? elementType(type) : type;
+            if (!type.empty() && elem != "int" && elem != "float" && (elem != "bool" || isArrayType(type))) {
+                error("element-wise operators take int[] and float[] arrays and numbers, not " + type);
+            }
+            // Numbers are float in a float expression, as a float variable would be
+            int reg = elem == "float" && !isArrayType(type) ? valueAs(*leaf, "float") : operand(*leaf);
+            leaves[leaf] = reg;
+            if (!isArrayType(type)) continue;
+            if (length < 0) {
+                length = allocReg();
+                emit(Op::Len, length, reg);
+            } else {
+                emit(Op::CheckLen, length, reg);
+            }
+        }
+
+        bool floating = staticType(root) == "float[]";
+        int result = allocReg();
+        if (!reduce) {
+            emit(Op::NewArray, result, result, 0);
+        } else if (!floating) {
+            emit(Op::LoadK, result, intConstant(0));
+        } else {
+            int zeros = nextReg;
+            for (int k = 0; k < sumLanes; ++k) emit(Op::LoadK, allocReg(), addConstant(Value::makeFloat(0)));
+            emit(Op::NewArray, result, zeros, sumLanes);
+        }
+        int index = allocReg(), test = allocReg(), lane = allocReg(), lanes = allocReg(), partial = allocReg();
+        emit(Op::LoadK, index, intConstant(0));
+        if (floating && reduce) emit(Op::LoadK, lanes, intConstant(sumLanes));
+        int mark = nextReg;
+        size_t top = here();
+        emit(Op::Lt, test, index, length);
+        size_t exit = emit(Op::JumpIfFalse, test);
+        int value = compileElement(root, leaves, index);
+        if (!reduce) {
+            emit(Op::Push, result, value);
+        } else if (!floating) {
+            emit(Op::Add, result, result, value);
+        } else {
+            emit(Op::Mod, lane, index, lanes);
+            emit(Op::Index, partial, result, lane);
+            emit(Op::Add, partial, partial, value);
+            emit(Op::ToFloat, partial);
+            emit(Op::SetIndex, result, lane, partial);
+        }
+        nextReg = mark;
+        emit(Op::Inc, index);
+        emitJump(Op::Jump, 0, top);
+        patch(exit, here());
+        if (reduce && floating) emit(Op::Sum, result, result, 1);
+        return moveResult(result, dst);
+    }
+
+    int compileArrayBuiltin(const CallExpr& call, const std::string& name, int dst) {
+        size_t arity = name == "slice" ? 3 : (name == "len" || name == "copy" || name == "sum") ? 1 : 2;
+        if (call.args.size() != arity) {
+            error("builtin '" + name + "' expects " + std::to_string(arity) + " arguments");
+        }
+        std::string arrayType = staticType(*call.args[0]);
+        std::string elemType = isArrayType(arrayType) ? elementType(arrayType) : "";
+        if (name == "sum" && isFused(*call.args[0])) return compileFused(*call.args[0], dst, true);
+        int array = operand(*call.args[0]);
+        int out = target(dst);
+        if (name == "len") {
+            emit(Op::Len, out, array);
+        } else if (name == "copy") {
+            emit(Op::Copy, out, array);
+        } else if (name == "sum") {
+            emit(Op::Sum, out, array, elemType == "float");   // plain arrays; element-wise ones are fused above
+        } else if (name == "slice") {
+            int bounds = allocReg();
+            allocReg();
+            compileExpr(*call.args[1], bounds);
+            compileExpr(*call.args[2], bounds + 1);
+            emit(Op::Slice, out, array, bounds);
+        } else {
+            int value = name == "append" ? operand(*call.args[1]) : valueAs(*call.args[1], elemType);
+            emit(name == "push" ? Op::Push : name == "append" ? Op::Append : Op::Fill, array, value);
+        }
+        return out;
+    }
+
+    int compileMapBuiltin(const CallExpr& call, const std::string& name, int dst) {
+        size_t arity = name == "get" ? 3 : (name == "len" || name == "keys" || name == "values") ? 1 : 2;
+        if (call.args.size() != arity) {
+            error("builtin '" + name + "' expects " + std::to_string(arity) + " arguments");
+        }
+        std::string mapType = staticType(*call.args[0]);
+        int map = operand(*call.args[0]);
+        int out = target(dst);
+        if (name == "len" || name == "keys" || name == "values") {
+            emit(name == "len" ? Op::Len : name == "keys" ? Op::Keys : Op::Values, out, map);
+        } else if (name == "get") {
+            int args = allocReg();
+            allocReg();
+            compileExpr(*call.args[1], args);
+            convert(args, mapKeyType(mapType), staticType(*call.args[1]));
+            compileExpr(*call.args[2], args + 1);
+            convert(args + 1, mapValueType(mapType), staticType(*call.args[2]));
+            emit(Op::Get, out, map, args);
+        } else if (name == "reserve" || name == "rehash") {
+            emit(Op::Reserve, map, valueAs(*call.args[1], "int"), name == "rehash");
+        } else {
+            emit(name == "has" ? Op::Has : Op::Remove, out, map, valueAs(*call.args[1], mapKeyType(mapType)));
+        }
+        return out;
+    }
+
+    // Lambdas become extra functions compiled after the current one; captures are rejected
+    int lambdaFunction(const LambdaExpr& lambda) {
+        auto found = lambdaIndex.find(&lambda);
+        if (found != lambdaIndex.end()) return found->second;
+
+        std::unordered_set<std::string> locals(lambda.params.begin(), lambda.params.end());
+        std::vector<std::string> referenced;
+        for (const auto& stmt : lambda.body) {
+            walkStmt(*stmt, [&](const Stmt& s) {
+                if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&s)) locals.insert(varDecl->name);
+                if (dynamic_cast<const TimerStmt*>(&s)) locals.insert("__i");
+            }, [&](const Expr& e) {
+                if (auto var = dynamic_cast<const VarExpr*>(&e)) referenced.push_back(var->name);
+                if (auto inner = dynamic_cast<const LambdaExpr*>(&e)) {
+                    locals.insert(inner->params.begin(), inner->params.end());
+                }
+            });
+        }
+        for (const auto& name : referenced) {
+            if (!locals.count(name) && lookupLocal(name)) {
+                error("the VM does not support lambdas that capture locals ('" + name + "'); compile to C instead");
+            }
+        }
+
+        FunctionCode code;
+        code.name = "_lambda_" + std::to_string(lambdaIndex.size());
+        code.numParams = static_cast<int>(lambda.params.size());
+        module.functions.push_back(code);
+        int index = static_cast<int>(module.functions.size() - 1);
+        lambdaIndex[&lambda] = index;
+        pendingLambdas.push_back(&lambda);
+        return index;
+    }
+
+    void compileBlock(const std::vector<std::unique_ptr<Stmt>>& body) {
+        pushScope();
+        int mark = nextReg;
+        for (const auto& stmt : body) compileStmt(*stmt);
+        nextReg = mark;
+        popScope();
+    }
+
+    void compileLoopBody(const std::vector<std::unique_ptr<Stmt>>& body) {
+        loops.emplace_back();
+        compileBlock(body);
+    }
+
+    void finishLoop(size_t continueTarget, size_t breakTarget) {
+        for (size_t at : loops.back().continues) patch(at, continueTarget);
+        for (size_t at : loops.back().breaks) patch(at, breakTarget);
+        loops.pop_back();
+    }
+
+    // Statement used only for its effects: postfix ++/-- need not keep the old value
+    void compileEffect(const Expr& expr) {
+        if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            if (unary->op == "++" || unary->op == "--") {
+                compileUnary(*unary, -1, true);
+                return;
+            }
+        }
+        compileExpr(expr, -1);
+    }
+
+    void compileStmt(const Stmt& stmt) {
+        line = stmt.line;
+        int mark = nextReg;
+
+        if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&stmt)) {
+            int reg = allocReg();
+            std::string type = varDecl->type;
+            auto lit = dynamic_cast<const ArrayLiteralExpr*>(varDecl->initializer.get());
+            if (dynamic_cast<const LambdaExpr*>(varDecl->initializer.get())) {
+                type = "function";
+                compileExpr(*varDecl->initializer, reg);
+            } else if (lit && isArrayType(type)) {
+                compileArrayLiteral(*lit, reg, elementType(type));
+            } else if (varDecl->initializer) {
+                compileExpr(*varDecl->initializer, reg);
+                std::string from = staticType(*varDecl->initializer);
+                if (from == "function" && type == "auto") type = from;   // another name for a lambda
+                else if (!isArrayType(type)) convert(reg, type, from);
+            } else if (isArrayType(type)) {
+                emit(Op::NewArray, reg, reg, 0);
+            } else if (isMapType(type)) {
+                emit(Op::NewMap, reg);
+            } else if (type == "string") {
+                emit(Op::LoadK, reg, stringConstant(""));
+            } else {
+                emit(Op::LoadK, reg, intConstant(0));
+                convert(reg, type, "int");
+            }
+            scopes.back()[varDecl->name] = {reg, type};
+            nextReg = reg + 1;
+            return;
+        } else if (auto heat = dynamic_cast<const HeatStmt*>(&stmt)) {
+            emit(Op::SetGlobal, valueAs(*heat->expr, "int"), GlobalHeat);
+        } else if (auto beep = dynamic_cast<const BeepStmt*>(&stmt)) {
+            emit(Op::Beep, operand(*beep->expr));
+        } else if (auto defrost = dynamic_cast<const DefrostStmt*>(&stmt)) {
+            if (auto local = lookupLocal(defrost->varName)) {
+                emit(Op::LoadK, local->reg, intConstant(0));
+                convert(local->reg, local->type, "int");
+            } else if (globals.count(defrost->varName)) {
+                int zero = allocReg();
+                emit(Op::LoadK, zero, intConstant(0));
+                emit(Op::SetGlobal, zero, globals.at(defrost->varName));
+            } else {
+                error("unknown variable '" + defrost->varName + "'");
+            }
+        } else if (auto ret = dynamic_cast<const ReturnStmt*>(&stmt)) {
+            if (ret->expr) {
+                bool typed = !returnType.empty() && returnType != "void" && returnType != "string" &&
+                             !isArrayType(returnType);
+                emit(Op::Return, typed ? valueAs(*ret->expr, returnType) : operand(*ret->expr));
+            } else {
+                emit(Op::ReturnVoid);
+            }
+        } else if (dynamic_cast<const BreakStmt*>(&stmt)) {
+            if (loops.empty()) error("break outside of a loop");
+            loops.back().breaks.push_back(emit(Op::Jump));
+        } else if (dynamic_cast<const ContinueStmt*>(&stmt)) {
+            if (loops.empty()) error("continue outside of a loop");
+            loops.back().continues.push_back(emit(Op::Jump));
+        } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(&stmt)) {
+            size_t top = here();
+            size_t exit = emit(Op::JumpIfFalse, operand(*whileStmt->cond));
+            nextReg = mark;
+            compileLoopBody(whileStmt->body);
+            emitJump(Op::Jump, 0, top);
+            patch(exit, here());
+            finishLoop(top, here());
+        } else if (auto forStmt = dynamic_cast<const ForStmt*>(&stmt)) {
+            pushScope();
+            if (forStmt->init) compileStmt(*forStmt->init);
+            int loopMark = nextReg;
+            size_t top = here();
+            size_t exit = 0;
+            bool hasCond = forStmt->cond != nullptr;
+            if (hasCond) exit = emit(Op::JumpIfFalse, operand(*forStmt->cond));
+            nextReg = loopMark;
+            compileLoopBody(forStmt->body);
+            size_t next = here();
+            if (forStmt->update) compileEffect(*forStmt->update);
+            nextReg = loopMark;
+            emitJump(Op::Jump, 0, top);
+            if (hasCond) patch(exit, here());
+            finishLoop(next, here());
+            popScope();
+        } else if (auto timer = dynamic_cast<const TimerStmt*>(&stmt)) {
+            pushScope();
+            int limit = allocReg();
+            compileExpr(*timer->count, limit);
+            convert(limit, "int", staticType(*timer->count));
+            int counter = allocReg();
+            emit(Op::LoadK, counter, intConstant(0));
+            scopes.back()["__i"] = {counter, "int"};
+            int test = allocReg();
+            size_t top = here();
+            emit(Op::Lt, test, counter, limit);
+            size_t exit = emit(Op::JumpIfFalse, test);
+            compileLoopBody(timer->body);
+            size_t next = here();
+            emit(Op::Inc, counter);
+            emitJump(Op::Jump, 0, top);
+            patch(exit, here());
+            finishLoop(next, here());
+            popScope();
+        } else if (auto ifStmt = dynamic_cast<const IfStmt*>(&stmt)) {
+            size_t skipThen = emit(Op::JumpIfFalse, operand(*ifStmt->cond));
+            nextReg = mark;
+            compileBlock(ifStmt->thenBody);
+            if (ifStmt->elseBody.empty()) {
+                patch(skipThen, here());
+            } else {
+                size_t skipElse = emit(Op::Jump);
+                patch(skipThen, here());
+                compileBlock(ifStmt->elseBody);
+                patch(skipElse, here());
+            }
+        } else if (auto exprStmt = dynamic_cast<const ExprStmt*>(&stmt)) {
+            auto var = dynamic_cast<const VarExpr*>(exprStmt->expr.get());
+            if (!var || var->name != "beep") compileEffect(*exprStmt->expr); // a bare `beep;` does nothing
+        }
+        nextReg = mark;
+    }
+
+    void compileBody(int index, const std::vector<std::string>& names, const std::vector<std::string>& types,
+                     const std::string& retType, const std::vector<std::unique_ptr<Stmt>>& body, bool isMain) {
+        fnIndex = index;
+        returnType = retType;
+        scopes.clear();
+        loops.clear();
+        nextReg = 0;
+        pushScope();
+        for (size_t i = 0; i < names.size(); ++i) {
+            std::string type = types[i] == "auto" ? "int" : types[i];
+            scopes.back()[names[i]] = {allocReg(), type};
+        }
+        compileBlock(body);
+        if (isMain) {
+            int zero = allocReg();
+            emit(Op::LoadK, zero, intConstant(0));
+            emit(Op::Return, zero);
+        } else {
+            emit(Op::ReturnVoid);
+        }
+    }
+
+public:
+    BytecodeCompiler(Module& m) : module(m) {}
+
+    void compile(const Program& program) {
+        for (const auto& func : program.functions) {
+            if (functionDecls.count(func->name)) {
+                throw std::runtime_error("Function '" + func->name + "' is defined twice");
+            }
+            functionDecls[func->name] = func.get();
+            functionIndex[func->name] = static_cast<int>(module.functions.size());
+            FunctionCode code;
+            code.name = func->name;
+            code.numParams = static_cast<int>(func->params.size());
+            code.memoized = func->memoized;
+            module.functions.push_back(code);
+        }
+        auto mainFn = functionIndex.find("main");
+        if (mainFn == functionIndex.end()) throw std::runtime_error("Program has no main function");
+        module.mainIndex = mainFn->second;
+
+        for (const auto& func : program.functions) {
+            line = func->line;
+            std::vector<std::string> names, types;
+            for (const auto& param : func->params) {
+                names.push_back(param.name);
+                types.push_back(param.type);
+            }
+            compileBody(functionIndex[func->name], names, types, func->returnType, func->body, func->name == "main");
+        }
+        for (size_t i = 0; i < pendingLambdas.size(); ++i) {
+            const LambdaExpr* lambda = pendingLambdas[i];
+            compileBody(lambdaIndex[lambda], lambda->params, lambda->paramTypes, "", lambda->body, false);
+        }
+    }
+};
+
+std::unique_ptr<Module> compileBytecode(const Program& program) {
+    auto module = std::make_unique<Module>();
+    BytecodeCompiler compiler(*module);
+    compiler.compile(program);
+    return module;
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include "parser.h"
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Register-based bytecode for the Microwave VM
+
+// Operands: a is usually the destination register, b and c sources.
+// Jump targets are 32 bits spread over b (low) and c (high).
+#define MW_OPCODES(X) \
+    X(LoadK)     /* R[a] = K[b] */                          \
+    X(Move)      /* R[a] = R[b] */                          \
+    X(GetGlobal) /* R[a] = G[b] */                          \
+    X(SetGlobal) /* G[b] = R[a] */                          \
+    X(Add) X(Sub) X(Mul) X(Div) X(Mod)                      \
+    X(BitAnd) X(BitOr) X(BitXor) X(Shl) X(Shr)              \
+    X(Eq) X(Ne) X(Lt) X(Le) X(Gt) X(Ge)                     \
+    X(Neg) X(Not) X(BitNot) /* R[a] = op R[b] */            \
+    X(Inc) X(Dec)           /* R[a] += 1 / -= 1 */          \
+    X(ToInt) X(ToFloat) X(ToBool) /* convert R[a] in place */ \
+    X(Jump)      /* goto target */                          \
+    X(JumpIfFalse) /* if !R[a] goto target */               \
+    X(JumpIfTrue)  /* if R[a] goto target */                \
+    X(Call)      /* R[a] = F[b](R[a] .. R[a+c-1]) */        \
+    X(CallValue) /* R[a] = R[b](R[a] .. R[a+c-1]) */        \
+    X(Return)    /* return R[a] */                          \
+    X(ReturnVoid)                                           \
+    X(Beep)      /* print R[a] and a newline */             \
+    X(Printf)    /* R[a] = printf(R[b] .. R[b+c-1]) */      \
+    X(NewArray)  /* R[a] = {R[b] .. R[b+c-1]} */            \
+    X(Index)     /* R[a] = R[b][R[c]] */                    \
+    X(SetIndex)  /* R[a][R[b]] = R[c] */                    \
+    X(Len)       /* R[a] = len(R[b]) */                     \
+    X(Push)      /* push(R[a], R[b]) */                     \
+    X(Append)    /* append(R[a], R[b]) */                   \
+    X(Slice)     /* R[a] = slice(R[b], R[c], R[c+1]) */     \
+    X(Copy)      /* R[a] = copy(R[b]) */                    \
+    X(Fill)      /* fill(R[a], R[b]) */                     \
+    X(Sum)       /* R[a] = sum(R[b]), float lanes if c */   \
+    X(CheckLen)  /* fail unless len(R[b]) == R[a] */        \
+    X(NewMap)    /* R[a] = empty map */                     \
+    X(Has)       /* R[a] = has(R[b], R[c]) */               \
+    X(Get)       /* R[a] = get(R[b], R[c], R[c+1]) */       \
+    X(Remove)    /* R[a] = remove(R[b], R[c]) */            \
+    X(Keys)      /* R[a] = keys(R[b]) */                    \
+    X(Values)    /* R[a] = values(R[b]) */                  \
+    X(Reserve)   /* reserve(R[a], R[b]), rehash if c */     \
+    X(Halt)
+
+enum class Op : uint16_t {
+#define MW_OP_ENUM(name) name,
+    MW_OPCODES(MW_OP_ENUM)
+#undef MW_OP_ENUM
+    Count
+};
+
+const char* opName(Op op);
+
+struct Instr {
+    uint16_t op;
+    uint16_t a, b, c;
+};
+
+enum class ValueType : uint8_t { Void, Int, Float, Bool, String, Array, Map, Function };
+
+struct ArrayObject;
+struct MapObject;
+
+// Ints keep C's 32-bit wrap-around; floats are doubles rounded to float on typed stores
+struct Value {
+    ValueType type = ValueType::Void;
+    union {
+        int32_t i;
+        double f;
+        const std::string* s;
+        ArrayObject* a;
+        MapObject* m;
+        int32_t fn;
+    };
+    Value() : f(0) {}
+    static Value makeInt(int32_t v) { Value r; r.type = ValueType::Int; r.i = v; return r; }
+    static Value makeFloat(double v) { Value r; r.type = ValueType::Float; r.f = v; return r; }
+    static Value makeBool(bool v) { Value r; r.type = ValueType::Bool; r.i = v; return r; }
+    static Value makeString(const std::string* v) { Value r; r.type = ValueType::String; r.s = v; return r; }
+    static Value makeArray(ArrayObject* v) { Value r; r.type = ValueType::Array; r.a = v; return r; }
+    static Value makeMap(MapObject* v) { Value r; r.type = ValueType::Map; r.m = v; return r; }
+    static Value makeFunction(int32_t v) { Value r; r.type = ValueType::Function; r.fn = v; return r; }
+};
+
+// Slices share the store of their source; pushing onto a slice detaches it first
+struct ArrayObject {
+    std::shared_ptr<std::vector<Value>> store;
+    size_t offset = 0;
+    size_t length = 0;
+    bool view = false;
+};
+
+// Entries in insertion order, found through a hash index on the key. Removing an entry moves the
+// last one into its place, as the C runtime does, so keys() lists them in the same order.
+struct MapObject {
+    std::vector<Value> keys, values;
+    std::unordered_map<int32_t, uint32_t> ints;          // int key -> entry
+    std::unordered_map<std::string, uint32_t> strings;   // string key -> entry
+};
+
+struct FunctionCode {
+    std::string name;
+    int numParams = 0;
+    int numRegs = 1;            // register 0 doubles as the return slot
+    bool memoized = false;      // popcorn: results cached on argument bits
+    std::vector<Instr> code;
+    std::vector<int> lines;     // source line per instruction
+};
+
+enum Global : uint16_t { GlobalHeat, GlobalDoorClosed, GlobalDoorOpen, GlobalCount };
+
+struct Module {
+    std::vector<FunctionCode> functions;
+    std::vector<Value> constants;
+    std::deque<std::string> strings;    // backing store for string constants
+    int mainIndex = -1;
+};
+
+// Throws std::runtime_error for programs the VM cannot run (e.g. capturing lambdas)
+std::unique_ptr<Module> compileBytecode(const Program& program);
@@ -1,18 +1,454 @@
 #include "codegen.h"
-#include <sstream>
+#include "analysis.h"
+#include "runtime.h"
+#include "writer.h"
+#include <stdexcept>
 #include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 
+static bool isArrayType(const std::string& type) {
+    return type.size() > 2 && type.compare(type.size() - 2, 2, "[]") == 0;
+}
+
+static std::string elementType(const std::string& arrayType) {
+    std::string elem = arrayType.substr(0, arrayType.size() - 2);
+    return elem == "auto" ? "int" : elem;
+}
+
+// "map<K,V>", as the parser spells map types
+static bool isMapType(const std::string& type) {
+    return type.compare(0, 4, "map<") == 0;
+}
+
+static std::string mapKeyType(const std::string& mapType) {
+    return mapType.substr(4, mapType.find(',') - 4);
+}
+
+static std::string mapValueType(const std::string& mapType) {
+    size_t comma = mapType.find(',');
+    return mapType.substr(comma + 1, mapType.size() - comma - 2);
+}
+
+// Prefix of the MW_DEFINE_MAP instance behind a map type
+static std::string mapName(const std::string& mapType) {
+    return "mw_" + mapKeyType(mapType) + "_" + mapValueType(mapType) + "_map";
+}
+
+// Element type of an array literal, judged from its elements alone
+static std::string literalElementType(const ArrayLiteralExpr& lit) {
+    for (const auto& e : lit.elements) {
+        if (auto num = dynamic_cast<const NumberExpr*>(e.get())) {
+            if (num->value.find('.') != std::string::npos) return "float";
+        } else if (dynamic_cast<const StringExpr*>(e.get())) {
+            return "string";
+        } else if (dynamic_cast<const BoolExpr*>(e.get())) {
+            return "bool";
+        }
+    }
+    return "int";
+}
+
+// Literal elements only, so the whole array can live in a static table
+static bool isConstantLiteral(const ArrayLiteralExpr& lit) {
+    for (const auto& e : lit.elements) {
+        auto unary = dynamic_cast<const UnaryExpr*>(e.get());
+        const Expr* value = unary && (unary->op == "-" || unary->op == "+") ? unary->operand.get() : e.get();
+        if (!dynamic_cast<const NumberExpr*>(value) &&
+            (unary || (!dynamic_cast<const StringExpr*>(value) && !dynamic_cast<const BoolExpr*>(value)))) {
+            return false;
+        }
+    }
+    return !lit.elements.empty();
+}
+
+// An int literal, with an optional leading minus
+static bool intConstant(const Expr& e, long long& value) {
+    auto unary = dynamic_cast<const UnaryExpr*>(&e);
+    bool negate = unary && unary->op == "-";
+    auto num = dynamic_cast<const NumberExpr*>(negate ? unary->operand.get() : &e);
+    if (!num || num->value.find_first_of(".ef") != std::string::npos) return false;
+    value = std::strtoll(num->value.c_str(), nullptr, 10);
+    if (negate) value = -value;
+    return value >= INT_MIN && value <= INT_MAX;
+}
+
+// Structural equality of expressions that only read variables: no calls, no assignments
+static bool sameReadOnlyExpr(const Expr& a, const Expr& b) {
+    if (auto x = dynamic_cast<const VarExpr*>(&a)) {
+        auto y = dynamic_cast<const VarExpr*>(&b);
+        return y && x->name == y->name;
+    }
+    if (auto x = dynamic_cast<const NumberExpr*>(&a)) {
+        auto y = dynamic_cast<const NumberExpr*>(&b);
+        return y && x->value == y->value;
+    }
+    if (auto x = dynamic_cast<const ArrayExpr*>(&a)) {
+        auto y = dynamic_cast<const ArrayExpr*>(&b);
+        return y && sameReadOnlyExpr(*x->base, *y->base) && sameReadOnlyExpr(*x->index, *y->index);
+    }
+    if (auto x = dynamic_cast<const UnaryExpr*>(&a)) {
+        auto y = dynamic_cast<const UnaryExpr*>(&b);
+        return y && x->op == y->op && x->op != "++" && x->op != "--" && sameReadOnlyExpr(*x->operand, *y->operand);
+    }
+    if (auto x = dynamic_cast<const BinaryExpr*>(&a)) {
+        auto y = dynamic_cast<const BinaryExpr*>(&b);
+        const std::string& op = x->op;
+        bool assigns = op.back() == '=' && op != "==" && op != "!=" && op != "<=" && op != ">=";
+        return y && op == y->op && !assigns && sameReadOnlyExpr(*x->left, *y->left) &&
+               sameReadOnlyExpr(*x->right, *y->right);
+    }
+    return false;
+}
+
+// A break that would leave the enclosing loop; inside a switch it would only leave the switch
+static bool breaksOut(const std::vector<std::unique_ptr<Stmt>>& stmts) {
+    for (const auto& s : stmts) {
+        if (dynamic_cast<const BreakStmt*>(s.get())) return true;
+        auto ifStmt = dynamic_cast<const IfStmt*>(s.get());
+        if (ifStmt && (breaksOut(ifStmt->thenBody) || breaksOut(ifStmt->elseBody))) return true;
+    }
+    return false;
+}
+
+// A block being checked for spawn targets: what it declares, and the targets declared here that
+// a spawn has stored into since the block's last sync (name, line of the spawn)
+struct SpawnScope {
+    std::unordered_set<std::string> names;
+    std::vector<std::pair<std::string, int>> unsynced;
+    bool loopBody;
+};
+
+// The variable an assignment stores into, directly or through an element
+static std::string storedVariable(const Expr& target) {
+    const Expr* e = &target;
+    while (auto element = dynamic_cast<const ArrayExpr*>(e)) e = element->base.get();
+    auto var = dynamic_cast<const VarExpr*>(e);
+    return var ? var->name : "";
+}
+
+// A task stores its result through a pointer when it finishes, so the variable it goes to must
+// still be in scope at the sync that waits for it: declared in the function's own block (every
+// return syncs), or followed by a sync in its own block before control can leave that block.
+static void checkSpawnTargets(const std::vector<std::unique_ptr<Stmt>>& body, std::vector<SpawnScope>& scopes,
+                              bool loopBody, const std::string& loopVar = "") {
+    auto outlived = [](const std::pair<std::string, int>& target) {
+        throw std::runtime_error("line " + std::to_string(target.second) + ": '" + target.first +
+                                 "' goes out of scope before a sync waits for the spawn that stores into it; "
+                                 "declare it outside the block or sync within it");
+    };
+    scopes.push_back({{}, {}, loopBody});
+    if (!loopVar.empty()) scopes.back().names.insert(loopVar);
+    for (const auto& stmt : body) {
+        std::string target;
+        const SpawnExpr* spawn = nullptr;
+        if (auto varDecl = dynamic_cast<const VarDeclStmt*>(stmt.get())) {
+            scopes.back().names.insert(varDecl->name);
+            spawn = dynamic_cast<const SpawnExpr*>(varDecl->initializer.get());
+            if (spawn) target = varDecl->name;
+        } else if (auto exprStmt = dynamic_cast<const ExprStmt*>(stmt.get())) {
+            auto bin = dynamic_cast<const BinaryExpr*>(exprStmt->expr.get());
+            spawn = bin && bin->op == "=" ? dynamic_cast<const SpawnExpr*>(bin->right.get()) : nullptr;
+            if (spawn) target = storedVariable(*bin->left);
+        } else if (dynamic_cast<const SyncStmt*>(stmt.get())) {
+            scopes.back().unsynced.clear();
+        } else if (dynamic_cast<const BreakStmt*>(stmt.get()) || dynamic_cast<const ContinueStmt*>(stmt.get())) {
+            // Leaves every block up to the loop body
+            for (size_t k = scopes.size(); k-- > 1;) {
+                if (!scopes[k].unsynced.empty()) outlived(scopes[k].unsynced.front());
+                if (scopes[k].loopBody) break;
+            }
+        } else if (auto ifStmt = dynamic_cast<const IfStmt*>(stmt.get())) {
+            checkSpawnTargets(ifStmt->thenBody, scopes, false);
+            checkSpawnTargets(ifStmt->elseBody, scopes, false);
+        } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(stmt.get())) {
+            checkSpawnTargets(whileStmt->body, scopes, true);
+        } else if (auto timer = dynamic_cast<const TimerStmt*>(stmt.get())) {
+            checkSpawnTargets(timer->body, scopes, true);
+        } else if (auto forStmt = dynamic_cast<const ForStmt*>(stmt.get())) {
+            auto init = dynamic_cast<const VarDeclStmt*>(forStmt->init.get());
+            checkSpawnTargets(forStmt->body, scopes, true, init ? init->name : "");
+        }
+        if (target.empty()) continue;
+        for (size_t k = scopes.size(); k-- > 0;) {
+            if (!scopes[k].names.count(target)) continue;
+            if (k > 0) scopes[k].unsynced.emplace_back(target, spawn->line);
+            break;
+        }
+    }
+    if (scopes.size() > 1 && !scopes.back().unsynced.empty()) outlived(scopes.back().unsynced.front());
+    scopes.pop_back();
+}
+
+// Whether func spawns tasks. A spawn must begin a statement, initialize a declaration or be the
+// right side of a plain assignment; lambdas have no task frame, so they may neither spawn nor sync.
+static bool spawnsIn(const Function& func) {
+    auto misplaced = [](const ASTNode& node, const std::string& what) {
+        throw std::runtime_error("line " + std::to_string(node.line) + ": " + what);
+    };
+    std::unordered_set<const Expr*> placed;
+    bool spawns = false;
+    for (const auto& stmt : func.body) {
+        walkStmt(*stmt, [&](const Stmt& s) {
+            if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&s)) {
+                placed.insert(varDecl->initializer.get());
+            } else if (auto exprStmt = dynamic_cast<const ExprStmt*>(&s)) {
+                auto bin = dynamic_cast<const BinaryExpr*>(exprStmt->expr.get());
+                placed.insert(bin && bin->op == "=" ? bin->right.get() : exprStmt->expr.get());
+            } else if (auto forStmt = dynamic_cast<const ForStmt*>(&s)) {
+                if (forStmt->init) walkStmt(*forStmt->init, nullptr, [&](const Expr& e) {
+                    if (dynamic_cast<const SpawnExpr*>(&e)) misplaced(e, "spawn cannot start a for loop");
+                });
+            }
+        }, [&](const Expr& e) {
+            if (dynamic_cast<const SpawnExpr*>(&e)) {
+                if (!placed.count(&e)) {
+                    misplaced(e, "spawn must begin a statement, initialize a declaration or be assigned with '='");
+                }
+                spawns = true;
+            } else if (auto lambda = dynamic_cast<const LambdaExpr*>(&e)) {
+                for (const auto& inner : lambda->body) {
+                    walkStmt(*inner, [&](const Stmt& s) {
+                        if (dynamic_cast<const SyncStmt*>(&s)) misplaced(s, "a lambda cannot sync");
+                    }, [&](const Expr& x) {
+                        if (dynamic_cast<const SpawnExpr*>(&x)) misplaced(x, "a lambda cannot spawn");
+                    });
+                }
+            }
+        });
+    }
+    if (spawns) {
+        std::vector<SpawnScope> scopes;
+        checkSpawnTargets(func.body, scopes, false);
+    }
+    return spawns;
+}
+
+static std::string cString(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Profile-guided thresholds
+static const double hotShare = 0.05;              // of the hottest function's time
+static const unsigned long long inlineMinCalls = 1000;
+static const int inlineMaxStmts = 12;
+static const unsigned long long expectMinEvals = 100;
+static const double expectBias = 0.95;
+
+static const std::unordered_set<std::string> arrayBuiltins = {
+    "len", "push", "append", "slice", "copy", "fill", "sum"
+};
+
+static const std::unordered_set<std::string> mapBuiltins = {
+    "len", "has", "get", "remove", "reserve", "rehash", "keys", "values"
+};
+
+// Operators that apply element by element when an operand is an int[] or float[]
+static const std::unordered_set<std::string> elementwiseOps = {"+", "-", "*", "/", "%"};
+
+// Fused loops run in blocks of this many elements. sum() keeps one partial sum per position in
+// the block (element i goes to lane i % fusedBlock), so a float sum vectorizes without
+// reassociating; the VM adds in the same order.
+static const int fusedBlock = 16;
+
+// Largest mutable array literal given stack storage instead of a heap copy
+static const size_t maxStackElements = 1024;
+
+// if/else-if chains on one value become a switch from this many cases; a range test such as
+// x >= 1 && x <= 8 becomes one label per value up to maxRangeLabels
+static const size_t minSwitchCases = 3;
+static const long long maxRangeLabels = 256;
+
+// One arm of a lowered if/else-if chain
+struct SwitchCase {
+    std::vector<long long> values;
+    const std::vector<std::unique_ptr<Stmt>>* body;
+};
+
+// How a local array variable is used across a function
+struct ArrayUses {
+    bool written = false;       // element stores, push, append or fill
+    bool reassigned = false;
+    bool escapes = false;       // its data pointer may be copied somewhere that outlives or aliases it
+};
+
+// A lambda hoisted to a static C function; captures live in a stack-allocated env struct
+struct LambdaInfo {
+    std::string name;
+    std::string returnType;
+    std::vector<std::string> paramTypes;
+    std::vector<std::pair<std::string, std::string>> captures; // name, Microwave type
+};
 
 class CodeGenerator {
-    std::stringstream code;
+    CodeWriter code;
     int indentLevel = 0;
     int lambdaCounter = 0;
+    int tableCounter = 0;
+    CodegenOptions options;
+    const Program* program = nullptr;
+    std::unordered_map<std::string, const Function*> functions;
+    std::unordered_map<const Function*, bool> purity;
+    std::map<std::pair<const Function*, size_t>, ArrayUses> paramUseCache;
+    std::vector<std::unordered_map<std::string, std::string>> scopes;
+    const Function* currentFunction = nullptr;
+    std::string currentSource;                              // .mw file of currentFunction
+    std::unordered_map<const Function*, int> functionIds;   // --instrument tables
+    std::unordered_map<const Stmt*, int> loopIds;
+    std::unordered_map<const Stmt*, int> branchIds;
+    std::unordered_map<const Function*, std::string> qualifiers;   // from --profile-use
+    bool tasks = false;                 // spawn runs on the work-stealing runtime (not under --instrument)
+    bool taskFrame = false;             // currentFunction spawns, so it has a frame named mw_tasks
+    int spawnCounter = 0;
+    int loopDepth = 0;
+    int fusedCounter = 0;
+    int mapCounter = 0;
+    std::unordered_map<std::string, std::string> mapUpdates;   // map type + compound op -> helper
+    std::unordered_set<std::string> arrayRuntimes;      // element types with MW_DEFINE_ARRAY emitted
+    
+    CodeWriter hoisted;                                // lambdas, tables and helpers, emitted ahead of the enclosing function
+    std::vector<LambdaInfo> lambdas;
+    std::unordered_map<const LambdaExpr*, size_t> lambdaIds;
+    std::unordered_map<std::string, std::string> captureNames; // captured var -> env access
+    std::string* returnTypeSink = nullptr;              // first return type seen in a lambda body
     
     void indent() {
-        for (int i = 0; i < indentLevel; ++i) code << "    ";
+        code.indent(indentLevel);
+    }
+    
+    void pushScope() { scopes.emplace_back(); }
+    void popScope() { scopes.pop_back(); }
+    
+    void declare(const std::string& name, const std::string& type) {
+        if (!scopes.empty()) scopes.back()[name] = type;
+    }
+    
+    bool isLocal(const std::string& name) const {
+        for (const auto& scope : scopes) {
+            if (scope.count(name)) return true;
+        }
+        return false;
+    }
+    
+    std::string varRef(const std::string& name) const {
+        auto found = captureNames.find(name);
+        return found != captureNames.end() ? found->second : name;
+    }
+    
+    // "lambda:N" is a binding known at every call site; "lambdaptr:N" may be reassigned
+    const LambdaInfo* lambdaOf(const std::string& type) const {
+        size_t colon = type.find(':');
+        if (colon == std::string::npos || type.compare(0, 6, "lambda") != 0) return nullptr;
+        return &lambdas[std::stoul(type.substr(colon + 1))];
+    }
+    
+    std::string lookupType(const std::string& name) const {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(name);
+            if (found != it->end()) return found->second;
+        }
+        return "int"; // globals (heat, door_closed, ...) and unknown names are int
+    }
+    
+    // Best-effort static type of an expression, in Microwave type names
+    std::string exprType(const Expr& expr) {
+        if (auto num = dynamic_cast<const NumberExpr*>(&expr)) {
+            return num->value.find('.') != std::string::npos ? "float" : "int";
+        } else if (dynamic_cast<const StringExpr*>(&expr)) {
+            return "string";
+        } else if (dynamic_cast<const BoolExpr*>(&expr)) {
+            return "bool";
+        } else if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+            return lookupType(var->name);
+        } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            const std::string& op = bin->op;
+            if (op == "==" || op == "!=" || op == "<" || op == ">" || op == "<=" || op == ">=" ||
+                op == "&&" || op == "||") {
+                return "bool";
+            }
+            if (op.back() == '=') return exprType(*bin->left); // assignments
+            std::string l = exprType(*bin->left), r = exprType(*bin->right);
+            if (elementwiseOps.count(op) && (isArrayType(l) || isArrayType(r))) {
+                bool floating = (isArrayType(l) ? elementType(l) : l) == "float" ||
+                                (isArrayType(r) ? elementType(r) : r) == "float";
+                return floating ? "float[]" : "int[]";
+            }
+            if (op == "+" && (l == "string" || r == "string")) return "string";
+            if (l == "float" || r == "float") return "float";
+            return "int";
+        } else if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            if (unary->op == "!") return "bool";
+            std::string t = exprType(*unary->operand);
+            return t == "bool" ? "int" : t;
+        } else if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+            std::string builtin;
+            if (isArrayBuiltin(*call, builtin)) {
+                if (builtin == "len") return "int";
+                if (builtin == "slice" || builtin == "copy") return exprType(*call->args[0]);
+                if (builtin == "sum") return elementType(exprType(*call->args[0]));
+                return "void";
+            }
+            if (isMapBuiltin(*call, builtin)) {
+                std::string t = exprType(*call->args[0]);
+                if (builtin == "len") return "int";
+                if (builtin == "has" || builtin == "remove") return "bool";
+                if (builtin == "get") return mapValueType(t);
+                if (builtin == "keys") return mapKeyType(t) + "[]";
+                if (builtin == "values") return mapValueType(t) + "[]";
+                return "void";
+            }
+            if (auto callee = dynamic_cast<const VarExpr*>(call->function.get())) {
+                if (auto info = lambdaOf(lookupType(callee->name))) return info->returnType;
+                auto fn = functions.find(callee->name);
+                if (fn != functions.end()) return fn->second->returnType;
+            }
+            return "int";
+        } else if (auto array = dynamic_cast<const ArrayExpr*>(&expr)) {
+            std::string t = exprType(*array->base);
+            if (isArrayType(t)) return elementType(t);
+            if (isMapType(t)) return mapValueType(t);
+            return "int";
+        } else if (auto arrayLit = dynamic_cast<const ArrayLiteralExpr*>(&expr)) {
+            return literalElementType(*arrayLit) + "[]";
+        } else if (auto spawn = dynamic_cast<const SpawnExpr*>(&expr)) {
+            return exprType(*spawn->call);
+        }
+        return "int";
+    }
+    
+    // Array builtins apply when no user function shadows the name and the first argument is an array
+    bool isArrayBuiltin(const CallExpr& call, std::string& name) {
+        auto callee = dynamic_cast<const VarExpr*>(call.function.get());
+        if (!callee || !arrayBuiltins.count(callee->name) || functions.count(callee->name)) return false;
+        if (call.args.empty() || !isArrayType(exprType(*call.args[0]))) return false;
+        name = callee->name;
+        return true;
+    }
+    
+    // Likewise for map builtins, on a map
+    bool isMapBuiltin(const CallExpr& call, std::string& name) {
+        auto callee = dynamic_cast<const VarExpr*>(call.function.get());
+        if (!callee || !mapBuiltins.count(callee->name) || functions.count(callee->name)) return false;
+        if (call.args.empty() || !isMapType(exprType(*call.args[0]))) return false;
+        name = callee->name;
+        return true;
     }
     
     std::string typeToC(const std::string& type) {
+        if (isArrayType(type)) return "mw_" + elementType(type) + "_array";
+        if (isMapType(type)) return mapName(type) + "*";
+        if (auto info = lambdaOf(type)) {
+            return info->captures.empty() ? info->name + "_fn" : "struct " + info->name + "_env";
+        }
         if (type == "int") return "int";
         if (type == "float") return "float";
         if (type == "string") return "char*";
@@ -23,7 +459,9 @@ class CodeGenerator {
     
     void generateExpr(const Expr& expr) {
         if (auto num = dynamic_cast<const NumberExpr*>(&expr)) {
-            code << num->value;
+            // Folded results can be negative; parenthesized so that "- -5" never becomes "--5"
+            if (num->value[0] == '-') code << "(" << num->value << ")";
+            else code << num->value;
         } else if (auto str = dynamic_cast<const StringExpr*>(&expr)) {
             code << "\"" << str->value << "\"";
         } else if (auto boolean = dynamic_cast<const BoolExpr*>(&expr)) {
@@ -33,13 +471,23 @@ class CodeGenerator {
             if (var->name == "beep") {
                 code << "printf";
             } else {
-                code << var->name;
+                code << varRef(var->name);
             }
         } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
-            if (bin->op == "=") {
+            auto element = dynamic_cast<const ArrayExpr*>(bin->left.get());
+            bool assigns = bin->op.back() == '=' && bin->op != "==" && bin->op != "!=" &&
+                           bin->op != "<=" && bin->op != ">=";
+            if (assigns && element && isMapType(exprType(*element->base))) {
+                generateMapStore(*bin, *element);
+            } else if (bin->op == "=") {
                 generateExpr(*bin->left);
                 code << " = ";
-                generateExpr(*bin->right);
+                std::string leftType = exprType(*bin->left);
+                if (isArrayType(leftType)) {
+                    generateArrayValue(*bin->right, leftType);
+                } else {
+                    generateExpr(*bin->right);
+                }
             } else if (bin->op == "&&") {
                 generateExpr(*bin->left);
                 code << " && ";
@@ -48,6 +496,8 @@ class CodeGenerator {
                 generateExpr(*bin->left);
                 code << " || ";
                 generateExpr(*bin->right);
+            } else if (elementwiseOps.count(bin->op) && isArrayType(exprType(*bin))) {
+                generateFused(*bin, false);
             } else {
                 // Check for string concatenation
                 if (bin->op == "+") {
@@ -56,7 +506,7 @@ class CodeGenerator {
                     
                     if (leftStr && rightVar) {
                         // String + variable - use sprintf and return temp_str  
-                        code << "(sprintf(temp_str, \"" << leftStr->value << "%d\", " << rightVar->name << "), temp_str)";
+                        code << "(sprintf(temp_str, \"" << leftStr->value << "%d\", " << varRef(rightVar->name) << "), temp_str)";
                         return;
                     }
                 }
@@ -68,7 +518,17 @@ class CodeGenerator {
                 code << ")";
             }
         } else if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
-            if (unary->isPrefix) {
+            auto element = dynamic_cast<const ArrayExpr*>(unary->operand.get());
+            if (unary->op == "-" && isArrayType(exprType(*unary->operand))) {
+                generateFused(*unary, false);
+            } else if ((unary->op == "++" || unary->op == "--") && element && isMapType(exprType(*element->base))) {
+                // Missing keys start at zero, as in a compound assignment
+                code << "(" << (unary->isPrefix ? unary->op : "") << "(*" << mapName(exprType(*element->base)) << "_slot(";
+                generateExpr(*element->base);
+                code << ", ";
+                generateExpr(*element->index);
+                code << "))" << (unary->isPrefix ? "" : unary->op) << ")";
+            } else if (unary->isPrefix) {
                 code << unary->op;
                 generateExpr(*unary->operand);
             } else {
@@ -76,41 +536,773 @@ class CodeGenerator {
                 code << unary->op;
             }
         } else if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
-            generateExpr(*call->function);
-            code << "(";
+            std::string builtin;
+            if (isArrayBuiltin(*call, builtin)) {
+                generateArrayBuiltin(*call, builtin);
+                return;
+            }
+            if (isMapBuiltin(*call, builtin)) {
+                generateMapBuiltin(*call, builtin);
+                return;
+            }
+            // Lambdas known at the call site are called directly so the C compiler can inline them
+            bool needComma = false;
+            auto callee = dynamic_cast<const VarExpr*>(call->function.get());
+            auto lambdaCallee = dynamic_cast<const LambdaExpr*>(call->function.get());
+            const LambdaInfo* info = callee ? lambdaOf(lookupType(callee->name)) : nullptr;
+            if (lambdaCallee) {
+                info = &lambdas[generateLambda(*lambdaCallee)];
+                code << info->name << "(";
+                if (!info->captures.empty()) {
+                    code << "&(struct " << info->name << "_env)";
+                    generateEnvInit(*info);
+                    needComma = true;
+                }
+            } else if (info && lookupType(callee->name).compare(0, 7, "lambda:") == 0) {
+                code << info->name << "(";
+                if (!info->captures.empty()) {
+                    code << "&" << varRef(callee->name);
+                    needComma = true;
+                }
+            } else {
+                generateExpr(*call->function);
+                code << "(";
+            }
             for (size_t i = 0; i < call->args.size(); ++i) {
-                if (i > 0) code << ", ";
-                generateExpr(*call->args[i]);
+                if (i > 0 || needComma) code << ", ";
+                // A constant literal that the callee only reads is passed as a view of a static table
+                auto lit = dynamic_cast<const ArrayLiteralExpr*>(call->args[i].get());
+                const Function* fn = callee && !info ? functionNamed(callee->name) : nullptr;
+                std::string argType = exprType(*call->args[i]);
+                if (lit && fn && i < fn->params.size() && isArrayType(fn->params[i].type) &&
+                    keepsArrayPrivate(callee->name) && isConstantLiteral(*lit)) {
+                    generateTableView(*lit, fn->params[i].type, true);
+                } else if (isArrayType(argType) && !(fn && i < fn->params.size() && !paramUses(*fn, i).escapes)) {
+                    generateArrayView(*call->args[i], argType);
+                } else {
+                    generateExpr(*call->args[i]);
+                }
             }
             code << ")";
         } else if (auto lambda = dynamic_cast<const LambdaExpr*>(&expr)) {
-            // Generate lambda as inline function
-            (void)lambda; // Use variable to suppress warning
-            std::string lambdaName = "_lambda_" + std::to_string(lambdaCounter++);
-            code << lambdaName;
+            const LambdaInfo& info = lambdas[generateLambda(*lambda)];
+            if (!info.captures.empty()) {
+                throw std::runtime_error("A lambda that captures '" + info.captures[0].first +
+                                         "' must be bound to a variable or called directly");
+            }
+            code << info.name;
         } else if (auto array = dynamic_cast<const ArrayExpr*>(&expr)) {
+            std::string baseType = exprType(*array->base);
+            if (isMapType(baseType)) {
+                // A missing key stops the program with the line
+                code << mapName(baseType) << "_at(";
+                generateExpr(*array->base);
+                code << ", ";
+                generateExpr(*array->index);
+                code << ", " << array->line << ")";
+                return;
+            }
             generateExpr(*array->base);
+            if (isArrayType(exprType(*array->base))) code << ".data";
             code << "[";
             generateExpr(*array->index);
             code << "]";
         } else if (auto arrayLit = dynamic_cast<const ArrayLiteralExpr*>(&expr)) {
-            code << "{";
-            for (size_t i = 0; i < arrayLit->elements.size(); ++i) {
-                if (i > 0) code << ", ";
-                generateExpr(*arrayLit->elements[i]);
+            generateArrayLiteral(*arrayLit, literalElementType(*arrayLit) + "[]");
+        } else if (auto spawn = dynamic_cast<const SpawnExpr*>(&expr)) {
+            generateExpr(*spawn->call);   // without the task runtime a spawned call runs in place
+        }
+    }
+    
+    // Array literals become heap-backed arrays copied from a static table, or from a compound
+    // literal when some elements are computed
+    void generateArrayLiteral(const ArrayLiteralExpr& lit, const std::string& arrayType) {
+        std::string elem = elementType(arrayType);
+        code << typeToC(arrayType) << "_from(";
+        if (lit.elements.empty()) {
+            code << "NULL, 0)";
+            return;
+        }
+        if (isConstantLiteral(lit)) {
+            code << constantTable(lit, elem) << ", " << lit.elements.size() << ")";
+            return;
+        }
+        code << "(" << typeToC(elem) << " const[]){";
+        for (size_t i = 0; i < lit.elements.size(); ++i) {
+            if (i > 0) code << ", ";
+            generateExpr(*lit.elements[i]);
+        }
+        code << "}, " << lit.elements.size() << ")";
+    }
+    
+    // The value stored by an array declaration or assignment; copying another variable yields
+    // a non-owning view (cap 0), so a push on either side moves it to storage of its own
+    void generateArrayValue(const Expr& value, const std::string& arrayType) {
+        if (auto lit = dynamic_cast<const ArrayLiteralExpr*>(&value)) {
+            generateArrayLiteral(*lit, arrayType);
+        } else {
+            generateArrayView(value, arrayType);
+        }
+    }
+    
+    // An array that something else may keep: a variable gives up its storage first (cap 0 on
+    // both sides), since a view must not see it moved by a push or freed at scope exit
+    void generateArrayView(const Expr& value, const std::string& arrayType) {
+        if (dynamic_cast<const VarExpr*>(&value)) {
+            code << typeToC(arrayType) << "_share(&";
+            generateExpr(value);
+            code << ")";
+        } else {
+            generateExpr(value);
+        }
+    }
+    
+    // Emits a static const table ahead of the function; returns its name
+    std::string constantTable(const ArrayLiteralExpr& lit, const std::string& elem) {
+        std::string name = "mw_table_" + std::to_string(tableCounter++);
+        CodeWriter table;
+        std::swap(code, table);
+        // A string table is const in its pointers, not its characters, to match string[] data
+        code << (elem == "string" ? "static char* const " : "static const " + typeToC(elem) + " ")
+             << name << "[" << lit.elements.size() << "] = {";
+        for (size_t i = 0; i < lit.elements.size(); ++i) {
+            if (i > 0) code << ", ";
+            generateExpr(*lit.elements[i]);
+        }
+        code << "};\n";
+        std::swap(code, table);
+        hoisted.splice(table);
+        return name;
+    }
+    
+    // A non-owning array over a static table; cap 0 makes a push copy it first
+    void generateTableView(const ArrayLiteralExpr& lit, const std::string& arrayType, bool compound) {
+        std::string elem = elementType(arrayType);
+        std::string table = constantTable(lit, elem);
+        if (compound) code << "(" << typeToC(arrayType) << ")";
+        code << "{ (" << typeToC(elem) << "*)" << table << ", " << lit.elements.size() << ", 0 }";
+    }
+    
+    const Function* functionNamed(const std::string& name) const {
+        auto found = functions.find(name);
+        return found != functions.end() ? found->second : nullptr;
+    }
+    
+    // Pure functions never write through an array argument, and without an array result they
+    // cannot hand it back either
+    bool keepsArrayPrivate(const std::string& name) {
+        const Function* fn = functionNamed(name);
+        if (!fn || isArrayType(fn->returnType)) return false;
+        auto verdict = purity.find(fn);
+        if (verdict == purity.end()) verdict = purity.emplace(fn, impurityReason(*fn, *program).empty()).first;
+        return verdict->second;
+    }
+    
+    // Every use of a local array in the current function (lambdas included), judged by the node
+    // that holds it: indexing, len(), copy() and pure callees only read it
+    ArrayUses arrayUses(const std::string& name) {
+        ArrayUses uses;
+        auto is = [&](const std::unique_ptr<Expr>& e) {
+            auto var = dynamic_cast<const VarExpr*>(e.get());
+            return var && var->name == name;
+        };
+        auto indexes = [&](const std::unique_ptr<Expr>& e) {
+            auto array = dynamic_cast<const ArrayExpr*>(e.get());
+            return array && is(array->base);
+        };
+        // The whole array handed to a statement: return t, beep t, int[] u = t, ...
+        auto held = [&](const std::unique_ptr<Expr>& e) {
+            if (is(e)) uses.escapes = true;
+        };
+        for (const auto& stmt : currentFunction->body) {
+            walkStmt(*stmt, [&](const Stmt& s) {
+                if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&s)) held(varDecl->initializer);
+                else if (auto heat = dynamic_cast<const HeatStmt*>(&s)) held(heat->expr);
+                else if (auto beep = dynamic_cast<const BeepStmt*>(&s)) held(beep->expr);
+                else if (auto ret = dynamic_cast<const ReturnStmt*>(&s)) held(ret->expr);
+                else if (auto whileStmt = dynamic_cast<const WhileStmt*>(&s)) held(whileStmt->cond);
+                else if (auto timer = dynamic_cast<const TimerStmt*>(&s)) held(timer->count);
+                else if (auto ifStmt = dynamic_cast<const IfStmt*>(&s)) held(ifStmt->cond);
+                else if (auto expr = dynamic_cast<const ExprStmt*>(&s)) held(expr->expr);
+                else if (auto defrost = dynamic_cast<const DefrostStmt*>(&s)) uses.escapes |= defrost->varName == name;
+                else if (auto forStmt = dynamic_cast<const ForStmt*>(&s)) {
+                    held(forStmt->cond);
+                    held(forStmt->update);
+                }
+            }, [&](const Expr& e) {
+                if (auto bin = dynamic_cast<const BinaryExpr*>(&e)) {
+                    bool assigns = bin->op.back() == '=' && bin->op != "==" && bin->op != "!=" &&
+                                   bin->op != "<=" && bin->op != ">=";
+                    // Element-wise arithmetic only reads its operands
+                    bool reads = elementwiseOps.count(bin->op) > 0;
+                    if (is(bin->left) && assigns) uses.reassigned = true;
+                    else if (is(bin->left) && !reads) uses.escapes = true;
+                    if (assigns && indexes(bin->left)) uses.written = true;
+                    if (!reads) held(bin->right);
+                } else if (auto unary = dynamic_cast<const UnaryExpr*>(&e)) {
+                    if (unary->op != "-") held(unary->operand);
+                    if ((unary->op == "++" || unary->op == "--") && indexes(unary->operand)) uses.written = true;
+                } else if (auto array = dynamic_cast<const ArrayExpr*>(&e)) {
+                    held(array->index);
+                } else if (auto lit = dynamic_cast<const ArrayLiteralExpr*>(&e)) {
+                    for (const auto& element : lit->elements) held(element);
+                } else if (auto call = dynamic_cast<const CallExpr*>(&e)) {
+                    held(call->function);
+                    auto callee = dynamic_cast<const VarExpr*>(call->function.get());
+                    std::string fn = callee ? callee->name : "";
+                    bool builtin = arrayBuiltins.count(fn) && !functions.count(fn);
+                    const Function* named = builtin ? nullptr : functionNamed(fn);
+                    for (size_t i = 0; i < call->args.size(); ++i) {
+                        if (!is(call->args[i])) continue;
+                        if (builtin && (fn == "len" || fn == "copy" || fn == "sum" || (fn == "append" && i == 1))) continue;
+                        if (builtin && i == 0 && (fn == "push" || fn == "append" || fn == "fill")) {
+                            uses.written = true;
+                        } else if (named && i < named->params.size()) {
+                            ArrayUses callee = paramUses(*named, i);
+                            uses.written |= callee.written;
+                            uses.escapes |= callee.escapes;
+                        } else {
+                            uses.escapes = true;
+                        }
+                    }
+                } else if (auto spawn = dynamic_cast<const SpawnExpr*>(&e)) {
+                    // A task reads its arguments while this function goes on
+                    for (const auto& arg : spawn->call->args) held(arg);
+                }
+            });
+        }
+        return uses;
+    }
+    
+    // How a function uses its array parameter i: a caller's array stays private when the
+    // callee neither keeps nor returns it. A recursive call meets the worst case.
+    ArrayUses paramUses(const Function& fn, size_t i) {
+        auto key = std::make_pair(&fn, i);
+        auto found = paramUseCache.find(key);
+        if (found != paramUseCache.end()) return found->second;
+        ArrayUses& entry = paramUseCache[key];
+        entry.written = entry.escapes = true;
+        const Function* saved = currentFunction;
+        currentFunction = &fn;
+        ArrayUses uses = arrayUses(fn.params[i].name);
+        currentFunction = saved;
+        return paramUseCache[key] = uses;
+    }
+    
+    void generateArrayBuiltin(const CallExpr& call, const std::string& name) {
+        std::string prefix = typeToC(exprType(*call.args[0]));
+        size_t arity = name == "slice" ? 3 : (name == "len" || name == "copy" || name == "sum") ? 1 : 2;
+        if (call.args.size() != arity) {
+            throw std::runtime_error("Builtin '" + name + "' expects " + std::to_string(arity) + " arguments");
+        }
+        if (name == "sum") {
+            generateFused(*call.args[0], true);
+            return;
+        }
+        if (name == "len") {
+            code << "(int)";
+            generateExpr(*call.args[0]);
+            code << ".len";
+            return;
+        }
+        code << prefix << "_" << name << "(";
+        if (name == "push" || name == "append") code << "&";
+        for (size_t i = 0; i < call.args.size(); ++i) {
+            if (i > 0) code << ", ";
+            if (name == "slice" && i == 0) generateArrayView(*call.args[0], exprType(*call.args[0]));
+            else generateExpr(*call.args[i]);
+        }
+        code << ")";
+    }
+    
+    // m[k] = v puts; m[k] op= v updates the value in place, starting a missing key at zero. The
+    // right side is evaluated first, since it may grow the map and move the value.
+    void generateMapStore(const BinaryExpr& bin, const ArrayExpr& element) {
+        std::string type = exprType(*element.base);
+        std::string key = mapKeyType(type), value = mapValueType(type);
+        if (bin.op != "=" && value == "string") {
+            throw std::runtime_error("line " + std::to_string(bin.line) + ": '" + bin.op +
+                                     "' cannot update a string map value; assign it with '='");
+        }
+        if (bin.op == "=" && key != "string") {
+            code << mapName(type) << "_put(";
+            generateExpr(*element.base);
+            code << ", ";
+            generateExpr(*element.index);
+            code << ", ";
+            generateExpr(*bin.right);
+            code << ")";
+            return;
+        }
+        // A compound store goes through a helper so that the right side is evaluated before the
+        // slot is taken: it may insert into the same map and move its values. A string key is
+        // copied aside before the right side runs, which may rebuild temp_str under it.
+        std::string& helper = mapUpdates[mapName(type) + bin.op];
+        if (helper.empty()) {
+            helper = "mw_m" + std::to_string(mapCounter++);
+            std::string valueC = typeToC(value);
+            std::string store = bin.op == "=" ? mapName(type) + "_put(m, k, v)"
+                                              : "*" + mapName(type) + "_slot(m, k) " + bin.op + " v";
+            hoisted << "static " << valueC << " " << helper << "(" << typeToC(type) << " m, ";
+            if (key == "string") {
+                hoisted << valueC << " v) {\n"
+                        << "    char* k = mw_key_string_take();\n"
+                        << "    " << valueC << " stored = " << store << ";\n"
+                        << "    free(k);\n"
+                        << "    return stored;\n}\n\n";
+            } else {
+                hoisted << typeToC(key) << " k, " << valueC << " v) {\n"
+                        << "    return " << store << ";\n}\n\n";
             }
-            code << "}";
         }
+        if (key == "string") {
+            code << "(mw_key_string_hold(";
+            generateExpr(*element.index);
+            code << "), " << helper << "(";
+            generateExpr(*element.base);
+        } else {
+            code << helper << "(";
+            generateExpr(*element.base);
+            code << ", ";
+            generateExpr(*element.index);
+        }
+        code << ", ";
+        generateExpr(*bin.right);
+        code << (key == "string" ? "))" : ")");
+    }
+    
+    void generateMapBuiltin(const CallExpr& call, const std::string& name) {
+        size_t arity = name == "get" ? 3 : (name == "len" || name == "keys" || name == "values") ? 1 : 2;
+        if (call.args.size() != arity) {
+            throw std::runtime_error("Builtin '" + name + "' expects " + std::to_string(arity) + " arguments");
+        }
+        if (name == "len") {
+            code << "(int)";
+            generateExpr(*call.args[0]);
+            code << "->len";
+            return;
+        }
+        code << mapName(exprType(*call.args[0])) << "_" << name << "(";
+        for (size_t i = 0; i < call.args.size(); ++i) {
+            if (i > 0) code << ", ";
+            generateExpr(*call.args[i]);
+        }
+        code << ")";
+    }
+    
+    // The arrays and values an element-wise expression combines, in evaluation order
+    void fusedLeaves(const Expr& expr, std::vector<const Expr*>& leaves) {
+        auto bin = dynamic_cast<const BinaryExpr*>(&expr);
+        auto unary = dynamic_cast<const UnaryExpr*>(&expr);
+        if (bin && elementwiseOps.count(bin->op) && isArrayType(exprType(expr))) {
+            fusedLeaves(*bin->left, leaves);
+            fusedLeaves(*bin->right, leaves);
+        } else if (unary && unary->op == "-" && isArrayType(exprType(*unary->operand))) {
+            fusedLeaves(*unary->operand, leaves);
+        } else {
+            leaves.push_back(&expr);
+        }
+    }
+    
+    // One element of a fused expression, in float arithmetic wherever it is not all int: float
+    // literals are not promoted to double, and each step is rounded as a float[] would store it
+    void generateElement(const Expr& expr, const std::unordered_map<const Expr*, std::string>& names,
+                         const std::string& index) {
+        auto found = names.find(&expr);
+        if (found != names.end()) {
+            code << found->second;
+            if (isArrayType(exprType(expr))) code << ".data[" << index << "]";
+        } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            bool rounds = exprType(expr) == "float[]";
+            if (rounds && bin->op == "%") {
+                // C has no % on floats; fmodf is exact, so it matches the VM's fmod
+                code << "fmodf(";
+                generateElement(*bin->left, names, index);
+                code << ", ";
+                generateElement(*bin->right, names, index);
+                code << ")";
+                return;
+            }
+            code << (rounds ? "((float)(" : "(");
+            generateElement(*bin->left, names, index);
+            code << " " << bin->op << " ";
+            generateElement(*bin->right, names, index);
+            code << (rounds ? "))" : ")");
+        } else if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            code << "(-";
+            generateElement(*unary->operand, names, index);
+            code << ")";
+        } else if (exprType(expr) == "float") {
+            // A float literal is a float here, as a float variable would be, not a double
+            code << "(float)";
+            generateExpr(expr);
+        } else {
+            generateExpr(expr);   // an int literal
+        }
+    }
+    
+    // An element-wise array expression, or sum() of one, becomes a single loop in a static helper:
+    // its operands are evaluated once as the arguments, their lengths checked once, and each
+    // element is computed straight into the result (or the running sum) with no intermediate
+    // arrays. The loop body is plain indexed arithmetic through a restrict pointer, which the C
+    // compiler vectorizes.
+    void generateFused(const Expr& root, bool reduce) {
+        std::string fn = "mw_e" + std::to_string(fusedCounter++), p = fn + "_";
+        std::vector<const Expr*> leaves;
+        fusedLeaves(root, leaves);
+        std::unordered_map<const Expr*, std::string> names;
+        std::vector<std::string> arrays;
+        std::string params;
+        size_t named = 0;
+        code << fn << "(";
+        for (const Expr* leaf : leaves) {
+            std::string type = exprType(*leaf);
+            std::string elem = isArrayType(type) ? elementType(type) : type;
+            if (elem != "int" && elem != "float" && (elem != "bool" || isArrayType(type))) {
+                throw std::runtime_error("line " + std::to_string(leaf->line) +
+                                         ": element-wise operators take int[] and float[] arrays and numbers, not " + type);
+            }
+            if (dynamic_cast<const NumberExpr*>(leaf)) continue;
+            auto var = dynamic_cast<const VarExpr*>(leaf);
+            auto same = std::find_if(names.begin(), names.end(), [&](const std::pair<const Expr* const, std::string>& named) {
+                auto other = dynamic_cast<const VarExpr*>(named.first);
+                return var && other && other->name == var->name;
+            });
+            if (same != names.end()) {
+                names[leaf] = same->second;   // a variable used twice is read once
+                continue;
+            }
+            std::string name = p + std::to_string(named++);
+            names[leaf] = name;
+            if (!params.empty()) {
+                params += ", ";
+                code << ", ";
+            }
+            params += "const " + typeToC(type) + " " + name;
+            generateExpr(*leaf);
+            if (isArrayType(type)) arrays.push_back(name);
+        }
+        code << ")";
+        
+        std::string type = exprType(root), elem = elementType(type);
+        if (!reduce && !arrayRuntimes.count(elem)) {
+            hoisted << "MW_DEFINE_ARRAY(" << elem << ", " << typeToC(elem) << ")\n\n";
+            arrayRuntimes.insert(elem);
+        }
+        CodeWriter helper;
+        std::swap(code, helper);
+        sourceLine(code, root.line);
+        code << "static " << typeToC(reduce ? elem : type) << " " << fn << "(" << params << ") {\n";
+        std::string n = p + "n", i = p + "i";
+        code << "    size_t " << n << " = " << arrays[0] << ".len;\n";
+        for (size_t k = 1; k < arrays.size(); ++k) {
+            code << "    mw_length_check(" << n << ", " << arrays[k] << ".len, " << root.line << ");\n";
+        }
+        
+        // Whole blocks, then the rest. With the inner loop unrolled, GCC vectorizes the block loop
+        // even at -O2, where it will not vectorize a loop that needs a scalar epilogue.
+        std::string k = p + "k", at = i + " + " + k, block = std::to_string(fusedBlock);
+        auto loops = [&](const std::string& store) {
+            code << "    size_t " << i << " = 0;\n    MW_IVDEP for (; " << i << " + " << block << " <= " << n << "; " << i
+                 << " += " << block << ") MW_UNROLL(" << block << ") for (int " << k << " = 0; " << k << " < " << block << "; ++" << k << ") "
+                 << store;
+            generateElement(root, names, at);
+            code << ";\n    for (int " << k << " = 0; " << i << " + " << k << " < " << n << "; ++" << k << ") " << store;
+            generateElement(root, names, at);
+            code << ";\n";
+        };
+        
+        if (!reduce) {
+            code << "    " << typeToC(type) << " " << p << "r = " << typeToC(type) << "_alloc(" << n << ");\n    "
+                 << typeToC(elem) << "* restrict " << p << "out = " << p << "r.data;\n";
+            loops(p + "out[" + at + "] = ");
+            code << "    return " << p << "r;\n";
+        } else {
+            std::string lane = p + "lane", sum = p + "sum";
+            code << "    " << typeToC(elem) << " " << lane << "[" << block << "] = {0};\n";
+            loops(lane + "[" + k + "] += ");
+            code << "    " << typeToC(elem) << " " << sum << " = " << lane << "[0];\n    for (int " << k << " = 1; " << k << " < "
+                 << block << "; ++" << k << ") " << sum << " += " << lane << "[" << k << "];\n    return " << sum << ";\n";
+        }
+        code << "}\n";
+        generatedLines(code);
+        code << "\n";
+        std::swap(code, helper);
+        hoisted.splice(helper);
+    }
+    
+    void generateEnvInit(const LambdaInfo& info) {
+        code << "{ ";
+        for (size_t i = 0; i < info.captures.size(); ++i) {
+            if (i > 0) code << ", ";
+            code << "&" << varRef(info.captures[i].first);
+        }
+        code << " }";
+    }
+    
+    bool isReassigned(const std::string& name) const {
+        bool reassigned = false;
+        for (const auto& stmt : currentFunction->body) {
+            walkStmt(*stmt, nullptr, [&](const Expr& e) {
+                auto bin = dynamic_cast<const BinaryExpr*>(&e);
+                auto target = bin && bin->op == "=" ? dynamic_cast<const VarExpr*>(bin->left.get()) : nullptr;
+                if (target && target->name == name) reassigned = true;
+            });
+        }
+        return reassigned;
+    }
+    
+    // Hoist a lambda out as a static function; returns its index in lambdas
+    size_t generateLambda(const LambdaExpr& lambda) {
+        auto found = lambdaIds.find(&lambda);
+        if (found != lambdaIds.end()) return found->second;
+        
+        LambdaInfo info;
+        info.name = "_lambda_" + std::to_string(lambdaCounter++);
+        for (const auto& type : lambda.paramTypes) info.paramTypes.push_back(type == "auto" ? "int" : type);
+        
+        // Free variables that name locals of the enclosing scopes become captures
+        std::unordered_set<std::string> locals(lambda.params.begin(), lambda.params.end());
+        std::vector<std::string> referenced;
+        for (const auto& stmt : lambda.body) {
+            walkStmt(*stmt, [&](const Stmt& s) {
+                if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&s)) locals.insert(varDecl->name);
+                if (dynamic_cast<const TimerStmt*>(&s)) locals.insert("__i");
+            }, [&](const Expr& e) {
+                if (auto var = dynamic_cast<const VarExpr*>(&e)) {
+                    if (std::find(referenced.begin(), referenced.end(), var->name) == referenced.end()) {
+                        referenced.push_back(var->name);
+                    }
+                } else if (auto inner = dynamic_cast<const LambdaExpr*>(&e)) {
+                    locals.insert(inner->params.begin(), inner->params.end());
+                }
+            });
+        }
+        for (const auto& name : referenced) {
+            if (!locals.count(name) && isLocal(name)) info.captures.emplace_back(name, lookupType(name));
+        }
+        size_t id = lambdas.size();
+        lambdas.push_back(info);
+        lambdaIds[&lambda] = id;
+        
+        // Generate the body with its own scopes, reaching captures through env
+        auto savedScopes = std::move(scopes);
+        auto savedCaptures = std::move(captureNames);
+        std::string* savedSink = returnTypeSink;
+        int savedIndent = indentLevel;
+        bool savedFrame = taskFrame;
+        scopes.clear();
+        captureNames.clear();
+        std::string returnType;
+        returnTypeSink = &returnType;
+        indentLevel = 0;
+        taskFrame = false;
+        
+        CodeWriter body;
+        std::swap(code, body);
+        pushScope();
+        for (const auto& capture : info.captures) {
+            declare(capture.first, capture.second);
+            captureNames[capture.first] = "(*env->" + capture.first + ")";
+        }
+        std::vector<std::pair<std::string, std::string>> params;
+        for (size_t i = 0; i < lambda.params.size(); ++i) {
+            declare(lambda.params[i], info.paramTypes[i]);
+            params.emplace_back(lambda.params[i], info.paramTypes[i]);
+        }
+        generateBlock(lambda.body, paramViews(params));
+        popScope();
+        std::swap(code, body);
+        
+        scopes = std::move(savedScopes);
+        captureNames = std::move(savedCaptures);
+        returnTypeSink = savedSink;
+        indentLevel = savedIndent;
+        taskFrame = savedFrame;
+        lambdas[id].returnType = returnType.empty() ? "void" : returnType;
+        const LambdaInfo& done = lambdas[id];
+        
+        std::string cReturn = typeToC(done.returnType);
+        if (done.captures.empty()) {
+            hoisted << "typedef " << cReturn << " (*" << done.name << "_fn)(";
+            for (size_t i = 0; i < done.paramTypes.size(); ++i) {
+                if (i > 0) hoisted << ", ";
+                hoisted << typeToC(done.paramTypes[i]);
+            }
+            if (done.paramTypes.empty()) hoisted << "void";
+            hoisted << ");\n";
+        } else {
+            hoisted << "struct " << done.name << "_env {\n";
+            for (const auto& capture : done.captures) {
+                hoisted << "    " << typeToC(capture.second) << "* " << capture.first << ";\n";
+            }
+            hoisted << "};\n";
+        }
+        sourceLine(hoisted, lambda.line);
+        hoisted << "static " << cReturn << " " << done.name << "(";
+        bool first = true;
+        if (!done.captures.empty()) {
+            hoisted << "struct " << done.name << "_env* env";
+            first = false;
+        }
+        for (size_t i = 0; i < lambda.params.size(); ++i) {
+            if (!first) hoisted << ", ";
+            hoisted << typeToC(done.paramTypes[i]) << " " << lambda.params[i];
+            first = false;
+        }
+        if (first) hoisted << "void";
+        hoisted << ") {\n";
+        hoisted.splice(body);
+        hoisted << "}\n";
+        generatedLines(hoisted);
+        hoisted << "\n";
+        return id;
+    }
+    
+    // Declaration without indent, terminator or newline (shared with for-loop init; only a
+    // statement may declare a second, backing array)
+    void generateVarDecl(const VarDeclStmt& varDecl, bool statement = false) {
+        if (auto lambda = dynamic_cast<const LambdaExpr*>(varDecl.initializer.get())) {
+            size_t id = generateLambda(*lambda);
+            const LambdaInfo& info = lambdas[id];
+            bool reassigned = isReassigned(varDecl.name);
+            if (reassigned && !info.captures.empty()) {
+                throw std::runtime_error("Capturing lambda '" + varDecl.name + "' cannot be reassigned");
+            }
+            std::string type = (reassigned ? "lambdaptr:" : "lambda:") + std::to_string(id);
+            code << typeToC(type) << " " << varDecl.name << (reassigned ? "" : " MW_UNUSED") << " = ";
+            if (info.captures.empty()) {
+                code << info.name;
+            } else {
+                generateEnvInit(info);
+            }
+            declare(varDecl.name, type);
+            return;
+        }
+        // Another name for a lambda variable: the same function, and a copy of its env, whose
+        // pointers still reach the captured variables
+        auto alias = dynamic_cast<const VarExpr*>(varDecl.initializer.get());
+        std::string aliased = alias ? lookupType(alias->name) : "";
+        if (lambdaOf(aliased)) {
+            if (varDecl.type != "auto") {
+                throw std::runtime_error("line " + std::to_string(varDecl.line) + ": lambda '" + alias->name +
+                                         "' can only be bound with auto");
+            }
+            bool reassigned = isReassigned(varDecl.name);
+            if (reassigned && !lambdaOf(aliased)->captures.empty()) {
+                throw std::runtime_error("Capturing lambda '" + varDecl.name + "' cannot be reassigned");
+            }
+            std::string type = (reassigned ? "lambdaptr" : "lambda") + aliased.substr(aliased.find(':'));
+            code << typeToC(type) << " " << varDecl.name << (reassigned ? "" : " MW_UNUSED") << " = "
+                 << varRef(alias->name);
+            declare(varDecl.name, type);
+            return;
+        }
+        declare(varDecl.name, varDecl.type);
+        auto lit = dynamic_cast<const ArrayLiteralExpr*>(varDecl.initializer.get());
+        if (lit && isArrayType(varDecl.type) && !lit->elements.empty()) {
+            ArrayUses uses = arrayUses(varDecl.name);
+            if (!uses.written && !uses.reassigned && !uses.escapes && isConstantLiteral(*lit)) {
+                // Read-only: shared static data, nothing built when the declaration runs
+                code << typeToC(varDecl.type) << " " << varDecl.name << " = ";
+                generateTableView(*lit, varDecl.type, false);
+                return;
+            }
+            if (statement && !uses.escapes && lit->elements.size() <= maxStackElements) {
+                // Written but never handed on, so its storage can live in this frame
+                std::string data = "mw_data_" + varDecl.name;
+                code << typeToC(elementType(varDecl.type)) << " " << data << "[" << lit->elements.size() << "] = {";
+                for (size_t i = 0; i < lit->elements.size(); ++i) {
+                    if (i > 0) code << ", ";
+                    generateExpr(*lit->elements[i]);
+                }
+                code << "}; " << typeToC(varDecl.type) << " " << varDecl.name << released(varDecl)
+                     << " = { " << data << ", " << lit->elements.size() << ", 0 }";
+                return;
+            }
+        }
+        code << typeToC(varDecl.type) << " " << varDecl.name;
+        if (statement) code << released(varDecl);
+        if (varDecl.initializer) {
+            code << " = ";
+            if (isArrayType(varDecl.type)) {
+                generateArrayValue(*varDecl.initializer, varDecl.type);
+            } else {
+                generateExpr(*varDecl.initializer);
+            }
+        } else if (isArrayType(varDecl.type)) {
+            code << " = { NULL, 0, 0 }";
+        } else if (isMapType(varDecl.type)) {
+            code << " = " << mapName(varDecl.type) << "_new()";
+        }
+    }
+    
+    // A local array that is never handed on frees what it owns when it goes out of scope
+    std::string released(const VarDeclStmt& varDecl) {
+        if (!isArrayType(varDecl.type) || arrayUses(varDecl.name).escapes) return "";
+        return " __attribute__((cleanup(" + typeToC(varDecl.type) + "_release)))";
+    }
+    
+    // An array parameter that the function grows must not move its caller's storage
+    std::string paramViews(const std::vector<std::pair<std::string, std::string>>& params) {
+        std::string views;
+        for (const auto& param : params) {
+            if (!isArrayType(param.second) || !arrayUses(param.first).written) continue;
+            views += (views.empty() ? "" : " ") + param.first + ".cap = 0;";
+        }
+        return views;
+    }
+    
+    // prologue is emitted as the first line inside the block
+    void generateBlock(const std::vector<std::unique_ptr<Stmt>>& body, const std::string& prologue = "") {
+        indentLevel++;
+        pushScope();
+        if (!prologue.empty()) {
+            indent();
+            code << prologue << "\n";
+        }
+        for (const auto& s : body) {
+            generateStmt(*s);
+        }
+        popScope();
+        indentLevel--;
+    }
+    
+    // --line-directives: attribute the lines that follow to the .mw source...
+    void sourceLine(CodeWriter& out, int line) {
+        if (options.lineDirectives && line > 0) out << "#line " << line << " " << cString(currentSource) << "\n";
+    }
+    
+    // ...or hand them back to the generated file
+    void generatedLines(CodeWriter& out) {
+        if (options.lineDirectives) out.lineMarker(cString(options.outputName));
+    }
+    
+    // With --instrument, count loop entries here and return the per-iteration counter
+    std::string loopCounter(const Stmt& loop) {
+        auto found = loopIds.find(&loop);
+        if (!options.instrument || found == loopIds.end()) return "";
+        indent();
+        code << "mw_prof_entries[" << found->second << "]++;\n";
+        return "mw_prof_iters[" + std::to_string(found->second) + "]++;";
     }
     
     void generateStmt(const Stmt& stmt) {
+        sourceLine(code, stmt.line);
         if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&stmt)) {
-            indent();
-            code << typeToC(varDecl->type) << " " << varDecl->name;
-            if (varDecl->initializer) {
-                code << " = ";
-                generateExpr(*varDecl->initializer);
+            auto spawn = dynamic_cast<const SpawnExpr*>(varDecl->initializer.get());
+            if (tasks && spawn) {
+                // Declared empty; the task fills it in by the next sync
+                declare(varDecl->name, varDecl->type);
+                indent();
+                code << typeToC(varDecl->type) << " " << varDecl->name << released(*varDecl)
+                     << (isArrayType(varDecl->type) ? " = { NULL, 0, 0 };\n" : " = 0;\n");
+                VarExpr target(varDecl->name);
+                generateSpawn(*spawn, &target);
+                return;
             }
+            indent();
+            generateVarDecl(*varDecl, true);
             code << ";\n";
         } else if (auto heat = dynamic_cast<const HeatStmt*>(&stmt)) {
             indent();
@@ -118,14 +1310,24 @@ class CodeGenerator {
             generateExpr(*heat->expr);
             code << ";\n";
         } else if (auto beep = dynamic_cast<const BeepStmt*>(&stmt)) {
+            std::string type = exprType(*beep->expr);
             indent();
-            code << "printf(\"%s\\n\", ";
+            if (type == "float") code << "mw_beep_float(";
+            else if (type == "bool") code << "mw_beep_bool(";
+            else if (type == "string") code << "mw_beep_str(";
+            else code << "mw_beep_int(";
             generateExpr(*beep->expr);
             code << ");\n";
         } else if (auto defrost = dynamic_cast<const DefrostStmt*>(&stmt)) {
             indent();
-            code << defrost->varName << " = 0;\n";
+            code << varRef(defrost->varName) << " = 0;\n";
         } else if (auto ret = dynamic_cast<const ReturnStmt*>(&stmt)) {
+            if (returnTypeSink && ret->expr && returnTypeSink->empty()) *returnTypeSink = exprType(*ret->expr);
+            if (taskFrame) {
+                // The value may read what spawned calls return
+                indent();
+                code << "mw_sync(&mw_tasks);\n";
+            }
             indent();
             code << "return";
             if (ret->expr) {
@@ -142,28 +1344,25 @@ class CodeGenerator {
             indent();
             code << "continue;\n";
         } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(&stmt)) {
+            std::string counter = loopCounter(stmt);
             indent();
             code << "while (";
             generateExpr(*whileStmt->cond);
             code << ") {\n";
-            indentLevel++;
-            for (const auto& s : whileStmt->body) {
-                generateStmt(*s);
-            }
-            indentLevel--;
+            loopDepth++;
+            generateBlock(whileStmt->body, counter);
+            loopDepth--;
             indent();
             code << "}\n";
         } else if (auto forStmt = dynamic_cast<const ForStmt*>(&stmt)) {
+            std::string counter = loopCounter(stmt);
+            pushScope();
             indent();
             code << "for (";
             if (forStmt->init) {
                 // Generate init without indent and newline
                 if (auto varDecl = dynamic_cast<const VarDeclStmt*>(forStmt->init.get())) {
-                    code << typeToC(varDecl->type) << " " << varDecl->name;
-                    if (varDecl->initializer) {
-                        code << " = ";
-                        generateExpr(*varDecl->initializer);
-                    }
+                    generateVarDecl(*varDecl);
                 } else if (auto exprStmt = dynamic_cast<const ExprStmt*>(forStmt->init.get())) {
                     generateExpr(*exprStmt->expr);
                 }
@@ -177,95 +1376,691 @@ class CodeGenerator {
                 generateExpr(*forStmt->update);
             }
             code << ") {\n";
-            indentLevel++;
-            for (const auto& s : forStmt->body) {
-                generateStmt(*s);
-            }
-            indentLevel--;
+            loopDepth++;
+            generateBlock(forStmt->body, counter);
+            loopDepth--;
             indent();
             code << "}\n";
+            popScope();
         } else if (auto timer = dynamic_cast<const TimerStmt*>(&stmt)) {
+            std::string counter = loopCounter(stmt);
             indent();
             code << "for (int __i = 0; __i < ";
             generateExpr(*timer->count);
             code << "; ++__i) {\n";
-            indentLevel++;
-            for (const auto& s : timer->body) {
-                generateStmt(*s);
-            }
-            indentLevel--;
+            pushScope();
+            declare("__i", "int");
+            loopDepth++;
+            generateBlock(timer->body, counter);
+            loopDepth--;
+            popScope();
             indent();
             code << "}\n";
         } else if (auto ifStmt = dynamic_cast<const IfStmt*>(&stmt)) {
+            if (generateSwitch(*ifStmt)) return;
             indent();
             code << "if (";
-            generateExpr(*ifStmt->cond);
-            code << ") {\n";
-            indentLevel++;
-            for (const auto& s : ifStmt->thenBody) {
-                generateStmt(*s);
+            auto branch = branchIds.find(&stmt);
+            std::string expect = branchExpectation(*ifStmt);
+            if (!expect.empty()) code << expect << "(";
+            if (options.instrument && branch != branchIds.end()) {
+                code << "mw_prof_branch(" << branch->second << ", ";
+                generateExpr(*ifStmt->cond);
+                code << ")";
+            } else {
+                generateExpr(*ifStmt->cond);
             }
-            indentLevel--;
+            if (!expect.empty()) code << ")";
+            code << ") {\n";
+            generateBlock(ifStmt->thenBody);
             indent();
             code << "}";
             if (!ifStmt->elseBody.empty()) {
                 code << " else {\n";
-                indentLevel++;
-                for (const auto& s : ifStmt->elseBody) {
-                    generateStmt(*s);
-                }
-                indentLevel--;
+                generateBlock(ifStmt->elseBody);
                 indent();
                 code << "}";
             }
             code << "\n";
         } else if (auto expr = dynamic_cast<const ExprStmt*>(&stmt)) {
+            auto bin = dynamic_cast<const BinaryExpr*>(expr->expr.get());
+            auto assigned = bin && bin->op == "=" ? dynamic_cast<const SpawnExpr*>(bin->right.get()) : nullptr;
+            auto spawn = dynamic_cast<const SpawnExpr*>(expr->expr.get());
+            if (tasks && (spawn || assigned)) {
+                generateSpawn(spawn ? *spawn : *assigned, spawn ? nullptr : bin->left.get());
+                return;
+            }
             indent();
             generateExpr(*expr->expr);
             code << ";\n";
+        } else if (dynamic_cast<const SyncStmt*>(&stmt)) {
+            if (taskFrame) {
+                indent();
+                code << "mw_sync(&mw_tasks);\n";
+            }
         }
     }
     
+    // spawn f(args), storing the result through target if there is one. The task is a struct
+    // emitted ahead of the function: the arguments, evaluated now, and where the result goes.
+    // It lives on the stack until the function returns, or on the heap until the next sync when
+    // the spawn sits in a loop.
+    void generateSpawn(const SpawnExpr& spawn, const Expr* target) {
+        const CallExpr& call = *spawn.call;
+        const std::string& name = static_cast<const VarExpr&>(*call.function).name;
+        const Function* fn = functionNamed(name);
+        if (!fn || lambdaOf(lookupType(name))) {
+            throw std::runtime_error("line " + std::to_string(spawn.line) + ": spawn needs a mode function; '" +
+                                     name + "' is not one");
+        }
+        if (fn->name == "main") throw std::runtime_error("line " + std::to_string(spawn.line) + ": main cannot be spawned");
+        if (call.args.size() != fn->params.size()) {
+            throw std::runtime_error("line " + std::to_string(spawn.line) + ": '" + name + "' expects " +
+                                     std::to_string(fn->params.size()) + " arguments");
+        }
+        if (target && fn->returnType == "void") {
+            throw std::runtime_error("line " + std::to_string(spawn.line) + ": '" + name + "' returns nothing");
+        }
+        
+        std::string task = "mw_spawn_" + std::to_string(spawnCounter++);
+        hoisted << functionSignature(*fn) << ";\n";
+        hoisted << "struct " << task << " {\n    mw_task task;\n";
+        if (target) hoisted << "    " << typeToC(exprType(*target)) << "* result;\n";
+        for (size_t i = 0; i < fn->params.size(); ++i) {
+            hoisted << "    " << typeToC(fn->params[i].type) << " a" << i << ";\n";
+            if (fn->params[i].type == "string") hoisted << "    char a" << i << "_copy[sizeof temp_str];\n";
+        }
+        hoisted << "};\n";
+        hoisted << "static void " << task << "_run(mw_task* t) {\n";
+        hoisted << "    struct " << task << "* s = (struct " << task << "*)t;\n    ";
+        bool keepString = target && fn->returnType == "string";
+        if (target) hoisted << "*s->result = " << (keepString ? "mw_task_result_str(" : "");
+        hoisted << name << "(";
+        for (size_t i = 0; i < fn->params.size(); ++i) hoisted << (i > 0 ? ", " : "") << "s->a" << i;
+        hoisted << (keepString ? "));\n" : ");\n") << "}\n\n";
+        
+        indent();
+        code << "{\n";
+        indentLevel++;
+        indent();
+        code << "struct " << task << "* mw_t = (struct " << task << "*)";
+        if (loopDepth > 0) code << "mw_task_new(&mw_tasks, sizeof(struct " << task << "));\n";
+        else code << "__builtin_alloca(sizeof(struct " << task << "));\n";
+        indent();
+        code << "mw_t->task.run = " << task << "_run;\n";
+        if (target) {
+            indent();
+            code << "mw_t->result = &";
+            generateExpr(*target);
+            code << ";\n";
+        }
+        for (size_t i = 0; i < call.args.size(); ++i) {
+            const std::string& type = fn->params[i].type;
+            bool copied = type == "string";
+            indent();
+            code << "mw_t->a" << i << " = " << (copied ? "mw_task_str(" : "");
+            auto lit = dynamic_cast<const ArrayLiteralExpr*>(call.args[i].get());
+            if (lit && isArrayType(type)) generateArrayLiteral(*lit, type);
+            else if (isArrayType(type)) generateArrayView(*call.args[i], type);
+            else generateExpr(*call.args[i]);
+            if (copied) code << ", mw_t->a" << i << "_copy)";
+            code << ";\n";
+        }
+        indent();
+        code << "mw_spawn(&mw_tasks, &mw_t->task);\n";
+        indentLevel--;
+        indent();
+        code << "}\n";
+    }
+    
+    // An if/else-if chain testing one int expression against constants, emitted as a switch so
+    // that the C compiler can dispatch through a jump table; false if the chain does not qualify
+    bool generateSwitch(const IfStmt& first) {
+        if (options.instrument) return false;   // per-branch counters need the ifs
+        const Expr* subject = nullptr;
+        std::vector<SwitchCase> cases;
+        std::unordered_set<long long> seen;
+        const std::vector<std::unique_ptr<Stmt>>* rest = nullptr;
+        size_t links = 0;
+        for (const IfStmt* link = &first; link; ++links) {
+            std::vector<long long> values;
+            if (!caseValues(*link->cond, subject, values) || breaksOut(link->thenBody)) break;
+            // The first link testing a value wins, so later repeats are dropped
+            SwitchCase arm{{}, &link->thenBody};
+            for (long long v : values) {
+                if (seen.insert(v).second) arm.values.push_back(v);
+            }
+            if (!arm.values.empty()) cases.push_back(arm);
+            rest = &link->elseBody;
+            link = rest->size() == 1 ? dynamic_cast<const IfStmt*>(rest->front().get()) : nullptr;
+        }
+        if (links < minSwitchCases || cases.size() < 2 || breaksOut(*rest)) return false;
+
+        indent();
+        code << "switch (";
+        generateExpr(*subject);
+        code << ") {\n";
+        for (const auto& arm : cases) {
+            indent();
+            for (size_t i = 0; i < arm.values.size(); ++i) {
+                if (i > 0 && i % 8 == 0) {
+                    code << "\n";
+                    indent();
+                } else if (i > 0) {
+                    code << " ";
+                }
+                code << "case " << arm.values[i] << ":";
+            }
+            code << " {\n";
+            generateCaseBody(*arm.body);
+        }
+        if (!rest->empty()) {
+            indent();
+            code << "default: {\n";
+            generateCaseBody(*rest);
+        }
+        indent();
+        code << "}\n";
+        return true;
+    }
+
+    void generateCaseBody(const std::vector<std::unique_ptr<Stmt>>& body) {
+        generateBlock(body);
+        const Stmt* last = body.empty() ? nullptr : body.back().get();
+        if (!dynamic_cast<const ReturnStmt*>(last) && !dynamic_cast<const ContinueStmt*>(last)) {
+            indentLevel++;
+            indent();
+            code << "break;\n";
+            indentLevel--;
+        }
+        indent();
+        code << "}\n";
+    }
+
+    // The values of an int expression for which cond holds, when cond compares only that
+    // expression with constants: ==, ranges such as x >= 1 && x <= 8, and || of those.
+    // subject is set by the first comparison and must match in every later one.
+    bool caseValues(const Expr& cond, const Expr*& subject, std::vector<long long>& values) {
+        auto bin = dynamic_cast<const BinaryExpr*>(&cond);
+        if (!bin) return false;
+        if (bin->op == "||") return caseValues(*bin->left, subject, values) && caseValues(*bin->right, subject, values);
+        if (bin->op == "==") {
+            long long value;
+            const Expr* side = intConstant(*bin->right, value) ? bin->left.get() :
+                               intConstant(*bin->left, value) ? bin->right.get() : nullptr;
+            if (!side || !matchSubject(*side, subject)) return false;
+            values.push_back(value);
+            return true;
+        }
+        if (bin->op == "&&") {
+            long long lo = LLONG_MIN, hi = LLONG_MAX;
+            if (!rangeBound(*bin->left, subject, lo, hi) || !rangeBound(*bin->right, subject, lo, hi)) return false;
+            if (lo == LLONG_MIN || hi == LLONG_MAX || hi - lo >= maxRangeLabels) return false;
+            for (long long v = lo; v <= hi; ++v) values.push_back(v);
+            return true;
+        }
+        return false;
+    }
+
+    // One side of a range test: x >= c, x > c, c <= x, c < x, or an upper bound likewise
+    bool rangeBound(const Expr& cond, const Expr*& subject, long long& lo, long long& hi) {
+        auto bin = dynamic_cast<const BinaryExpr*>(&cond);
+        if (!bin || (bin->op != "<" && bin->op != "<=" && bin->op != ">" && bin->op != ">=")) return false;
+        long long value;
+        std::string op = bin->op;
+        const Expr* side;
+        if (intConstant(*bin->right, value)) {
+            side = bin->left.get();
+        } else if (intConstant(*bin->left, value)) {
+            side = bin->right.get();
+            op = op[0] == '<' ? ">" + op.substr(1) : "<" + op.substr(1);   // c < x is x > c
+        } else {
+            return false;
+        }
+        if (!matchSubject(*side, subject)) return false;
+        if (op[0] == '>') {
+            if (lo != LLONG_MIN) return false;
+            lo = op == ">" ? value + 1 : value;
+        } else {
+            if (hi != LLONG_MAX) return false;
+            hi = op == "<" ? value - 1 : value;
+        }
+        return true;
+    }
+
+    bool matchSubject(const Expr& expr, const Expr*& subject) {
+        if (subject) return sameReadOnlyExpr(expr, *subject);
+        if (!sameReadOnlyExpr(expr, expr) || exprType(expr) != "int") return false;
+        subject = &expr;
+        return true;
+    }
+
+    // MW_LIKELY/MW_UNLIKELY for if conditions the profile shows to be strongly biased
+    std::string branchExpectation(const IfStmt& ifStmt) {
+        if (!options.profile || !currentFunction) return "";
+        auto found = options.profile->branches.find({currentFunction->name, ifStmt.line});
+        if (found == options.profile->branches.end() || found->second.evals < expectMinEvals) return "";
+        double ratio = static_cast<double>(found->second.taken) / found->second.evals;
+        std::string expect;
+        if (ratio >= expectBias) expect = "MW_LIKELY";
+        else if (ratio <= 1.0 - expectBias) expect = "MW_UNLIKELY";
+        if (!expect.empty()) {
+            note("expect: " + currentFunction->name + " line " + std::to_string(ifStmt.line) + " " +
+                 (expect == "MW_LIKELY" ? "likely" : "unlikely") + " (taken " +
+                 std::to_string(found->second.taken) + " of " + std::to_string(found->second.evals) + ")");
+        }
+        return expect;
+    }
+    
+    void note(const std::string& decision) {
+        if (options.profileDecisions) options.profileDecisions->push_back(decision);
+    }
+    
+    // Order functions hot-first and pick hot/cold/inline qualifiers from the profile
+    std::vector<const Function*> applyProfile(const Program& program) {
+        std::vector<const Function*> order;
+        for (const auto& func : program.functions) order.push_back(func.get());
+        if (!options.profile) return order;
+        
+        const auto& stats = options.profile->functions;
+        auto weight = [&](const Function* func) {
+            auto found = stats.find(func->name);
+            if (found == stats.end()) return 0ULL;
+            return found->second.ticks ? found->second.ticks : found->second.calls;
+        };
+        unsigned long long hottest = 0;
+        for (const Function* func : order) hottest = std::max(hottest, weight(func));
+        
+        std::vector<const Function*> sorted = order;
+        std::stable_sort(sorted.begin(), sorted.end(), [&](const Function* a, const Function* b) {
+            return weight(a) > weight(b);
+        });
+        if (sorted != order) {
+            std::string line = "order:";
+            for (const Function* func : sorted) line += " " + func->name;
+            note(line);
+        }
+        
+        for (const Function* func : sorted) {
+            auto found = stats.find(func->name);
+            if (found == stats.end() || func->name == "main") continue;
+            const FunctionProfile& fp = found->second;
+            if (fp.calls == 0) {
+                qualifiers[func] = "MW_COLD ";
+                note("cold: " + func->name + " (never called)");
+                continue;
+            }
+            if (hottest == 0 || weight(func) < hotShare * hottest) continue;
+            
+            int stmts = 0;
+            bool recursive = false;
+            for (const auto& stmt : func->body) {
+                walkStmt(*stmt, [&](const Stmt&) { ++stmts; }, [&](const Expr& e) {
+                    auto call = dynamic_cast<const CallExpr*>(&e);
+                    auto callee = call ? dynamic_cast<const VarExpr*>(call->function.get()) : nullptr;
+                    if (callee && callee->name == func->name) recursive = true;
+                });
+            }
+            std::string why = "(calls " + std::to_string(fp.calls) + ", " +
+                              std::to_string(100 * weight(func) / hottest) + "% of hottest)";
+            if (fp.calls >= inlineMinCalls && stmts <= inlineMaxStmts && !recursive) {
+                qualifiers[func] = "static inline MW_HOT ";
+                note("inline: " + func->name + " " + why);
+            } else {
+                qualifiers[func] = "MW_HOT ";
+                note("hot: " + func->name + " " + why);
+            }
+        }
+        return sorted;
+    }
+    
+    std::string functionSignature(const Function& func) {
+        if (func.name == "main") return "int main()";
+        auto qualifier = qualifiers.find(&func);
+        std::string sig = qualifier != qualifiers.end() ? qualifier->second : "";
+        // Internal linkage lets the C compiler inline, clone or drop any function; unused ones are not errors
+        if (options.wholeProgram && sig.compare(0, 7, "static ") != 0) sig = "static MW_UNUSED " + sig;
+        sig += typeToC(func.returnType) + " " + func.name + "(";
+        for (size_t i = 0; i < func.params.size(); ++i) {
+            if (i > 0) sig += ", ";
+            sig += typeToC(func.params[i].type) + " " + func.params[i].name;
+        }
+        return sig + ")";
+    }
+    
+    // popcorn functions must be pure and keyed on scalar arguments
+    void checkMemoizable(const Function& func, const Program& program) {
+        if (func.name == "main") throw std::runtime_error("popcorn cannot memoize main");
+        if (func.returnType == "void" || isArrayType(func.returnType) || isMapType(func.returnType)) {
+            throw std::runtime_error("popcorn function '" + func.name + "' must return a scalar or string");
+        }
+        for (const auto& param : func.params) {
+            if (param.type != "int" && param.type != "float" && param.type != "bool" && param.type != "auto") {
+                throw std::runtime_error("popcorn function '" + func.name + "' has " + param.type +
+                                         " parameter '" + param.name + "'; cache keys must be int, float or bool");
+            }
+        }
+        std::string reason = impurityReason(func, program);
+        if (!reason.empty()) {
+            throw std::runtime_error("popcorn function '" + func.name + "' is not pure: it " + reason);
+        }
+    }
+    
+    static int memoCapacityOf(const Function& func, int fallback) {
+        int requested = func.memoCapacity > 0 ? func.memoCapacity : fallback;
+        int capacity = 16;
+        while (capacity < requested && capacity < (1 << 26)) capacity *= 2;
+        return capacity;
+    }
+    
+    std::string memoBits(const std::string& type, const std::string& value) {
+        return (type == "float" ? "mw_memo_bits_float(" : "mw_memo_bits_int(") + value + ")";
+    }
+    
+    // Cache table ahead of the body, which is renamed <name>__impl
+    void generateMemoTable(const Function& func) {
+        std::string entry = "mw_memo_" + func.name + "_entry";
+        code << functionSignature(func) << ";\n";
+        code << "typedef struct { unsigned long long hash; ";
+        for (size_t i = 0; i < func.params.size(); ++i) code << typeToC(func.params[i].type) << " a" << i << "; ";
+        code << typeToC(func.returnType) << " value; unsigned char used; } " << entry << ";\n";
+        // One cache per thread when tasks run in parallel, so entries are never half written
+        std::string storage = tasks ? "static _Thread_local " : "static ";
+        code << storage << entry << " mw_memo_" << func.name << "[" << memoCapacityOf(func, options.memoCapacity) << "];\n";
+        code << storage << "unsigned mw_memo_" << func.name << "_clock;\n";
+        std::string sig = "static " + typeToC(func.returnType) + " " + func.name + "__impl(";
+        for (size_t i = 0; i < func.params.size(); ++i) {
+            if (i > 0) sig += ", ";
+            sig += typeToC(func.params[i].type) + " " + func.params[i].name;
+        }
+        code << sig << ")";
+    }
+    
+    // Probe a bounded window from the key's home slot; when it is full, evict round-robin
+    void generateMemoWrapper(const Function& func) {
+        std::string table = "mw_memo_" + func.name, entry = table + "_entry";
+        std::string mask = std::to_string(memoCapacityOf(func, options.memoCapacity) - 1);
+        code << functionSignature(func) << " {\n";
+        code << "    unsigned long long h = 0;\n";
+        for (const auto& param : func.params) {
+            code << "    h = mw_memo_mix(h, " << memoBits(param.type, param.name) << ");\n";
+        }
+        code << "    size_t home = (size_t)h & " << mask << ";\n";
+        code << "    for (size_t probe = 0; probe < MW_MEMO_PROBES; ++probe) {\n";
+        code << "        " << entry << "* e = &" << table << "[(home + probe) & " << mask << "];\n";
+        code << "        if (!e->used) break;\n";
+        code << "        if (e->hash == h";
+        for (size_t i = 0; i < func.params.size(); ++i) {
+            const Parameter& param = func.params[i];
+            code << " && " << memoBits(param.type, "e->a" + std::to_string(i)) << " == " << memoBits(param.type, param.name);
+        }
+        code << ") return e->value;\n";
+        code << "    }\n";
+        code << "    " << typeToC(func.returnType) << " value = " << func.name << "__impl(";
+        for (size_t i = 0; i < func.params.size(); ++i) code << (i > 0 ? ", " : "") << func.params[i].name;
+        code << ");\n";
+        code << "    " << entry << "* slot = &" << table << "[(home + " << table << "_clock++ % MW_MEMO_PROBES) & " << mask << "];\n";
+        code << "    for (size_t probe = 0; probe < MW_MEMO_PROBES; ++probe) {\n";
+        code << "        " << entry << "* e = &" << table << "[(home + probe) & " << mask << "];\n";
+        code << "        if (!e->used) { slot = e; break; }\n";
+        code << "    }\n";
+        code << "    slot->hash = h;\n";
+        for (size_t i = 0; i < func.params.size(); ++i) code << "    slot->a" << i << " = " << func.params[i].name << ";\n";
+        code << "    slot->value = value;\n";
+        code << "    slot->used = 1;\n";
+        code << "    return value;\n";
+        code << "}\n\n";
+    }
+    
+    // Number every function, loop and branch, then emit the counter tables and the profiling runtime
+    void generateProfileRuntime(const Program& program) {
+        std::vector<const Stmt*> loops, branches;
+        std::vector<int> loopFuncs, branchFuncs;
+        for (size_t i = 0; i < program.functions.size(); ++i) {
+            functionIds[program.functions[i].get()] = static_cast<int>(i);
+            for (const auto& stmt : program.functions[i]->body) {
+                walkStmt(*stmt, [&](const Stmt& s) {
+                    if (dynamic_cast<const WhileStmt*>(&s) || dynamic_cast<const ForStmt*>(&s) ||
+                        dynamic_cast<const TimerStmt*>(&s)) {
+                        loopIds[&s] = static_cast<int>(loops.size());
+                        loops.push_back(&s);
+                        loopFuncs.push_back(static_cast<int>(i));
+                    } else if (dynamic_cast<const IfStmt*>(&s)) {
+                        branchIds[&s] = static_cast<int>(branches.size());
+                        branches.push_back(&s);
+                        branchFuncs.push_back(static_cast<int>(i));
+                    }
+                }, nullptr);
+            }
+        }
+        
+        // Tables get one spare slot so that empty programs still declare valid arrays
+        size_t nfuncs = program.functions.size(), nloops = loops.size(), nbranches = branches.size();
+        code << "#define MW_PROF_FUNCS " << nfuncs << "\n";
+        code << "#define MW_PROF_LOOPS " << nloops << "\n";
+        code << "#define MW_PROF_BRANCHES " << nbranches << "\n";
+        code << "static const char mw_prof_source[] = " << cString(options.sourceName) << ";\n";
+        code << "static unsigned long long mw_prof_calls[" << nfuncs + 1 << "], mw_prof_ticks[" << nfuncs + 1 << "];\n";
+        code << "static int mw_prof_depth[" << nfuncs + 1 << "];\n";
+        code << "static unsigned long long mw_prof_entries[" << nloops + 1 << "], mw_prof_iters[" << nloops + 1 << "];\n";
+        code << "static const char* const mw_prof_func_names[] = {";
+        for (const auto& func : program.functions) code << " " << cString(func->name) << ",";
+        code << " \"\" };\n";
+        code << "static const int mw_prof_func_lines[] = {";
+        for (const auto& func : program.functions) code << " " << func->line << ",";
+        code << " 0 };\n";
+        code << "static const char* const mw_prof_loop_kinds[] = {";
+        for (const Stmt* loop : loops) {
+            code << (dynamic_cast<const WhileStmt*>(loop) ? " \"while\"," :
+                     dynamic_cast<const ForStmt*>(loop) ? " \"for\"," : " \"timer\",");
+        }
+        code << " \"\" };\n";
+        code << "static const int mw_prof_loop_lines[] = {";
+        for (const Stmt* loop : loops) code << " " << loop->line << ",";
+        code << " 0 };\n";
+        code << "static const int mw_prof_loop_funcs[] = {";
+        for (int f : loopFuncs) code << " " << f << ",";
+        code << " 0 };\n";
+        code << "static unsigned long long mw_prof_evals[" << nbranches + 1 << "], mw_prof_taken[" << nbranches + 1 << "];\n";
+        code << "static const int mw_prof_branch_lines[] = {";
+        for (const Stmt* branch : branches) code << " " << branch->line << ",";
+        code << " 0 };\n";
+        code << "static const int mw_prof_branch_funcs[] = {";
+        for (int f : branchFuncs) code << " " << f << ",";
+        code << " 0 };\n\n";
+        code << profileRuntimeC;
+    }
+    
+    // Emit the array runtime only for the element types the program actually uses, and the map
+    // runtime for its map types. keys() and values() return arrays, so a map uses the arrays of
+    // its key and value types.
+    void generateArrayRuntime(const Program& program) {
+        std::unordered_set<std::string> used;
+        std::set<std::string> maps;
+        auto noteType = [&](const std::string& type) {
+            if (isArrayType(type)) used.insert(elementType(type));
+            if (isMapType(type)) {
+                maps.insert(type);
+                used.insert(mapKeyType(type));
+                used.insert(mapValueType(type));
+            }
+        };
+        for (const auto& func : program.functions) {
+            noteType(func->returnType);
+            for (const auto& param : func->params) noteType(param.type);
+            for (const auto& stmt : func->body) {
+                walkStmt(*stmt, [&](const Stmt& s) {
+                    if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&s)) noteType(varDecl->type);
+                }, [&](const Expr& e) {
+                    if (auto lit = dynamic_cast<const ArrayLiteralExpr*>(&e)) used.insert(literalElementType(*lit));
+                });
+            }
+        }
+        if (used.empty()) return;
+        
+        code << arrayRuntimeC;
+        for (const char* elem : {"int", "float", "bool", "string"}) {
+            if (!used.count(elem)) continue;
+            code << "MW_DEFINE_ARRAY(" << elem << ", " << typeToC(elem) << ")\n";
+            arrayRuntimes.insert(elem);
+        }
+        code << "\n";
+        if (maps.empty()) return;
+        
+        code << mapRuntimeC;
+        for (const auto& type : maps) {
+            std::string key = mapKeyType(type), value = mapValueType(type);
+            code << "MW_DEFINE_MAP(" << key << ", " << value << ", " << typeToC(key) << ", " << typeToC(value) << ")\n";
+        }
+        code << "\n";
+    }
+    
 public:
-    std::string generate(const Program& program) {
+    CodeGenerator(const CodegenOptions& opts, int fd = -1) : code(fd), options(opts) {}
+    
+    void generate(const Program& program) {
+        this->program = &program;
+        for (const auto& func : program.functions) {
+            functions[func->name] = func.get();
+        }
+        
+        for (const auto& func : program.functions) {
+            if (spawnsIn(*func) && !options.instrument) tasks = true;   // per-function counters stay single-threaded
+        }
+        if (options.lineFlush) code << "#define MW_LINE_FLUSH 1\n";
+        if (tasks) code << "#define MW_THREADS 1\n";
         code << "#include <stdio.h>\n";
         code << "#include <math.h>\n";
         code << "#include <string.h>\n\n";
-        code << "char temp_str[256];\n";
-        code << "int heat = 0;\n";
+        code << "#if defined(__GNUC__)\n"
+                "#define MW_UNUSED __attribute__((unused))\n"
+                "#define MW_HOT __attribute__((hot))\n"
+                "#define MW_COLD __attribute__((cold, noinline))\n"
+                "#define MW_LIKELY(x) __builtin_expect(!!(x), 1)\n"
+                "#define MW_UNLIKELY(x) __builtin_expect(!!(x), 0)\n"
+                "#else\n"
+                "#define MW_UNUSED\n"
+                "#define MW_HOT\n"
+                "#define MW_COLD\n"
+                "#define MW_LIKELY(x) (x)\n"
+                "#define MW_UNLIKELY(x) (x)\n"
+                "#endif\n\n";
+        // Each thread builds strings in its own buffer; heat is shared, so it is atomic
+        code << (tasks ? "_Thread_local char temp_str[256];\n" : "char temp_str[256];\n");
+        code << (tasks ? "_Atomic int heat = 0;\n" : "int heat = 0;\n");
         code << "int door_closed = 1;\n";
         code << "int door_open = 0;\n\n";
-        
+        code << beepRuntimeC;
+        if (tasks) code << taskRuntimeC;
+        generateArrayRuntime(program);
+        if (options.instrument) generateProfileRuntime(program);
+        bool anyMemo = false;
         for (const auto& func : program.functions) {
-            if (func->name == "main") {
-                code << "int main() {\n";
+            if (!func->memoized) continue;
+            checkMemoizable(*func, program);
+            anyMemo = true;
+        }
+        if (anyMemo) code << memoRuntimeC;
+        
+        std::vector<const Function*> order = applyProfile(program);
+        if (options.profile || options.wholeProgram) {
+            // Definitions need not follow call order (hot-first, merged inputs), so declare everything up front
+            for (const Function* func : order) {
+                if (func->name != "main") code << functionSignature(*func) << ";\n";
+            }
+            code << "\n";
+        }
+        
+        for (const Function* func : order) {
+            // Generate the function aside so the lambdas it defines can be emitted first
+            CodeWriter funcCode;
+            std::swap(code, funcCode);
+            currentFunction = func;
+            taskFrame = tasks && spawnsIn(*func);
+            currentSource = func->sourceName.empty() ? options.sourceName : func->sourceName;
+            sourceLine(code, func->line);
+            
+            if (func->memoized) {
+                generateMemoTable(*func);
+                code << " {\n";
             } else {
-                code << typeToC(func->returnType) << " " << func->name << "(";
-                for (size_t i = 0; i < func->params.size(); ++i) {
-                    if (i > 0) code << ", ";
-                    code << typeToC(func->params[i].type) << " " << func->params[i].name;
-                }
-                code << ") {\n";
+                code << functionSignature(*func) << " {\n";
             }
             
-            indentLevel++;
-            for (const auto& stmt : func->body) {
-                generateStmt(*stmt);
+            pushScope();
+            for (const auto& param : func->params) {
+                declare(param.name, param.type);
             }
-            indentLevel--;
+            if (func->name == "main") {
+                indentLevel++;
+                indent();
+                code << "mw_out_init();\n";
+                if (tasks) {
+                    indent();
+                    code << "mw_tasks_init();\n";
+                }
+                if (options.instrument) {
+                    indent();
+                    code << "atexit(mw_prof_dump);\n";
+                }
+                indentLevel--;
+            }
+            std::string prologue;
+            if (options.instrument) {
+                // The cleanup attribute closes the frame on every return path
+                prologue = "mw_prof_frame __mw_frame __attribute__((cleanup(mw_prof_leave))) = mw_prof_enter(" +
+                           std::to_string(functionIds[func]) + ");";
+            }
+            if (taskFrame) {
+                // Leaving the function by any path waits for what it spawned
+                prologue = "mw_frame mw_tasks __attribute__((cleanup(mw_sync))); mw_frame_enter(&mw_tasks);";
+            }
+            std::vector<std::pair<std::string, std::string>> params;
+            for (const auto& param : func->params) params.emplace_back(param.name, param.type);
+            std::string views = paramViews(params);
+            if (!views.empty()) prologue += (prologue.empty() ? "" : " ") + views;
+            generateBlock(func->body, prologue);
+            popScope();
             
             if (func->name == "main") {
                 indent();
                 code << "return 0;\n";
             }
-            code << "}\n\n";
+            code << "}\n";
+            generatedLines(code);
+            code << "\n";
+            if (func->memoized) generateMemoWrapper(*func);
+            
+            std::swap(code, funcCode);
+            code.splice(hoisted);
+            code.splice(funcCode);
         }
-        
-        return code.str();
+        code.finish();
     }
+    
+    std::string text() const { return code.str(); }
 };
 
-std::string generateC(const Program& program) {
-    CodeGenerator gen;
-    return gen.generate(program);
+bool usesTasks(const Program& program) {
+    for (const auto& func : program.functions) {
+        bool spawns = false;
+        for (const auto& stmt : func->body) {
+            walkStmt(*stmt, nullptr, [&](const Expr& e) {
+                if (dynamic_cast<const SpawnExpr*>(&e)) spawns = true;
+            });
+        }
+        if (spawns) return true;
+    }
+    return false;
+}
+
+std::string generateC(const Program& program, const CodegenOptions& options) {
+    CodeGenerator gen(options);
+    gen.generate(program);
+    return gen.text();
+}
+
+void writeC(const Program& program, int fd, const CodegenOptions& options) {
+    CodeGenerator gen(options, fd);
+    gen.generate(program);
 }
@@ -1,5 +1,25 @@
 #pragma once
 #include "parser.h"
+#include "profile.h"
 #include <string>
+#include <vector>
 
-std::string generateC(const Program& program);
+struct CodegenOptions {
+    bool lineFlush = false;     // flush beep output at every newline instead of when the buffer fills
+    bool instrument = false;    // count calls, time and loop iterations; dump a profile at exit
+    std::string sourceName;     // .mw file name recorded in profiles and #line directives
+    bool lineDirectives = false; // emit #line so debuggers and profilers report .mw lines
+    std::string outputName = "output.c"; // generated file named when #line hands back to generated code
+    int memoCapacity = 1024;    // default popcorn cache entries (rounded up to a power of two)
+    bool wholeProgram = false;  // one translation unit: prototypes first, every function but main static
+    const Profile* profile = nullptr;                    // --profile-use: order, hot/cold, expect, inline
+    std::vector<std::string>* profileDecisions = nullptr; // receives one line per profile-driven decision
+};
+
+// True if the program spawns tasks; its C then runs threads (build it with -pthread)
+bool usesTasks(const Program& program);
+
+std::string generateC(const Program& program, const CodegenOptions& options = CodegenOptions());
+
+// Streams the same C to fd in fixed-size chunks as functions complete, never holding the whole file
+void writeC(const Program& program, int fd, const CodegenOptions& options = CodegenOptions());
@@ -0,0 +1,697 @@
+#include "consteval.h"
+#include "analysis.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+// Largest array result that is written back as a literal
+static const size_t maxFoldedElements = 4096;
+
+// Thrown when a call cannot be evaluated exactly as the generated C would run it
+struct NotConstant {};
+
+// A value with the C type the generated code gives it: bool is int, and number literals
+// with a decimal point are double until stored into a float
+struct ConstValue {
+    enum Kind { Int, Float, Double, String, Array } kind = Int;
+    int32_t i = 0;
+    double f = 0;           // Float values are always exactly representable as float
+    std::string text;       // String contents, or an Array's element type
+    std::shared_ptr<std::vector<ConstValue>> elements;   // shared until written (see elementsOf)
+};
+
+// Signed overflow is undefined in C, so it ends the evaluation rather than wrapping
+static ConstValue intValue(long long v) {
+    if (v < INT_MIN || v > INT_MAX) throw NotConstant();
+    ConstValue r;
+    r.i = static_cast<int32_t>(v);
+    return r;
+}
+
+static ConstValue floatValue(float v) {
+    ConstValue r;
+    r.kind = ConstValue::Float;
+    r.f = v;
+    return r;
+}
+
+static ConstValue doubleValue(double v) {
+    ConstValue r;
+    r.kind = ConstValue::Double;
+    r.f = v;
+    return r;
+}
+
+static ConstValue arrayValue(const std::string& elementType, std::vector<ConstValue> elements) {
+    ConstValue r;
+    r.kind = ConstValue::Array;
+    r.text = elementType;
+    r.elements = std::make_shared<std::vector<ConstValue>>(std::move(elements));
+    return r;
+}
+
+static bool isArrayType(const std::string& type) {
+    return type.size() > 2 && type.compare(type.size() - 2, 2, "[]") == 0;
+}
+
+static std::string elementType(const std::string& arrayType) {
+    std::string elem = arrayType.substr(0, arrayType.size() - 2);
+    return elem == "auto" ? "int" : elem;
+}
+
+// Element type of an array literal, judged from its elements alone (as codegen does)
+static std::string literalElementType(const ArrayLiteralExpr& lit) {
+    for (const auto& e : lit.elements) {
+        if (auto num = dynamic_cast<const NumberExpr*>(e.get())) {
+            if (num->value.find('.') != std::string::npos) return "float";
+        } else if (dynamic_cast<const StringExpr*>(e.get())) {
+            return "string";
+        } else if (dynamic_cast<const BoolExpr*>(e.get())) {
+            return "bool";
+        }
+    }
+    return "int";
+}
+
+static bool truthy(const ConstValue& v) {
+    if (v.kind == ConstValue::Int) return v.i != 0;
+    if (v.kind == ConstValue::Float || v.kind == ConstValue::Double) return v.f != 0;
+    throw NotConstant();
+}
+
+// C conversion on storing into a Microwave type (auto and bool are int)
+static ConstValue convert(const ConstValue& v, const std::string& type) {
+    if (isArrayType(type)) {
+        if (v.kind != ConstValue::Array || v.text != elementType(type)) throw NotConstant();
+        return v;
+    }
+    if (type == "string") {
+        if (v.kind != ConstValue::String) throw NotConstant();
+        return v;
+    }
+    if (v.kind == ConstValue::String || v.kind == ConstValue::Array) throw NotConstant();
+    if (type == "float") return floatValue(v.kind == ConstValue::Int ? static_cast<float>(v.i) : static_cast<float>(v.f));
+    if (type != "int" && type != "bool" && type != "auto") throw NotConstant();
+    if (v.kind == ConstValue::Int) return v;
+    // Converting an out-of-range float to int is undefined
+    if (!(v.f > -2147483649.0 && v.f < 2147483648.0)) throw NotConstant();
+    return intValue(static_cast<long long>(v.f));
+}
+
+// A binary operator after C's usual arithmetic conversions (int, then float, then double)
+static ConstValue arithmetic(const std::string& op, const ConstValue& a, const ConstValue& b) {
+    // Strings are pointers and arrays are structs in the generated C
+    if (a.kind > ConstValue::Double || b.kind > ConstValue::Double) throw NotConstant();
+    ConstValue::Kind kind = std::max(a.kind, b.kind);
+    auto operand = [&](const ConstValue& v) -> double {
+        if (v.kind != ConstValue::Int) return v.f;
+        return kind == ConstValue::Float ? static_cast<float>(v.i) : static_cast<double>(v.i);
+    };
+
+    if (op == "==" || op == "!=" || op == "<" || op == ">" || op == "<=" || op == ">=") {
+        double x = operand(a), y = operand(b);
+        bool r = op == "==" ? x == y : op == "!=" ? x != y : op == "<" ? x < y :
+                 op == ">" ? x > y : op == "<=" ? x <= y : x >= y;
+        return intValue(r);
+    }
+    if (kind == ConstValue::Int) {
+        long long x = a.i, y = b.i;
+        if (op == "+") return intValue(x + y);
+        if (op == "-") return intValue(x - y);
+        if (op == "*") return intValue(x * y);
+        if (op == "/" || op == "%") {
+            if (y == 0 || (x == INT_MIN && y == -1)) throw NotConstant();
+            return intValue(op == "/" ? x / y : x % y);
+        }
+        if (op == "&") return intValue(x & y);
+        if (op == "|") return intValue(x | y);
+        if (op == "^") return intValue(x ^ y);
+        if (op == "<<" || op == ">>") {
+            if (y < 0 || y > 31 || (op == "<<" && x < 0)) throw NotConstant();
+            return intValue(op == "<<" ? x << y : x >> y);
+        }
+    } else if (kind == ConstValue::Float) {
+        float x = static_cast<float>(operand(a)), y = static_cast<float>(operand(b));
+        if (op == "+") return floatValue(x + y);
+        if (op == "-") return floatValue(x - y);
+        if (op == "*") return floatValue(x * y);
+        if (op == "/") return floatValue(x / y);
+    } else {
+        double x = operand(a), y = operand(b);
+        if (op == "+") return doubleValue(x + y);
+        if (op == "-") return doubleValue(x - y);
+        if (op == "*") return doubleValue(x * y);
+        if (op == "/") return doubleValue(x / y);
+    }
+    throw NotConstant(); // % and the bitwise operators take integers only
+}
+
+static ConstValue unaryOp(const std::string& op, const ConstValue& v) {
+    if (v.kind > ConstValue::Double) throw NotConstant();
+    if (op == "!") return intValue(!truthy(v));
+    if (op == "+") return v;
+    if (op == "-") {
+        if (v.kind == ConstValue::Int) return intValue(-static_cast<long long>(v.i));
+        ConstValue r = v;
+        r.f = -v.f;
+        return r;
+    }
+    if (op == "~" && v.kind == ConstValue::Int) return intValue(~static_cast<long long>(v.i));
+    throw NotConstant();
+}
+
+static ConstValue numberValue(const std::string& text) {
+    try {
+        if (text.find('.') != std::string::npos) {
+            double v = std::stod(text);
+            return text.back() == 'f' ? floatValue(static_cast<float>(v)) : doubleValue(v);
+        }
+        // Literals past INT_MAX are long in C
+        return intValue(std::stoll(text));
+    } catch (const std::exception&) {
+        throw NotConstant();
+    }
+}
+
+// Interprets pure functions over the AST with C semantics
+class ConstEvaluator {
+    struct Slot {
+        std::string type;
+        ConstValue value;
+        bool assigned;
+    };
+    enum class Flow { Next, Break, Continue, Return };
+
+    const Program& program;
+    ConstEvalLimits limits;
+    std::unordered_map<std::string, const Function*> functions;
+    std::unordered_map<const Function*, bool> purity;
+    std::unordered_map<std::string, ConstValue> results;   // finished calls, by function and arguments
+    std::unordered_set<std::string> failed;                // calls that failed with the whole budget
+
+    std::vector<std::unordered_map<std::string, Slot>> scopes;
+    ConstValue returned;
+    bool returnedValue = false;
+    long long steps = 0;
+    int depth = 0;
+
+    void step() {
+        if (++steps > limits.steps) throw NotConstant();
+    }
+
+    // Globals and anything else that is not a local of the running function are only known at run time
+    Slot& slot(const std::string& name) {
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(name);
+            if (found != it->end()) return found->second;
+        }
+        throw NotConstant();
+    }
+
+    static bool callKey(const Function& fn, const std::vector<ConstValue>& args, std::string& key) {
+        key = fn.name;
+        for (const auto& arg : args) {
+            if (arg.kind == ConstValue::Array) return false;
+            char buf[48];
+            snprintf(buf, sizeof buf, "|%d:%d:%a:%zu:", static_cast<int>(arg.kind), arg.i, arg.f, arg.text.size());
+            key += buf + arg.text;
+        }
+        return true;
+    }
+
+    ConstValue invoke(const Function& fn, const std::vector<ConstValue>& args) {
+        if (args.size() != fn.params.size()) throw NotConstant();
+        std::vector<ConstValue> params;
+        for (size_t i = 0; i < args.size(); ++i) params.push_back(convert(args[i], fn.params[i].type));
+
+        std::string key;
+        bool cacheable = callKey(fn, params, key);
+        if (cacheable) {
+            auto done = results.find(key);
+            if (done != results.end()) return done->second;
+            if (failed.count(key)) throw NotConstant();
+        }
+        bool wholeBudget = depth == 0 && steps == 0;
+        try {
+            ConstValue value = run(fn, params);
+            if (cacheable) results[key] = value;
+            return value;
+        } catch (const NotConstant&) {
+            if (cacheable && wholeBudget) failed.insert(key);
+            throw;
+        }
+    }
+
+    ConstValue run(const Function& fn, const std::vector<ConstValue>& params) {
+        if (++depth > limits.depth) throw NotConstant();
+        step();
+        auto callerScopes = std::move(scopes);
+        scopes.clear();
+        scopes.emplace_back();
+        for (size_t i = 0; i < params.size(); ++i) {
+            scopes.back()[fn.params[i].name] = {fn.params[i].type, params[i], true};
+        }
+        // Falling off the end of a value-returning function leaves the result undefined
+        if (execBlock(fn.body) != Flow::Return || !returnedValue) throw NotConstant();
+        ConstValue value = convert(returned, fn.returnType);
+        scopes = std::move(callerScopes);
+        --depth;
+        return value;
+    }
+
+    Flow execBlock(const std::vector<std::unique_ptr<Stmt>>& body) {
+        scopes.emplace_back();
+        Flow flow = Flow::Next;
+        for (const auto& stmt : body) {
+            flow = exec(*stmt);
+            if (flow != Flow::Next) break;
+        }
+        scopes.pop_back();
+        return flow;
+    }
+
+    Flow exec(const Stmt& stmt) {
+        step();
+        if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&stmt)) {
+            declare(*varDecl);
+        } else if (auto ret = dynamic_cast<const ReturnStmt*>(&stmt)) {
+            returnedValue = ret->expr != nullptr;
+            if (ret->expr) returned = eval(*ret->expr);
+            return Flow::Return;
+        } else if (dynamic_cast<const BreakStmt*>(&stmt)) {
+            return Flow::Break;
+        } else if (dynamic_cast<const ContinueStmt*>(&stmt)) {
+            return Flow::Continue;
+        } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(&stmt)) {
+            while (true) {
+                step();
+                if (!truthy(eval(*whileStmt->cond))) break;
+                Flow flow = execBlock(whileStmt->body);
+                if (flow == Flow::Break) break;
+                if (flow == Flow::Return) return flow;
+            }
+        } else if (auto forStmt = dynamic_cast<const ForStmt*>(&stmt)) {
+            scopes.emplace_back();
+            Flow flow = execFor(*forStmt);
+            scopes.pop_back();
+            return flow;
+        } else if (auto timer = dynamic_cast<const TimerStmt*>(&stmt)) {
+            // for (int __i = 0; __i < count; ++__i), with count read before every iteration
+            scopes.emplace_back();
+            scopes.back()["__i"] = {"int", intValue(0), true};
+            Flow result = Flow::Next;
+            while (true) {
+                step();
+                ConstValue count = eval(*timer->count);
+                if (!truthy(arithmetic("<", slot("__i").value, count))) break;
+                Flow flow = execBlock(timer->body);
+                if (flow == Flow::Break) break;
+                if (flow == Flow::Return) {
+                    result = flow;
+                    break;
+                }
+                Slot& index = slot("__i");
+                index.value = intValue(index.value.i + 1LL);
+            }
+            scopes.pop_back();
+            return result;
+        } else if (auto ifStmt = dynamic_cast<const IfStmt*>(&stmt)) {
+            return execBlock(truthy(eval(*ifStmt->cond)) ? ifStmt->thenBody : ifStmt->elseBody);
+        } else if (auto expr = dynamic_cast<const ExprStmt*>(&stmt)) {
+            eval(*expr->expr);
+        } else {
+            throw NotConstant(); // heat, beep and defrost reach outside the function
+        }
+        return Flow::Next;
+    }
+
+    Flow execFor(const ForStmt& forStmt) {
+        if (auto varDecl = dynamic_cast<const VarDeclStmt*>(forStmt.init.get())) {
+            declare(*varDecl);
+        } else if (auto exprStmt = dynamic_cast<const ExprStmt*>(forStmt.init.get())) {
+            eval(*exprStmt->expr);
+        }
+        while (true) {
+            step();
+            if (forStmt.cond && !truthy(eval(*forStmt.cond))) break;
+            Flow flow = execBlock(forStmt.body);
+            if (flow == Flow::Break) break;
+            if (flow == Flow::Return) return flow;
+            if (forStmt.update) eval(*forStmt.update);
+        }
+        return Flow::Next;
+    }
+
+    void declare(const VarDeclStmt& varDecl) {
+        Slot declared = {varDecl.type, ConstValue(), false};
+        if (varDecl.initializer) {
+            declared.value = storedValue(*varDecl.initializer, varDecl.type);
+            declared.assigned = true;
+        } else if (isArrayType(varDecl.type)) {
+            declared.value = arrayValue(elementType(varDecl.type), {});
+            declared.assigned = true;
+        }
+        scopes.back()[varDecl.name] = declared;
+    }
+
+    // expr converted for a variable of the given type; array literals take their element type from it
+    ConstValue storedValue(const Expr& expr, const std::string& type) {
+        auto lit = dynamic_cast<const ArrayLiteralExpr*>(&expr);
+        if (lit && isArrayType(type)) return arrayLiteral(*lit, elementType(type));
+        return convert(eval(expr), type);
+    }
+
+    ConstValue arrayLiteral(const ArrayLiteralExpr& lit, const std::string& elemType) {
+        std::vector<ConstValue> elements;
+        for (const auto& e : lit.elements) elements.push_back(convert(eval(*e), elemType));
+        return arrayValue(elemType, std::move(elements));
+    }
+
+    ConstValue eval(const Expr& expr) {
+        if (auto num = dynamic_cast<const NumberExpr*>(&expr)) {
+            return numberValue(num->value);
+        } else if (auto str = dynamic_cast<const StringExpr*>(&expr)) {
+            ConstValue r;
+            r.kind = ConstValue::String;
+            r.text = str->value;
+            return r;
+        } else if (auto boolean = dynamic_cast<const BoolExpr*>(&expr)) {
+            return intValue(boolean->value);
+        } else if (auto var = dynamic_cast<const VarExpr*>(&expr)) {
+            const Slot& found = slot(var->name);
+            if (!found.assigned) throw NotConstant();
+            return found.value;
+        } else if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+            return binary(*bin);
+        } else if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+            if (unary->op == "++" || unary->op == "--") return increment(*unary);
+            return unaryOp(unary->op, eval(*unary->operand));
+        } else if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+            return callValue(*call);
+        } else if (auto spawn = dynamic_cast<const SpawnExpr*>(&expr)) {
+            return callValue(*spawn->call);
+        } else if (auto array = dynamic_cast<const ArrayExpr*>(&expr)) {
+            ConstValue base = eval(*array->base), index = eval(*array->index);
+            if (base.kind != ConstValue::Array || index.kind != ConstValue::Int || index.i < 0 ||
+                static_cast<size_t>(index.i) >= base.elements->size()) {
+                throw NotConstant();
+            }
+            return (*base.elements)[index.i];
+        } else if (auto lit = dynamic_cast<const ArrayLiteralExpr*>(&expr)) {
+            return arrayLiteral(*lit, literalElementType(*lit));
+        }
+        throw NotConstant(); // lambdas
+    }
+
+    ConstValue binary(const BinaryExpr& bin) {
+        const std::string& op = bin.op;
+        if (op == "&&") return intValue(truthy(eval(*bin.left)) && truthy(eval(*bin.right)));
+        if (op == "||") return intValue(truthy(eval(*bin.left)) || truthy(eval(*bin.right)));
+        bool assigns = op.back() == '=' && op != "==" && op != "!=" && op != "<=" && op != ">=";
+        if (!assigns) {
+            ConstValue left = eval(*bin.left);
+            return arithmetic(op, left, eval(*bin.right));
+        }
+
+        // Pure functions only write elements of arrays they created, which nothing else holds
+        if (auto element = dynamic_cast<const ArrayExpr*>(bin.left.get())) {
+            ConstValue index = eval(*element->index);
+            ConstValue right = eval(*bin.right);
+            ConstValue& array = ownArray(*element->base);
+            ConstValue& target = elementOf(array, index);
+            target = convert(op == "=" ? right : arithmetic(op.substr(0, op.size() - 1), target, right), array.text);
+            return target;
+        }
+        auto target = dynamic_cast<const VarExpr*>(bin.left.get());
+        if (!target) throw NotConstant();
+        std::string type = slot(target->name).type;
+        ConstValue value;
+        if (op == "=") {
+            value = storedValue(*bin.right, type);
+        } else {
+            ConstValue right = eval(*bin.right);
+            const Slot& current = slot(target->name);
+            if (!current.assigned) throw NotConstant();
+            value = convert(arithmetic(op.substr(0, op.size() - 1), current.value, right), type);
+        }
+        Slot& assigned = slot(target->name);
+        assigned.value = value;
+        assigned.assigned = true;
+        return value;
+    }
+
+    // An array local about to be written, unshared first so that no other value sees the write
+    ConstValue& ownArray(const Expr& target) {
+        auto var = dynamic_cast<const VarExpr*>(&target);
+        if (!var) throw NotConstant();
+        Slot& s = slot(var->name);
+        if (!s.assigned || s.value.kind != ConstValue::Array) throw NotConstant();
+        if (s.value.elements.use_count() > 1) s.value.elements = std::make_shared<std::vector<ConstValue>>(*s.value.elements);
+        return s.value;
+    }
+
+    static ConstValue& elementOf(ConstValue& array, const ConstValue& index) {
+        if (index.kind != ConstValue::Int || index.i < 0 || static_cast<size_t>(index.i) >= array.elements->size()) {
+            throw NotConstant();
+        }
+        return (*array.elements)[index.i];
+    }
+
+    ConstValue increment(const UnaryExpr& unary) {
+        if (auto element = dynamic_cast<const ArrayExpr*>(unary.operand.get())) {
+            ConstValue index = eval(*element->index);
+            ConstValue& array = ownArray(*element->base);
+            ConstValue& target = elementOf(array, index);
+            ConstValue old = target;
+            target = convert(arithmetic(unary.op == "++" ? "+" : "-", old, intValue(1)), array.text);
+            return unary.isPrefix ? target : old;
+        }
+        auto target = dynamic_cast<const VarExpr*>(unary.operand.get());
+        if (!target) throw NotConstant();
+        Slot& s = slot(target->name);
+        if (!s.assigned) throw NotConstant();
+        ConstValue old = s.value;
+        s.value = convert(arithmetic(unary.op == "++" ? "+" : "-", old, intValue(1)), s.type);
+        return unary.isPrefix ? s.value : old;
+    }
+
+    // slice() bounds are long long in the runtime
+    static long long bound(const ConstValue& v) {
+        if (v.kind == ConstValue::Int) return v.i;
+        if (v.kind == ConstValue::String || v.kind == ConstValue::Array || !(std::fabs(v.f) < 9e18)) throw NotConstant();
+        return static_cast<long long>(v.f);
+    }
+
+    // push, append and fill on an array local; the value is converted as the C call converts it
+    ConstValue mutate(const CallExpr& call, const std::string& name) {
+        if (call.args.size() != 2) throw NotConstant();
+        ConstValue value = eval(*call.args[1]);
+        ConstValue& array = ownArray(*call.args[0]);
+        std::vector<ConstValue>& elements = *array.elements;
+        if (name == "append") {
+            if (value.kind != ConstValue::Array || value.text != array.text) throw NotConstant();
+            std::vector<ConstValue> tail = *value.elements;   // may be the array itself
+            elements.insert(elements.end(), tail.begin(), tail.end());
+        } else if (name == "push") {
+            elements.push_back(convert(value, array.text));
+        } else {
+            std::fill(elements.begin(), elements.end(), convert(value, array.text));
+        }
+        return ConstValue();
+    }
+
+    ConstValue callValue(const CallExpr& call) {
+        auto callee = dynamic_cast<const VarExpr*>(call.function.get());
+        if (!callee) throw NotConstant();
+        if (!functions.count(callee->name) &&
+            (callee->name == "push" || callee->name == "append" || callee->name == "fill")) {
+            return mutate(call, callee->name);
+        }
+        std::vector<ConstValue> args;
+        for (const auto& arg : call.args) args.push_back(eval(*arg));
+        if (functions.count(callee->name)) {
+            const Function* fn = pureFunction(callee->name);
+            if (!fn) throw NotConstant();
+            return invoke(*fn, args);
+        }
+
+        // Array builtins, as codegen picks them: the first argument is an array
+        if (args.empty() || args[0].kind != ConstValue::Array) throw NotConstant();
+        const std::vector<ConstValue>& elements = *args[0].elements;
+        if (callee->name == "len" && args.size() == 1) return intValue(static_cast<long long>(elements.size()));
+        if (callee->name == "copy" && args.size() == 1) return args[0];
+        if (callee->name == "slice" && args.size() == 3) {
+            long long size = static_cast<long long>(elements.size());
+            long long lo = std::max(bound(args[1]), 0LL), hi = std::min(bound(args[2]), size);
+            if (lo >= hi) return arrayValue(args[0].text, {});
+            return arrayValue(args[0].text, std::vector<ConstValue>(elements.begin() + lo, elements.begin() + hi));
+        }
+        throw NotConstant();
+    }
+
+public:
+    ConstEvaluator(const Program& program, const ConstEvalLimits& limits) : program(program), limits(limits) {
+        for (const auto& func : program.functions) functions[func->name] = func.get();
+    }
+
+    // The named function if it is pure and returns a value
+    const Function* pureFunction(const std::string& name) {
+        auto found = functions.find(name);
+        if (found == functions.end() || found->second->returnType == "void") return nullptr;
+        const Function* fn = found->second;
+        auto verdict = purity.find(fn);
+        if (verdict == purity.end()) verdict = purity.emplace(fn, impurityReason(*fn, program).empty()).first;
+        return verdict->second ? fn : nullptr;
+    }
+
+    // Runs the call with a fresh budget; false if its value cannot be known exactly
+    bool evaluate(const CallExpr& call, ConstValue& value) {
+        scopes.clear();
+        steps = 0;
+        depth = 0;
+        try {
+            value = callValue(call);
+            return true;
+        } catch (const NotConstant&) {
+            return false;
+        }
+    }
+};
+
+// The literal that reproduces v where the generated C expects the given type, or null if none does
+static std::unique_ptr<Expr> literalFor(const ConstValue& v, const std::string& type) {
+    if (isArrayType(type)) {
+        std::string elem = elementType(type);
+        if (v.elements->size() > maxFoldedElements) return nullptr;
+        // An empty literal reads as int[] wherever its type is judged from its elements
+        if (v.elements->empty() && elem != "int") return nullptr;
+        auto lit = std::make_unique<ArrayLiteralExpr>();
+        for (const auto& element : *v.elements) {
+            auto e = literalFor(element, elem);
+            if (!e) return nullptr;
+            lit->elements.push_back(std::move(e));
+        }
+        return lit;
+    }
+    if (type == "string") return std::make_unique<StringExpr>(v.text);
+    if (type == "bool") {
+        if (v.i != 0 && v.i != 1) return nullptr;
+        return std::make_unique<BoolExpr>(v.i != 0);
+    }
+    if (type == "float") {
+        if (!std::isfinite(v.f)) return nullptr;
+        // Seventeen digits name the float exactly, whether read as a float (the suffix) or a double
+        char buf[40];
+        snprintf(buf, sizeof buf, "%.17g", v.f);
+        std::string text = buf;
+        if (text.find('.') == std::string::npos) {
+            size_t exponent = text.find('e');
+            text.insert(exponent == std::string::npos ? text.size() : exponent, ".0");
+        }
+        return std::make_unique<NumberExpr>(text + "f");
+    }
+    // -2147483648 is not an int literal in C
+    if (v.i == INT_MIN) return nullptr;
+    return std::make_unique<NumberExpr>(std::to_string(v.i));
+}
+
+// Rewrites the AST in place, innermost calls first so that calls on folded arguments fold too
+class CallFolder {
+    ConstEvaluator evaluator;
+    int folded = 0;
+
+    void foldBody(std::vector<std::unique_ptr<Stmt>>& body) {
+        for (auto& stmt : body) foldStmt(*stmt);
+    }
+
+    void foldStmt(Stmt& stmt) {
+        if (auto varDecl = dynamic_cast<VarDeclStmt*>(&stmt)) {
+            if (varDecl->initializer) fold(varDecl->initializer);
+        } else if (auto heat = dynamic_cast<HeatStmt*>(&stmt)) {
+            fold(heat->expr);
+        } else if (auto beep = dynamic_cast<BeepStmt*>(&stmt)) {
+            fold(beep->expr);
+        } else if (auto ret = dynamic_cast<ReturnStmt*>(&stmt)) {
+            if (ret->expr) fold(ret->expr);
+        } else if (auto whileStmt = dynamic_cast<WhileStmt*>(&stmt)) {
+            fold(whileStmt->cond);
+            foldBody(whileStmt->body);
+        } else if (auto forStmt = dynamic_cast<ForStmt*>(&stmt)) {
+            if (forStmt->init) foldStmt(*forStmt->init);
+            if (forStmt->cond) fold(forStmt->cond);
+            if (forStmt->update) fold(forStmt->update, true);
+            foldBody(forStmt->body);
+        } else if (auto timer = dynamic_cast<TimerStmt*>(&stmt)) {
+            fold(timer->count);
+            foldBody(timer->body);
+        } else if (auto ifStmt = dynamic_cast<IfStmt*>(&stmt)) {
+            fold(ifStmt->cond);
+            foldBody(ifStmt->thenBody);
+            foldBody(ifStmt->elseBody);
+        } else if (auto expr = dynamic_cast<ExprStmt*>(&stmt)) {
+            fold(expr->expr, true);
+        }
+    }
+
+    // A call whose value is discarded is left alone: a bare literal statement only draws a warning
+    void fold(std::unique_ptr<Expr>& slot, bool discarded = false) {
+        Expr& expr = *slot;
+        if (auto bin = dynamic_cast<BinaryExpr*>(&expr)) {
+            fold(bin->left);
+            fold(bin->right);
+        } else if (auto unary = dynamic_cast<UnaryExpr*>(&expr)) {
+            fold(unary->operand);
+        } else if (auto array = dynamic_cast<ArrayExpr*>(&expr)) {
+            fold(array->base);
+            fold(array->index);
+        } else if (auto lit = dynamic_cast<ArrayLiteralExpr*>(&expr)) {
+            for (auto& element : lit->elements) fold(element);
+        } else if (auto lambda = dynamic_cast<LambdaExpr*>(&expr)) {
+            foldBody(lambda->body);
+        } else if (auto spawn = dynamic_cast<SpawnExpr*>(&expr)) {
+            // A spawned call with a constant result needs no task: the spawn becomes the result
+            std::unique_ptr<Expr> call = std::move(spawn->call);
+            fold(call, discarded);
+            if (auto folded = dynamic_cast<CallExpr*>(call.get())) {
+                call.release();
+                spawn->call.reset(folded);
+            } else {
+                slot = std::move(call);
+            }
+            return;
+        }
+
+        auto call = dynamic_cast<CallExpr*>(&expr);
+        if (!call) return;
+        fold(call->function);
+        for (auto& arg : call->args) fold(arg);
+        auto callee = dynamic_cast<const VarExpr*>(call->function.get());
+        const Function* fn = callee ? evaluator.pureFunction(callee->name) : nullptr;
+        ConstValue value;
+        if (discarded || !fn || !evaluator.evaluate(*call, value)) return;
+        auto literal = literalFor(value, fn->returnType);
+        if (!literal) return;
+        literal->line = call->line;
+        literal->column = call->column;
+        slot = std::move(literal);
+        ++folded;
+    }
+
+public:
+    CallFolder(const Program& program, const ConstEvalLimits& limits) : evaluator(program, limits) {}
+
+    int run(Program& program) {
+        for (auto& func : program.functions) foldBody(func->body);
+        return folded;
+    }
+};
+
+int foldConstantCalls(Program& program, const ConstEvalLimits& limits) {
+    CallFolder folder(program, limits);
+    return folder.run(program);
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "parser.h"
+
+// Budget for evaluating one call site at compile time
+struct ConstEvalLimits {
+    long long steps = 1000000;  // statements, loop tests and calls
+    int depth = 200;            // nested calls
+};
+
+// Replaces calls to pure functions whose arguments are all literals with the literal they
+// return, running the callee's body (loops and calls included) over the AST. Calls that run
+// out of budget, or would do anything whose C result is not certain (overflow, division by
+// zero, out-of-range indexes), are left alone. Returns the number of calls replaced.
+int foldConstantCalls(Program& program, const ConstEvalLimits& limits = ConstEvalLimits());
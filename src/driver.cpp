@@ -0,0 +1,293 @@
+#include "driver.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+const char* const nativeEntrySymbol = "mw_entry";
+
+std::vector<std::string> cCompiler() {
+    std::vector<std::string> argv;
+    const char* cc = getenv("CC");
+    std::istringstream words(cc && *cc ? cc : "cc");
+    std::string word;
+    while (words >> word) argv.push_back(word);
+    return argv;
+}
+
+int runProcess(const std::vector<std::string>& argv) {
+    std::vector<char*> args;
+    for (const auto& arg : argv) args.push_back(const_cast<char*>(arg.c_str()));
+    args.push_back(nullptr);
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        execvp(args[0], args.data());
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (!WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status) == 127 ? -1 : WEXITSTATUS(status);
+}
+
+uint64_t hashBytes(const std::string& data, uint64_t seed) {
+    uint64_t h = seed;
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void makeDirectories(const std::string& path) {
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        std::string prefix = path.substr(0, slash);
+        if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Cannot create directory " + prefix + ": " + strerror(errno));
+        }
+        if (slash == std::string::npos) break;
+    }
+}
+
+std::string cacheDirectory() {
+    std::string dir;
+    const char* env;
+    if ((env = getenv("MW_CACHE_DIR")) && *env) {
+        dir = env;
+    } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        dir = std::string(env) + "/microwave";
+    } else if ((env = getenv("HOME")) && *env) {
+        dir = std::string(env) + "/.cache/microwave";
+    } else {
+        dir = "/tmp/microwave-" + std::to_string(getuid());
+    }
+    makeDirectories(dir);
+    return dir;
+}
+
+static std::string temporaryName(const std::string& path) {
+    return path + ".tmp" + std::to_string(getpid());
+}
+
+void writeFileAtomic(const std::string& path, const std::string& content) {
+    std::string tmp = temporaryName(path);
+    {
+        std::ofstream file(tmp, std::ios::binary);
+        if (!file || !(file << content) || !file.flush()) {
+            unlink(tmp.c_str());
+            throw std::runtime_error("Cannot write file: " + path);
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        throw std::runtime_error("Cannot write file: " + path);
+    }
+}
+
+// Size and hash of a file's contents; false if it cannot be read
+static bool hashFile(const std::string& path, size_t& size, uint64_t& hash) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::string chunk(1 << 16, '\0');
+    size = 0;
+    hash = hashBytes("");
+    while (file.read(&chunk[0], chunk.size()) || file.gcount() > 0) {
+        size_t n = static_cast<size_t>(file.gcount());
+        size += n;
+        hash = hashBytes(n == chunk.size() ? chunk : chunk.substr(0, n), hash);
+    }
+    return !file.bad();
+}
+
+bool writeFileIfChanged(const std::string& path, const std::string& content) {
+    size_t size;
+    uint64_t hash;
+    if (hashFile(path, size, hash) && size == content.size() && hash == hashBytes(content)) return false;
+    writeFileAtomic(path, content);
+    return true;
+}
+
+bool replaceIfChanged(const std::string& tmp, const std::string& path) {
+    size_t oldSize, newSize;
+    uint64_t oldHash, newHash;
+    if (hashFile(path, oldSize, oldHash) && hashFile(tmp, newSize, newHash) &&
+        oldSize == newSize && oldHash == newHash) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        throw std::runtime_error("Cannot write file: " + path);
+    }
+    return true;
+}
+
+namespace {
+
+// GNU make jobserver client. MAKEFLAGS names a pipe (--jobserver-auth=R,W) or, since make 4.4,
+// a fifo (--jobserver-auth=fifo:PATH) holding one byte per free job slot. The process already
+// owns one implicit slot; each byte read is another, and goes back when this object dies.
+class Jobserver {
+    int readFd = -1, writeFd = -1;
+    bool ownWriteFd = false;
+    std::vector<char> tokens;
+
+public:
+    Jobserver() {
+        const char* flags = getenv("MAKEFLAGS");
+        if (!flags) return;
+        std::string auth;
+        std::istringstream words(flags);
+        for (std::string word; words >> word;) {
+            for (const char* prefix : {"--jobserver-auth=", "--jobserver-fds="}) {
+                if (word.compare(0, strlen(prefix), prefix) == 0) auth = word.substr(strlen(prefix));
+            }
+        }
+        if (auth.compare(0, 5, "fifo:") == 0) {
+            readFd = open(auth.c_str() + 5, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            writeFd = open(auth.c_str() + 5, O_WRONLY | O_CLOEXEC);
+            ownWriteFd = true;
+        } else if (auth.find(',') != std::string::npos) {
+            int r = atoi(auth.c_str()), w = atoi(auth.c_str() + auth.find(',') + 1);
+            if (fcntl(r, F_GETFD) == -1 || fcntl(w, F_GETFD) == -1) return;   // not passed down to us
+            // A fresh open of the pipe gets its own O_NONBLOCK, leaving make's descriptor blocking
+            readFd = open(("/proc/self/fd/" + std::to_string(r)).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            writeFd = w;
+        }
+        if (readFd < 0 || writeFd < 0) release();
+    }
+
+    ~Jobserver() { release(); }
+
+    bool active() const { return readFd >= 0; }
+
+    // Takes a slot only if one is free right now
+    bool tryAcquire() {
+        char token;
+        if (read(readFd, &token, 1) != 1) return false;
+        tokens.push_back(token);
+        return true;
+    }
+
+private:
+    void release() {
+        for (char token : tokens) {
+            while (write(writeFd, &token, 1) < 0 && errno == EINTR) {}
+        }
+        tokens.clear();
+        if (readFd >= 0) close(readFd);
+        if (ownWriteFd && writeFd >= 0) close(writeFd);
+        readFd = writeFd = -1;
+    }
+};
+
+} // namespace
+
+void runParallel(size_t count, const std::function<void(size_t)>& task) {
+    // make -jN decides the width when it runs us; otherwise the core count does
+    Jobserver jobserver;
+    size_t extra = 0;
+    if (jobserver.active()) {
+        while (extra + 1 < count && jobserver.tryAcquire()) ++extra;
+    } else {
+        extra = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency())) - 1;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::exception_ptr> errors(count);
+    auto work = [&] {
+        for (size_t i; (i = next++) < count;) {
+            try {
+                task(i);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < extra; ++t) threads.emplace_back(work);
+    work();
+    for (auto& thread : threads) thread.join();
+    for (const auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+}
+
+bool compileSharedObject(const std::string& cSource, const std::string& soPath,
+                         const std::vector<std::string>& flags) {
+    std::string cPath = soPath + ".c";
+    std::string tmpSo = temporaryName(soPath);
+    writeFileAtomic(cPath, cSource);
+
+    std::vector<std::string> argv = cCompiler();
+    argv.insert(argv.end(), flags.begin(), flags.end());
+    argv.insert(argv.end(), {"-shared", "-fPIC", std::string("-Dmain=") + nativeEntrySymbol,
+                             "-o", tmpSo, cPath, "-lm"});
+    bool ok = runProcess(argv) == 0 && rename(tmpSo.c_str(), soPath.c_str()) == 0;
+    unlink(tmpSo.c_str());
+    unlink(cPath.c_str());
+    return ok;
+}
+
+std::string cachedObject(const std::string& cSource) {
+    std::string key;
+    for (const auto& word : cCompiler()) key += word + '\0';
+    char name[32];
+    snprintf(name, sizeof name, "%016llx.o", static_cast<unsigned long long>(hashBytes(cSource, hashBytes(key))));
+    std::string objPath = cacheDirectory() + "/" + name;
+    if (access(objPath.c_str(), R_OK) == 0) return objPath;
+
+    std::string cPath = objPath + ".c";
+    std::string tmpObj = temporaryName(objPath);
+    writeFileAtomic(cPath, cSource);
+    std::vector<std::string> argv = cCompiler();
+    argv.insert(argv.end(), {"-O2", "-c", "-o", tmpObj, cPath});
+    bool ok = runProcess(argv) == 0 && rename(tmpObj.c_str(), objPath.c_str()) == 0;
+    unlink(tmpObj.c_str());
+    unlink(cPath.c_str());
+    if (!ok) throw std::runtime_error("C compiler failed to build " + objPath);
+    return objPath;
+}
+
+bool compileExecutable(const std::string& cPath, const std::string& exePath, const std::vector<std::string>& flags) {
+    std::vector<std::string> argv = cCompiler();
+    argv.insert(argv.end(), flags.begin(), flags.end());
+    argv.insert(argv.end(), {"-o", exePath, cPath, "-lm"});
+    return runProcess(argv) == 0;
+}
+
+bool runSharedObject(const std::string& soPath, int& exitCode, std::string& error) {
+    // Never dlclose: the program's stdout buffer lives in the object until exit
+    void* handle = dlopen(soPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        error = dlerror();
+        return false;
+    }
+    auto entry = reinterpret_cast<int (*)()>(dlsym(handle, nativeEntrySymbol));
+    if (!entry) {
+        error = std::string("no ") + nativeEntrySymbol + " in " + soPath;
+        dlclose(handle);
+        return false;
+    }
+    exitCode = entry();
+    fflush(stdout);
+    return true;
+}
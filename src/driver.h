@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Invoking the system C compiler and caching what it builds
+
+// $CC split on spaces, or "cc"
+std::vector<std::string> cCompiler();
+
+// Runs argv[0] from PATH and waits; returns the exit status, or -1 if it could not be started
+int runProcess(const std::vector<std::string>& argv);
+
+// 64-bit FNV-1a, chainable through seed
+uint64_t hashBytes(const std::string& data, uint64_t seed = 14695981039346656037ULL);
+
+// $MW_CACHE_DIR, else $XDG_CACHE_HOME/microwave, else $HOME/.cache/microwave; created on demand
+std::string cacheDirectory();
+
+// Writes content to path through a temporary file and rename, so readers never see a partial file
+void writeFileAtomic(const std::string& path, const std::string& content);
+
+// Like writeFileAtomic, but leaves path (and its mtime) alone when it already holds content.
+// Returns whether the file was written.
+bool writeFileIfChanged(const std::string& path, const std::string& content);
+
+// Renames the finished file tmp over path, or deletes it when path already has the same
+// size and hash. Returns whether path was replaced.
+bool replaceIfChanged(const std::string& tmp, const std::string& path);
+
+// Runs task(0) .. task(count - 1) on worker threads and rethrows the first failure by index.
+// Under make -jN each extra thread holds a jobserver token, so the build stays within N jobs;
+// otherwise there is one thread per core.
+void runParallel(size_t count, const std::function<void(size_t)>& task);
+
+// Compiles C source into a shared object at soPath; false if the compiler failed (its output goes to stderr)
+bool compileSharedObject(const std::string& cSource, const std::string& soPath,
+                         const std::vector<std::string>& flags);
+
+// Compiles C source to an object file in the cache directory, once per source text and compiler;
+// returns its path. Throws std::runtime_error if the compiler fails.
+std::string cachedObject(const std::string& cSource);
+
+// Builds the C file at cPath into an executable; false if the compiler failed (its output goes to stderr)
+bool compileExecutable(const std::string& cPath, const std::string& exePath, const std::vector<std::string>& flags);
+
+// Symbol the generated main is renamed to inside a shared object
+extern const char* const nativeEntrySymbol;
+
+// Loads soPath and calls its entry point; false (with the reason in error) if it cannot be loaded
+bool runSharedObject(const std::string& soPath, int& exitCode, std::string& error);
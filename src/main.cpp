@@ -2,9 +2,24 @@
 #include "tokenizer.h"
 #include "parser.h"
 #include "codegen.h"
+#include "bytecode.h"
+#include "vm.h"
+#include "driver.h"
+#include "astfile.h"
+#include "consteval.h"
+#include "asmgen.h"
+#include "watch.h"
+#include <chrono>
 #include <iostream>
+#include <map>
 #include <fstream>
 #include <sstream>
+#include <vector>
+#include <climits>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 std::string readFile(const std::string& filename) {
     std::ifstream file(filename);
@@ -16,47 +31,501 @@ std::string readFile(const std::string& filename) {
     return buffer.str();
 }
 
-void writeFile(const std::string& filename, const std::string& content) {
-    std::ofstream file(filename);
-    if (!file) {
-        throw std::runtime_error("Cannot write file: " + filename);
+// Streams generated C into a temporary file beside the output, renamed into place only once
+// generation has succeeded and only if it differs, so an unchanged output keeps its mtime.
+// Returns whether the output was replaced.
+static bool writeGeneratedC(const Program& program, const CodegenOptions& options, const std::string& outputFile) {
+    std::string tmp = outputFile + ".tmp" + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot write file: " + outputFile);
+    }
+    try {
+        writeC(program, fd, options);
+    } catch (...) {
+        close(fd);
+        unlink(tmp.c_str());
+        throw;
     }
-    file << content;
+    if (close(fd) != 0) {
+        unlink(tmp.c_str());
+        throw std::runtime_error("Cannot write file: " + outputFile);
+    }
+    return replaceIfChanged(tmp, outputFile);
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: microwave <source.mw> [output.c]" << std::endl;
-        return 1;
+// Hash of the compiler and flags an executable is built with, kept in <executable>.stamp
+static std::string compilerStamp(const std::vector<std::string>& flags) {
+    std::string key;
+    for (const auto& word : cCompiler()) key += word + '\0';
+    key += '\0';
+    for (const auto& flag : flags) key += flag + '\0';
+    char text[24];
+    snprintf(text, sizeof text, "%016llx\n", static_cast<unsigned long long>(hashBytes(key)));
+    return text;
+}
+
+// Whether path exists, was modified no earlier than source and was built as stamp says
+static bool upToDate(const std::string& path, const std::string& source, const std::string& stamp) {
+    struct stat built, from;
+    if (stat(path.c_str(), &built) != 0 || stat(source.c_str(), &from) != 0) return false;
+    std::ifstream file(path + ".stamp");
+    std::stringstream recorded;
+    recorded << file.rdbuf();
+    if (!file || recorded.str() != stamp) return false;
+    if (built.st_mtim.tv_sec != from.st_mtim.tv_sec) return built.st_mtim.tv_sec > from.st_mtim.tv_sec;
+    return built.st_mtim.tv_nsec >= from.st_mtim.tv_nsec;
+}
+
+// A path as a make rule spells it
+static std::string makeEscape(const std::string& path) {
+    std::string out;
+    for (char c : path) {
+        if (c == ' ' || c == '#' || c == '\\') out += '\\';
+        if (c == '$') out += '$';
+        out += c;
     }
-    
-    try {
-        const char* filename = argv[1];
-        std::string outputFile = argc > 2 ? argv[2] : "output.c";
-        
-        std::cout << "Compiling " << filename << "..." << std::endl;
-        
+    return out;
+}
+
+// Make-style dependency file, as cc -MD -MP writes: targets depend on every input, and each
+// input gets an empty rule so that deleting one does not break the build
+static void writeDepfile(const std::string& path, const std::vector<std::string>& targets,
+                         const std::vector<std::string>& deps) {
+    std::string rule;
+    for (const auto& target : targets) rule += (rule.empty() ? "" : " ") + makeEscape(target);
+    rule += ":";
+    for (const auto& dep : deps) rule += " \\\n  " + makeEscape(dep);
+    rule += "\n";
+    for (const auto& dep : deps) rule += "\n" + makeEscape(dep) + ":\n";
+    writeFileIfChanged(path, rule);
+}
+
+// Parses one input, source or pre-parsed module; progress lines go to log. With a cache (--watch)
+// only the functions edited since the last parse are tokenized and parsed again.
+static std::unique_ptr<Program> loadInput(const std::string& filename, std::ostream& log, ParseCache* cache) {
+    log << "Compiling " << filename << "..." << std::endl;
+    std::unique_ptr<Program> program;
+    if (isASTFile(filename)) {
+        // Pre-parsed module: decoded straight from the mapped file
+        program = loadAST(filename);
+        log << "Loaded " << program->functions.size() << " pre-parsed functions." << std::endl;
+    } else {
         // Read source file
         std::string source = readFile(filename);
         
+        if (cache) {
+            size_t parsed;
+            program = parseIncremental(source, *cache, parsed);
+            log << "Parsed " << program->functions.size() << " functions (" << parsed
+                << " chunks re-parsed)." << std::endl;
+            return program;
+        }
+        
         // Tokenize
         auto tokens = tokenize(source);
-        std::cout << "Tokenized " << tokens.size() << " tokens." << std::endl;
+        log << "Tokenized " << tokens.size() << " tokens." << std::endl;
         
         // Parse
-        auto program = parse(tokens);
-        std::cout << "Parsed " << program->functions.size() << " functions." << std::endl;
-        
-        // Generate C code
-        std::string cCode = generateC(*program);
+        program = parse(tokens);
+        log << "Parsed " << program->functions.size() << " functions." << std::endl;
+    }
+    return program;
+}
+
+// Loads the inputs in parallel, then moves every function of later inputs into the first,
+// remembering where each came from; caches is empty or holds one ParseCache per input
+static std::unique_ptr<Program> mergeInputs(const std::vector<std::string>& inputs, std::vector<ParseCache>& caches) {
+    auto cache = [&](size_t i) { return caches.empty() ? nullptr : &caches[i]; };
+    if (inputs.size() == 1) return loadInput(inputs[0], std::cout, cache(0));
+    std::vector<std::unique_ptr<Program>> parts(inputs.size());
+    std::vector<std::ostringstream> logs(inputs.size());
+    try {
+        runParallel(inputs.size(), [&](size_t i) { parts[i] = loadInput(inputs[i], logs[i], cache(i)); });
+    } catch (...) {
+        for (const auto& log : logs) std::cout << log.str();
+        throw;
+    }
+
+    std::unique_ptr<Program> program;
+    std::map<std::string, std::string> definedIn;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const std::string& filename = inputs[i];
+        std::cout << logs[i].str();
+        auto part = std::move(parts[i]);
+        for (auto& func : part->functions) {
+            auto inserted = definedIn.emplace(func->name, filename);
+            if (!inserted.second) {
+                throw std::runtime_error("Function '" + func->name + "' defined in both " +
+                                         inserted.first->second + " and " + filename);
+            }
+            func->sourceName = filename;
+        }
+        if (!program) {
+            program = std::move(part);
+        } else {
+            for (auto& func : part->functions) program->functions.push_back(std::move(func));
+        }
+    }
+    return program;
+}
+
+static void printUsage() {
+    std::cerr << "Usage: microwave [options] <source.mw|module.mwa> [output.c]" << std::endl;
+    std::cerr << "       microwave [options] -o <output.c> <source.mw|module.mwa>..." << std::endl;
+    std::cerr << "       microwave [options] --build <program> <source.mw|module.mwa>..." << std::endl;
+    std::cerr << "       microwave run [--vm] [--stats] [--line-flush] <source.mw>" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  -o <file>       write C (or the .mwa module) here; every other argument is an input" << std::endl;
+    std::cerr << "  --whole-program one translation unit: prototypes up front, every function but main static" << std::endl;
+    std::cerr << "                  (implied by several inputs)" << std::endl;
+    std::cerr << "  --build <exe>   whole-program C (default <exe>.c), then build it with $CC or cc" << std::endl;
+    std::cerr << "  --cflags \"<flags>\"      C flags for --build (default \"-O3 -march=native -flto\")" << std::endl;
+    std::cerr << "  --asm           write x86-64 assembly (default output.s) instead of C; with --build," << std::endl;
+    std::cerr << "                  assemble and link it without running the C compiler on the program" << std::endl;
+    std::cerr << "  -MD             also write a make dependency file (default the output with .d)" << std::endl;
+    std::cerr << "  -MF <file>      write the dependency file here (implies -MD)" << std::endl;
+    std::cerr << "  --watch         build, then rebuild whenever an input is saved, re-parsing only" << std::endl;
+    std::cerr << "                  the functions that changed" << std::endl;
+    std::cerr << "  --line-flush    flush beep output after every line" << std::endl;
+    std::cerr << "  --line-directives  emit #line so debuggers and profilers report .mw lines" << std::endl;
+    std::cerr << "  --emit-ast      write the parsed program as a binary .mwa module (default output.mwa)" << std::endl;
+    std::cerr << "  --no-fold       keep calls to pure functions with literal arguments for run time" << std::endl;
+    std::cerr << "  --fold-steps <n>         evaluation budget per folded call (default 1000000)" << std::endl;
+    std::cerr << "  --fold-depth <n>         call depth limit when folding (default 200)" << std::endl;
+    std::cerr << "  --instrument    count calls, time and loop iterations; the program writes" << std::endl;
+    std::cerr << "                  microwave.prof (or $MW_PROFILE) at exit" << std::endl;
+    std::cerr << "  --memo-capacity <n>      default cache entries for popcorn functions" << std::endl;
+    std::cerr << "  --profile-use <file>     optimize using a profile from an --instrument run" << std::endl;
+    std::cerr << "  --profile-report <file>  list the decisions the profile changed" << std::endl;
+    std::cerr << "  --vm            (run) interpret bytecode instead of building a cached native object" << std::endl;
+    std::cerr << "  --stats         (run) interpret, then print instruction and call counts to stderr" << std::endl;
+}
+
+// A non-negative decimal option value no larger than max; false for anything else
+static bool parseCount(const std::string& text, long long max, long long& value) {
+    if (text.empty() || text.size() > 18 || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    value = std::stoll(text);
+    return value <= max;
+}
+
+// Source text, or a module already parsed by --emit-ast, with constant calls folded
+static std::unique_ptr<Program> parseSource(const std::string& source) {
+    auto program = isASTData(source.data(), source.size()) ? deserializeAST(source.data(), source.size())
+                                                           : parse(tokenize(source));
+    foldConstantCalls(*program);
+    return program;
+}
+
+// Part of every cache key, so objects built by an older compiler are never reused
+static const char* const buildStamp = __DATE__ " " __TIME__;
+
+// Cache path for a source text under the current compiler, flags and codegen options
+static std::string nativeCachePath(const std::string& source, const std::vector<std::string>& flags,
+                                   const CodegenOptions& codegen) {
+    std::string key = buildStamp;
+    for (const auto& word : cCompiler()) key += '\0' + word;
+    for (const auto& flag : flags) key += '\0' + flag;
+    if (codegen.lineFlush) key += std::string("\0line-flush", 11);
+    char name[32];
+    snprintf(name, sizeof name, "%016llx.so", static_cast<unsigned long long>(hashBytes(source, hashBytes(key))));
+    return cacheDirectory() + "/" + name;
+}
+
+// microwave run: execute natively through a cached shared object, or in the bytecode VM;
+// the program's exit code is ours
+static int runMode(int argc, char* argv[]) {
+    VMOptions options;
+    bool useVm = false;
+    std::string filename;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--vm") {
+            useVm = true;
+        } else if (arg == "--stats") {
+            options.stats = true;
+            useVm = true;
+        } else if (arg == "--line-flush") {
+            options.lineFlush = true;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            printUsage();
+            return 1;
+        } else if (filename.empty()) {
+            filename = arg;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+    if (filename.empty()) {
+        printUsage();
+        return 1;
+    }
+    
+    try {
+        std::string source = readFile(filename);
+        std::unique_ptr<Program> program;
         
-        // Write output
-        writeFile(outputFile, cCode);
-        std::cout << "Generated C code written to " << outputFile << std::endl;
+        if (!useVm) {
+            CodegenOptions codegen;
+            codegen.lineFlush = options.lineFlush;
+            codegen.sourceName = filename;
+            const std::vector<std::string> flags = {"-O2", "-w"};
+            
+            std::string soPath, error;
+            try {
+                soPath = nativeCachePath(source, flags, codegen);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            
+            // A cache hit skips tokenize, parse, codegen and the C compile
+            int status;
+            if (!soPath.empty() && access(soPath.c_str(), R_OK) == 0 && runSharedObject(soPath, status, error)) {
+                return status;
+            }
+            program = parseSource(source);
+            if (!soPath.empty()) {
+                std::string cCode = generateC(*program, codegen);
+                std::vector<std::string> buildFlags = flags;
+                if (usesTasks(*program)) buildFlags.push_back("-pthread");
+                if (compileSharedObject(cCode, soPath, buildFlags) && runSharedObject(soPath, status, error)) {
+                    return status;
+                }
+            }
+            std::cerr << "microwave: native build failed" << (error.empty() ? "" : ": " + error)
+                      << "; running in the VM" << std::endl;
+        }
         
-        return 0;
+        if (!program) program = parseSource(source);
+        auto module = compileBytecode(*program);
+        return runBytecode(*module, options);
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
 }
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "run") {
+        return runMode(argc, argv);
+    }
+    
+    CodegenOptions options;
+    std::vector<std::string> positional;
+    std::string outputFile, executable;
+    std::vector<std::string> cflags = {"-O3", "-march=native", "-flto"};
+    bool cflagsGiven = false;
+    bool assembly = false;
+    bool depfile = false;
+    std::string depfilePath;
+    std::string profileFile, profileReport;
+    bool emitAst = false;
+    bool fold = true;
+    bool watch = false;
+    ConstEvalLimits foldLimits;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--line-flush") {
+            options.lineFlush = true;
+        } else if (arg == "-o" && i + 1 < argc) {
+            outputFile = argv[++i];
+        } else if (arg == "--asm") {
+            assembly = true;
+        } else if (arg == "-MD") {
+            depfile = true;
+        } else if (arg == "-MF" && i + 1 < argc) {
+            depfile = true;
+            depfilePath = argv[++i];
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--whole-program") {
+            options.wholeProgram = true;
+        } else if (arg == "--build" && i + 1 < argc) {
+            executable = argv[++i];
+        } else if (arg == "--cflags" && i + 1 < argc) {
+            std::istringstream words(argv[++i]);
+            cflags.clear();
+            cflagsGiven = true;
+            for (std::string word; words >> word;) cflags.push_back(word);
+        } else if (arg == "--line-directives") {
+            options.lineDirectives = true;
+        } else if (arg == "--emit-ast") {
+            emitAst = true;
+        } else if (arg == "--no-fold") {
+            fold = false;
+        } else if ((arg == "--fold-steps" || arg == "--fold-depth") && i + 1 < argc) {
+            long long value;
+            if (!parseCount(argv[++i], arg == "--fold-steps" ? LLONG_MAX : INT_MAX, value)) {
+                std::cerr << "Invalid value for " << arg << ": " << argv[i] << std::endl;
+                printUsage();
+                return 1;
+            }
+            if (arg == "--fold-steps") foldLimits.steps = value;
+            else foldLimits.depth = static_cast<int>(value);
+        } else if (arg == "--instrument") {
+            options.instrument = true;
+        } else if (arg == "--memo-capacity" && i + 1 < argc) {
+            long long value;
+            if (!parseCount(argv[++i], INT_MAX, value) || value == 0) {
+                std::cerr << "Invalid value for " << arg << ": " << argv[i] << std::endl;
+                printUsage();
+                return 1;
+            }
+            options.memoCapacity = static_cast<int>(value);
+        } else if (arg == "--profile-use" && i + 1 < argc) {
+            profileFile = argv[++i];
+        } else if (arg == "--profile-report" && i + 1 < argc) {
+            profileReport = argv[++i];
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            printUsage();
+            return 1;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    
+    if (positional.empty()) {
+        printUsage();
+        return 1;
+    }
+    
+    // Without -o or --build the second argument is the output, as it always was
+    std::vector<std::string> inputs = positional;
+    if (outputFile.empty() && executable.empty() && inputs.size() > 1) {
+        if (inputs.size() > 2) {
+            std::cerr << "Several inputs need -o or --build" << std::endl;
+            printUsage();
+            return 1;
+        }
+        outputFile = inputs.back();
+        inputs.pop_back();
+    }
+    if (!executable.empty() && emitAst) {
+        std::cerr << "--build and --emit-ast cannot be combined" << std::endl;
+        return 1;
+    }
+    if (assembly && (options.instrument || !profileFile.empty())) {
+        std::cerr << "--instrument and --profile-use need the C backend" << std::endl;
+        return 1;
+    }
+    std::string extension = assembly ? ".s" : ".c";
+    if (outputFile.empty()) outputFile = !executable.empty() ? executable + extension : emitAst ? "output.mwa" : "output" + extension;
+    if (inputs.size() > 1 || !executable.empty()) options.wholeProgram = true;
+    if (depfile && depfilePath.empty()) {
+        size_t dot = outputFile.find_last_of('.');
+        size_t slash = outputFile.find_last_of('/');
+        bool extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+        depfilePath = (extension ? outputFile.substr(0, dot) : outputFile) + ".d";
+    }
+    std::vector<std::string> targets = {outputFile};
+    if (!executable.empty()) targets.push_back(executable);
+    std::vector<std::string> deps = inputs;
+    if (!profileFile.empty()) deps.push_back(profileFile);
+    
+    // One ParseCache per input under --watch, so a rebuild re-parses only what was edited
+    std::vector<ParseCache> caches(watch ? inputs.size() : 0);
+    auto build = [&]() -> int {
+        try {
+            options.sourceName = inputs[0];
+            options.outputName = outputFile;
+            
+            auto program = mergeInputs(inputs, caches);
+            
+            if (depfile) writeDepfile(depfilePath, targets, deps);
+            
+            if (emitAst) {
+                bool changed = writeFileIfChanged(outputFile, serializeAST(*program));
+                std::cout << (changed ? "AST written to " : "AST unchanged in ") << outputFile << std::endl;
+                return 0;
+            }
+            
+            // Run pure calls on literal arguments now and keep only their results
+            if (fold) {
+                int folded = foldConstantCalls(*program, foldLimits);
+                if (folded > 0) std::cout << "Folded " << folded << " constant calls." << std::endl;
+            }
+            
+            if (assembly) {
+                bool changed = writeFileIfChanged(outputFile, generateAsm(*program, options));
+                std::cout << (changed ? "Generated assembly written to " : "Generated assembly unchanged in ")
+                          << outputFile << std::endl;
+                std::vector<std::string> flags = cflagsGiven ? cflags : std::vector<std::string>();
+                std::string stamp = compilerStamp(flags);
+                if (!executable.empty() && !changed && upToDate(executable, outputFile, stamp)) {
+                    std::cout << "Executable " << executable << " is up to date" << std::endl;
+                } else if (!executable.empty()) {
+                    // The runtime is C, compiled once and cached; the program itself only needs as and ld
+                    flags.push_back(cachedObject(asmRuntimeSource()));
+                    if (!compileExecutable(outputFile, executable, flags)) {
+                        throw std::runtime_error("Assembler or linker failed to build " + executable);
+                    }
+                    writeFileIfChanged(executable + ".stamp", stamp);
+                    std::cout << "Built " << executable << std::endl;
+                }
+                return 0;
+            }
+            
+            // Load the profile that guides codegen, if any
+            Profile profile;
+            std::vector<std::string> decisions;
+            if (!profileFile.empty()) {
+                profile = loadProfile(profileFile);
+                options.profile = &profile;
+                options.profileDecisions = &decisions;
+            }
+            
+            // Generate C code straight into the output file
+            bool changed = writeGeneratedC(*program, options, outputFile);
+            
+            if (options.profile) {
+                std::cout << "Profile " << profileFile << " changed " << decisions.size() << " decisions." << std::endl;
+                if (!profileReport.empty()) {
+                    std::string report;
+                    for (const auto& decision : decisions) report += decision + "\n";
+                    writeFileIfChanged(profileReport, report);
+                }
+            }
+            
+            std::cout << (changed ? "Generated C code written to " : "Generated C code unchanged in ") << outputFile << std::endl;
+            
+            // Unchanged C with a newer executable, built by the same compiler and flags, has
+            // nothing left to build
+            std::vector<std::string> flags = cflags;
+            if (usesTasks(*program)) flags.push_back("-pthread");
+            std::string stamp = compilerStamp(flags);
+            if (!executable.empty() && !changed && upToDate(executable, outputFile, stamp)) {
+                std::cout << "Executable " << executable << " is up to date" << std::endl;
+            } else if (!executable.empty()) {
+                if (!compileExecutable(outputFile, executable, flags)) {
+                    throw std::runtime_error("C compiler failed to build " + executable);
+                }
+                writeFileIfChanged(executable + ".stamp", stamp);
+                std::cout << "Built " << executable << std::endl;
+            }
+            
+            return 0;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    };
+    
+    if (!watch) return build();
+    build();
+    try {
+        std::cout << "Watching " << inputs.size() << (inputs.size() == 1 ? " input" : " inputs")
+                  << " for changes (Ctrl-C to stop)..." << std::endl;
+        watchFiles(inputs, [&] {
+            auto start = std::chrono::steady_clock::now();
+            if (build() != 0) return;
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "Rebuilt in " << elapsed.count() << " ms." << std::endl;
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+    }
+    return 1;
+}
@@ -10,10 +10,31 @@ class Parser {
         return pos < tokens.size() ? tokens[pos] : tokens.back(); 
     }
     
+    Token peek(size_t offset = 1) const {
+        return pos + offset < tokens.size() ? tokens[pos + offset] : tokens.back();
+    }
+    
     void advance() { 
         if (pos < tokens.size()) ++pos; 
     }
     
+    static void locate(ASTNode& node, const Token& at) {
+        node.line = at.line;
+        node.column = at.column;
+    }
+    
+    // Binary and postfix nodes start where their leftmost operand does
+    static void locate(ASTNode& node, const ASTNode& from) {
+        node.line = from.line;
+        node.column = from.column;
+    }
+    
+    std::unique_ptr<Expr> binary(const std::string& op, std::unique_ptr<Expr> left, std::unique_ptr<Expr> right) {
+        auto expr = std::make_unique<BinaryExpr>(op, std::move(left), std::move(right));
+        locate(*expr, *expr->left);
+        return expr;
+    }
+    
     bool match(TokenType type, const std::string& val = "") {
         if (curr().type == type && (val.empty() || curr().value == val)) {
             advance();
@@ -22,6 +43,32 @@ class Parser {
         return false;
     }
 
+    // map<K, V> with curr() on 'map'; the type is spelled "map<K,V>"
+    std::string parseMapType() {
+        advance(); // consume 'map'
+        if (!match(TokenType::Symbol, "<")) {
+            throw std::runtime_error("Expected '<' after 'map'");
+        }
+        std::string key = curr().value;
+        if (curr().type != TokenType::Keyword || (key != "int" && key != "string")) {
+            throw std::runtime_error("Map keys must be int or string");
+        }
+        advance();
+        if (!match(TokenType::Symbol, ",")) {
+            throw std::runtime_error("Expected ',' after map key type");
+        }
+        std::string value = curr().value;
+        if (curr().type != TokenType::Keyword ||
+            (value != "int" && value != "float" && value != "string" && value != "bool")) {
+            throw std::runtime_error("Map values must be int, float, string or bool");
+        }
+        advance();
+        if (!match(TokenType::Symbol, ">")) {
+            throw std::runtime_error("Expected '>' after map value type");
+        }
+        return "map<" + key + "," + value + ">";
+    }
+
 public:
     Parser(const std::vector<Token>& t) : tokens(t) {}
     
@@ -34,6 +81,23 @@ public:
     }
     
     std::unique_ptr<Function> parseFunction() {
+        Token start = curr();
+        
+        // popcorn [(capacity)] mode ... memoizes a pure function
+        bool memoized = false;
+        int memoCapacity = 0;
+        if (match(TokenType::Keyword, "popcorn")) {
+            memoized = true;
+            if (match(TokenType::Symbol, "(")) {
+                if (curr().type != TokenType::Number) {
+                    throw std::runtime_error("Expected cache capacity after 'popcorn('");
+                }
+                memoCapacity = std::stoi(curr().value);
+                advance();
+                match(TokenType::Symbol, ")");
+            }
+        }
+        
         if (!match(TokenType::Keyword, "mode")) {
             throw std::runtime_error("Expected 'mode'");
         }
@@ -45,6 +109,16 @@ public:
              curr().value == "bool" || curr().value == "void")) {
             returnType = curr().value;
             advance();
+            
+            if (returnType != "void" && curr().type == TokenType::Symbol && curr().value == "[") {
+                advance(); // consume '['
+                if (!match(TokenType::Symbol, "]")) {
+                    throw std::runtime_error("Expected ']' after '[' in array type");
+                }
+                returnType += "[]";
+            }
+        } else if (curr().type == TokenType::Keyword && curr().value == "map") {
+            returnType = parseMapType();
         }
         
         if (curr().type != TokenType::Identifier) {
@@ -74,6 +148,8 @@ public:
                         throw std::runtime_error("Expected ']' after '[' in array type");
                     }
                 }
+            } else if (curr().type == TokenType::Keyword && curr().value == "map") {
+                paramType = parseMapType();
             }
             
             // Parse parameter name
@@ -93,7 +169,10 @@ public:
         match(TokenType::Symbol, "{");
         
         auto fn = std::make_unique<Function>(returnType, name);
+        locate(*fn, start);
         fn->params = params;
+        fn->memoized = memoized;
+        fn->memoCapacity = memoCapacity;
         while (!match(TokenType::Symbol, "}")) {
             fn->body.push_back(parseStmt());
         }
@@ -101,15 +180,26 @@ public:
     }
     
     std::unique_ptr<Stmt> parseStmt() {
+        Token start = curr();
+        auto stmt = parseStatement();
+        locate(*stmt, start);
+        return stmt;
+    }
+    
+    std::unique_ptr<Stmt> parseStatement() {
         // Variable declarations
         if (curr().type == TokenType::Keyword && 
             (curr().value == "int" || curr().value == "float" || curr().value == "string" || 
-             curr().value == "bool" || curr().value == "auto")) {
+             curr().value == "bool" || curr().value == "auto" || curr().value == "map")) {
             std::string type = curr().value;
-            advance();
+            if (type == "map") {
+                type = parseMapType();
+            } else {
+                advance();
+            }
             
             // Check for array type (int[], float[], etc.)
-            if (curr().type == TokenType::Symbol && curr().value == "[") {
+            if (type.compare(0, 4, "map<") != 0 && curr().type == TokenType::Symbol && curr().value == "[") {
                 advance(); // consume '['
                 if (curr().type == TokenType::Symbol && curr().value == "]") {
                     advance(); // consume ']'
@@ -150,6 +240,10 @@ public:
             match(TokenType::Symbol, ";");
             return std::make_unique<ContinueStmt>();
         }
+        if (match(TokenType::Keyword, "sync")) {
+            match(TokenType::Symbol, ";");
+            return std::make_unique<SyncStmt>();
+        }
         
         // Loop statements
         if (match(TokenType::Keyword, "while")) {
@@ -230,6 +324,28 @@ public:
             return stmt;
         }
         
+        // Output: beep <expr>; a whole statement beep(fmt, ...) with two or more arguments stays
+        // printf-style, and anything else after beep, parentheses included, is the value printed
+        if (curr().type == TokenType::Keyword && curr().value == "beep" &&
+            !(peek().type == TokenType::Symbol && peek().value == ";")) {
+            size_t start = pos;
+            if (peek().type == TokenType::Symbol && peek().value == "(") {
+                auto expr = parseExpr();
+                auto call = dynamic_cast<CallExpr*>(expr.get());
+                auto callee = call ? dynamic_cast<VarExpr*>(call->function.get()) : nullptr;
+                if (callee && callee->name == "beep" && call->args.size() >= 2 &&
+                    curr().type == TokenType::Symbol && curr().value == ";") {
+                    advance();
+                    return std::make_unique<ExprStmt>(std::move(expr));
+                }
+                pos = start;
+            }
+            advance();
+            auto expr = parseExpr();
+            match(TokenType::Symbol, ";");
+            return std::make_unique<BeepStmt>(std::move(expr));
+        }
+        
         // Expression statement
         auto expr = parseExpr();
         match(TokenType::Symbol, ";");
@@ -251,7 +367,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseAssignment();
-            return std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            return binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -264,7 +380,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseLogicalAnd();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -277,7 +393,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseBitwiseOr();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -290,7 +406,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseBitwiseXor();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -303,7 +419,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseBitwiseAnd();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -316,7 +432,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseEquality();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -330,7 +446,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseRelational();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -345,7 +461,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseShift();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -359,7 +475,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseAdditive();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -373,7 +489,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseMultiplicative();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -387,7 +503,7 @@ public:
             std::string op = curr().value;
             advance();
             auto right = parseUnary();
-            expr = std::make_unique<BinaryExpr>(op, std::move(expr), std::move(right));
+            expr = binary(op, std::move(expr), std::move(right));
         }
         
         return expr;
@@ -397,10 +513,24 @@ public:
         if (curr().type == TokenType::Symbol && 
             (curr().value == "++" || curr().value == "--" || curr().value == "!" || 
              curr().value == "~" || curr().value == "+" || curr().value == "-")) {
-            std::string op = curr().value;
+            Token start = curr();
             advance();
-            auto operand = parseUnary();
-            return std::make_unique<UnaryExpr>(op, std::move(operand), true);
+            auto expr = std::make_unique<UnaryExpr>(start.value, parseUnary(), true);
+            locate(*expr, start);
+            return expr;
+        }
+        if (curr().type == TokenType::Keyword && curr().value == "spawn") {
+            Token start = curr();
+            advance();
+            auto target = parsePostfix();
+            auto call = dynamic_cast<CallExpr*>(target.get());
+            if (!call || !dynamic_cast<const VarExpr*>(call->function.get())) {
+                throw std::runtime_error("Expected a function call after 'spawn'");
+            }
+            target.release();
+            auto expr = std::make_unique<SpawnExpr>(std::unique_ptr<CallExpr>(call));
+            locate(*expr, start);
+            return expr;
         }
         
         return parsePostfix();
@@ -421,19 +551,24 @@ public:
                     }
                 }
                 match(TokenType::Symbol, ")");
+                locate(*call, *call->function);
                 expr = std::move(call);
             } else if (curr().type == TokenType::Symbol && curr().value == "[") {
                 // Array access
                 advance();
                 auto index = parseExpr();
                 match(TokenType::Symbol, "]");
-                expr = std::make_unique<ArrayExpr>(std::move(expr), std::move(index));
+                auto access = std::make_unique<ArrayExpr>(std::move(expr), std::move(index));
+                locate(*access, *access->base);
+                expr = std::move(access);
             } else if (curr().type == TokenType::Symbol && 
                        (curr().value == "++" || curr().value == "--")) {
                 // Postfix increment/decrement
                 std::string op = curr().value;
                 advance();
-                expr = std::make_unique<UnaryExpr>(op, std::move(expr), false);
+                auto postfix = std::make_unique<UnaryExpr>(op, std::move(expr), false);
+                locate(*postfix, *postfix->operand);
+                expr = std::move(postfix);
             } else {
                 break;
             }
@@ -443,6 +578,13 @@ public:
     }
     
     std::unique_ptr<Expr> parsePrimary() {
+        Token start = curr();
+        auto expr = parsePrimaryExpr();
+        locate(*expr, start);
+        return expr;
+    }
+    
+    std::unique_ptr<Expr> parsePrimaryExpr() {
         if (curr().type == TokenType::Number) {
             std::string val = curr().value;
             advance();
@@ -497,11 +639,21 @@ public:
         
         auto lambda = std::make_unique<LambdaExpr>();
         
-        // Parse parameters
+        // Parse parameters, optionally typed: lambda (x, float y)
         while (curr().type != TokenType::Symbol || curr().value != ")") {
+            std::string paramType = "auto";
+            if (curr().type == TokenType::Keyword && peek().type == TokenType::Identifier &&
+                (curr().value == "int" || curr().value == "float" || curr().value == "string" || 
+                 curr().value == "bool" || curr().value == "auto")) {
+                paramType = curr().value;
+                advance();
+            }
             if (curr().type == TokenType::Identifier || curr().type == TokenType::Keyword) {
                 lambda->params.push_back(curr().value);
+                lambda->paramTypes.push_back(paramType);
                 advance();
+            } else if (curr().type == TokenType::EndOfFile) {
+                throw std::runtime_error("Unterminated lambda parameter list");
             }
             if (curr().type == TokenType::Symbol && curr().value == ",") {
                 advance();
@@ -523,3 +675,58 @@ std::unique_ptr<Program> parse(const std::vector<Token>& tokens) {
     Parser parser(tokens);
     return parser.parseProgram();
 }
+
+void walkExpr(const Expr& expr, const StmtCallback& onStmt, const ExprCallback& onExpr) {
+    if (onExpr) onExpr(expr);
+    if (auto bin = dynamic_cast<const BinaryExpr*>(&expr)) {
+        walkExpr(*bin->left, onStmt, onExpr);
+        walkExpr(*bin->right, onStmt, onExpr);
+    } else if (auto unary = dynamic_cast<const UnaryExpr*>(&expr)) {
+        walkExpr(*unary->operand, onStmt, onExpr);
+    } else if (auto call = dynamic_cast<const CallExpr*>(&expr)) {
+        walkExpr(*call->function, onStmt, onExpr);
+        for (const auto& arg : call->args) walkExpr(*arg, onStmt, onExpr);
+    } else if (auto array = dynamic_cast<const ArrayExpr*>(&expr)) {
+        walkExpr(*array->base, onStmt, onExpr);
+        walkExpr(*array->index, onStmt, onExpr);
+    } else if (auto arrayLit = dynamic_cast<const ArrayLiteralExpr*>(&expr)) {
+        for (const auto& e : arrayLit->elements) walkExpr(*e, onStmt, onExpr);
+    } else if (auto lambda = dynamic_cast<const LambdaExpr*>(&expr)) {
+        for (const auto& s : lambda->body) walkStmt(*s, onStmt, onExpr);
+    } else if (auto spawn = dynamic_cast<const SpawnExpr*>(&expr)) {
+        walkExpr(*spawn->call, onStmt, onExpr);
+    }
+}
+
+void walkStmt(const Stmt& stmt, const StmtCallback& onStmt, const ExprCallback& onExpr) {
+    if (onStmt) onStmt(stmt);
+    auto walkBody = [&](const std::vector<std::unique_ptr<Stmt>>& body) {
+        for (const auto& s : body) walkStmt(*s, onStmt, onExpr);
+    };
+    if (auto varDecl = dynamic_cast<const VarDeclStmt*>(&stmt)) {
+        if (varDecl->initializer) walkExpr(*varDecl->initializer, onStmt, onExpr);
+    } else if (auto heat = dynamic_cast<const HeatStmt*>(&stmt)) {
+        walkExpr(*heat->expr, onStmt, onExpr);
+    } else if (auto beep = dynamic_cast<const BeepStmt*>(&stmt)) {
+        walkExpr(*beep->expr, onStmt, onExpr);
+    } else if (auto ret = dynamic_cast<const ReturnStmt*>(&stmt)) {
+        if (ret->expr) walkExpr(*ret->expr, onStmt, onExpr);
+    } else if (auto whileStmt = dynamic_cast<const WhileStmt*>(&stmt)) {
+        walkExpr(*whileStmt->cond, onStmt, onExpr);
+        walkBody(whileStmt->body);
+    } else if (auto forStmt = dynamic_cast<const ForStmt*>(&stmt)) {
+        if (forStmt->init) walkStmt(*forStmt->init, onStmt, onExpr);
+        if (forStmt->cond) walkExpr(*forStmt->cond, onStmt, onExpr);
+        if (forStmt->update) walkExpr(*forStmt->update, onStmt, onExpr);
+        walkBody(forStmt->body);
+    } else if (auto timer = dynamic_cast<const TimerStmt*>(&stmt)) {
+        walkExpr(*timer->count, onStmt, onExpr);
+        walkBody(timer->body);
+    } else if (auto ifStmt = dynamic_cast<const IfStmt*>(&stmt)) {
+        walkExpr(*ifStmt->cond, onStmt, onExpr);
+        walkBody(ifStmt->thenBody);
+        walkBody(ifStmt->elseBody);
+    } else if (auto exprStmt = dynamic_cast<const ExprStmt*>(&stmt)) {
+        walkExpr(*exprStmt->expr, onStmt, onExpr);
+    }
+}
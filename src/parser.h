@@ -1,5 +1,6 @@
 #pragma once
 #include "tokenizer.h"
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -9,6 +10,8 @@ struct Stmt;
 
 // AST Node base
 struct ASTNode {
+    int line = 0;   // source position of the node's first token (1-based)
+    int column = 0;
     virtual ~ASTNode() = default;
 };
 
@@ -58,6 +61,11 @@ struct ArrayLiteralExpr : Expr {
     std::vector<std::unique_ptr<Expr>> elements;
     ArrayLiteralExpr() = default;
 };
+// spawn f(args): the call may run as a task on another core until the next sync
+struct SpawnExpr : Expr {
+    std::unique_ptr<CallExpr> call;
+    SpawnExpr(std::unique_ptr<CallExpr> c) : call(std::move(c)) {}
+};
 
 // Statements
 struct Stmt : ASTNode {};
@@ -112,10 +120,13 @@ struct ExprStmt : Stmt {
     std::unique_ptr<Expr> expr;
     ExprStmt(std::unique_ptr<Expr> e) : expr(std::move(e)) {}
 };
+// Waits for every call the function has spawned so far
+struct SyncStmt : Stmt {};
 
 // Lambda expression (defined after Stmt to avoid forward declaration issues)
 struct LambdaExpr : Expr {
     std::vector<std::string> params;
+    std::vector<std::string> paramTypes;   // "auto" when the parameter is untyped
     std::vector<std::unique_ptr<Stmt>> body;
     std::string returnType;
     LambdaExpr() = default;
@@ -134,6 +145,9 @@ struct Function : ASTNode {
     std::string name;
     std::vector<Parameter> params;
     std::vector<std::unique_ptr<Stmt>> body;
+    bool memoized = false;      // declared with popcorn
+    int memoCapacity = 0;       // popcorn(N); 0 picks the compiler default
+    std::string sourceName;     // input file when several are merged (not serialized)
     Function(const std::string& retType, const std::string& n) : returnType(retType), name(n) {}
 };
 
@@ -143,3 +157,9 @@ struct Program : ASTNode {
 };
 
 std::unique_ptr<Program> parse(const std::vector<Token>& tokens);
+
+// Pre-order AST traversal; either callback may be empty. Lambda bodies are walked too.
+using StmtCallback = std::function<void(const Stmt&)>;
+using ExprCallback = std::function<void(const Expr&)>;
+void walkStmt(const Stmt& stmt, const StmtCallback& onStmt, const ExprCallback& onExpr);
+void walkExpr(const Expr& expr, const StmtCallback& onStmt, const ExprCallback& onExpr);
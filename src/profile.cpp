@@ -0,0 +1,65 @@
+#include "profile.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+Profile loadProfile(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file) {
+        throw std::runtime_error("Cannot open profile: " + filename);
+    }
+    
+    Profile profile;
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(file, line)) {
+        ++lineNo;
+        if (lineNo == 1) {
+            if (line.compare(0, 22, "# microwave profile v1") != 0) {
+                throw std::runtime_error("Not a microwave profile: " + filename);
+            }
+            size_t unit = line.find("unit=");
+            if (unit != std::string::npos) profile.unit = line.substr(unit + 5, line.find(' ', unit) - unit - 5);
+            continue;
+        }
+        if (line.empty() || line[0] == '#') continue;
+        
+        std::istringstream in(line);
+        std::string kind, name, key;
+        bool ok = false;
+        if (!(in >> kind)) continue;
+        if (kind == "func") {
+            FunctionProfile fp;
+            ok = static_cast<bool>(in >> name >> key >> fp.line >> key >> fp.calls >> key >> fp.ticks);
+            if (ok) profile.functions[name] = fp;
+        } else if (kind == "loop") {
+            std::string loopKind;
+            int at = 0;
+            LoopProfile lp;
+            ok = static_cast<bool>(in >> loopKind >> name >> key >> at >> key >> lp.entries >> key >> lp.iters);
+            if (ok) {
+                LoopProfile& total = profile.loops[{name, at}];
+                total.entries += lp.entries;
+                total.iters += lp.iters;
+            }
+        } else if (kind == "branch") {
+            int at = 0;
+            BranchProfile bp;
+            ok = static_cast<bool>(in >> name >> key >> at >> key >> bp.evals >> key >> bp.taken);
+            if (ok) {
+                BranchProfile& total = profile.branches[{name, at}];
+                total.evals += bp.evals;
+                total.taken += bp.taken;
+            }
+        } else {
+            ok = true; // unknown record kinds are skipped for forward compatibility
+        }
+        if (!ok) {
+            throw std::runtime_error(filename + ":" + std::to_string(lineNo) + ": malformed profile record");
+        }
+    }
+    if (lineNo == 0) {
+        throw std::runtime_error("Empty profile: " + filename);
+    }
+    return profile;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// Runtime profile written by programs compiled with --instrument
+
+struct FunctionProfile {
+    int line = 0;
+    unsigned long long calls = 0;
+    unsigned long long ticks = 0;   // inclusive time of outermost activations
+};
+
+struct LoopProfile {
+    unsigned long long entries = 0;
+    unsigned long long iters = 0;
+};
+
+struct BranchProfile {
+    unsigned long long evals = 0;
+    unsigned long long taken = 0;
+};
+
+struct Profile {
+    std::string unit;
+    std::unordered_map<std::string, FunctionProfile> functions;
+    std::map<std::pair<std::string, int>, LoopProfile> loops;       // keyed by (function, line)
+    std::map<std::pair<std::string, int>, BranchProfile> branches;  // keyed by (function, line)
+};
+
+Profile loadProfile(const std::string& filename);
@@ -0,0 +1,763 @@
+#include "runtime.h"
+
+const char* const beepRuntimeC = R"(/* beep output runtime: stdout with a large buffer, formatted without printf */
+#ifndef MW_OUT_BUFSIZE
+#define MW_OUT_BUFSIZE (1 << 16)
+#endif
+#ifndef MW_LINE_FLUSH
+#define MW_LINE_FLUSH 0
+#endif
+#if defined(__GLIBC__) && defined(__USE_MISC) && !defined(MW_THREADS)
+#define mw_fwrite fwrite_unlocked
+#else
+#define mw_fwrite fwrite
+#endif
+
+static char mw_out_buf[MW_OUT_BUFSIZE];
+static const char mw_digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline void mw_out_init(void) {
+    setvbuf(stdout, mw_out_buf, MW_LINE_FLUSH ? _IOLBF : _IOFBF, sizeof mw_out_buf);
+}
+
+static inline char* mw_fmt_u64(char* end, unsigned long long u) {
+    while (u >= 100) {
+        unsigned d = (unsigned)(u % 100) * 2;
+        u /= 100;
+        *--end = mw_digits[d + 1];
+        *--end = mw_digits[d];
+    }
+    if (u >= 10) {
+        unsigned d = (unsigned)u * 2;
+        *--end = mw_digits[d + 1];
+        *--end = mw_digits[d];
+    } else {
+        *--end = (char)('0' + u);
+    }
+    return end;
+}
+
+static inline void mw_beep_str(const char* s) {
+    char nl = '\n';
+#ifdef MW_THREADS
+    flockfile(stdout);   /* two writes, one line */
+#endif
+    mw_fwrite(s, 1, strlen(s), stdout);
+    mw_fwrite(&nl, 1, 1, stdout);
+#ifdef MW_THREADS
+    funlockfile(stdout);
+#endif
+}
+
+static inline void mw_beep_int(long long v) {
+    char buf[24];
+    char* end = buf + sizeof buf;
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    *--end = '\n';
+    char* p = mw_fmt_u64(end, u);
+    if (v < 0) *--p = '-';
+    mw_fwrite(p, 1, (size_t)(buf + sizeof buf - p), stdout);
+}
+
+static inline void mw_beep_bool(int v) {
+    mw_beep_str(v ? "true" : "false");
+}
+
+/* %g: six significant digits, written here unless %g would use an exponent (from 1e6 after
+   rounding, and below 1e-4), which is left to snprintf */
+static inline void mw_beep_float(double v) {
+    static const unsigned long long pow10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+        1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL
+    };
+    char buf[48];
+    char* p = buf;
+    if (v < 0) { *p++ = '-'; v = -v; }
+    if (v != v || v >= 999999.5 || (v != 0 && v < 1e-4)) {
+        int n = snprintf(p, sizeof buf - 2, "%g", v);
+        p += n;
+    } else {
+        unsigned long long ip = (unsigned long long)v;
+        int prec;
+        if (ip == 0) {
+            prec = v < 0.001 ? 9 : v < 0.01 ? 8 : v < 0.1 ? 7 : 6;
+        } else {
+            int idigits = 0;
+            for (unsigned long long t = ip; t; t /= 10) ++idigits;
+            prec = idigits >= 6 ? 0 : 6 - idigits;
+        }
+        unsigned long long scale = pow10[prec];
+        unsigned long long frac = (unsigned long long)((v - (double)ip) * (double)scale + 0.5);
+        if (frac >= scale) { ++ip; frac -= scale; }
+        char tmp[24];
+        char* s = mw_fmt_u64(tmp + sizeof tmp, ip);
+        memcpy(p, s, (size_t)(tmp + sizeof tmp - s));
+        p += tmp + sizeof tmp - s;
+        if (frac) {
+            while (frac % 10 == 0) { frac /= 10; --prec; }
+            *p++ = '.';
+            s = mw_fmt_u64(tmp + sizeof tmp, frac);
+            for (int pad = prec - (int)(tmp + sizeof tmp - s); pad > 0; --pad) *p++ = '0';
+            memcpy(p, s, (size_t)(tmp + sizeof tmp - s));
+            p += tmp + sizeof tmp - s;
+        }
+    }
+    *p++ = '\n';
+    mw_fwrite(buf, 1, (size_t)(p - buf), stdout);
+}
+
+)";
+const char* const arrayRuntimeC = R"(/* array runtime: pointer + length + capacity; cap == 0 means the storage is not owned (slice,
+   copy or empty). Making a view of an array hands its storage over to no one, so an owner is
+   the only array pointing into its buffer: growing reallocates it, and a local that is never
+   handed on releases it when it goes out of scope */
+#include <stdlib.h>
+
+/* element-wise loops write a fresh array, so no store can feed a later load; their inner
+   loops have a fixed length and are unrolled so that GCC vectorizes them at -O2 */
+#if defined(__GNUC__) && !defined(__clang__)
+#define MW_PRAGMA(x) _Pragma(#x)
+#define MW_IVDEP _Pragma("GCC ivdep")
+#define MW_UNROLL(n) MW_PRAGMA(GCC unroll n)
+#else
+#define MW_IVDEP
+#define MW_UNROLL(n)
+#endif
+
+/* element-wise operands must agree in length */
+static inline void mw_length_check(size_t n, size_t m, int line) {
+    if (n == m) return;
+    fprintf(stderr, "microwave: line %d: element-wise operands have lengths %zu and %zu\n", line, n, m);
+    exit(1);
+}
+
+#define MW_DEFINE_ARRAY(NAME, T) \
+typedef struct { T* data; size_t len; size_t cap; } mw_##NAME##_array; \
+static inline void mw_##NAME##_array_reserve(mw_##NAME##_array* a, size_t need) { \
+    if (need <= a->cap) return; \
+    size_t cap = a->cap ? a->cap * 2 : 8; \
+    while (cap < need) cap *= 2; \
+    T* data; \
+    if (a->cap) { \
+        data = (T*)realloc(a->data, cap * sizeof(T)); \
+    } else { \
+        data = (T*)malloc(cap * sizeof(T)); \
+        if (data && a->len) memcpy(data, a->data, a->len * sizeof(T)); \
+    } \
+    if (!data) { fputs("microwave: out of memory\n", stderr); abort(); } \
+    a->data = data; \
+    a->cap = cap; \
+} \
+static inline mw_##NAME##_array mw_##NAME##_array_alloc(size_t n) { \
+    mw_##NAME##_array a = { NULL, 0, 0 }; \
+    mw_##NAME##_array_reserve(&a, n); \
+    a.len = n; \
+    return a; \
+} \
+static inline mw_##NAME##_array mw_##NAME##_array_from(T const* src, size_t n) { \
+    mw_##NAME##_array a = { NULL, 0, 0 }; \
+    mw_##NAME##_array_reserve(&a, n); \
+    if (n) memcpy(a.data, src, n * sizeof(T)); \
+    a.len = n; \
+    return a; \
+} \
+static inline void mw_##NAME##_array_push(mw_##NAME##_array* a, T v) { \
+    if (a->len >= a->cap) mw_##NAME##_array_reserve(a, a->len + 1); \
+    a->data[a->len++] = v; \
+} \
+static inline void mw_##NAME##_array_append(mw_##NAME##_array* a, mw_##NAME##_array b) { \
+    int self = a->cap && b.data == a->data;   /* b may be a itself, whose storage growing moves */ \
+    mw_##NAME##_array_reserve(a, a->len + b.len); \
+    if (b.len) memmove(a->data + a->len, self ? a->data : b.data, b.len * sizeof(T)); \
+    a->len += b.len; \
+} \
+static inline mw_##NAME##_array mw_##NAME##_array_slice(mw_##NAME##_array a, long long lo, long long hi) { \
+    if (lo < 0) lo = 0; \
+    if (hi > (long long)a.len) hi = (long long)a.len; \
+    if (hi < lo) hi = lo; \
+    mw_##NAME##_array s = { a.data + lo, (size_t)(hi - lo), 0 }; \
+    return s; \
+} \
+/* a view of *a, which gives up its storage: neither frees it nor grows it in place */ \
+static inline mw_##NAME##_array mw_##NAME##_array_share(mw_##NAME##_array* a) { \
+    a->cap = 0; \
+    mw_##NAME##_array s = { a->data, a->len, 0 }; \
+    return s; \
+} \
+/* cleanup for a local that is never handed on */ \
+static inline void mw_##NAME##_array_release(mw_##NAME##_array* a) { \
+    if (a->cap) free(a->data); \
+} \
+static inline mw_##NAME##_array mw_##NAME##_array_copy(mw_##NAME##_array a) { \
+    return mw_##NAME##_array_from(a.data, a.len); \
+} \
+static inline void mw_##NAME##_array_fill(mw_##NAME##_array a, T v) { \
+    T* restrict p = a.data; \
+    for (size_t i = 0, n = a.len; i < n; ++i) p[i] = v; \
+}
+
+)";
+const char* const mapRuntimeC = R"(/* map runtime: entries stay dense in insertion order (keys, values and hashes in parallel
+   arrays) and are found through an open-addressing index probed linearly; removing an entry
+   moves the last one into its place */
+typedef struct { unsigned hash; unsigned entry; } mw_map_slot;   /* entry is the index + 1, 0 when free */
+
+/* the index stays at most 3/4 full */
+#define MW_MAP_FITS(len, slots) ((len) <= (slots) / 4 * 3)
+
+static inline unsigned mw_key_int_hash(int k) {
+    return (unsigned)(((unsigned long long)(unsigned)k * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+static inline int mw_key_int_eq(int a, int b) { return a == b; }
+static inline int mw_key_int_copy(int k) { return k; }
+static inline void mw_key_int_missing(int k, int line) {
+    fprintf(stderr, "microwave: line %d: key %d is not in the map\n", line, k);
+    exit(1);
+}
+
+static inline unsigned mw_key_string_hash(const char* k) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (; *k; ++k) h = (h ^ (unsigned char)*k) * 1099511628211ULL;
+    return (unsigned)(h ^ (h >> 32));
+}
+static inline int mw_key_string_eq(const char* a, const char* b) { return a == b || strcmp(a, b) == 0; }
+/* keys are copied, since strings built in temp_str change under the map */
+static inline char* mw_key_string_copy(const char* k) {
+    size_t n = strlen(k) + 1;
+    char* copy = (char*)malloc(n);
+    if (!copy) { fputs("microwave: out of memory\n", stderr); abort(); }
+    return (char*)memcpy(copy, k, n);
+}
+static inline void mw_key_string_missing(const char* k, int line) {
+    fprintf(stderr, "microwave: line %d: key \"%s\" is not in the map\n", line, k);
+    exit(1);
+}
+
+/* string values are copied for the same reason; the other values are stored as they are */
+static inline int mw_value_int_copy(int v) { return v; }
+static inline float mw_value_float_copy(float v) { return v; }
+static inline int mw_value_bool_copy(int v) { return v; }
+static inline char* mw_value_string_copy(const char* v) { return mw_key_string_copy(v); }
+
+static inline void* mw_map_grow(void* p, size_t n) {
+    p = realloc(p, n);
+    if (!p) { fputs("microwave: out of memory\n", stderr); abort(); }
+    return p;
+}
+
+/* m[k] = v holds a copy of a string key while v is evaluated, since v may be built in temp_str
+   too; stores made while evaluating v push and take above it */
+static _Thread_local char** mw_key_held;
+static _Thread_local size_t mw_key_held_len, mw_key_held_cap;
+static inline void mw_key_string_hold(const char* k) {
+    if (mw_key_held_len == mw_key_held_cap) {
+        mw_key_held_cap = mw_key_held_cap ? mw_key_held_cap * 2 : 8;
+        mw_key_held = (char**)mw_map_grow(mw_key_held, mw_key_held_cap * sizeof *mw_key_held);
+    }
+    mw_key_held[mw_key_held_len++] = mw_key_string_copy(k);
+}
+static inline char* mw_key_string_take(void) { return mw_key_held[--mw_key_held_len]; }
+
+/* instantiate after MW_DEFINE_ARRAY for the key and value types, which keys() and values() return */
+#define MW_DEFINE_MAP(KN, VN, K, V) \
+typedef struct { K* keys; V* values; unsigned* hashes; size_t len, cap; mw_map_slot* slots; size_t mask; } mw_##KN##_##VN##_map; \
+static inline mw_##KN##_##VN##_map* mw_##KN##_##VN##_map_new(void) { \
+    mw_##KN##_##VN##_map* m = (mw_##KN##_##VN##_map*)calloc(1, sizeof *m); \
+    mw_map_slot* slots = (mw_map_slot*)calloc(8, sizeof *slots); \
+    if (!m || !slots) { fputs("microwave: out of memory\n", stderr); abort(); } \
+    m->slots = slots; \
+    m->mask = 7; \
+    return m; \
+} \
+/* index slot holding the key, or the free slot that ends its probe */ \
+static inline size_t mw_##KN##_##VN##_map_probe(const mw_##KN##_##VN##_map* m, K k, unsigned h) { \
+    size_t i = h & m->mask; \
+    for (;;) { \
+        mw_map_slot s = m->slots[i]; \
+        if (!s.entry || (s.hash == h && mw_key_##KN##_eq(m->keys[s.entry - 1], k))) return i; \
+        i = (i + 1) & m->mask; \
+    } \
+} \
+/* rebuilds the index with at least n slots, and never fewer than the entries need */ \
+static inline void mw_##KN##_##VN##_map_rehash(mw_##KN##_##VN##_map* m, size_t n) { \
+    size_t size = 8; \
+    while (size < n || !MW_MAP_FITS(m->len, size)) size *= 2; \
+    mw_map_slot* slots = (mw_map_slot*)calloc(size, sizeof *slots); \
+    if (!slots) { fputs("microwave: out of memory\n", stderr); abort(); } \
+    for (size_t e = 0; e < m->len; ++e) { \
+        size_t i = m->hashes[e] & (size - 1); \
+        while (slots[i].entry) i = (i + 1) & (size - 1); \
+        slots[i].hash = m->hashes[e]; \
+        slots[i].entry = (unsigned)e + 1; \
+    } \
+    free(m->slots); \
+    m->slots = slots; \
+    m->mask = size - 1; \
+} \
+/* room for n entries without growing the entries or the index */ \
+static inline void mw_##KN##_##VN##_map_reserve(mw_##KN##_##VN##_map* m, size_t n) { \
+    if (n > m->cap) { \
+        m->keys = (K*)mw_map_grow(m->keys, n * sizeof(K)); \
+        m->values = (V*)mw_map_grow(m->values, n * sizeof(V)); \
+        m->hashes = (unsigned*)mw_map_grow(m->hashes, n * sizeof(unsigned)); \
+        m->cap = n; \
+    } \
+    size_t size = m->mask + 1; \
+    while (!MW_MAP_FITS(n, size)) size *= 2; \
+    if (size != m->mask + 1) mw_##KN##_##VN##_map_rehash(m, size); \
+} \
+/* value slot for k, inserted as zero when missing */ \
+static inline V* mw_##KN##_##VN##_map_slot(mw_##KN##_##VN##_map* m, K k) { \
+    unsigned h = mw_key_##KN##_hash(k); \
+    size_t i = mw_##KN##_##VN##_map_probe(m, k, h); \
+    if (m->slots[i].entry) return &m->values[m->slots[i].entry - 1]; \
+    if (m->len == m->cap || !MW_MAP_FITS(m->len + 1, m->mask + 1)) { \
+        if (m->len == m->cap) mw_##KN##_##VN##_map_reserve(m, m->cap ? m->cap * 2 : 8); \
+        else mw_##KN##_##VN##_map_rehash(m, (m->mask + 1) * 2); \
+        i = mw_##KN##_##VN##_map_probe(m, k, h); \
+    } \
+    size_t e = m->len++; \
+    m->keys[e] = mw_key_##KN##_copy(k); \
+    m->values[e] = (V)0; \
+    m->hashes[e] = h; \
+    m->slots[i].hash = h; \
+    m->slots[i].entry = (unsigned)e + 1; \
+    return &m->values[e]; \
+} \
+static inline V mw_##KN##_##VN##_map_put(mw_##KN##_##VN##_map* m, K k, V v) { \
+    return *mw_##KN##_##VN##_map_slot(m, k) = mw_value_##VN##_copy(v); \
+} \
+static inline V mw_##KN##_##VN##_map_at(const mw_##KN##_##VN##_map* m, K k, int line) { \
+    mw_map_slot s = m->slots[mw_##KN##_##VN##_map_probe(m, k, mw_key_##KN##_hash(k))]; \
+    if (MW_UNLIKELY(!s.entry)) mw_key_##KN##_missing(k, line); \
+    return m->values[s.entry - 1]; \
+} \
+static inline V mw_##KN##_##VN##_map_get(const mw_##KN##_##VN##_map* m, K k, V fallback) { \
+    mw_map_slot s = m->slots[mw_##KN##_##VN##_map_probe(m, k, mw_key_##KN##_hash(k))]; \
+    return s.entry ? m->values[s.entry - 1] : fallback; \
+} \
+static inline int mw_##KN##_##VN##_map_has(const mw_##KN##_##VN##_map* m, K k) { \
+    return m->slots[mw_##KN##_##VN##_map_probe(m, k, mw_key_##KN##_hash(k))].entry != 0; \
+} \
+static inline int mw_##KN##_##VN##_map_remove(mw_##KN##_##VN##_map* m, K k) { \
+    size_t i = mw_##KN##_##VN##_map_probe(m, k, mw_key_##KN##_hash(k)); \
+    unsigned entry = m->slots[i].entry; \
+    if (!entry) return 0; \
+    /* backward shift: pull later slots of the run into the gap unless they would pass their home slot */ \
+    for (size_t j = (i + 1) & m->mask; m->slots[j].entry; j = (j + 1) & m->mask) { \
+        size_t home = m->slots[j].hash & m->mask; \
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) { \
+            m->slots[i] = m->slots[j]; \
+            i = j; \
+        } \
+    } \
+    m->slots[i].entry = 0; \
+    size_t last = --m->len; \
+    if (entry - 1 != last) { \
+        size_t at = m->hashes[last] & m->mask; \
+        while (m->slots[at].entry != last + 1) at = (at + 1) & m->mask; \
+        m->slots[at].entry = entry; \
+        m->keys[entry - 1] = m->keys[last]; \
+        m->values[entry - 1] = m->values[last]; \
+        m->hashes[entry - 1] = m->hashes[last]; \
+    } \
+    return 1; \
+} \
+static inline mw_##KN##_array mw_##KN##_##VN##_map_keys(const mw_##KN##_##VN##_map* m) { \
+    return mw_##KN##_array_from(m->keys, m->len); \
+} \
+static inline mw_##VN##_array mw_##KN##_##VN##_map_values(const mw_##KN##_##VN##_map* m) { \
+    return mw_##VN##_array_from(m->values, m->len); \
+}
+
+)";
+const char* const profileRuntimeC = R"(/* profiling runtime: call counts, inclusive time of outermost activations, loop and branch counts */
+#include <stdlib.h>
+#include <time.h>
+#ifndef MW_PROF_FILE
+#define MW_PROF_FILE "microwave.prof"
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MW_PROF_UNIT "cycles"
+static inline unsigned long long mw_prof_now(void) { return __rdtsc(); }
+#else
+#define MW_PROF_UNIT "ns"
+static inline unsigned long long mw_prof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+#endif
+
+typedef struct { int fn; unsigned long long start; } mw_prof_frame;
+
+static inline mw_prof_frame mw_prof_enter(int fn) {
+    mw_prof_frame frame = { fn, 0 };
+    mw_prof_calls[fn]++;
+    if (mw_prof_depth[fn]++ == 0) frame.start = mw_prof_now();
+    return frame;
+}
+
+static inline void mw_prof_leave(mw_prof_frame* frame) {
+    if (--mw_prof_depth[frame->fn] == 0) mw_prof_ticks[frame->fn] += mw_prof_now() - frame->start;
+}
+
+static inline int mw_prof_branch(int id, int cond) {
+    mw_prof_evals[id]++;
+    mw_prof_taken[id] += cond != 0;
+    return cond;
+}
+
+static void mw_prof_dump(void) {
+    const char* path = getenv("MW_PROFILE");
+    FILE* out = fopen(path && *path ? path : MW_PROF_FILE, "w");
+    if (!out) return;
+    fprintf(out, "# microwave profile v1 unit=%s source=%s\n", MW_PROF_UNIT, mw_prof_source);
+    for (int i = 0; i < MW_PROF_FUNCS; ++i) {
+        fprintf(out, "func %s line %d calls %llu ticks %llu\n", mw_prof_func_names[i],
+                mw_prof_func_lines[i], mw_prof_calls[i], mw_prof_ticks[i]);
+    }
+    for (int i = 0; i < MW_PROF_LOOPS; ++i) {
+        fprintf(out, "loop %s %s line %d entries %llu iters %llu\n", mw_prof_loop_kinds[i],
+                mw_prof_func_names[mw_prof_loop_funcs[i]], mw_prof_loop_lines[i],
+                mw_prof_entries[i], mw_prof_iters[i]);
+    }
+    for (int i = 0; i < MW_PROF_BRANCHES; ++i) {
+        fprintf(out, "branch %s line %d evals %llu taken %llu\n",
+                mw_prof_func_names[mw_prof_branch_funcs[i]], mw_prof_branch_lines[i],
+                mw_prof_evals[i], mw_prof_taken[i]);
+    }
+    fclose(out);
+}
+
+)";
+const char* const memoRuntimeC = R"(/* popcorn runtime: fixed-size open-addressing caches keyed on argument bits */
+#ifndef MW_MEMO_PROBES
+#define MW_MEMO_PROBES 8
+#endif
+
+static inline unsigned long long mw_memo_bits_int(int v) { return (unsigned long long)(unsigned)v; }
+static inline unsigned long long mw_memo_bits_float(float v) {
+    unsigned bits;
+    memcpy(&bits, &v, sizeof bits);
+    return bits;
+}
+
+static inline unsigned long long mw_memo_mix(unsigned long long h, unsigned long long v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 29);
+}
+
+)";
+const char* const asmRuntimeC = R"(/* assembly backend entry points: the beep runtime behind plain C symbols */
+char temp_str[256];
+
+void mw_rt_init(int line_flush) {
+    setvbuf(stdout, mw_out_buf, line_flush ? _IOLBF : _IOFBF, sizeof mw_out_buf);
+}
+
+void mw_rt_beep_int(long long v) { mw_beep_int(v); }
+void mw_rt_beep_bool(int v) { mw_beep_bool(v); }
+void mw_rt_beep_str(const char* s) { mw_beep_str(s); }
+void mw_rt_beep_float(double v) { mw_beep_float(v); }
+
+/* "literal" + int, into the buffer every such concatenation shares, as in generated C */
+char* mw_rt_concat_int(const char* prefix, int v) {
+    snprintf(temp_str, sizeof temp_str, "%s%d", prefix, v);
+    return temp_str;
+}
+
+/* arrays with the element size passed in; same layout and growth as MW_DEFINE_ARRAY */
+typedef struct { char* data; size_t len; size_t cap; } mw_rt_array;
+
+static void mw_rt_array_reserve(mw_rt_array* a, size_t need, size_t size) {
+    if (need <= a->cap) return;
+    size_t cap = a->cap ? a->cap * 2 : 8;
+    while (cap < need) cap *= 2;
+    char* data = (char*)malloc(cap * size);
+    if (data && a->len) memcpy(data, a->data, a->len * size);
+    if (!data) { fputs("microwave: out of memory\n", stderr); abort(); }
+    a->data = data;
+    a->cap = cap;
+}
+
+void mw_rt_array_from(mw_rt_array* dst, const void* src, size_t n, size_t size) {
+    mw_rt_array a = { NULL, 0, 0 };
+    mw_rt_array_reserve(&a, n, size);
+    if (n) memcpy(a.data, src, n * size);
+    a.len = n;
+    *dst = a;
+}
+
+void mw_rt_array_push(mw_rt_array* a, const void* value, size_t size) {
+    if (a->len >= a->cap) mw_rt_array_reserve(a, a->len + 1, size);
+    memcpy(a->data + a->len++ * size, value, size);
+}
+
+void mw_rt_array_append(mw_rt_array* a, const mw_rt_array* b, size_t size) {
+    mw_rt_array src = *b;   /* b may be a itself; the storage it had stays valid after growing */
+    mw_rt_array_reserve(a, a->len + src.len, size);
+    if (src.data == NULL || src.len == 0) return;
+    memmove(a->data + a->len * size, src.data, src.len * size);
+    a->len += src.len;
+}
+
+void mw_rt_array_slice(mw_rt_array* dst, const mw_rt_array* a, long long lo, long long hi, size_t size) {
+    if (lo < 0) lo = 0;
+    if (hi > (long long)a->len) hi = (long long)a->len;
+    if (hi < lo) hi = lo;
+    mw_rt_array s = { a->data + lo * size, (size_t)(hi - lo), 0 };
+    *dst = s;
+}
+
+void mw_rt_array_copy(mw_rt_array* dst, const mw_rt_array* a, size_t size) {
+    mw_rt_array_from(dst, a->data, a->len, size);
+}
+
+void mw_rt_array_fill(const mw_rt_array* a, const void* value, size_t size) {
+    for (size_t i = 0; i < a->len; ++i) memcpy(a->data + i * size, value, size);
+}
+
+)";
+const char* const taskRuntimeC = R"(/* task runtime: spawn pushes onto the worker's own deque (Chase-Lev), idle workers steal the oldest task */
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifndef MW_DEQUE_SIZE
+#define MW_DEQUE_SIZE 4096
+#endif
+#ifndef MW_MAX_WORKERS
+#define MW_MAX_WORKERS 256
+#endif
+#ifndef MW_IDLE_SPINS
+#define MW_IDLE_SPINS 1024
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#define mw_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define mw_cpu_relax() __asm__ __volatile__("yield")
+#else
+#define mw_cpu_relax() ((void)0)
+#endif
+
+typedef struct mw_frame mw_frame;
+typedef struct mw_task {
+    void (*run)(struct mw_task*);
+    mw_frame* frame;
+    struct mw_task* next;   /* heap-allocated tasks of the frame, freed at sync */
+} mw_task;
+
+/* The spawns of one function activation: how many are unfinished, and where its deque entries start */
+struct mw_frame {
+    atomic_long pending;
+    long base;
+    mw_task* heap;
+};
+
+/* The owner pushes and pops at bottom; thieves take from top */
+typedef struct {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    unsigned rng;
+    _Atomic(mw_task*) slots[MW_DEQUE_SIZE];
+} mw_worker;
+
+static mw_worker* mw_workers;
+static int mw_worker_count = 1;
+static _Thread_local mw_worker* mw_self;
+static atomic_int mw_sleepers;
+static pthread_mutex_t mw_sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mw_sleep_cond = PTHREAD_COND_INITIALIZER;
+
+static inline int mw_deque_push(mw_worker* w, mw_task* t) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+    if (b - atomic_load_explicit(&w->top, memory_order_acquire) >= MW_DEQUE_SIZE) return 0;
+    atomic_store_explicit(&w->slots[b & (MW_DEQUE_SIZE - 1)], t, memory_order_relaxed);
+    atomic_store_explicit(&w->bottom, b + 1, memory_order_release);   /* publishes the task's fields */
+    return 1;
+}
+
+static inline mw_task* mw_deque_pop(mw_worker* w) {
+    long b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&w->top, memory_order_relaxed);
+    mw_task* t = NULL;
+    if (top <= b) {
+        t = atomic_load_explicit(&w->slots[b & (MW_DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (top == b) {
+            /* the last entry: race the thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&w->top, &top, top + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed)) {
+                t = NULL;
+            }
+            atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+    }
+    return t;
+}
+
+static inline mw_task* mw_deque_steal(mw_worker* w) {
+    long top = atomic_load_explicit(&w->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+    if (top >= b) return NULL;
+    mw_task* t = atomic_load_explicit(&w->slots[top & (MW_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&w->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return t;
+}
+
+/* The task may be gone once its frame hears it finished, so the frame is read first */
+static inline void mw_task_run(mw_task* t) {
+    mw_frame* f = t->frame;
+    t->run(t);
+    atomic_fetch_sub_explicit(&f->pending, 1, memory_order_release);
+}
+
+/* One pass over the other workers from a random start */
+static mw_task* mw_steal_any(mw_worker* self) {
+    int n = mw_worker_count;
+    self->rng = self->rng * 1103515245u + 12345u;
+    int start = (int)((self->rng >> 16) % (unsigned)n);
+    for (int i = 0; i < n; ++i) {
+        mw_worker* victim = &mw_workers[(start + i) % n];
+        if (victim == self) continue;
+        mw_task* t = mw_deque_steal(victim);
+        if (t) return t;
+    }
+    return NULL;
+}
+
+static int mw_work_visible(void) {
+    for (int i = 0; i < mw_worker_count; ++i) {
+        if (atomic_load_explicit(&mw_workers[i].top, memory_order_relaxed) <
+            atomic_load_explicit(&mw_workers[i].bottom, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Steal, spin a while when there is nothing, then sleep until a spawn wakes us */
+static void* mw_worker_main(void* arg) {
+    mw_self = (mw_worker*)arg;
+    for (int idle = 0;;) {
+        mw_task* t = mw_steal_any(mw_self);
+        if (t) {
+            mw_task_run(t);
+            idle = 0;
+        } else if (++idle < MW_IDLE_SPINS) {
+            mw_cpu_relax();
+        } else {
+            pthread_mutex_lock(&mw_sleep_lock);
+            atomic_fetch_add(&mw_sleepers, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!mw_work_visible()) pthread_cond_wait(&mw_sleep_cond, &mw_sleep_lock);
+            atomic_fetch_sub(&mw_sleepers, 1);
+            pthread_mutex_unlock(&mw_sleep_lock);
+            idle = 0;
+        }
+    }
+    return NULL;
+}
+
+/* The main thread is worker 0; $MW_WORKERS overrides one worker per core */
+static void mw_tasks_init(void) {
+    const char* env = getenv("MW_WORKERS");
+    long n = env && *env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > MW_MAX_WORKERS) n = MW_MAX_WORKERS;
+    mw_workers = (mw_worker*)aligned_alloc(_Alignof(mw_worker), (size_t)n * sizeof(mw_worker));
+    if (!mw_workers) { fputs("microwave: out of memory\n", stderr); abort(); }
+    for (long i = 0; i < n; ++i) {
+        atomic_init(&mw_workers[i].top, 0);
+        atomic_init(&mw_workers[i].bottom, 0);
+        mw_workers[i].rng = (unsigned)i * 2654435761u + 1;
+    }
+    mw_self = &mw_workers[0];
+    mw_worker_count = (int)n;
+    for (long i = 1; i < n; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, mw_worker_main, &mw_workers[i]) != 0) {
+            mw_worker_count = (int)i;   /* run with the workers we got */
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+static inline void mw_frame_enter(mw_frame* f) {
+    atomic_init(&f->pending, 0);
+    f->base = atomic_load_explicit(&mw_self->bottom, memory_order_relaxed);
+    f->heap = NULL;
+}
+
+/* Task storage for a spawn inside a loop, where one stack slot per site would not do */
+static inline void* mw_task_new(mw_frame* f, size_t size) {
+    mw_task* t = (mw_task*)malloc(size);
+    if (!t) { fputs("microwave: out of memory\n", stderr); abort(); }
+    t->next = f->heap;
+    f->heap = t;
+    return t;
+}
+
+static inline void mw_spawn(mw_frame* f, mw_task* t) {
+    t->frame = f;
+    atomic_fetch_add_explicit(&f->pending, 1, memory_order_relaxed);
+    if (mw_worker_count < 2 || !mw_deque_push(mw_self, t)) {
+        mw_task_run(t);
+        return;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&mw_sleepers, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&mw_sleep_lock);
+        pthread_cond_signal(&mw_sleep_cond);
+        pthread_mutex_unlock(&mw_sleep_lock);
+    }
+}
+
+/* Runs this frame's own tasks newest first; once the rest are stolen, helps elsewhere until they finish */
+static void mw_sync(mw_frame* f) {
+    while (atomic_load_explicit(&f->pending, memory_order_acquire) > 0) {
+        mw_task* t = NULL;
+        if (atomic_load_explicit(&mw_self->bottom, memory_order_relaxed) > f->base) t = mw_deque_pop(mw_self);
+        if (!t) t = mw_steal_any(mw_self);
+        if (t) mw_task_run(t);
+        else mw_cpu_relax();
+    }
+    while (f->heap) {
+        mw_task* next = f->heap->next;
+        free(f->heap);
+        f->heap = next;
+    }
+}
+
+/* A string argument or result in temp_str would be overwritten by its thread's next
+   concatenation, so it travels in a copy */
+static inline char* mw_task_str(char* s, char* copy) {
+    if (s != temp_str) return s;
+    memcpy(copy, s, sizeof temp_str);
+    return copy;
+}
+
+static inline char* mw_task_result_str(char* s) {
+    if (s != temp_str) return s;
+    char* copy = strdup(s);
+    if (!copy) { fputs("microwave: out of memory\n", stderr); abort(); }
+    return copy;
+}
+
+)";
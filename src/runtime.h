@@ -0,0 +1,25 @@
+#pragma once
+
+// C runtime fragments emitted into generated programs
+
+// Buffered, type-specialized writers behind the beep statement
+extern const char* const beepRuntimeC;
+
+// Length-carrying growable arrays; instantiate with MW_DEFINE_ARRAY(name, elementType)
+extern const char* const arrayRuntimeC;
+
+// Hash maps with int or string keys; instantiate with MW_DEFINE_MAP(keyName, valueName, K, V)
+// after the arrays of the key and value types
+extern const char* const mapRuntimeC;
+
+// --instrument counters; expects the mw_prof_* tables emitted ahead of it
+extern const char* const profileRuntimeC;
+
+// Key hashing for popcorn (memoized) functions
+extern const char* const memoRuntimeC;
+
+// Work-stealing scheduler behind spawn and sync; expects temp_str ahead of it and MW_THREADS defined
+extern const char* const taskRuntimeC;
+
+// Entry points called by generated assembly; expects beepRuntimeC ahead of it
+extern const char* const asmRuntimeC;
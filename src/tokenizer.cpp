@@ -6,7 +6,7 @@
 static const std::unordered_set<std::string> keywords = {
     "heat", "timer", "beep", "defrost", "mode", "popcorn", "door_closed", "door_open", 
     "if", "else", "while", "for", "break", "continue", "return", "int", "float", 
-    "string", "bool", "true", "false", "lambda", "auto", "void"
+    "string", "bool", "true", "false", "lambda", "auto", "void", "spawn", "sync", "map"
 };
 
 std::vector<Token> tokenize(const std::string& source) {
@@ -0,0 +1,934 @@
+#include "vm.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+// Computed-goto dispatch where the compiler supports labels as values, a switch otherwise
+#if defined(__GNUC__) && !defined(MW_VM_SWITCH)
+#define MW_VM_THREADED 1
+#endif
+
+static const size_t maxCallDepth = 1 << 20;
+static const size_t outBufSize = 1 << 16;
+static const size_t minCollection = 1 << 16;   // allocation units between collections, at least
+
+static inline int32_t wrap(int64_t v) { return static_cast<int32_t>(static_cast<uint32_t>(v)); }
+static inline bool intLike(const Value& v) { return v.type == ValueType::Int || v.type == ValueType::Bool; }
+
+static const char* typeName(ValueType type) {
+    switch (type) {
+        case ValueType::Void: return "void";
+        case ValueType::Int: return "int";
+        case ValueType::Float: return "float";
+        case ValueType::Bool: return "bool";
+        case ValueType::String: return "string";
+        case ValueType::Array: return "array";
+        case ValueType::Map: return "map";
+        case ValueType::Function: return "function";
+    }
+    return "?";
+}
+
+[[noreturn]] static void fail(const std::string& message) { throw std::runtime_error(message); }
+
+static double asDouble(const Value& v) {
+    if (intLike(v)) return v.i;
+    if (v.type == ValueType::Float) return v.f;
+    fail(std::string("expected a number, got ") + typeName(v.type));
+}
+
+static int32_t asInt(const Value& v) {
+    if (intLike(v)) return v.i;
+    fail(std::string("expected an integer, got ") + typeName(v.type));
+}
+
+static bool truthy(const Value& v) {
+    switch (v.type) {
+        case ValueType::Void: return false;
+        case ValueType::Float: return v.f != 0;
+        case ValueType::Int:
+        case ValueType::Bool: return v.i != 0;
+        default: return true;
+    }
+}
+
+// Same digits as mw_beep_float in the C runtime: %g, with the exponent forms left to snprintf
+static void formatFloat(std::string& out, double v) {
+    static const unsigned long long pow10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL
+    };
+    if (v < 0) {
+        out += '-';
+        v = -v;
+    }
+    if (v != v || v >= 999999.5 || (v != 0 && v < 1e-4)) {
+        char buf[32];
+        snprintf(buf, sizeof buf, "%g", v);
+        out += buf;
+        return;
+    }
+    unsigned long long ip = static_cast<unsigned long long>(v);
+    int prec;
+    if (ip == 0) {
+        prec = v < 0.001 ? 9 : v < 0.01 ? 8 : v < 0.1 ? 7 : 6;
+    } else {
+        int idigits = 0;
+        for (unsigned long long t = ip; t; t /= 10) ++idigits;
+        prec = idigits >= 6 ? 0 : 6 - idigits;
+    }
+    unsigned long long scale = pow10[prec];
+    unsigned long long frac = static_cast<unsigned long long>((v - static_cast<double>(ip)) * scale + 0.5);
+    if (frac >= scale) {
+        ++ip;
+        frac -= scale;
+    }
+    out += std::to_string(ip);
+    if (frac) {
+        while (frac % 10 == 0) {
+            frac /= 10;
+            --prec;
+        }
+        std::string digits = std::to_string(frac);
+        out += '.';
+        out.append(prec - digits.size(), '0');
+        out += digits;
+    }
+}
+
+static void formatValue(std::string& out, const Value& v) {
+    switch (v.type) {
+        case ValueType::Int: out += std::to_string(v.i); break;
+        case ValueType::Float: formatFloat(out, v.f); break;
+        case ValueType::Bool: out += v.i ? "true" : "false"; break;
+        case ValueType::String: out += *v.s; break;
+        case ValueType::Array: out += "<array>"; break;
+        case ValueType::Map: out += "<map>"; break;
+        case ValueType::Function: out += "<function>"; break;
+        case ValueType::Void: out += "<void>"; break;
+    }
+}
+
+// printf conversions, each handed to snprintf with the argument widened to its C type
+static int formatPrintf(std::string& out, const Value* args, int count) {
+    if (count == 0 || args[0].type != ValueType::String) fail("printf needs a format string");
+    const std::string& fmt = *args[0].s;
+    size_t start = out.size();
+    int next = 1;
+    auto arg = [&]() -> const Value& {
+        if (next >= count) fail("printf: too few arguments for \"" + fmt + "\"");
+        return args[next++];
+    };
+    char buf[512];
+    for (size_t i = 0; i < fmt.size(); ++i) {
+        if (fmt[i] != '%') {
+            out += fmt[i];
+            continue;
+        }
+        std::string spec = "%";
+        size_t j = i + 1;
+        while (j < fmt.size() && strchr("-+ #0", fmt[j])) spec += fmt[j++];
+        while (j < fmt.size() && (isdigit(static_cast<unsigned char>(fmt[j])) || fmt[j] == '.')) spec += fmt[j++];
+        while (j < fmt.size() && strchr("hlLqjzt", fmt[j])) ++j; // widths come from the value
+        if (j >= fmt.size()) {
+            out += fmt.substr(i);
+            break;
+        }
+        char conv = fmt[j];
+        i = j;
+        switch (conv) {
+            case '%':
+                out += '%';
+                continue;
+            case 'd': case 'i':
+                snprintf(buf, sizeof buf, (spec + "lld").c_str(), static_cast<long long>(asInt(arg())));
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                snprintf(buf, sizeof buf, (spec + "ll" + conv).c_str(),
+                         static_cast<unsigned long long>(static_cast<uint32_t>(asInt(arg()))));
+                break;
+            case 'c':
+                snprintf(buf, sizeof buf, (spec + "c").c_str(), asInt(arg()));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                snprintf(buf, sizeof buf, (spec + conv).c_str(), asDouble(arg()));
+                break;
+            case 's': {
+                std::string text;
+                formatValue(text, arg());
+                snprintf(buf, sizeof buf, (spec + "s").c_str(), text.c_str());
+                if (spec == "%") {
+                    out += text; // no width or precision: skip the truncating buffer
+                    continue;
+                }
+                break;
+            }
+            default:
+                fail(std::string("printf: unsupported conversion %") + conv);
+        }
+        out += buf;
+    }
+    return static_cast<int>(out.size() - start);
+}
+
+namespace {
+
+// Objects of one kind at stable addresses; slots the collector frees are handed out again
+template <typename T>
+struct Heap {
+    std::deque<T> objects;
+    std::vector<size_t> free;
+    std::vector<bool> freed;
+
+    T& allocate() {
+        if (free.empty()) {
+            objects.emplace_back();
+            freed.push_back(false);
+            return objects.back();
+        }
+        size_t slot = free.back();
+        free.pop_back();
+        freed[slot] = false;
+        return objects[slot];
+    }
+
+    // Frees every object not marked; returns how many are still live
+    size_t sweep(const std::unordered_set<const void*>& marked) {
+        for (size_t i = 0; i < objects.size(); ++i) {
+            if (freed[i] || marked.count(&objects[i])) continue;
+            release(objects[i]);
+            freed[i] = true;
+            free.push_back(i);
+        }
+        return objects.size() - free.size();
+    }
+
+    static void release(std::string& s) { std::string().swap(s); }
+    static void release(ArrayObject& a) { a = ArrayObject(); }
+    static void release(MapObject& m) { m = MapObject(); }
+};
+
+// A suspended caller, plus what the callee needs to cache its result
+struct Frame {
+    int fn;
+    size_t base;
+    uint32_t pc;
+    bool memo;
+    std::string memoKey;
+};
+
+class Interpreter {
+    const Module& module;
+    VMOptions options;
+    std::vector<Value> regs;
+    std::vector<Frame> frames;
+    Value globals[GlobalCount];
+    Heap<std::string> strings;
+    Heap<ArrayObject> arrays;
+    Heap<MapObject> maps;
+    size_t allocated = 0;                // units since the last collection: one per object, more for big ones
+    size_t collectAt = minCollection;
+    bool collectDue = false;
+    uint64_t collections = 0;
+    std::vector<std::unordered_map<std::string, Value>> memo;
+    std::string out;
+
+    uint64_t opCounts[static_cast<size_t>(Op::Count)] = {};
+    uint64_t calls = 0;
+    uint64_t memoHits = 0;
+    size_t maxDepth = 0;
+
+    void flush() {
+        if (!out.empty()) fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+
+    void wrote() {
+        if (options.lineFlush || out.size() >= outBufSize) {
+            flush();
+            if (options.lineFlush) fflush(stdout);
+        }
+    }
+
+    void allocate(size_t bytes) {
+        allocated += 1 + bytes / 256;
+        collectDue = allocated >= collectAt;
+    }
+
+    Value makeString(std::string s) {
+        allocate(s.size());
+        std::string& slot = strings.allocate();
+        slot = std::move(s);
+        return Value::makeString(&slot);
+    }
+
+    ArrayObject& newArray(size_t length) {
+        allocate(length * sizeof(Value));
+        return arrays.allocate();
+    }
+
+    Value makeArray(std::vector<Value> values) {
+        ArrayObject& a = newArray(values.size());
+        a.length = values.size();
+        a.store = std::make_shared<std::vector<Value>>(std::move(values));
+        return Value::makeArray(&a);
+    }
+
+    static ArrayObject& array(const Value& v) {
+        if (v.type != ValueType::Array) fail(std::string("expected an array, got ") + typeName(v.type));
+        return *v.a;
+    }
+
+    static MapObject& map(const Value& v) {
+        if (v.type != ValueType::Map) fail(std::string("expected a map, got ") + typeName(v.type));
+        return *v.m;
+    }
+
+    // Entry holding key, or -1
+    static long findKey(const MapObject& m, const Value& key) {
+        if (key.type == ValueType::String) {
+            auto found = m.strings.find(*key.s);
+            return found == m.strings.end() ? -1 : static_cast<long>(found->second);
+        }
+        auto found = m.ints.find(asInt(key));
+        return found == m.ints.end() ? -1 : static_cast<long>(found->second);
+    }
+
+    static Value mapAt(const MapObject& m, const Value& key) {
+        long entry = findKey(m, key);
+        if (entry < 0) {
+            std::string shown;
+            formatValue(shown, key);
+            fail("key " + (key.type == ValueType::String ? "\"" + shown + "\"" : shown) + " is not in the map");
+        }
+        return m.values[entry];
+    }
+
+    static void put(MapObject& m, const Value& key, const Value& v) {
+        long entry = findKey(m, key);
+        if (entry >= 0) {
+            m.values[entry] = v;
+            return;
+        }
+        uint32_t next = static_cast<uint32_t>(m.keys.size());
+        if (key.type == ValueType::String) m.strings.emplace(*key.s, next);
+        else m.ints.emplace(key.i, next);
+        m.keys.push_back(key.type == ValueType::String ? key : Value::makeInt(key.i));
+        m.values.push_back(v);
+    }
+
+    static bool remove(MapObject& m, const Value& key) {
+        long entry = findKey(m, key);
+        if (entry < 0) return false;
+        if (key.type == ValueType::String) m.strings.erase(*key.s);
+        else m.ints.erase(asInt(key));
+        size_t last = m.keys.size() - 1;
+        if (static_cast<size_t>(entry) != last) {
+            const Value& moved = m.keys[last];
+            if (moved.type == ValueType::String) m.strings[*moved.s] = static_cast<uint32_t>(entry);
+            else m.ints[moved.i] = static_cast<uint32_t>(entry);
+            m.keys[entry] = m.keys[last];
+            m.values[entry] = m.values[last];
+        }
+        m.keys.pop_back();
+        m.values.pop_back();
+        return true;
+    }
+
+    static size_t checkIndex(const ArrayObject& a, const Value& index) {
+        int32_t i = asInt(index);
+        if (i < 0 || static_cast<size_t>(i) >= a.length) {
+            fail("array index " + std::to_string(i) + " out of bounds (length " + std::to_string(a.length) + ")");
+        }
+        return a.offset + static_cast<size_t>(i);
+    }
+
+    // A slice shares its source's storage until it grows
+    static void detach(ArrayObject& a) {
+        if (!a.view) return;
+        a.store = std::make_shared<std::vector<Value>>(a.store->begin() + a.offset,
+                                                       a.store->begin() + a.offset + a.length);
+        a.offset = 0;
+        a.view = false;
+    }
+
+    static std::string memoKey(const Value* args, int count) {
+        std::string key;
+        for (int i = 0; i < count; ++i) {
+            key += static_cast<char>(args[i].type);
+            if (args[i].type == ValueType::String) {
+                key += *args[i].s;
+                key += '\0';
+            } else {
+                key.append(reinterpret_cast<const char*>(&args[i].f), sizeof args[i].f);
+            }
+        }
+        return key;
+    }
+
+    // Arrays combine element by element, a number on either side applying to every element.
+    // As in the generated C, the number and each result are rounded to float when they are floats.
+    Value elementwise(Op op, Value l, Value r) {
+        const ArrayObject* a = l.type == ValueType::Array ? l.a : nullptr;
+        const ArrayObject* b = r.type == ValueType::Array ? r.a : nullptr;
+        if (l.type == ValueType::Float) l.f = static_cast<float>(l.f);
+        if (r.type == ValueType::Float) r.f = static_cast<float>(r.f);
+        if (a && b && a->length != b->length) {
+            fail("element-wise operands have lengths " + std::to_string(a->length) + " and " + std::to_string(b->length));
+        }
+        size_t n = a ? a->length : b->length;
+        std::vector<Value> out(n);
+        for (size_t i = 0; i < n; ++i) {
+            Value v = arith(op, a ? (*a->store)[a->offset + i] : l, b ? (*b->store)[b->offset + i] : r);
+            if (v.type == ValueType::Float) v.f = static_cast<float>(v.f);
+            out[i] = v;
+        }
+        return makeArray(std::move(out));
+    }
+
+    // Floats go through the same 16 lanes as the generated C, so both add in one order
+    Value sum(const Value& v, bool floating) {
+        const ArrayObject& a = array(v);
+        const Value* items = a.store->data() + a.offset;
+        if (!floating) {
+            for (size_t i = 0; i < a.length; ++i) floating |= items[i].type == ValueType::Float;
+        }
+        if (floating) {
+            float lanes[16] = {};
+            for (size_t i = 0; i < a.length; ++i) lanes[i % 16] += static_cast<float>(asDouble(items[i]));
+            float total = lanes[0];
+            for (int k = 1; k < 16; ++k) total += lanes[k];
+            return Value::makeFloat(total);
+        }
+        int64_t total = 0;
+        for (size_t i = 0; i < a.length; ++i) total = wrap(total + asInt(items[i]));
+        return Value::makeInt(static_cast<int32_t>(total));
+    }
+
+    Value arith(Op op, const Value& l, const Value& r) {
+        if (l.type == ValueType::Array || r.type == ValueType::Array) return elementwise(op, l, r);
+        if (op == Op::Add && (l.type == ValueType::String || r.type == ValueType::String)) {
+            std::string s;
+            formatValue(s, l);
+            formatValue(s, r);
+            return makeString(std::move(s));
+        }
+        if (intLike(l) && intLike(r)) {
+            int64_t a = l.i, b = r.i;
+            switch (op) {
+                case Op::Add: return Value::makeInt(wrap(a + b));
+                case Op::Sub: return Value::makeInt(wrap(a - b));
+                case Op::Mul: return Value::makeInt(wrap(a * b));
+                case Op::Div:
+                    if (b == 0) fail("division by zero");
+                    return Value::makeInt(wrap(a / b));
+                case Op::Mod:
+                    if (b == 0) fail("division by zero");
+                    return Value::makeInt(wrap(a % b));
+                case Op::BitAnd: return Value::makeInt(l.i & r.i);
+                case Op::BitOr: return Value::makeInt(l.i | r.i);
+                case Op::BitXor: return Value::makeInt(l.i ^ r.i);
+                case Op::Shl: return Value::makeInt(wrap(static_cast<uint32_t>(l.i) << (r.i & 31)));
+                case Op::Shr: return Value::makeInt(l.i >> (r.i & 31));
+                default: break;
+            }
+        }
+        double a = asDouble(l), b = asDouble(r);
+        switch (op) {
+            case Op::Add: return Value::makeFloat(a + b);
+            case Op::Sub: return Value::makeFloat(a - b);
+            case Op::Mul: return Value::makeFloat(a * b);
+            case Op::Div: return Value::makeFloat(a / b);
+            case Op::Mod: return Value::makeFloat(std::fmod(a, b));
+            default: fail(std::string("operator ") + opName(op) + " needs integer operands");
+        }
+    }
+
+    static bool compare(Op op, const Value& l, const Value& r) {
+        int c;
+        if (l.type == ValueType::String && r.type == ValueType::String) {
+            c = l.s->compare(*r.s);
+        } else if (l.type == ValueType::Array || l.type == ValueType::Map || l.type == ValueType::Function ||
+                   l.type == ValueType::String) {
+            if (op != Op::Eq && op != Op::Ne) fail(std::string("cannot order values of type ") + typeName(l.type));
+            c = l.type == r.type && std::memcmp(&l.f, &r.f, sizeof l.f) == 0 ? 0 : 1; // identity
+        } else {
+            double a = asDouble(l), b = asDouble(r);
+            c = a < b ? -1 : a > b ? 1 : 0;
+            if (a != a || b != b) return op == Op::Ne; // NaN compares unequal to everything
+        }
+        switch (op) {
+            case Op::Eq: return c == 0;
+            case Op::Ne: return c != 0;
+            case Op::Lt: return c < 0;
+            case Op::Le: return c <= 0;
+            case Op::Gt: return c > 0;
+            default: return c >= 0;
+        }
+    }
+
+    static void convert(Op op, Value& v) {
+        if (op == Op::ToFloat) {
+            v = Value::makeFloat(static_cast<float>(asDouble(v)));
+        } else if (op == Op::ToBool) {
+            v = Value::makeBool(truthy(v));
+        } else if (v.type == ValueType::Float) {
+            // Out-of-range conversions give INT_MIN, as cvttsd2si does
+            bool inRange = v.f > -2147483649.0 && v.f < 2147483648.0;
+            v = Value::makeInt(inRange ? static_cast<int32_t>(v.f) : INT32_MIN);
+        } else {
+            v = Value::makeInt(asInt(v));
+        }
+    }
+
+    void step(Op op, Value& v) {
+        int delta = op == Op::Inc ? 1 : -1;
+        if (v.type == ValueType::Float) v.f += delta;
+        else v = Value::makeInt(wrap(static_cast<int64_t>(asInt(v)) + delta));
+    }
+
+    void unary(Op op, Value& dst, const Value& v) {
+        if (op == Op::Neg && v.type == ValueType::Array) {
+            const ArrayObject& a = *v.a;
+            std::vector<Value> out(a.length);
+            for (size_t i = 0; i < a.length; ++i) unary(op, out[i], (*a.store)[a.offset + i]);
+            dst = makeArray(std::move(out));
+        } else if (op == Op::Not) {
+            dst = Value::makeBool(!truthy(v));
+        } else if (op == Op::BitNot) {
+            dst = Value::makeInt(~asInt(v));
+        } else if (v.type == ValueType::Float) {
+            dst = Value::makeFloat(-v.f);
+        } else {
+            dst = Value::makeInt(wrap(-static_cast<int64_t>(asInt(v))));
+        }
+    }
+
+    Value index(const Value& base, const Value& index) {
+        if (base.type == ValueType::String) {
+            int32_t i = asInt(index);
+            if (i < 0 || static_cast<size_t>(i) > base.s->size()) {
+                fail("string index " + std::to_string(i) + " out of bounds (length " + std::to_string(base.s->size()) + ")");
+            }
+            return Value::makeInt(static_cast<size_t>(i) == base.s->size() ? 0 : static_cast<signed char>((*base.s)[i]));
+        }
+        if (base.type == ValueType::Map) return mapAt(*base.m, index);
+        ArrayObject& a = array(base);
+        return (*a.store)[checkIndex(a, index)];
+    }
+
+    Value slice(const Value& source, const Value& loValue, const Value& hiValue) {
+        ArrayObject& a = array(source);
+        long long lo = asInt(loValue), hi = asInt(hiValue);
+        if (lo < 0) lo = 0;
+        if (hi > static_cast<long long>(a.length)) hi = static_cast<long long>(a.length);
+        if (hi < lo) hi = lo;
+        ArrayObject& s = newArray(0);
+        s.store = a.store;
+        s.offset = a.offset + static_cast<size_t>(lo);
+        s.length = static_cast<size_t>(hi - lo);
+        s.view = true;
+        return Value::makeArray(&s);
+    }
+
+    void push(const Value& target, const Value& v) {
+        ArrayObject& a = array(target);
+        detach(a);
+        a.store->resize(a.length); // drop anything a shrunken owner left behind
+        a.store->push_back(v);
+        ++a.length;
+    }
+
+    void append(const Value& target, const Value& source) {
+        ArrayObject& a = array(target);
+        const ArrayObject& b = array(source);
+        std::vector<Value> items(b.store->begin() + b.offset, b.store->begin() + b.offset + b.length);
+        detach(a);
+        a.store->resize(a.length);
+        a.store->insert(a.store->end(), items.begin(), items.end());
+        a.length += items.size();
+    }
+
+    // Mark and sweep: everything reachable from the registers in use, the globals and the memo
+    // caches survives; the rest is freed for reuse. Runs only where the interpreter holds no
+    // values outside those roots (jumps and calls).
+    void collect(size_t liveRegs) {
+        std::unordered_set<const void*> marked, stores;
+        std::vector<Value> work(regs.begin(), regs.begin() + std::min(liveRegs, regs.size()));
+        work.insert(work.end(), std::begin(globals), std::end(globals));
+        for (const auto& cache : memo) {
+            for (const auto& entry : cache) work.push_back(entry.second);
+        }
+        while (!work.empty()) {
+            Value v = work.back();
+            work.pop_back();
+            if (v.type == ValueType::String) {
+                marked.insert(v.s);
+            } else if (v.type == ValueType::Array) {
+                if (marked.insert(v.a).second && v.a->store && stores.insert(v.a->store.get()).second) {
+                    work.insert(work.end(), v.a->store->begin(), v.a->store->end());
+                }
+            } else if (v.type == ValueType::Map) {
+                if (marked.insert(v.m).second) {
+                    work.insert(work.end(), v.m->keys.begin(), v.m->keys.end());
+                    work.insert(work.end(), v.m->values.begin(), v.m->values.end());
+                }
+            }
+        }
+        size_t live = strings.sweep(marked) + arrays.sweep(marked) + maps.sweep(marked);
+        ++collections;
+        allocated = 0;
+        collectAt = std::max(minCollection, live);
+        collectDue = false;
+    }
+
+    template <bool Stats>
+    int execute();
+
+    void printStats(double seconds) {
+        uint64_t total = 0;
+        for (uint64_t count : opCounts) total += count;
+        fprintf(stderr, "vm: %llu instructions in %.3f s (%.1f M/s), %llu calls, %llu memo hits, max depth %zu, "
+                "%llu collections\n",
+                static_cast<unsigned long long>(total), seconds, seconds > 0 ? total / seconds / 1e6 : 0.0,
+                static_cast<unsigned long long>(calls), static_cast<unsigned long long>(memoHits), maxDepth,
+                static_cast<unsigned long long>(collections));
+        std::vector<size_t> order;
+        for (size_t op = 0; op < static_cast<size_t>(Op::Count); ++op) {
+            if (opCounts[op]) order.push_back(op);
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return opCounts[a] > opCounts[b]; });
+        for (size_t op : order) {
+            fprintf(stderr, "  %-12s %14llu  %5.1f%%\n", opName(static_cast<Op>(op)),
+                    static_cast<unsigned long long>(opCounts[op]), 100.0 * opCounts[op] / total);
+        }
+    }
+
+public:
+    Interpreter(const Module& m, const VMOptions& o) : module(m), options(o), memo(m.functions.size()) {
+        globals[GlobalHeat] = Value::makeInt(0);
+        globals[GlobalDoorClosed] = Value::makeInt(1);
+        globals[GlobalDoorOpen] = Value::makeInt(0);
+    }
+
+    int run() {
+        auto start = std::chrono::steady_clock::now();
+        int status;
+        try {
+            status = options.stats ? execute<true>() : execute<false>();
+        } catch (...) {
+            flush();
+            fflush(stdout);
+            throw;
+        }
+        flush();
+        fflush(stdout);
+        if (options.stats) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            printStats(elapsed.count());
+        }
+        return status;
+    }
+};
+
+template <bool Stats>
+int Interpreter::execute() {
+    int fn = module.mainIndex;
+    size_t base = 0;
+    regs.assign(std::max(module.functions[fn].numRegs, 1), Value());
+    const Instr* code = module.functions[fn].code.data();
+    const Instr* pc = code;
+    const Instr* ins = pc;
+    const Value* K = module.constants.data();
+    Value* R = regs.data();
+    Value result;
+    int callee = 0;
+
+#ifdef MW_VM_THREADED
+    static void* const labels[] = {
+#define MW_OP_LABEL(name) &&op_##name,
+        MW_OPCODES(MW_OP_LABEL)
+#undef MW_OP_LABEL
+    };
+#define VM_CASE(name) op_##name:
+#define VM_DISPATCH()                            \
+    do {                                         \
+        ins = pc++;                              \
+        if (Stats) ++opCounts[ins->op];          \
+        goto *labels[ins->op];                   \
+    } while (0)
+#else
+#define VM_CASE(name) case static_cast<uint16_t>(Op::name):
+#define VM_DISPATCH() goto dispatch
+#endif
+#define VM_TARGET() (code + (ins->b | static_cast<uint32_t>(ins->c) << 16))
+#define VM_SAFEPOINT() \
+    if (collectDue) collect(base + static_cast<size_t>(module.functions[fn].numRegs))
+
+    try {
+        VM_DISPATCH();
+#ifndef MW_VM_THREADED
+    dispatch:
+        ins = pc++;
+        if (Stats) ++opCounts[ins->op];
+        switch (ins->op) {
+#endif
+        VM_CASE(LoadK) R[ins->a] = K[ins->b]; VM_DISPATCH();
+        VM_CASE(Move) R[ins->a] = R[ins->b]; VM_DISPATCH();
+        VM_CASE(GetGlobal) R[ins->a] = globals[ins->b]; VM_DISPATCH();
+        VM_CASE(SetGlobal) globals[ins->b] = R[ins->a]; VM_DISPATCH();
+
+        VM_CASE(Add) {
+            const Value& l = R[ins->b];
+            const Value& r = R[ins->c];
+            if (l.type == ValueType::Int && r.type == ValueType::Int) R[ins->a] = Value::makeInt(wrap(static_cast<int64_t>(l.i) + r.i));
+            else R[ins->a] = arith(Op::Add, l, r);
+            VM_DISPATCH();
+        }
+        VM_CASE(Sub) {
+            const Value& l = R[ins->b];
+            const Value& r = R[ins->c];
+            if (l.type == ValueType::Int && r.type == ValueType::Int) R[ins->a] = Value::makeInt(wrap(static_cast<int64_t>(l.i) - r.i));
+            else R[ins->a] = arith(Op::Sub, l, r);
+            VM_DISPATCH();
+        }
+        VM_CASE(Mul) {
+            const Value& l = R[ins->b];
+            const Value& r = R[ins->c];
+            if (l.type == ValueType::Int && r.type == ValueType::Int) R[ins->a] = Value::makeInt(wrap(static_cast<int64_t>(l.i) * r.i));
+            else R[ins->a] = arith(Op::Mul, l, r);
+            VM_DISPATCH();
+        }
+        VM_CASE(Div) R[ins->a] = arith(Op::Div, R[ins->b], R[ins->c]); VM_DISPATCH();
+        VM_CASE(Mod) R[ins->a] = arith(Op::Mod, R[ins->b], R[ins->c]); VM_DISPATCH();
+        VM_CASE(BitAnd) R[ins->a] = arith(Op::BitAnd, R[ins->b], R[ins->c]); VM_DISPATCH();
+        VM_CASE(BitOr) R[ins->a] = arith(Op::BitOr, R[ins->b], R[ins->c]); VM_DISPATCH();
+        VM_CASE(BitXor) R[ins->a] = arith(Op::BitXor, R[ins->b], R[ins->c]); VM_DISPATCH();
+        VM_CASE(Shl) R[ins->a] = arith(Op::Shl, R[ins->b], R[ins->c]); VM_DISPATCH();
+        VM_CASE(Shr) R[ins->a] = arith(Op::Shr, R[ins->b], R[ins->c]); VM_DISPATCH();
+
+        VM_CASE(Eq) R[ins->a] = Value::makeBool(compare(Op::Eq, R[ins->b], R[ins->c])); VM_DISPATCH();
+        VM_CASE(Ne) R[ins->a] = Value::makeBool(compare(Op::Ne, R[ins->b], R[ins->c])); VM_DISPATCH();
+        VM_CASE(Lt) {
+            const Value& l = R[ins->b];
+            const Value& r = R[ins->c];
+            if (l.type == ValueType::Int && r.type == ValueType::Int) R[ins->a] = Value::makeBool(l.i < r.i);
+            else R[ins->a] = Value::makeBool(compare(Op::Lt, l, r));
+            VM_DISPATCH();
+        }
+        VM_CASE(Le) R[ins->a] = Value::makeBool(compare(Op::Le, R[ins->b], R[ins->c])); VM_DISPATCH();
+        VM_CASE(Gt) R[ins->a] = Value::makeBool(compare(Op::Gt, R[ins->b], R[ins->c])); VM_DISPATCH();
+        VM_CASE(Ge) R[ins->a] = Value::makeBool(compare(Op::Ge, R[ins->b], R[ins->c])); VM_DISPATCH();
+
+        VM_CASE(Neg) unary(Op::Neg, R[ins->a], R[ins->b]); VM_DISPATCH();
+        VM_CASE(Not) unary(Op::Not, R[ins->a], R[ins->b]); VM_DISPATCH();
+        VM_CASE(BitNot) unary(Op::BitNot, R[ins->a], R[ins->b]); VM_DISPATCH();
+        VM_CASE(Inc) {
+            Value& v = R[ins->a];
+            if (v.type == ValueType::Int) v.i = wrap(static_cast<int64_t>(v.i) + 1);
+            else step(Op::Inc, v);
+            VM_DISPATCH();
+        }
+        VM_CASE(Dec) {
+            Value& v = R[ins->a];
+            if (v.type == ValueType::Int) v.i = wrap(static_cast<int64_t>(v.i) - 1);
+            else step(Op::Dec, v);
+            VM_DISPATCH();
+        }
+        VM_CASE(ToInt) if (R[ins->a].type != ValueType::Int) convert(Op::ToInt, R[ins->a]); VM_DISPATCH();
+        VM_CASE(ToFloat) convert(Op::ToFloat, R[ins->a]); VM_DISPATCH();
+        VM_CASE(ToBool) if (R[ins->a].type != ValueType::Bool) convert(Op::ToBool, R[ins->a]); VM_DISPATCH();
+
+        VM_CASE(Jump) {
+            VM_SAFEPOINT();
+            pc = VM_TARGET();
+            VM_DISPATCH();
+        }
+        VM_CASE(JumpIfFalse) {
+            VM_SAFEPOINT();
+            const Value& v = R[ins->a];
+            if (intLike(v) ? v.i == 0 : !truthy(v)) pc = VM_TARGET();
+            VM_DISPATCH();
+        }
+        VM_CASE(JumpIfTrue) {
+            VM_SAFEPOINT();
+            const Value& v = R[ins->a];
+            if (intLike(v) ? v.i != 0 : truthy(v)) pc = VM_TARGET();
+            VM_DISPATCH();
+        }
+
+        VM_CASE(Call) callee = ins->b; goto call;
+        VM_CASE(CallValue) {
+            const Value& f = R[ins->b];
+            if (f.type != ValueType::Function) fail(std::string("cannot call a value of type ") + typeName(f.type));
+            callee = f.fn;
+            goto call;
+        }
+    call: {
+            VM_SAFEPOINT();
+            const FunctionCode& target = module.functions[callee];
+            if (ins->c != target.numParams) {
+                fail("'" + target.name + "' expects " + std::to_string(target.numParams) + " arguments, got " +
+                     std::to_string(ins->c));
+            }
+            if (Stats) ++calls;
+            std::string key;
+            if (target.memoized) {
+                key = memoKey(R + ins->a, ins->c);
+                auto hit = memo[callee].find(key);
+                if (hit != memo[callee].end()) {
+                    if (Stats) ++memoHits;
+                    R[ins->a] = hit->second;
+                    VM_DISPATCH();
+                }
+            }
+            if (frames.size() >= maxCallDepth) fail("call stack overflow in '" + target.name + "'");
+            frames.push_back({fn, base, static_cast<uint32_t>(pc - code), target.memoized, std::move(key)});
+            if (Stats) maxDepth = std::max(maxDepth, frames.size());
+            base += ins->a;
+            size_t need = base + static_cast<size_t>(target.numRegs);
+            if (regs.size() < need) regs.resize(std::max(need, regs.size() * 2));
+            fn = callee;
+            code = target.code.data();
+            pc = code;
+            R = regs.data() + base;
+            VM_DISPATCH();
+        }
+        VM_CASE(Return) result = R[ins->a]; goto ret;
+        VM_CASE(ReturnVoid) result = Value(); goto ret;
+    ret: {
+            if (frames.empty()) return result.type == ValueType::Int ? result.i : 0;
+            Frame& caller = frames.back();
+            if (caller.memo) memo[fn][std::move(caller.memoKey)] = result;
+            R[0] = result;
+            fn = caller.fn;
+            base = caller.base;
+            code = module.functions[fn].code.data();
+            pc = code + caller.pc;
+            R = regs.data() + base;
+            frames.pop_back();
+            VM_DISPATCH();
+        }
+
+        VM_CASE(Beep) {
+            formatValue(out, R[ins->a]);
+            out += '\n';
+            wrote();
+            VM_DISPATCH();
+        }
+        VM_CASE(Printf) {
+            int written = formatPrintf(out, R + ins->b, ins->c);
+            R[ins->a] = Value::makeInt(written);
+            wrote();
+            VM_DISPATCH();
+        }
+
+        VM_CASE(NewArray) R[ins->a] = makeArray(std::vector<Value>(R + ins->b, R + ins->b + ins->c)); VM_DISPATCH();
+        VM_CASE(Index) {
+            const Value& b = R[ins->b];
+            if (b.type == ValueType::Array && R[ins->c].type == ValueType::Int) {
+                const ArrayObject& a = *b.a;
+                int32_t i = R[ins->c].i;
+                if (i >= 0 && static_cast<size_t>(i) < a.length) {
+                    R[ins->a] = (*a.store)[a.offset + i];
+                    VM_DISPATCH();
+                }
+            }
+            R[ins->a] = index(b, R[ins->c]);
+            VM_DISPATCH();
+        }
+        VM_CASE(SetIndex) {
+            if (R[ins->a].type == ValueType::Map) {
+                put(*R[ins->a].m, R[ins->b], R[ins->c]);
+                VM_DISPATCH();
+            }
+            ArrayObject& a = array(R[ins->a]);
+            (*a.store)[checkIndex(a, R[ins->b])] = R[ins->c];
+            VM_DISPATCH();
+        }
+        VM_CASE(Len) {
+            const Value& b = R[ins->b];
+            size_t length = b.type == ValueType::Map ? b.m->keys.size() : array(b).length;
+            R[ins->a] = Value::makeInt(static_cast<int32_t>(length));
+            VM_DISPATCH();
+        }
+        VM_CASE(Push) push(R[ins->a], R[ins->b]); VM_DISPATCH();
+        VM_CASE(Append) append(R[ins->a], R[ins->b]); VM_DISPATCH();
+        VM_CASE(Slice) R[ins->a] = slice(R[ins->b], R[ins->c], R[ins->c + 1]); VM_DISPATCH();
+        VM_CASE(Copy) {
+            const ArrayObject& a = array(R[ins->b]);
+            R[ins->a] = makeArray(std::vector<Value>(a.store->begin() + a.offset, a.store->begin() + a.offset + a.length));
+            VM_DISPATCH();
+        }
+        VM_CASE(Fill) {
+            ArrayObject& a = array(R[ins->a]);
+            std::fill(a.store->begin() + a.offset, a.store->begin() + a.offset + a.length, R[ins->b]);
+            VM_DISPATCH();
+        }
+        VM_CASE(Sum) R[ins->a] = sum(R[ins->b], ins->c != 0); VM_DISPATCH();
+        VM_CASE(CheckLen) {
+            size_t expected = static_cast<size_t>(R[ins->a].i), length = array(R[ins->b]).length;
+            if (length != expected) {
+                fail("element-wise operands have lengths " + std::to_string(expected) + " and " + std::to_string(length));
+            }
+            VM_DISPATCH();
+        }
+        VM_CASE(NewMap) {
+            allocate(0);
+            R[ins->a] = Value::makeMap(&maps.allocate());
+            VM_DISPATCH();
+        }
+        VM_CASE(Has) R[ins->a] = Value::makeBool(findKey(map(R[ins->b]), R[ins->c]) >= 0); VM_DISPATCH();
+        VM_CASE(Get) {
+            const MapObject& m = map(R[ins->b]);
+            long entry = findKey(m, R[ins->c]);
+            R[ins->a] = entry >= 0 ? m.values[entry] : R[ins->c + 1];
+            VM_DISPATCH();
+        }
+        VM_CASE(Remove) R[ins->a] = Value::makeBool(remove(map(R[ins->b]), R[ins->c])); VM_DISPATCH();
+        VM_CASE(Keys) R[ins->a] = makeArray(map(R[ins->b]).keys); VM_DISPATCH();
+        VM_CASE(Values) R[ins->a] = makeArray(map(R[ins->b]).values); VM_DISPATCH();
+        VM_CASE(Reserve) {
+            MapObject& m = map(R[ins->a]);
+            size_t n = static_cast<size_t>(std::max<int32_t>(asInt(R[ins->b]), 0));
+            if (ins->c) {
+                m.ints.rehash(n);
+                m.strings.rehash(n);
+            } else {
+                m.keys.reserve(n);
+                m.values.reserve(n);
+                m.ints.reserve(n);
+                m.strings.reserve(n);
+            }
+            VM_DISPATCH();
+        }
+        VM_CASE(Halt) return 0;
+#ifndef MW_VM_THREADED
+        default:
+            fail("bad opcode " + std::to_string(ins->op));
+        }
+#endif
+    } catch (const std::runtime_error& e) {
+        const FunctionCode& where = module.functions[fn];
+        int line = where.lines[ins - where.code.data()];
+        throw std::runtime_error("line " + std::to_string(line) + " in " + where.name + ": " + e.what());
+    }
+    return 0;
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_TARGET
+#undef VM_SAFEPOINT
+}
+
+} // namespace
+
+int runBytecode(const Module& module, const VMOptions& options) {
+    Interpreter interpreter(module, options);
+    return interpreter.run();
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "bytecode.h"
+
+struct VMOptions {
+    bool stats = false;         // print instruction and call counts to stderr at exit
+    bool lineFlush = false;     // flush beep output after every line
+};
+
+// Runs the module's main and returns its exit code.
+// Runtime errors (bad index, division by zero, ...) throw std::runtime_error naming the source line.
+int runBytecode(const Module& module, const VMOptions& options = VMOptions());
@@ -0,0 +1,139 @@
+#include "watch.h"
+#include "astfile.h"
+#include "tokenizer.h"
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <unordered_set>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace {
+
+struct Chunk {
+    size_t begin, end;   // byte range in the source
+    int line;            // tokenizer line of begin
+};
+
+// Cuts source after each line on which the brace depth falls back to zero. Braces inside strings
+// and comments do not count, and lines are counted the way the tokenizer counts them (a newline
+// inside a string literal does not advance its line).
+std::vector<Chunk> splitChunks(const std::string& source) {
+    std::vector<Chunk> chunks;
+    size_t begin = 0, n = source.size();
+    int line = 1, beginLine = 1, depth = 0;
+    bool closed = false;
+    for (size_t i = 0; i < n; ++i) {
+        char c = source[i];
+        if (c == '"') {
+            for (++i; i < n && source[i] != '"'; ++i) {
+                if (source[i] == '\\') ++i;
+            }
+        } else if (c == '/' && i + 1 < n && source[i + 1] == '/') {
+            while (i + 1 < n && source[i + 1] != '\n') ++i;
+        } else if (c == '{') {
+            ++depth;
+        } else if (c == '}') {
+            if (--depth == 0) closed = true;
+        } else if (c == '\n') {
+            ++line;
+            if (closed && depth == 0) {
+                chunks.push_back({begin, i + 1, beginLine});
+                begin = i + 1;
+                beginLine = line;
+                closed = false;
+            }
+        }
+    }
+    if (begin < n) chunks.push_back({begin, n, beginLine});
+    return chunks;
+}
+
+}
+
+std::unique_ptr<Program> parseIncremental(const std::string& source, ParseCache& cache, size_t& parsed) {
+    auto program = std::make_unique<Program>();
+    std::unordered_set<std::string> seen;
+    parsed = 0;
+    for (const auto& chunk : splitChunks(source)) {
+        std::string text = source.substr(chunk.begin, chunk.end - chunk.begin);
+        std::unique_ptr<Program> part;
+        auto found = cache.chunks.find(text);
+        if (found != cache.chunks.end()) {
+            const ParsedChunk& cached = found->second;
+            part = deserializeAST(cached.ast.data(), cached.ast.size(), chunk.line - cached.line);
+        } else {
+            auto tokens = tokenize(text);
+            for (auto& token : tokens) token.line += chunk.line - 1;
+            part = parse(tokens);
+            cache.chunks[text] = {chunk.line, serializeAST(*part)};
+            ++parsed;
+        }
+        for (auto& func : part->functions) program->functions.push_back(std::move(func));
+        seen.insert(std::move(text));
+    }
+
+    // Only once the whole source parsed, so a failed edit keeps everything it did not touch
+    for (auto it = cache.chunks.begin(); it != cache.chunks.end();) {
+        it = seen.count(it->first) ? std::next(it) : cache.chunks.erase(it);
+    }
+    return program;
+}
+
+void watchFiles(const std::vector<std::string>& paths, const std::function<void()>& onChange) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Cannot watch files: ") + strerror(errno));
+    }
+
+    // Directories are watched rather than the files, so a save that renames a new file over the
+    // old one is still seen
+    std::map<std::string, std::set<std::string>> names;
+    for (const auto& path : paths) {
+        size_t slash = path.find_last_of('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        names[dir].insert(slash == std::string::npos ? path : path.substr(slash + 1));
+    }
+    std::map<int, const std::set<std::string>*> watched;
+    for (const auto& entry : names) {
+        int wd = inotify_add_watch(fd, entry.first.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) {
+            std::string error = strerror(errno);
+            close(fd);
+            throw std::runtime_error("Cannot watch " + entry.first + ": " + error);
+        }
+        watched[wd] = &entry.second;
+    }
+
+    // Reads what is queued (blocking if nothing is) and says whether any of it touched a watched file
+    alignas(inotify_event) char buffer[4096];
+    auto readEvents = [&]() {
+        ssize_t n = read(fd, buffer, sizeof buffer);
+        if (n < 0) {
+            if (errno == EINTR) return false;
+            std::string error = strerror(errno);
+            close(fd);
+            throw std::runtime_error("Cannot watch files: " + error);
+        }
+        bool touched = false;
+        for (ssize_t offset = 0; offset < n;) {
+            auto event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            auto it = watched.find(event->wd);
+            if (event->len > 0 && it != watched.end() && it->second->count(event->name)) touched = true;
+            offset += sizeof(inotify_event) + event->len;
+        }
+        return touched;
+    };
+
+    const int settleMs = 20;
+    for (;;) {
+        if (!readEvents()) continue;
+        // Let a burst (write, then rename, then a second file) settle into one rebuild
+        pollfd pending = {fd, POLLIN, 0};
+        while (poll(&pending, 1, settleMs) > 0) readEvents();
+        onChange();
+    }
+}
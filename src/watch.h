@@ -0,0 +1,31 @@
+#pragma once
+#include "parser.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Incremental parsing and file watching behind --watch
+
+// A source is split into top-level chunks: each runs from the start of a line to the end of the
+// line where its braces close again, so it is one function with the comments above it (or
+// several, if they share a line). Chunks are tokenized and parsed on their own and kept, keyed
+// by their text, until the text changes.
+struct ParsedChunk {
+    int line;            // line the chunk started on when it was parsed
+    std::string ast;     // serialized Program of the chunk's functions
+};
+
+struct ParseCache {
+    std::unordered_map<std::string, ParsedChunk> chunks;
+};
+
+// Parses source, re-lexing and re-parsing only the chunks not found in cache; parsed is set to
+// how many were. Chunks that no longer occur are dropped from the cache.
+std::unique_ptr<Program> parseIncremental(const std::string& source, ParseCache& cache, size_t& parsed);
+
+// Blocks, calling onChange whenever one of paths is written or replaced by a rename (as many
+// editors save); events arriving within a few milliseconds of each other are one change.
+// Throws std::runtime_error if the files cannot be watched.
+void watchFiles(const std::vector<std::string>& paths, const std::function<void()>& onChange);
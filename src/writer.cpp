@@ -0,0 +1,174 @@
+#include "writer.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <stdexcept>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static const size_t lineNumberWidth = 10;
+
+// Copies without counting newlines; callers account for them
+void CodeWriter::append(const char* data, size_t size) {
+    while (size > 0) {
+        if (chunks.empty() || chunks.back().size == chunkSize) {
+            if (fd >= 0) drain();
+            chunks.push_back({std::unique_ptr<char[]>(new char[chunkSize]), 0});
+        }
+        Chunk& chunk = chunks.back();
+        size_t n = std::min(size, chunkSize - chunk.size);
+        memcpy(chunk.data.get() + chunk.size, data, n);
+        chunk.size += n;
+        data += n;
+        size -= n;
+    }
+}
+
+// Contiguous space for size bytes, starting a new chunk if the current one is too full
+char* CodeWriter::reserve(size_t size) {
+    if (chunks.empty() || chunkSize - chunks.back().size < size) {
+        if (fd >= 0) drain();
+        chunks.push_back({std::unique_ptr<char[]>(new char[chunkSize]), 0});
+    }
+    Chunk& chunk = chunks.back();
+    char* at = chunk.data.get() + chunk.size;
+    chunk.size += size;
+    return at;
+}
+
+void CodeWriter::write(const char* data, size_t size) {
+    newlines += static_cast<size_t>(std::count(data, data + size, '\n'));
+    append(data, size);
+}
+
+CodeWriter& CodeWriter::operator<<(long long v) {
+    unsigned long long u = v < 0 ? 0ULL - static_cast<unsigned long long>(v) : static_cast<unsigned long long>(v);
+    if (v < 0) *this << '-';
+    return *this << u;
+}
+
+CodeWriter& CodeWriter::operator<<(unsigned long long v) {
+    char buf[24];
+    char* end = buf + sizeof buf;
+    char* p = end;
+    do {
+        *--p = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v);
+    append(p, static_cast<size_t>(end - p));
+    return *this;
+}
+
+void CodeWriter::indent(int level) {
+    static const std::string spaces(64, ' ');
+    for (size_t n = static_cast<size_t>(std::max(level, 0)) * 4; n > 0;) {
+        size_t step = std::min(n, spaces.size());
+        append(spaces.data(), step);
+        n -= step;
+    }
+}
+
+void CodeWriter::lineMarker(const std::string& quotedFile) {
+    const char prefix[] = "#line ";
+    size_t size = sizeof prefix - 1 + lineNumberWidth + 1 + quotedFile.size() + 1;
+    char* at = reserve(size);
+    memcpy(at, prefix, sizeof prefix - 1);
+    // Spaces after the number are just whitespace between the directive's tokens
+    memset(at + sizeof prefix - 1, ' ', lineNumberWidth + 1);
+    memcpy(at + sizeof prefix + lineNumberWidth, quotedFile.data(), quotedFile.size());
+    at[size - 1] = '\n';
+    Marker marker = {at + sizeof prefix - 1, newlines};
+    newlines++;
+    patch(marker);
+    if (fd < 0) markers.push_back(marker);
+}
+
+void CodeWriter::patch(const Marker& marker) {
+    // The directive names the line after itself
+    std::string number = std::to_string(marker.newlines + 2);
+    memset(marker.digits, ' ', lineNumberWidth);
+    memcpy(marker.digits, number.data(), std::min(number.size(), lineNumberWidth));
+}
+
+void CodeWriter::splice(CodeWriter& other) {
+    // Number other's directives for their new position before any chunk can be written out
+    std::vector<Marker> moved = other.markers;
+    for (auto& marker : moved) {
+        marker.newlines += newlines;
+        patch(marker);
+    }
+    newlines += other.newlines;
+
+    for (auto& chunk : other.chunks) {
+        char* from = chunk.data.get();
+        char* to = from;
+        size_t size = chunk.size;
+        // Small tails are cheaper to copy than to keep as mostly empty chunks
+        if (size < chunkSize / 4 && !chunks.empty() && chunkSize - chunks.back().size >= size) {
+            to = chunks.back().data.get() + chunks.back().size;
+            memcpy(to, from, size);
+            chunks.back().size += size;
+        } else {
+            chunks.push_back(std::move(chunk));
+        }
+        for (auto& marker : moved) {
+            if (marker.digits >= from && marker.digits < from + size) marker.digits = to + (marker.digits - from);
+        }
+    }
+    if (fd < 0) markers.insert(markers.end(), moved.begin(), moved.end());
+    other.chunks.clear();
+    other.markers.clear();
+    other.newlines = 0;
+    if (fd >= 0) {
+        size_t buffered = 0;
+        for (const auto& chunk : chunks) buffered += chunk.size;
+        if (buffered >= chunkSize) drain();
+    }
+}
+
+std::string CodeWriter::str() const {
+    std::string out;
+    size_t total = 0;
+    for (const auto& chunk : chunks) total += chunk.size;
+    out.reserve(total);
+    for (const auto& chunk : chunks) out.append(chunk.data.get(), chunk.size);
+    return out;
+}
+
+void CodeWriter::drain() {
+    size_t done = 0;
+    while (done < chunks.size()) {
+        struct iovec iov[IOV_MAX];
+        int count = 0;
+        for (size_t i = done; i < chunks.size() && count < IOV_MAX; ++i, ++count) {
+            iov[count].iov_base = chunks[i].data.get();
+            iov[count].iov_len = chunks[i].size;
+        }
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("Cannot write output: ") + strerror(errno));
+        }
+        // Drop fully written chunks; shift a partially written one
+        size_t left = static_cast<size_t>(written);
+        while (done < chunks.size() && left >= chunks[done].size) {
+            left -= chunks[done].size;
+            chunks[done].data.reset();
+            ++done;
+        }
+        if (left > 0) {
+            Chunk& chunk = chunks[done];
+            memmove(chunk.data.get(), chunk.data.get() + left, chunk.size - left);
+            chunk.size -= left;
+        }
+    }
+    chunks.clear();
+}
+
+void CodeWriter::finish() {
+    if (fd >= 0) drain();
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Append-only text kept in fixed-size chunks. Given a file descriptor, chunks are written
+// out with writev as they fill, so memory stays bounded however large the output grows.
+class CodeWriter {
+public:
+    static const size_t chunkSize = 64 * 1024;
+
+    explicit CodeWriter(int fd = -1) : fd(fd) {}
+    CodeWriter(CodeWriter&&) = default;
+    CodeWriter& operator=(CodeWriter&&) = default;
+
+    void write(const char* data, size_t size);
+
+    CodeWriter& operator<<(const std::string& s) { write(s.data(), s.size()); return *this; }
+    CodeWriter& operator<<(const char* s) { write(s, strlen(s)); return *this; }
+    CodeWriter& operator<<(char c) { write(&c, 1); return *this; }
+    CodeWriter& operator<<(int v) { return *this << static_cast<long long>(v); }
+    CodeWriter& operator<<(long v) { return *this << static_cast<long long>(v); }
+    CodeWriter& operator<<(long long v);
+    CodeWriter& operator<<(unsigned v) { return *this << static_cast<unsigned long long>(v); }
+    CodeWriter& operator<<(unsigned long v) { return *this << static_cast<unsigned long long>(v); }
+    CodeWriter& operator<<(unsigned long long v);
+
+    // Four spaces per level, copied from a precomputed run of spaces
+    void indent(int level);
+
+    // A "#line <next line> file" directive whose number is filled in once this text's
+    // final position is known (when it is spliced into the writer that owns the file)
+    void lineMarker(const std::string& quotedFile);
+
+    // Moves other's text to the end of this one; large chunks are relinked rather than copied.
+    // other is left empty.
+    void splice(CodeWriter& other);
+
+    std::string str() const;
+
+    // Writes out whatever is still buffered; throws std::runtime_error on a write error
+    void finish();
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    struct Marker {
+        char* digits;       // start of the blank number field inside a chunk
+        size_t newlines;    // newlines in this writer before the directive
+    };
+
+    int fd;
+    std::vector<Chunk> chunks;
+    std::vector<Marker> markers;
+    size_t newlines = 0;
+
+    void append(const char* data, size_t size);
+    char* reserve(size_t size);
+    void patch(const Marker& marker);
+    void drain();
+};